@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "libsimul.h"
+
+// Lockstep simulation of many instances of the same circuit.
+//
+// Matrices and vectors are stored structure-of-arrays: element (col,row) of
+// lane l is at [(col*nodecnt+row)*width + l]. Every arithmetic loop has the
+// lane index innermost so that the compiler vectorizes it across instances.
+// LU decomposition is done without pivoting. Nodal conductance matrices of
+// resistors, switches, diodes and linear transformers are symmetric and
+// diagonally dominant (or positive semidefinite updates of such), so
+// pivoting isn't needed for stability, and without pivoting all lanes
+// follow the same instruction stream.
+//
+// The nonlinear parts (diodes, transformer search, reactive element
+// updates) run per lane on the lane's own context. A lane that has converged
+// is masked out of the rest of the recalculation loop so that its solution
+// isn't disturbed by the lanes whose switch or diode states still change.
+// A lane that fails keeps the error in its context like simulation_step()
+// and is left out of the later steps, the other lanes go on.
+
+static double *soa_alloc(size_t cnt)
+{
+	return malloc(sizeof(double)*(cnt ? cnt : 1));
+}
+
+int libsimul_batch_init(struct libsimul_batch *b, const struct libsimul_ctx *proto, size_t width)
+{
+	const size_t nodecnt = proto->nodecnt;
+	size_t lane;
+	int ret;
+	b->width = width;
+	b->nodecnt = nodecnt;
+	b->lanes = NULL;
+	b->G_soa = NULL;
+	b->LU_soa = NULL;
+	b->Isrc_soa = NULL;
+	b->V_soa = NULL;
+	b->lane_flags = NULL;
+	b->lane_recalccnt = NULL;
+	b->lanecnt_initialized = 0;
+	if (width == 0 || proto->G_matrix == NULL)
+	{
+		return -ERR_NO_DATA;
+	}
+	b->lanes = malloc(sizeof(*b->lanes)*width);
+	b->lane_flags = calloc(width, sizeof(*b->lane_flags));
+	b->lane_recalccnt = calloc(width, sizeof(*b->lane_recalccnt));
+	b->G_soa = soa_alloc(nodecnt*nodecnt*width);
+	b->LU_soa = soa_alloc(nodecnt*nodecnt*width);
+	b->Isrc_soa = soa_alloc(nodecnt*width);
+	b->V_soa = soa_alloc(nodecnt*width);
+	if (b->lanes == NULL || b->lane_flags == NULL ||
+	    b->lane_recalccnt == NULL || b->G_soa == NULL ||
+	    b->LU_soa == NULL || b->Isrc_soa == NULL || b->V_soa == NULL)
+	{
+		libsimul_batch_free(b);
+		return -ERR_NO_MEMORY;
+	}
+	for (lane = 0; lane < width; lane++)
+	{
+		ret = libsimul_clone(&b->lanes[lane], proto);
+		if (ret != 0)
+		{
+			libsimul_batch_free(b);
+			return ret;
+		}
+		b->lanecnt_initialized++;
+		if (b->lanes[lane].part != NULL)
+		{
+			// Lanes are solved together as whole dense matrices
+			ret = libsimul_set_partitioning(&b->lanes[lane], 0);
+			if (ret != 0)
+			{
+				libsimul_batch_free(b);
+				return ret;
+			}
+		}
+		b->lane_flags[lane] = BATCH_LANE_DIRTY;
+	}
+	return 0;
+}
+
+void libsimul_batch_free(struct libsimul_batch *b)
+{
+	size_t lane;
+	for (lane = 0; lane < b->lanecnt_initialized; lane++)
+	{
+		libsimul_free(&b->lanes[lane]);
+	}
+	free(b->lanes);
+	free(b->lane_flags);
+	free(b->lane_recalccnt);
+	free(b->G_soa);
+	free(b->LU_soa);
+	free(b->Isrc_soa);
+	free(b->V_soa);
+	b->lanes = NULL;
+	b->lane_flags = NULL;
+	b->lane_recalccnt = NULL;
+	b->G_soa = NULL;
+	b->LU_soa = NULL;
+	b->Isrc_soa = NULL;
+	b->V_soa = NULL;
+	b->lanecnt_initialized = 0;
+}
+
+struct libsimul_ctx *libsimul_batch_lane(struct libsimul_batch *b, size_t lane)
+{
+	if (lane >= b->width)
+	{
+		return NULL;
+	}
+	return &b->lanes[lane];
+}
+
+// Call after changing switch states or component values of a lane
+int libsimul_batch_recalc(struct libsimul_batch *b, size_t lane)
+{
+	if (lane >= b->width)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	b->lane_flags[lane] |= BATCH_LANE_DIRTY;
+	return 0;
+}
+
+static void batch_gather_g(struct libsimul_batch *b, size_t lane)
+{
+	const size_t W = b->width;
+	const size_t nn = b->nodecnt*b->nodecnt;
+	const double *G = b->lanes[lane].G_matrix;
+	size_t i;
+	for (i = 0; i < nn; i++)
+	{
+		b->G_soa[i*W+lane] = G[i];
+	}
+}
+
+static void batch_gather_isrc(struct libsimul_batch *b, size_t lane)
+{
+	const size_t W = b->width;
+	const size_t n = b->nodecnt;
+	const double *I = b->lanes[lane].Isrc_vector;
+	size_t i;
+	for (i = 0; i < n; i++)
+	{
+		b->Isrc_soa[i*W+lane] = I[i];
+	}
+}
+
+static void batch_scatter_v(struct libsimul_batch *b, size_t lane)
+{
+	const size_t W = b->width;
+	const size_t n = b->nodecnt;
+	double *V = b->lanes[lane].V_vector;
+	size_t i;
+	for (i = 0; i < n; i++)
+	{
+		V[i] = b->V_soa[i*W+lane];
+	}
+}
+
+static void batch_lu(struct libsimul_batch *b)
+{
+	const size_t W = b->width;
+	const size_t n = b->nodecnt;
+	double *restrict A = b->LU_soa;
+	size_t i, j, k, l;
+	memcpy(A, b->G_soa, sizeof(*A)*n*n*W);
+	for (k = 0; k < n; k++)
+	{
+		const double *restrict pivot = &A[(k*n+k)*W];
+		for (l = 0; l < W; l++)
+		{
+			// The other lanes aren't affected by the division by
+			// zero
+			if (pivot[l] == 0 && b->lanes[l].err == 0)
+			{
+				b->lanes[l].err = libsimul_fail(&b->lanes[l], ERR_SINGULAR,
+					"Can't LU decompose lane %zu: %zu", l, k+1);
+			}
+		}
+		for (i = k+1; i < n; i++)
+		{
+			double *restrict a_ik = &A[(k*n+i)*W];
+			for (l = 0; l < W; l++)
+			{
+				a_ik[l] /= pivot[l];
+			}
+		}
+		for (j = k+1; j < n; j++)
+		{
+			const double *restrict a_kj = &A[(j*n+k)*W];
+			for (i = k+1; i < n; i++)
+			{
+				const double *restrict a_ik = &A[(k*n+i)*W];
+				double *restrict a_ij = &A[(j*n+i)*W];
+				for (l = 0; l < W; l++)
+				{
+					a_ij[l] -= a_ik[l]*a_kj[l];
+				}
+			}
+		}
+	}
+}
+
+static void batch_solve(struct libsimul_batch *b)
+{
+	const size_t W = b->width;
+	const size_t n = b->nodecnt;
+	const double *restrict A = b->LU_soa;
+	double *restrict x = b->V_soa;
+	size_t i, j, l;
+	memcpy(x, b->Isrc_soa, sizeof(*x)*n*W);
+	// Forward substitution, L has unit diagonal
+	for (j = 0; j < n; j++)
+	{
+		const double *restrict x_j = &x[j*W];
+		for (i = j+1; i < n; i++)
+		{
+			const double *restrict a_ij = &A[(j*n+i)*W];
+			double *restrict x_i = &x[i*W];
+			for (l = 0; l < W; l++)
+			{
+				x_i[l] -= a_ij[l]*x_j[l];
+			}
+		}
+	}
+	// Back substitution
+	for (j = n; j-- > 0; )
+	{
+		const double *restrict a_jj = &A[(j*n+j)*W];
+		double *restrict x_j = &x[j*W];
+		for (l = 0; l < W; l++)
+		{
+			x_j[l] /= a_jj[l];
+		}
+		for (i = 0; i < j; i++)
+		{
+			const double *restrict a_ij = &A[(j*n+i)*W];
+			double *restrict x_i = &x[i*W];
+			for (l = 0; l < W; l++)
+			{
+				x_i[l] -= a_ij[l]*x_j[l];
+			}
+		}
+	}
+}
+
+// Refactors if any lane has a changed matrix, then solves all lanes
+static void batch_refactor_solve(struct libsimul_batch *b)
+{
+	const size_t W = b->width;
+	size_t lane;
+	int any_dirty = 0;
+	for (lane = 0; lane < W; lane++)
+	{
+		if (b->lane_flags[lane] & BATCH_LANE_DIRTY)
+		{
+			batch_gather_g(b, lane);
+			b->lane_flags[lane] &= ~BATCH_LANE_DIRTY;
+			any_dirty = 1;
+		}
+	}
+	if (any_dirty)
+	{
+		batch_lu(b);
+	}
+	batch_solve(b);
+}
+
+// Same algorithm as simulation_step() for all lanes in lockstep. Returns 0,
+// or the -ERR_* of the first lane that has failed, see
+// libsimul_batch_lane() and libsimul_error().
+int libsimul_batch_step(struct libsimul_batch *b)
+{
+	const size_t W = b->width;
+	const int has_shockley = b->lanes[0].circuit->has_shockley;
+	size_t lane;
+	size_t active_cnt;
+	size_t solve_cnt;
+	int ret = 0;
+	for (lane = 0; lane < W; lane++)
+	{
+		struct libsimul_ctx *ctx = &b->lanes[lane];
+		b->lane_flags[lane] &= ~(BATCH_LANE_ACTIVE | BATCH_LANE_RECALC_LOOP);
+		if (ctx->err != 0)
+		{
+			continue;
+		}
+		if (ctx->circuit->pwmcnt)
+		{
+			// Lanes can't split steps independently, so PWM edges
+			// are rounded to step boundaries
+			pwm_apply(ctx);
+		}
+		if (ctx->circuit->wavecnt)
+		{
+			wave_apply(ctx);
+		}
+		if (has_shockley || ctx->needs_recalc || (b->lane_flags[lane] & BATCH_LANE_DIRTY))
+		{
+			ctx->needs_recalc = 0;
+			form_g_matrix(ctx);
+			b->lane_flags[lane] |= BATCH_LANE_DIRTY;
+		}
+		form_isrc_vector(ctx);
+		batch_gather_isrc(b, lane);
+		b->lane_flags[lane] |= BATCH_LANE_ACTIVE;
+		b->lane_recalccnt[lane] = 0;
+	}
+	batch_refactor_solve(b);
+	for (lane = 0; lane < W; lane++)
+	{
+		if (b->lanes[lane].err != 0)
+		{
+			b->lane_flags[lane] &= ~BATCH_LANE_ACTIVE;
+			continue;
+		}
+		batch_scatter_v(b, lane);
+	}
+	for (;;)
+	{
+		active_cnt = 0;
+		solve_cnt = 0;
+		for (lane = 0; lane < W; lane++)
+		{
+			struct libsimul_ctx *ctx = &b->lanes[lane];
+			int recalc_loop;
+			int status;
+			if (!(b->lane_flags[lane] & BATCH_LANE_ACTIVE))
+			{
+				continue;
+			}
+			recalc_loop = !!(b->lane_flags[lane] & BATCH_LANE_RECALC_LOOP);
+			status = go_through_all(ctx, recalc_loop);
+			if (status == 0)
+			{
+				b->lane_flags[lane] &= ~BATCH_LANE_ACTIVE;
+				continue;
+			}
+			if (status < 0)
+			{
+				ctx->err = status;
+				b->lane_flags[lane] &= ~BATCH_LANE_ACTIVE;
+				continue;
+			}
+			active_cnt++;
+			b->lane_recalccnt[lane]++;
+			if (b->lane_recalccnt[lane] == 1024)
+			{
+				if (recalc_loop)
+				{
+					ctx->err = libsimul_fail(ctx, ERR_NOT_CONVERGED,
+						"Recalc loop at t=%g, can't handle", ctx->t);
+					b->lane_flags[lane] &= ~BATCH_LANE_ACTIVE;
+					active_cnt--;
+					continue;
+				}
+				// Like simulation_step(), retry with forced diode
+				// states without solving again
+				b->lane_flags[lane] |= BATCH_LANE_RECALC_LOOP;
+				b->lane_recalccnt[lane] = 0;
+				continue;
+			}
+			if (status != ERR_HAVE_TO_SIMULATE_AGAIN_TRANSFORMER || has_shockley)
+			{
+				form_g_matrix(ctx);
+				b->lane_flags[lane] |= BATCH_LANE_DIRTY;
+			}
+			form_isrc_vector(ctx);
+			batch_gather_isrc(b, lane);
+			b->lane_flags[lane] |= BATCH_LANE_SOLVE;
+			solve_cnt++;
+		}
+		if (active_cnt == 0)
+		{
+			break;
+		}
+		if (solve_cnt == 0)
+		{
+			continue;
+		}
+		batch_refactor_solve(b);
+		// Converged lanes are masked: their solution is left untouched
+		for (lane = 0; lane < W; lane++)
+		{
+			if (b->lane_flags[lane] & BATCH_LANE_SOLVE)
+			{
+				b->lane_flags[lane] &= ~BATCH_LANE_SOLVE;
+				if (b->lanes[lane].err != 0)
+				{
+					b->lane_flags[lane] &= ~BATCH_LANE_ACTIVE;
+					continue;
+				}
+				batch_scatter_v(b, lane);
+			}
+		}
+	}
+	for (lane = 0; lane < W; lane++)
+	{
+		if (b->lanes[lane].err != 0)
+		{
+			if (ret == 0)
+			{
+				ret = b->lanes[lane].err;
+			}
+			continue;
+		}
+		go_through_shockley_diodes_2(&b->lanes[lane]);
+		b->lanes[lane].t += b->lanes[lane].dt;
+		if (b->lanes[lane].circuit->ctlcnt)
+		{
+			ctl_run(&b->lanes[lane]);
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+const double dt = 1e-7; // 100 ns
+
+#define LANES 8
+
+int main(int argc, char **argv)
+{
+	size_t i, lane;
+	int switch_state[LANES];
+	int cnt_remain[LANES];
+	int on_time[LANES];
+	struct libsimul_ctx ctx;
+	struct libsimul_batch batch;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "buck.txt");
+	init_simulation(&ctx);
+	if (libsimul_batch_init(&batch, &ctx, LANES) != 0)
+	{
+		fprintf(stderr, "Can't create batch\n");
+		return 1;
+	}
+	// Every lane has its own load and duty cycle
+	for (lane = 0; lane < LANES; lane++)
+	{
+		struct libsimul_ctx *l = libsimul_batch_lane(&batch, lane);
+		set_resistor(l, "RL", 5.0 + 5.0*lane);
+		switch_state[lane] = 1;
+		on_time[lane] = 300 + 50*lane;
+		cnt_remain[lane] = on_time[lane];
+		set_switch_state(l, "S1", 1);
+		libsimul_batch_recalc(&batch, lane);
+	}
+	for (i = 0; i < 5*1000*1000; i++)
+	{
+		libsimul_batch_step(&batch);
+		if (i % 1000 == 0)
+		{
+			printf("%zu", i);
+			for (lane = 0; lane < LANES; lane++)
+			{
+				printf(" %g", get_V(libsimul_batch_lane(&batch, lane), 4));
+			}
+			printf("\n");
+		}
+		for (lane = 0; lane < LANES; lane++)
+		{
+			struct libsimul_ctx *l = libsimul_batch_lane(&batch, lane);
+			cnt_remain[lane]--;
+			if (cnt_remain[lane] == 0)
+			{
+				switch_state[lane] = !switch_state[lane];
+				if (set_switch_state(l, "S1", switch_state[lane]) != 0)
+				{
+					libsimul_batch_recalc(&batch, lane);
+				}
+				if (switch_state[lane])
+				{
+					cnt_remain[lane] = on_time[lane];
+				}
+				else
+				{
+					cnt_remain[lane] = 1000 - on_time[lane];
+				}
+			}
+		}
+	}
+	libsimul_batch_free(&batch);
+	libsimul_free(&ctx);
+	return 0;
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+const double dt = 1e-6; // 1 us
+
+// Load resistances simulated from the same steady state
+const double RL_sweep[] = {5.0, 10.0, 20.0};
+
+static void run(struct libsimul_ctx *ctx, double t)
+{
+	while (ctx->t < t - dt/2)
+	{
+		simulation_step(ctx);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t j;
+	int ret;
+	struct libsimul_ctx ctx;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "buckpwm.txt");
+	init_simulation(&ctx);
+	run(&ctx, 0.3);
+	ret = libsimul_checkpoint_write(&ctx, "buckcheckpoint.bin");
+	if (ret != 0)
+	{
+		fprintf(stderr, "Can't write checkpoint: %d\n", ret);
+		return 1;
+	}
+	printf("steady state at t=%g: V_out %g\n", ctx.t, get_V(&ctx, 4));
+	for (j = 0; j < sizeof(RL_sweep)/sizeof(*RL_sweep); j++)
+	{
+		// Every sweep point could be a separate process
+		struct libsimul_ctx sweep;
+		libsimul_init(&sweep, dt);
+		read_file(&sweep, "buckpwm.txt");
+		init_simulation(&sweep);
+		ret = libsimul_checkpoint_read(&sweep, "buckcheckpoint.bin");
+		if (ret != 0)
+		{
+			fprintf(stderr, "Can't read checkpoint: %d\n", ret);
+			return 1;
+		}
+		if (set_resistor(&sweep, "RL", RL_sweep[j]) != 0)
+		{
+			recalc(&sweep);
+		}
+		run(&sweep, 0.35);
+		printf("RL %g: V_out %g at t=%g\n", RL_sweep[j], get_V(&sweep, 4), sweep.t);
+		libsimul_free(&sweep);
+	}
+	libsimul_free(&ctx);
+	return 0;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <sys/stat.h>
+#include "libsimul.h"
+
+const double dt = 1e-7; // 100 ns
+
+// Records the buck converter of buckrecord.c compressed in chunks, then
+// reads the recording back: a few frames from the middle found through the
+// chunk index and the minimum and maximum of V_out over the whole run.
+int main(int argc, char **argv)
+{
+	size_t i;
+	int switch_state = 1;
+	int cnt_remain = 500;
+	struct libsimul_ctx ctx;
+	struct libsimul_record_stats st;
+	struct libsimul_recfile rf;
+	struct stat sb;
+	const double *frame;
+	double V_min = 1e300, V_max = -1e300;
+	size_t frames = 0;
+	int col, ret;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "buck.txt");
+	init_simulation(&ctx);
+	libsimul_add_probe_voltage(&ctx, "V_out", 4, 0);
+	libsimul_add_probe_inductor_current(&ctx, "I_L1", "L1");
+	libsimul_add_probe_source_current(&ctx, "I_V1", "V1");
+	if (libsimul_record_open(&ctx, "buckchunked.bin", RECORD_CHUNKED, 65536, 1) != 0)
+	{
+		fprintf(stderr, "Can't open buckchunked.bin\n");
+		return 1;
+	}
+	if (set_switch_state(&ctx, "S1", switch_state) != 0)
+	{
+		recalc(&ctx);
+	}
+	for (i = 0; i < 5*1000*1000; i++)
+	{
+		simulation_step(&ctx);
+		cnt_remain--;
+		if (cnt_remain == 0)
+		{
+			switch_state = !switch_state;
+			if (set_switch_state(&ctx, "S1", switch_state) != 0)
+			{
+				recalc(&ctx);
+			}
+			cnt_remain = 500;
+		}
+	}
+	libsimul_record_get_stats(&ctx, &st);
+	fprintf(stderr, "%zu frames, %zu stalls, max fill %zu/%zu\n",
+	        st.frame_cnt, st.stall_cnt, st.max_fill, st.ring_frames);
+	if (libsimul_record_close(&ctx) != 0 || stat("buckchunked.bin", &sb) != 0)
+	{
+		fprintf(stderr, "Can't write buckchunked.bin\n");
+		return 1;
+	}
+	libsimul_free(&ctx);
+
+	if (libsimul_recfile_open(&rf, "buckchunked.bin") != 0)
+	{
+		fprintf(stderr, "Can't read buckchunked.bin\n");
+		return 1;
+	}
+	printf("%zu chunks, %lld bytes, %.2f bytes/frame (uncompressed %zu)\n", rf.chunkcnt,
+	       (long long)sb.st_size, (double)sb.st_size/(5*1000*1000), sizeof(double)*(rf.probecnt+1));
+	col = libsimul_recfile_probe(&rf, "V_out");
+	if (libsimul_recfile_seek(&rf, 0.25) != 0)
+	{
+		fprintf(stderr, "Recording ends before 0.25 s\n");
+		return 1;
+	}
+	for (i = 0; i < 5 && libsimul_recfile_next(&rf, &frame) == 1; i++)
+	{
+		printf("t %.9f V_out %g I_L1 %g I_V1 %g\n", frame[0], frame[col], frame[2], frame[3]);
+	}
+	libsimul_recfile_seek(&rf, 0);
+	while ((ret = libsimul_recfile_next(&rf, &frame)) == 1)
+	{
+		V_min = frame[col] < V_min ? frame[col] : V_min;
+		V_max = frame[col] > V_max ? frame[col] : V_max;
+		frames++;
+	}
+	if (ret != 0)
+	{
+		fprintf(stderr, "Corrupt recording\n");
+		return 1;
+	}
+	printf("%zu frames, V_out %g .. %g\n", frames, V_min, V_max);
+	libsimul_recfile_close(&rf);
+	return 0;
+}
@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+// The regulator is in the netlist, the loop only steps and prints
+const double dt = 1e-6; // 1 us
+
+// Same circuit with three integral gains, changed without editing the netlist
+const double ki_sweep[] = {2.0, 5.0, 10.0};
+
+int main(int argc, char **argv)
+{
+	size_t i, j;
+	struct libsimul_ctx proto;
+	libsimul_init(&proto, dt);
+	read_file(&proto, "buckctl.txt");
+	init_simulation(&proto);
+	for (j = 0; j < sizeof(ki_sweep)/sizeof(*ki_sweep); j++)
+	{
+		struct libsimul_ctx ctx;
+		double V_max = 0;
+		if (libsimul_clone(&ctx, &proto) != 0)
+		{
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		set_control_param(&ctx, "REG", "ki", ki_sweep[j]);
+		for (i = 0; i < 300*1000; i++)
+		{
+			simulation_step(&ctx);
+			if (get_V(&ctx, 4) > V_max)
+			{
+				V_max = get_V(&ctx, 4);
+			}
+			if (i % 1000 == 0)
+			{
+				printf("%g %g %g %g\n", ki_sweep[j], ctx.t, get_V(&ctx, 4), get_control_output(&ctx, "REG"));
+			}
+		}
+		printf("ki %g: V_out %g, peak %g, duty %g\n", ki_sweep[j], get_control_output(&ctx, "VAVG"),
+			V_max, get_pwm_duty(&ctx, "PWM1"));
+		libsimul_free(&ctx);
+	}
+	libsimul_free(&proto);
+	return 0;
+}
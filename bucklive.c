@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+const double dt = 1e-7; // 100 ns
+
+// Runs the buck converter of buckrecord.c and publishes every 10th step to
+// the shared memory ring /libsimul-bucklive (or the name given) for liveview.
+int main(int argc, char **argv)
+{
+	size_t i;
+	int switch_state = 1;
+	int cnt_remain = 500;
+	const char *name = argc > 1 ? argv[1] : "/libsimul-bucklive";
+	struct libsimul_ctx ctx;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "buck.txt");
+	init_simulation(&ctx);
+	libsimul_add_probe_voltage(&ctx, "V_out", 4, 0);
+	libsimul_add_probe_inductor_current(&ctx, "I_L1", "L1");
+	libsimul_add_probe_source_current(&ctx, "I_V1", "V1");
+	if (libsimul_live_open(&ctx, name, 65536, 10) != 0)
+	{
+		fprintf(stderr, "Can't create %s\n", name);
+		return 1;
+	}
+	if (set_switch_state(&ctx, "S1", switch_state) != 0)
+	{
+		recalc(&ctx);
+	}
+	for (i = 0; i < 20*1000*1000; i++)
+	{
+		simulation_step(&ctx);
+		cnt_remain--;
+		if (cnt_remain == 0)
+		{
+			switch_state = !switch_state;
+			if (set_switch_state(&ctx, "S1", switch_state) != 0)
+			{
+				recalc(&ctx);
+			}
+			cnt_remain = 500;
+		}
+	}
+	printf("t %g V_out %g\n", ctx.t, libsimul_probe_value(&ctx, 0));
+	libsimul_free(&ctx);
+	return 0;
+}
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+const double dt = 1e-6; // 1 us
+
+// The regulated buck converter of buckctl.txt with named nodes, which are
+// numbered when the netlist has been read. The output is probed by name.
+int main(int argc, char **argv)
+{
+	static const char *nodes[] = {"in", "sw", "l_out", "out"};
+	size_t i;
+	int probe;
+	struct libsimul_ctx ctx;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "buckname.txt");
+	for (i = 0; i < sizeof(nodes)/sizeof(*nodes); i++)
+	{
+		int n = libsimul_node(&ctx, nodes[i]);
+		printf("Node %s: %d (%s)\n", nodes[i], n, libsimul_node_name(&ctx, n));
+	}
+	init_simulation(&ctx);
+	probe = libsimul_add_probe_node_voltage(&ctx, "V_out", "out", "gnd");
+	if (probe < 0)
+	{
+		fprintf(stderr, "Can't probe node out\n");
+		return 1;
+	}
+	for (i = 0; i < 300*1000; i++)
+	{
+		simulation_step(&ctx);
+		if (i % 10000 == 0)
+		{
+			printf("%g %g %g\n", ctx.t, libsimul_probe_value(&ctx, probe), get_control_output(&ctx, "REG"));
+		}
+	}
+	printf("V_out %g, duty %g\n", get_control_output(&ctx, "VAVG"), get_pwm_duty(&ctx, "PWM1"));
+	libsimul_free(&ctx);
+	return 0;
+}
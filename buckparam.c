@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+const double dt = 1e-6; // 1 us
+
+// Input voltage and output power sweep of the regulated buck converter of
+// buckparam.txt. The netlist is read once, every point is a clone with its
+// own parameter values, which change the elements, the PWM and the control
+// blocks that use them before the simulation is initialized. A point that
+// fails is reported without ending the sweep.
+int main(int argc, char **argv)
+{
+	static const double vins[] = {8, 13.2, 24};
+	static const double pouts[] = {1, 2.5, 5};
+	size_t i, j, k;
+	int ret;
+	struct libsimul_ctx ctx;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "buckparam.txt");
+	printf("vin pout rload V_out duty\n");
+	for (i = 0; i < sizeof(vins)/sizeof(*vins); i++)
+	{
+		for (j = 0; j < sizeof(pouts)/sizeof(*pouts); j++)
+		{
+			struct libsimul_ctx point;
+			if (libsimul_clone(&point, &ctx) != 0)
+			{
+				fprintf(stderr, "Can't clone context\n");
+				return 1;
+			}
+			if (libsimul_set_param(&point, "vin", vins[i]) != 0 ||
+			    libsimul_set_param(&point, "pout", pouts[j]) != 0)
+			{
+				fprintf(stderr, "Can't set parameters\n");
+				return 1;
+			}
+			ret = init_simulation(&point);
+			for (k = 0; ret == 0 && k < 300*1000; k++)
+			{
+				ret = simulation_step(&point);
+			}
+			if (ret != 0)
+			{
+				// The other points go on
+				printf("%g %g failed: %s\n", vins[i], pouts[j], libsimul_error(&point));
+				libsimul_free(&point);
+				continue;
+			}
+			printf("%g %g %g %g %g\n", libsimul_get_param(&point, "vin"), libsimul_get_param(&point, "pout"),
+				get_resistor(&point, "RL"), get_control_output(&point, "VAVG"), get_pwm_duty(&point, "PWM1"));
+			libsimul_free(&point);
+		}
+	}
+	// The netlist itself is unchanged
+	printf("Netlist rload %g\n", libsimul_get_param(&ctx, "rload"));
+	libsimul_free(&ctx);
+	return 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <math.h>
+#include "libsimul.h"
+
+const double dt = 1e-7; // 100 ns
+const double t_end = 0.1;
+
+// 10 kHz, 50 % duty cycle, from simulation time so that it works with any dt
+static int controller(struct libsimul_ctx *ctx, void *ctl_state, void *userdata)
+{
+	int *switch_state = ctl_state;
+	int new_state = fmod(ctx->t, 100e-6) < 50e-6;
+	if (new_state != *switch_state)
+	{
+		*switch_state = new_state;
+		if (set_switch_state(ctx, "S1", new_state) != 0)
+		{
+			recalc(ctx);
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct libsimul_ctx ctx, seq, res;
+	struct libsimul_parareal pr;
+	int switch_state = 1;
+	int ret;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "buck.txt");
+	init_simulation(&ctx);
+	if (set_switch_state(&ctx, "S1", switch_state) != 0)
+	{
+		recalc(&ctx);
+	}
+
+	// Reference: plain sequential run
+	libsimul_clone(&seq, &ctx);
+	while (seq.t < t_end - dt/2)
+	{
+		simulation_step(&seq);
+		controller(&seq, &switch_state, NULL);
+	}
+
+	switch_state = 1;
+	libsimul_parareal_init(&pr, &ctx, t_end, 8, controller, sizeof(switch_state), &switch_state, NULL);
+	pr.coarse_ratio = 10;
+	pr.tol = 1e-4;
+	ret = libsimul_parareal_run(&pr);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Parareal failed: %d\n", ret);
+		return 1;
+	}
+	libsimul_parareal_result(&pr, &res, NULL);
+	printf("%zu iterations, defect %g\n", pr.iterations, pr.defect);
+	printf("sequential V_out %g I_L1 %g\n", get_V(&seq, 4), get_inductor_current(&seq, "L1"));
+	printf("parareal   V_out %g I_L1 %g\n", get_V(&res, 4), get_inductor_current(&res, "L1"));
+	libsimul_parareal_free(&pr);
+	libsimul_free(&res);
+	libsimul_free(&seq);
+	libsimul_free(&ctx);
+	return 0;
+}
@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+// PWM edges are at exact times, so dt can be much longer than the duty
+// cycle resolution would otherwise require
+const double dt = 1e-6; // 1 us
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	struct libsimul_ctx ctx;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "buckpwm.txt");
+	init_simulation(&ctx);
+	for (i = 0; i < 500*1000; i++)
+	{
+		simulation_step(&ctx);
+		if (i % 100 == 0)
+		{
+			printf("%g %g\n", ctx.t, get_V(&ctx, 4));
+		}
+		if (i == 250*1000)
+		{
+			set_pwm_duty(&ctx, "PWM1", 0.5);
+		}
+	}
+	libsimul_free(&ctx);
+	return 0;
+}
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+const double dt = 1e-7; // 100 ns
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	int switch_state = 1;
+	int cnt_remain = 500;
+	struct libsimul_ctx ctx;
+	struct libsimul_record_stats st;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "buck.txt");
+	init_simulation(&ctx);
+	libsimul_add_probe_voltage(&ctx, "V_out", 4, 0);
+	libsimul_add_probe_inductor_current(&ctx, "I_L1", "L1");
+	libsimul_add_probe_source_current(&ctx, "I_V1", "V1");
+	if (libsimul_record_open(&ctx, "buckrecord.bin", RECORD_BINARY, 65536, 1) != 0)
+	{
+		fprintf(stderr, "Can't open buckrecord.bin\n");
+		return 1;
+	}
+	if (set_switch_state(&ctx, "S1", switch_state) != 0)
+	{
+		recalc(&ctx);
+	}
+	for (i = 0; i < 5*1000*1000; i++)
+	{
+		simulation_step(&ctx);
+		cnt_remain--;
+		if (cnt_remain == 0)
+		{
+			switch_state = !switch_state;
+			if (set_switch_state(&ctx, "S1", switch_state) != 0)
+			{
+				recalc(&ctx);
+			}
+			cnt_remain = 500;
+		}
+	}
+	libsimul_record_get_stats(&ctx, &st);
+	fprintf(stderr, "%zu frames, %zu stalls, max fill %zu/%zu\n",
+	        st.frame_cnt, st.stall_cnt, st.max_fill, st.ring_frames);
+	libsimul_free(&ctx); // flushes the recording
+	return 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <math.h>
+#include "libsimul.h"
+
+const double dt = 1e-7; // 100 ns
+const double T_sample = 1e-6; // controller runs every 1 us
+const double T_pwm = 100e-6; // 10 kHz
+const double V_tgt = 5.0;
+
+struct buck_ctl {
+	int h_S1;
+	int h_C1;
+	double duty;
+	double integ;
+	double carrier_start;
+	size_t samples;
+};
+
+static int controller(struct libsimul_ctx *ctx, void *ctl_state, void *userdata)
+{
+	struct buck_ctl *c = ctl_state;
+	double V_out = libsimul_handle_voltage(ctx, c->h_C1);
+	if (ctx->t - c->carrier_start >= T_pwm - dt/2)
+	{
+		// PI regulator, duty latched once per carrier period
+		double err = V_tgt - V_out;
+		c->carrier_start += T_pwm;
+		c->integ += 0.0005*err;
+		if (c->integ < 0)
+		{
+			c->integ = 0;
+		}
+		if (c->integ > 0.9)
+		{
+			c->integ = 0.9;
+		}
+		c->duty = c->integ + 0.02*err;
+		c->duty = fmin(0.9, fmax(0.0, c->duty));
+	}
+	libsimul_handle_set_switch(ctx, c->h_S1, ctx->t - c->carrier_start < c->duty*T_pwm);
+	if (++c->samples % 1000 == 0)
+	{
+		printf("%g %g %g\n", ctx->t, V_out, c->duty);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct libsimul_ctx ctx;
+	struct buck_ctl c = {0};
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "buck.txt");
+	init_simulation(&ctx);
+	c.h_S1 = libsimul_element_handle(&ctx, "S1");
+	c.h_C1 = libsimul_element_handle(&ctx, "C1");
+	if (c.h_S1 < 0 || c.h_C1 < 0)
+	{
+		fprintf(stderr, "Element not found\n");
+		return 1;
+	}
+	libsimul_run(&ctx, 0.5, controller, T_sample, &c, NULL);
+	libsimul_free(&ctx);
+	return 0;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <math.h>
+#include "libsimul.h"
+
+const double dt = 1e-7; // 100 ns
+
+// Runs the buck converter of buckrecord.c for 2 s with load steps at 1 s
+// and 1.5 s but records only windows around the start-up (V_out rising
+// through 5 V) and the load steps (raised by the driver), then lists the
+// windows found in the recording.
+int main(int argc, char **argv)
+{
+	size_t i;
+	int switch_state = 1;
+	int cnt_remain = 500;
+	struct libsimul_ctx ctx;
+	struct libsimul_record_stats st;
+	struct libsimul_recfile rf;
+	const double *frame;
+	double t_first = 0, t_prev = -1, V_min = 0, V_max = 0;
+	size_t frames = 0;
+	int col, ret;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "buck.txt");
+	init_simulation(&ctx);
+	col = libsimul_add_probe_voltage(&ctx, "V_out", 4, 0);
+	libsimul_add_probe_inductor_current(&ctx, "I_L1", "L1");
+	if (libsimul_record_open(&ctx, "buckwindow.bin", RECORD_CHUNKED, 65536, 10) != 0 ||
+	    libsimul_record_set_window(&ctx, 2000, 20000) != 0 ||
+	    libsimul_record_add_trigger(&ctx, TRIGGER_RISING, col, 5.0) != 0)
+	{
+		fprintf(stderr, "Can't open buckwindow.bin\n");
+		return 1;
+	}
+	if (set_switch_state(&ctx, "S1", switch_state) != 0)
+	{
+		recalc(&ctx);
+	}
+	for (i = 0; i < 20*1000*1000; i++)
+	{
+		if (i == 10*1000*1000 || i == 15*1000*1000)
+		{
+			set_resistor(&ctx, "RL", i == 10*1000*1000 ? 5 : 10);
+			recalc(&ctx);
+			libsimul_record_trigger(&ctx);
+		}
+		simulation_step(&ctx);
+		cnt_remain--;
+		if (cnt_remain == 0)
+		{
+			switch_state = !switch_state;
+			if (set_switch_state(&ctx, "S1", switch_state) != 0)
+			{
+				recalc(&ctx);
+			}
+			cnt_remain = 500;
+		}
+	}
+	libsimul_record_get_stats(&ctx, &st);
+	printf("%zu windows, %zu of 2000000 frames recorded\n", st.window_cnt, st.frame_cnt);
+	if (libsimul_record_close(&ctx) != 0)
+	{
+		fprintf(stderr, "Can't write buckwindow.bin\n");
+		return 1;
+	}
+	libsimul_free(&ctx);
+
+	if (libsimul_recfile_open(&rf, "buckwindow.bin") != 0)
+	{
+		fprintf(stderr, "Can't read buckwindow.bin\n");
+		return 1;
+	}
+	col = libsimul_recfile_probe(&rf, "V_out");
+	// A gap in time separates the windows
+	while ((ret = libsimul_recfile_next(&rf, &frame)) >= 0)
+	{
+		if (ret == 0 || (frames > 0 && frame[0] - t_prev > 1.5*10*dt))
+		{
+			printf("t %.6f .. %.6f: %zu frames, V_out %g .. %g\n",
+			       t_first, t_prev, frames, V_min, V_max);
+			frames = 0;
+		}
+		if (ret == 0)
+		{
+			break;
+		}
+		if (frames == 0)
+		{
+			t_first = frame[0];
+			V_min = V_max = frame[col];
+		}
+		V_min = fmin(V_min, frame[col]);
+		V_max = fmax(V_max, frame[col]);
+		t_prev = frame[0];
+		frames++;
+	}
+	libsimul_recfile_close(&rf);
+	if (ret < 0)
+	{
+		fprintf(stderr, "Corrupt recording\n");
+		return 1;
+	}
+	return 0;
+}
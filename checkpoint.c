@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "libsimul.h"
+
+// Checkpoint and restore of the complete dynamic state of a context.
+//
+// The blob has a magic, a version, a hash of the circuit topology and the
+// object counts, followed by the time, the transformer search state, every
+// element state, the node voltages and the state of PWM modulators,
+// waveforms and control blocks, as native-endian integers and doubles. It
+// can be restored into any context that has been initialized from the same
+// netlist, even if element values have been changed since, which is what
+// parameter sweeps starting from a steady state need. Netlist constants and
+// the time step are not part of the state.
+
+#define CKPT_HDR_SZ (4 + 4 + 8 + 6*8)
+#define CKPT_CTX_SZ (7*8 + 8 + 4)
+#define CKPT_ELEMENT_SZ (4 + 10*8)
+#define CKPT_PWM_SZ (3*8)
+#define CKPT_WAVE_SZ (6*8 + 2*8)
+#define CKPT_CTL_SZ (6*8 + 2*8)
+
+struct ckpt_writer {
+	unsigned char *p;
+	size_t off;
+};
+
+struct ckpt_reader {
+	const unsigned char *p;
+	size_t off;
+};
+
+static void put_bytes(struct ckpt_writer *w, const void *data, size_t sz)
+{
+	memcpy(&w->p[w->off], data, sz);
+	w->off += sz;
+}
+
+static void put_u32(struct ckpt_writer *w, uint32_t u)
+{
+	put_bytes(w, &u, sizeof(u));
+}
+
+static void put_u64(struct ckpt_writer *w, uint64_t u)
+{
+	put_bytes(w, &u, sizeof(u));
+}
+
+static void put_double(struct ckpt_writer *w, double d)
+{
+	put_bytes(w, &d, sizeof(d));
+}
+
+static void get_bytes(struct ckpt_reader *r, void *data, size_t sz)
+{
+	memcpy(data, &r->p[r->off], sz);
+	r->off += sz;
+}
+
+static uint32_t get_u32(struct ckpt_reader *r)
+{
+	uint32_t u;
+	get_bytes(r, &u, sizeof(u));
+	return u;
+}
+
+static uint64_t get_u64(struct ckpt_reader *r)
+{
+	uint64_t u;
+	get_bytes(r, &u, sizeof(u));
+	return u;
+}
+
+static double get_double(struct ckpt_reader *r)
+{
+	double d;
+	get_bytes(r, &d, sizeof(d));
+	return d;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t sz)
+{
+	const unsigned char *p = data;
+	size_t i;
+	for (i = 0; i < sz; i++)
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static uint64_t fnv1a_str(uint64_t h, const char *s)
+{
+	return fnv1a(h, s, strlen(s)+1);
+}
+
+static uint64_t fnv1a_u64(uint64_t h, uint64_t u)
+{
+	return fnv1a(h, &u, sizeof(u));
+}
+
+// Hash of element names, types and nodes and of the names of the other
+// netlist objects, but not of element values
+uint64_t libsimul_circuit_hash(const struct libsimul_ctx *ctx)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	uint64_t h = 14695981039346656037ULL;
+	size_t i, j;
+	h = fnv1a_u64(h, c->elements_used_sz);
+	h = fnv1a_u64(h, ctx->nodecnt);
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		const struct element *el = c->elements_used[i];
+		h = fnv1a_str(h, el->name);
+		h = fnv1a_u64(h, el->typ);
+		h = fnv1a_u64(h, (uint64_t)el->n1);
+		h = fnv1a_u64(h, (uint64_t)el->n2);
+		h = fnv1a_u64(h, el->primary);
+	}
+	for (i = 0; i < c->pwmcnt; i++)
+	{
+		h = fnv1a_str(h, c->pwms[i].name);
+	}
+	for (i = 0; i < c->wavecnt; i++)
+	{
+		h = fnv1a_u64(h, c->waves[i].typ);
+		for (j = 0; j < c->waves[i].srccnt; j++)
+		{
+			h = fnv1a_str(h, c->waves[i].srcs[j].name);
+		}
+	}
+	for (i = 0; i < c->ctlcnt; i++)
+	{
+		h = fnv1a_str(h, c->ctls[i].name);
+		h = fnv1a_u64(h, c->ctls[i].typ);
+	}
+	return fnv1a_u64(h, c->ctl_bufsz);
+}
+
+static size_t checkpoint_size(const struct libsimul_ctx *ctx)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	return CKPT_HDR_SZ + CKPT_CTX_SZ +
+		c->elements_used_sz*CKPT_ELEMENT_SZ +
+		ctx->nodecnt*8 +
+		c->pwmcnt*CKPT_PWM_SZ +
+		c->wavecnt*CKPT_WAVE_SZ +
+		c->ctlcnt*CKPT_CTL_SZ +
+		c->ctl_bufsz*8;
+}
+
+// Allocates the blob, which the caller frees. Returns 0 or negative error
+// code.
+int libsimul_checkpoint_save(const struct libsimul_ctx *ctx, void **blob, size_t *blobsz)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	struct ckpt_writer w;
+	size_t i;
+	if (ctx->G_matrix == NULL)
+	{
+		// init_simulation() not yet called
+		return -ERR_NO_DATA;
+	}
+	*blobsz = checkpoint_size(ctx);
+	w.p = malloc(*blobsz);
+	w.off = 0;
+	if (w.p == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	put_bytes(&w, CHECKPOINT_MAGIC, 4);
+	put_u32(&w, CHECKPOINT_VERSION);
+	put_u64(&w, libsimul_circuit_hash(ctx));
+	put_u64(&w, c->elements_used_sz);
+	put_u64(&w, ctx->nodecnt);
+	put_u64(&w, c->pwmcnt);
+	put_u64(&w, c->wavecnt);
+	put_u64(&w, c->ctlcnt);
+	put_u64(&w, c->ctl_bufsz);
+
+	put_double(&w, ctx->t);
+	put_double(&w, ctx->loboV);
+	put_double(&w, ctx->hiboV);
+	put_double(&w, ctx->trialV);
+	put_double(&w, ctx->lobophi);
+	put_double(&w, ctx->hibophi);
+	put_double(&w, ctx->trialphi);
+	put_u64(&w, ctx->xformerid == SIZE_MAX ? UINT64_MAX : ctx->xformerid);
+	put_u32(&w, ctx->xformerstate);
+
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		const struct element_state *st = &ctx->state[i];
+		put_u32(&w, st->current_switch_state_is_closed);
+		put_double(&w, st->V);
+		put_double(&w, st->V_across_diode);
+		put_double(&w, st->I_src);
+		put_double(&w, st->I_model);
+		put_double(&w, st->G_shockley);
+		put_double(&w, st->G_R_shockley);
+		put_double(&w, st->expval);
+		put_double(&w, st->cur_phi_single);
+		put_double(&w, st->dphi_single);
+		put_double(&w, st->transformer_direct_const);
+	}
+	put_bytes(&w, ctx->V_vector, ctx->nodecnt*8);
+	for (i = 0; i < c->pwmcnt; i++)
+	{
+		const struct libsimul_pwm_state *st = &ctx->pwm_state[i];
+		put_double(&w, st->duty_cmd);
+		put_double(&w, st->duty);
+		put_double(&w, st->period_start);
+	}
+	for (i = 0; i < c->wavecnt; i++)
+	{
+		const struct libsimul_wave_state *st = &ctx->wave_state[i];
+		put_double(&w, st->t);
+		put_double(&w, st->c);
+		put_double(&w, st->s);
+		put_double(&w, st->rot_dt);
+		put_double(&w, st->rot_c);
+		put_double(&w, st->rot_s);
+		put_u64(&w, st->rotations);
+		put_u64(&w, st->pwl_seg);
+	}
+	for (i = 0; i < c->ctlcnt; i++)
+	{
+		const struct libsimul_ctl_state *st = &ctx->ctl_state[i];
+		put_double(&w, st->out);
+		put_double(&w, st->integ);
+		put_double(&w, st->prev_err);
+		put_double(&w, st->prev_trig);
+		put_double(&w, st->sum);
+		put_double(&w, st->next_sample);
+		put_u64(&w, st->pos);
+		put_u64(&w, st->fill);
+	}
+	if (c->ctl_bufsz)
+	{
+		put_bytes(&w, ctx->ctl_buf, c->ctl_bufsz*8);
+	}
+	*blob = w.p;
+	return 0;
+}
+
+// The context must have been initialized from the same netlist. Nothing is
+// modified if the blob doesn't match it.
+int libsimul_checkpoint_restore(struct libsimul_ctx *ctx, const void *blob, size_t blobsz)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	struct ckpt_reader r;
+	uint64_t xformerid;
+	size_t i;
+	if (ctx->G_matrix == NULL)
+	{
+		return -ERR_NO_DATA;
+	}
+	r.p = blob;
+	r.off = 0;
+	if (blobsz < CKPT_HDR_SZ || memcmp(blob, CHECKPOINT_MAGIC, 4) != 0)
+	{
+		return -ERR_MISMATCH;
+	}
+	r.off = 4;
+	if (get_u32(&r) != CHECKPOINT_VERSION ||
+	    get_u64(&r) != libsimul_circuit_hash(ctx) ||
+	    get_u64(&r) != c->elements_used_sz ||
+	    get_u64(&r) != ctx->nodecnt ||
+	    get_u64(&r) != c->pwmcnt ||
+	    get_u64(&r) != c->wavecnt ||
+	    get_u64(&r) != c->ctlcnt ||
+	    get_u64(&r) != c->ctl_bufsz ||
+	    blobsz != checkpoint_size(ctx))
+	{
+		return -ERR_MISMATCH;
+	}
+
+	ctx->t = get_double(&r);
+	ctx->loboV = get_double(&r);
+	ctx->hiboV = get_double(&r);
+	ctx->trialV = get_double(&r);
+	ctx->lobophi = get_double(&r);
+	ctx->hibophi = get_double(&r);
+	ctx->trialphi = get_double(&r);
+	xformerid = get_u64(&r);
+	ctx->xformerid = xformerid == UINT64_MAX ? SIZE_MAX : (size_t)xformerid;
+	ctx->xformerstate = (enum xformerstatetype)get_u32(&r);
+
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		struct element_state *st = &ctx->state[i];
+		st->current_switch_state_is_closed = (int)get_u32(&r);
+		st->V = get_double(&r);
+		st->V_across_diode = get_double(&r);
+		st->I_src = get_double(&r);
+		st->I_model = get_double(&r);
+		st->G_shockley = get_double(&r);
+		st->G_R_shockley = get_double(&r);
+		st->expval = get_double(&r);
+		st->cur_phi_single = get_double(&r);
+		st->dphi_single = get_double(&r);
+		st->transformer_direct_const = get_double(&r);
+	}
+	get_bytes(&r, ctx->V_vector, ctx->nodecnt*8);
+	for (i = 0; i < c->pwmcnt; i++)
+	{
+		struct libsimul_pwm_state *st = &ctx->pwm_state[i];
+		st->duty_cmd = get_double(&r);
+		st->duty = get_double(&r);
+		st->period_start = get_double(&r);
+	}
+	for (i = 0; i < c->wavecnt; i++)
+	{
+		struct libsimul_wave_state *st = &ctx->wave_state[i];
+		st->t = get_double(&r);
+		st->c = get_double(&r);
+		st->s = get_double(&r);
+		st->rot_dt = get_double(&r);
+		st->rot_c = get_double(&r);
+		st->rot_s = get_double(&r);
+		st->rotations = (size_t)get_u64(&r);
+		st->pwl_seg = (size_t)get_u64(&r);
+	}
+	for (i = 0; i < c->ctlcnt; i++)
+	{
+		struct libsimul_ctl_state *st = &ctx->ctl_state[i];
+		st->out = get_double(&r);
+		st->integ = get_double(&r);
+		st->prev_err = get_double(&r);
+		st->prev_trig = get_double(&r);
+		st->sum = get_double(&r);
+		st->next_sample = get_double(&r);
+		st->pos = (size_t)get_u64(&r);
+		st->fill = (size_t)get_u64(&r);
+	}
+	if (c->ctl_bufsz)
+	{
+		get_bytes(&r, ctx->ctl_buf, c->ctl_bufsz*8);
+	}
+
+	// Switch and diode states have changed. A failed context can go on
+	// from an earlier checkpoint.
+	ctx->needs_recalc = 0;
+	ctx->err = 0;
+	ctx->errmsg[0] = '\0';
+	form_g_matrix(ctx);
+	return calc_lu(ctx);
+}
+
+int libsimul_checkpoint_write(const struct libsimul_ctx *ctx, const char *fname)
+{
+	void *blob;
+	size_t blobsz;
+	FILE *f;
+	int ret = libsimul_checkpoint_save(ctx, &blob, &blobsz);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	f = fopen(fname, "wb");
+	if (f == NULL)
+	{
+		free(blob);
+		return -ERR_IO;
+	}
+	ret = (fwrite(blob, 1, blobsz, f) == blobsz) ? 0 : -ERR_IO;
+	if (fclose(f) != 0)
+	{
+		ret = -ERR_IO;
+	}
+	free(blob);
+	return ret;
+}
+
+int libsimul_checkpoint_read(struct libsimul_ctx *ctx, const char *fname)
+{
+	size_t blobsz = checkpoint_size(ctx);
+	void *blob;
+	FILE *f;
+	int ret;
+	blob = malloc(blobsz+1);
+	if (blob == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	f = fopen(fname, "rb");
+	if (f == NULL)
+	{
+		free(blob);
+		return -ERR_IO;
+	}
+	// One byte more than expected to detect a longer file
+	blobsz = fread(blob, 1, blobsz+1, f);
+	if (ferror(f))
+	{
+		ret = -ERR_IO;
+	}
+	else
+	{
+		ret = libsimul_checkpoint_restore(ctx, blob, blobsz);
+	}
+	fclose(f);
+	free(blob);
+	return ret;
+}
@@ -0,0 +1,702 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include "libsimul.h"
+
+// Discrete-time control blocks declared in the netlist:
+//
+// .ctl VAVG avg in=V(4) n=100 Ts=1e-6
+// .ctl REG pi in=VAVG ref=5 kp=0.02 ki=5 min=0 max=0.9 Ts=100e-6 out=PWM1
+//
+// Block types:
+// pi, pid: output kp*e + integral of ki*e + kd*de/dt, e = ref - in, with
+//          the integrator and the output clamped to min..max
+// limit:   in clamped to min..max
+// avg:     moving average of the last n samples of in
+// rms:     moving RMS of the last n samples of in
+// cmp:     1 if in > ref, 0 if in < ref, with hysteresis hyst
+// sh:      in sampled at rising edges of trig, or every sample without trig
+//
+// Inputs (in, ref, trig) are a constant, an expression of parameters in
+// braces, V(n1) or V(n1,n2) of node numbers or names, I(element) for any
+// element libsimul_handle_current() supports, or the name of another
+// block. A block runs every Ts of simulation time (every step if Ts isn't
+// given) after the step, in netlist order, so a block reading a later block
+// gets its previous output. out= drives a PWM duty cycle or a switch
+// (closed if the output is above 0.5), otherwise the output can be read by
+// get_control_output(). Gains and limits can be changed by
+// set_control_param() without changing the netlist, for example in clones
+// of a context for a parameter sweep.
+
+// Value of the control block being read
+static double ctl_read_double(struct libsimul_ctx *ctx, const char *val, size_t off, enum libsimul_param_check check)
+{
+	return netlist_value(ctx, val, PARAM_CTL, ctx->circuit->ctlcnt-1, off, check);
+}
+
+static void ctl_read_signal(struct libsimul_ctx *ctx, struct libsimul_signal *sig, const char *val)
+{
+	char *endptr;
+	size_t len = strlen(val);
+	free(sig->name);
+	memset(sig, 0, sizeof(*sig));
+	if (strncmp(val, "V(", 2) == 0 && len > 3 && val[len-1] == ')')
+	{
+		// Nodes are numbers or names
+		char *nodes = strndup(&val[2], len-3);
+		char *comma;
+		if (nodes == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		comma = strchr(nodes, ',');
+		if (comma != NULL)
+		{
+			*comma = '\0';
+		}
+		if (*nodes == '\0' || (comma != NULL && comma[1] == '\0'))
+		{
+			fprintf(stderr, "Invalid voltage input: %s\n", val);
+			exit(1);
+		}
+		sig->typ = SIGNAL_VOLTAGE;
+		sig->n1 = node_parse(ctx, nodes);
+		sig->n2 = comma != NULL ? node_parse(ctx, &comma[1]) : 0;
+		free(nodes);
+		return;
+	}
+	if (strncmp(val, "I(", 2) == 0 && len > 3 && val[len-1] == ')')
+	{
+		sig->typ = SIGNAL_CURRENT;
+		sig->name = strndup(&val[2], len-3);
+	}
+	else if (*val == '{')
+	{
+		// Expression of parameters
+		const size_t off = (size_t)((char *)&sig->val - (char *)&ctx->circuit->ctls[ctx->circuit->ctlcnt-1]);
+		sig->typ = SIGNAL_CONST;
+		sig->val = ctl_read_double(ctx, val, off, PARAM_ANY);
+		return;
+	}
+	else
+	{
+		sig->val = strtod(val, &endptr);
+		if (*val != '\0' && *endptr == '\0')
+		{
+			sig->typ = SIGNAL_CONST;
+			return;
+		}
+		sig->typ = SIGNAL_BLOCK;
+		sig->name = strdup(val);
+	}
+	if (sig->name == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+}
+
+static char *ctl_strdup_or_null(const char *s, int *oom)
+{
+	char *d;
+	if (s == NULL)
+	{
+		return NULL;
+	}
+	d = strdup(s);
+	if (d == NULL)
+	{
+		*oom = 1;
+	}
+	return d;
+}
+
+// Range checks of the values of a control block, applied again when a
+// parameter is overridden
+int ctl_valid(const struct libsimul_ctl *ctl)
+{
+	return ctl->min <= ctl->max && ctl->Ts >= 0 && ctl->hyst >= 0;
+}
+
+int ctl_read_directive(struct libsimul_ctx *ctx, char *lineptr)
+{
+	struct libsimul_circuit *c;
+	struct libsimul_ctl *ctl;
+	char *name = next_token(&lineptr);
+	char *typname = next_token(&lineptr);
+	char *tok;
+	int has_in = 0;
+	size_t i;
+	if (name == NULL || typname == NULL)
+	{
+		fprintf(stderr, "Control block must have name and type\n");
+		exit(1);
+	}
+	netlist_unshare(ctx);
+	c = ctx->circuit;
+	for (i = 0; i < c->ctlcnt; i++)
+	{
+		if (strcmp(c->ctls[i].name, name) == 0)
+		{
+			fprintf(stderr, "Duplicate control block %s\n", name);
+			exit(1);
+		}
+	}
+	if (c->ctlcnt >= c->ctlcap || c->ctls == NULL)
+	{
+		size_t new_cap = 2*c->ctlcnt+4;
+		struct libsimul_ctl *new_ctls;
+		new_ctls = realloc(c->ctls, sizeof(*c->ctls)*new_cap);
+		if (new_ctls == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		c->ctls = new_ctls;
+		c->ctlcap = new_cap;
+	}
+	ctl = &c->ctls[c->ctlcnt];
+	memset(ctl, 0, sizeof(*ctl));
+	ctl->name = strdup(name);
+	if (ctl->name == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	c->ctlcnt++;
+	if (strcmp(typname, "pi") == 0)
+	{
+		ctl->typ = CTL_PI;
+	}
+	else if (strcmp(typname, "pid") == 0)
+	{
+		ctl->typ = CTL_PID;
+	}
+	else if (strcmp(typname, "limit") == 0)
+	{
+		ctl->typ = CTL_LIMIT;
+	}
+	else if (strcmp(typname, "avg") == 0)
+	{
+		ctl->typ = CTL_AVG;
+	}
+	else if (strcmp(typname, "rms") == 0)
+	{
+		ctl->typ = CTL_RMS;
+	}
+	else if (strcmp(typname, "cmp") == 0)
+	{
+		ctl->typ = CTL_CMP;
+	}
+	else if (strcmp(typname, "sh") == 0)
+	{
+		ctl->typ = CTL_SH;
+	}
+	else
+	{
+		fprintf(stderr, "Invalid control block type: %s\n", typname);
+		exit(1);
+	}
+	ctl->min = -INFINITY;
+	ctl->max = INFINITY;
+	while ((tok = next_token(&lineptr)) != NULL)
+	{
+		char *equals = strchr(tok, '=');
+		char *val;
+		if (equals == NULL)
+		{
+			fprintf(stderr, "Extra token no equals sign\n");
+			exit(1);
+		}
+		*equals = '\0';
+		val = &equals[1];
+		if (strcmp(tok, "in") == 0)
+		{
+			ctl_read_signal(ctx, &ctl->in, val);
+			has_in = 1;
+		}
+		else if (strcmp(tok, "ref") == 0 &&
+		         (ctl->typ == CTL_PI || ctl->typ == CTL_PID || ctl->typ == CTL_CMP))
+		{
+			ctl_read_signal(ctx, &ctl->ref, val);
+			ctl->has_ref = 1;
+		}
+		else if (strcmp(tok, "trig") == 0 && ctl->typ == CTL_SH)
+		{
+			ctl_read_signal(ctx, &ctl->ref, val);
+			ctl->has_ref = 1;
+		}
+		else if (strcmp(tok, "Ts") == 0)
+		{
+			ctl->Ts = ctl_read_double(ctx, val, offsetof(struct libsimul_ctl, Ts), PARAM_NONNEGATIVE);
+			if (ctl->Ts < 0)
+			{
+				fprintf(stderr, "Invalid sample time: %lf\n", ctl->Ts);
+				exit(1);
+			}
+		}
+		else if (strcmp(tok, "kp") == 0 && (ctl->typ == CTL_PI || ctl->typ == CTL_PID))
+		{
+			ctl->kp = ctl_read_double(ctx, val, offsetof(struct libsimul_ctl, kp), PARAM_ANY);
+		}
+		else if (strcmp(tok, "ki") == 0 && (ctl->typ == CTL_PI || ctl->typ == CTL_PID))
+		{
+			ctl->ki = ctl_read_double(ctx, val, offsetof(struct libsimul_ctl, ki), PARAM_ANY);
+		}
+		else if (strcmp(tok, "kd") == 0 && ctl->typ == CTL_PID)
+		{
+			ctl->kd = ctl_read_double(ctx, val, offsetof(struct libsimul_ctl, kd), PARAM_ANY);
+		}
+		else if (strcmp(tok, "min") == 0 &&
+		         (ctl->typ == CTL_PI || ctl->typ == CTL_PID || ctl->typ == CTL_LIMIT))
+		{
+			ctl->min = ctl_read_double(ctx, val, offsetof(struct libsimul_ctl, min), PARAM_ANY);
+		}
+		else if (strcmp(tok, "max") == 0 &&
+		         (ctl->typ == CTL_PI || ctl->typ == CTL_PID || ctl->typ == CTL_LIMIT))
+		{
+			ctl->max = ctl_read_double(ctx, val, offsetof(struct libsimul_ctl, max), PARAM_ANY);
+		}
+		else if (strcmp(tok, "hyst") == 0 && ctl->typ == CTL_CMP)
+		{
+			ctl->hyst = ctl_read_double(ctx, val, offsetof(struct libsimul_ctl, hyst), PARAM_NONNEGATIVE);
+			if (ctl->hyst < 0)
+			{
+				fprintf(stderr, "Invalid hysteresis: %lf\n", ctl->hyst);
+				exit(1);
+			}
+		}
+		else if (strcmp(tok, "n") == 0 && (ctl->typ == CTL_AVG || ctl->typ == CTL_RMS))
+		{
+			char *endptr;
+			long n = strtol(val, &endptr, 10);
+			if (*val == '\0' || *endptr != '\0' || n < 1)
+			{
+				fprintf(stderr, "Invalid window: %s\n", val);
+				exit(1);
+			}
+			ctl->n = (size_t)n;
+		}
+		else if (strcmp(tok, "init") == 0)
+		{
+			ctl->init = ctl_read_double(ctx, val, offsetof(struct libsimul_ctl, init), PARAM_ANY);
+		}
+		else if (strcmp(tok, "out") == 0)
+		{
+			free(ctl->out_name);
+			ctl->out_name = strdup(val);
+			if (ctl->out_name == NULL)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Invalid parameter: %s\n", tok);
+			exit(1);
+		}
+	}
+	if (!has_in)
+	{
+		fprintf(stderr, "Control block %s must have input\n", ctl->name);
+		exit(1);
+	}
+	if (!ctl_valid(ctl))
+	{
+		fprintf(stderr, "Control block %s minimum above maximum\n", ctl->name);
+		exit(1);
+	}
+	if ((ctl->typ == CTL_AVG || ctl->typ == CTL_RMS) && ctl->n == 0)
+	{
+		fprintf(stderr, "Control block %s must have window\n", ctl->name);
+		exit(1);
+	}
+	ctl->bufoff = c->ctl_bufsz;
+	c->ctl_bufsz += ctl->n;
+	return 0;
+}
+
+int ctl_copy_defs(struct libsimul_circuit *dst, const struct libsimul_circuit *src)
+{
+	size_t i;
+	int oom = 0;
+	dst->ctls = NULL;
+	dst->ctlcnt = 0;
+	dst->ctlcap = 0;
+	dst->ctl_bufsz = src->ctl_bufsz;
+	if (src->ctlcnt == 0)
+	{
+		return 0;
+	}
+	dst->ctls = malloc(sizeof(*dst->ctls)*src->ctlcnt);
+	if (dst->ctls == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	dst->ctlcap = src->ctlcnt;
+	for (i = 0; i < src->ctlcnt; i++)
+	{
+		struct libsimul_ctl *ctl = &dst->ctls[i];
+		*ctl = src->ctls[i];
+		ctl->name = ctl_strdup_or_null(ctl->name, &oom);
+		ctl->in.name = ctl_strdup_or_null(ctl->in.name, &oom);
+		ctl->ref.name = ctl_strdup_or_null(ctl->ref.name, &oom);
+		ctl->out_name = ctl_strdup_or_null(ctl->out_name, &oom);
+		dst->ctlcnt++;
+	}
+	return oom ? -ERR_NO_MEMORY : 0;
+}
+
+void ctl_free_defs(struct libsimul_circuit *c)
+{
+	size_t i;
+	for (i = 0; i < c->ctlcnt; i++)
+	{
+		free(c->ctls[i].name);
+		free(c->ctls[i].in.name);
+		free(c->ctls[i].ref.name);
+		free(c->ctls[i].out_name);
+	}
+	free(c->ctls);
+	c->ctls = NULL;
+	c->ctlcnt = 0;
+	c->ctlcap = 0;
+	c->ctl_bufsz = 0;
+}
+
+static size_t ctl_find(const struct libsimul_circuit *c, const char *blockname)
+{
+	size_t i;
+	for (i = 0; i < c->ctlcnt; i++)
+	{
+		if (strcmp(c->ctls[i].name, blockname) == 0)
+		{
+			return i;
+		}
+	}
+	return SIZE_MAX;
+}
+
+static int ctl_resolve_signal(struct libsimul_ctx *ctx, const struct libsimul_ctl *ctl,
+                              const struct libsimul_signal *sig, size_t *idx)
+{
+	int h;
+	*idx = SIZE_MAX;
+	switch (sig->typ)
+	{
+		case SIGNAL_CONST:
+			break;
+		case SIGNAL_VOLTAGE:
+			if ((size_t)sig->n1 > ctx->nodecnt || (size_t)sig->n2 > ctx->nodecnt)
+			{
+				return libsimul_fail(ctx, ERR_NOT_FOUND, "Node of control block %s not found", ctl->name);
+			}
+			break;
+		case SIGNAL_CURRENT:
+			h = libsimul_element_handle(ctx, sig->name);
+			if (h < 0)
+			{
+				return libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s of control block %s not found",
+					sig->name, ctl->name);
+			}
+			*idx = (size_t)h;
+			break;
+		case SIGNAL_BLOCK:
+			*idx = ctl_find(ctx->circuit, sig->name);
+			if (*idx == SIZE_MAX)
+			{
+				return libsimul_fail(ctx, ERR_NOT_FOUND, "Input %s of control block %s not found",
+					sig->name, ctl->name);
+			}
+			break;
+	}
+	return 0;
+}
+
+static double ctl_signal(struct libsimul_ctx *ctx, const struct libsimul_signal *sig, size_t idx)
+{
+	switch (sig->typ)
+	{
+		case SIGNAL_CONST:
+			return sig->val;
+		case SIGNAL_VOLTAGE:
+			return get_V(ctx, sig->n1) - get_V(ctx, sig->n2);
+		case SIGNAL_CURRENT:
+			return libsimul_handle_current(ctx, (int)idx);
+		case SIGNAL_BLOCK:
+			return ctx->ctl_state[idx].out;
+	}
+	abort();
+}
+
+static void ctl_output(struct libsimul_ctx *ctx, const struct libsimul_ctl_state *st, double out)
+{
+	switch (st->out_typ)
+	{
+		case CTL_OUT_NONE:
+			break;
+		case CTL_OUT_PWM:
+			libsimul_handle_set_pwm_duty(ctx, (int)st->out_idx, out);
+			break;
+		case CTL_OUT_SWITCH:
+			libsimul_handle_set_switch(ctx, (int)st->out_idx, out > 0.5);
+			break;
+	}
+}
+
+// Resolves input and output names, they may be defined after the block
+int ctl_init_simulation(struct libsimul_ctx *ctx)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	size_t i;
+	int ret = 0;
+	if (c->ctlcnt == 0)
+	{
+		return 0;
+	}
+	free(ctx->ctl_state);
+	free(ctx->ctl_buf);
+	ctx->ctl_state = calloc(c->ctlcnt, sizeof(*ctx->ctl_state));
+	ctx->ctl_buf = calloc(c->ctl_bufsz+1, sizeof(*ctx->ctl_buf));
+	if (ctx->ctl_state == NULL || ctx->ctl_buf == NULL)
+	{
+		ret = libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
+		goto fail;
+	}
+	for (i = 0; i < c->ctlcnt; i++)
+	{
+		const struct libsimul_ctl *ctl = &c->ctls[i];
+		struct libsimul_ctl_state *st = &ctx->ctl_state[i];
+		ret = ctl_resolve_signal(ctx, ctl, &ctl->in, &st->in_idx);
+		st->ref_idx = SIZE_MAX;
+		if (ret == 0 && ctl->has_ref)
+		{
+			ret = ctl_resolve_signal(ctx, ctl, &ctl->ref, &st->ref_idx);
+		}
+		if (ret != 0)
+		{
+			goto fail;
+		}
+		st->out_typ = CTL_OUT_NONE;
+		st->out_idx = SIZE_MAX;
+		if (ctl->out_name != NULL)
+		{
+			int h = libsimul_pwm_handle(ctx, ctl->out_name);
+			st->out_typ = CTL_OUT_PWM;
+			if (h < 0)
+			{
+				h = libsimul_element_handle(ctx, ctl->out_name);
+				st->out_typ = CTL_OUT_SWITCH;
+			}
+			if (h < 0 || (st->out_typ == CTL_OUT_SWITCH &&
+			              c->elements_used[h]->typ != TYPE_SWITCH))
+			{
+				ret = libsimul_fail(ctx, ERR_NOT_FOUND, "Output %s of control block %s not a PWM or switch",
+					ctl->out_name, ctl->name);
+				goto fail;
+			}
+			st->out_idx = (size_t)h;
+		}
+		st->out = ctl->init;
+		st->integ = fmin(ctl->max, fmax(ctl->min, ctl->init));
+		st->next_sample = ctx->t;
+		ctl_output(ctx, st, st->out);
+	}
+	return 0;
+fail:
+	free(ctx->ctl_state);
+	free(ctx->ctl_buf);
+	ctx->ctl_state = NULL;
+	ctx->ctl_buf = NULL;
+	return ret;
+}
+
+// Runs the blocks whose sample time has come, after a simulation step
+void ctl_run(struct libsimul_ctx *ctx)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	size_t i, j;
+	for (i = 0; i < c->ctlcnt; i++)
+	{
+		const struct libsimul_ctl *ctl = &c->ctls[i];
+		struct libsimul_ctl_state *st = &ctx->ctl_state[i];
+		double Ts = ctl->Ts;
+		double x, r, err, out;
+		double *buf;
+		if (Ts > 0)
+		{
+			if (ctx->t < st->next_sample - 1e-9*Ts)
+			{
+				continue;
+			}
+			// A late sample doesn't cause a burst of samples to catch up
+			do {
+				st->next_sample += Ts;
+			} while (st->next_sample <= ctx->t + 1e-9*Ts);
+		}
+		else
+		{
+			Ts = ctx->dt;
+		}
+		x = ctl_signal(ctx, &ctl->in, st->in_idx);
+		out = st->out;
+		switch (ctl->typ)
+		{
+			case CTL_PI:
+			case CTL_PID:
+				r = ctl->has_ref ? ctl_signal(ctx, &ctl->ref, st->ref_idx) : 0;
+				err = r - x;
+				st->integ += ctl->ki*Ts*err;
+				st->integ = fmin(ctl->max, fmax(ctl->min, st->integ));
+				out = ctl->kp*err + st->integ;
+				if (ctl->typ == CTL_PID)
+				{
+					// No derivative kick at the first sample
+					out += st->fill ? ctl->kd*(err - st->prev_err)/Ts : 0;
+					st->fill = 1;
+				}
+				st->prev_err = err;
+				out = fmin(ctl->max, fmax(ctl->min, out));
+				break;
+			case CTL_LIMIT:
+				out = fmin(ctl->max, fmax(ctl->min, x));
+				break;
+			case CTL_AVG:
+			case CTL_RMS:
+				buf = &ctx->ctl_buf[ctl->bufoff];
+				if (ctl->typ == CTL_RMS)
+				{
+					x *= x;
+				}
+				if (st->fill == ctl->n)
+				{
+					st->sum -= buf[st->pos];
+				}
+				else
+				{
+					st->fill++;
+				}
+				buf[st->pos] = x;
+				st->sum += x;
+				if (++st->pos == ctl->n)
+				{
+					// Summed again once per window so that rounding
+					// errors of the running sum don't accumulate
+					st->pos = 0;
+					st->sum = 0;
+					for (j = 0; j < ctl->n; j++)
+					{
+						st->sum += buf[j];
+					}
+				}
+				out = st->sum/st->fill;
+				if (ctl->typ == CTL_RMS)
+				{
+					out = sqrt(fmax(0, out));
+				}
+				break;
+			case CTL_CMP:
+				r = ctl->has_ref ? ctl_signal(ctx, &ctl->ref, st->ref_idx) : 0;
+				if (x > r + ctl->hyst/2)
+				{
+					out = 1;
+				}
+				else if (x < r - ctl->hyst/2)
+				{
+					out = 0;
+				}
+				break;
+			case CTL_SH:
+				if (!ctl->has_ref)
+				{
+					out = x;
+					break;
+				}
+				r = ctl_signal(ctx, &ctl->ref, st->ref_idx);
+				if (st->prev_trig <= 0.5 && r > 0.5)
+				{
+					out = x;
+				}
+				st->prev_trig = r;
+				break;
+		}
+		st->out = out;
+		ctl_output(ctx, st, out);
+	}
+}
+
+// Changes a gain, limit, hysteresis, sample time or constant setpoint of a
+// block. The circuit is unshared first, so clones aren't affected.
+int set_control_param(struct libsimul_ctx *ctx, const char *blockname, const char *param, double val)
+{
+	struct libsimul_ctl *ctl;
+	size_t idx = ctl_find(ctx->circuit, blockname);
+	if (idx == SIZE_MAX)
+	{
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Control block %s not found", blockname);
+	}
+	if (libsimul_unshare(ctx) != 0)
+	{
+		return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
+	}
+	ctl = &ctx->circuit->ctls[idx];
+	if (strcmp(param, "kp") == 0)
+	{
+		ctl->kp = val;
+	}
+	else if (strcmp(param, "ki") == 0)
+	{
+		ctl->ki = val;
+	}
+	else if (strcmp(param, "kd") == 0)
+	{
+		ctl->kd = val;
+	}
+	else if (strcmp(param, "min") == 0 && val <= ctl->max)
+	{
+		ctl->min = val;
+	}
+	else if (strcmp(param, "max") == 0 && val >= ctl->min)
+	{
+		ctl->max = val;
+	}
+	else if (strcmp(param, "hyst") == 0 && val >= 0)
+	{
+		ctl->hyst = val;
+	}
+	else if (strcmp(param, "Ts") == 0 && val >= 0)
+	{
+		ctl->Ts = val;
+	}
+	else if (strcmp(param, "ref") == 0 && ctl->has_ref && ctl->ref.typ == SIGNAL_CONST)
+	{
+		ctl->ref.val = val;
+	}
+	else
+	{
+		return libsimul_fail(ctx, ERR_INVALID, "Invalid parameter %s = %lf for control block %s",
+			param, val, blockname);
+	}
+	return 0;
+}
+
+double get_control_output(struct libsimul_ctx *ctx, const char *blockname)
+{
+	size_t idx = ctl_find(ctx->circuit, blockname);
+	if (idx == SIZE_MAX)
+	{
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Control block %s not found", blockname);
+		return NAN;
+	}
+	if (ctx->ctl_state == NULL)
+	{
+		libsimul_fail(ctx, ERR_NO_DATA, "Control block %s used before init_simulation", blockname);
+		return NAN;
+	}
+	return ctx->ctl_state[idx].out;
+}
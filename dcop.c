@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#if 0
+#include <lapack.h>
+#else
+#define lapack_int int
+#define LAPACK_dgetrf dgetrf_
+void LAPACK_dgetrf(const lapack_int*, const lapack_int*, double*, const lapack_int*, lapack_int*, lapack_int*);
+#define LAPACK_dgetrs dgetrs_
+void LAPACK_dgetrs(const char*, const lapack_int*, const lapack_int*, const double*, const lapack_int*, const lapack_int*, double*, const lapack_int*, lapack_int*);
+#endif
+#include "libsimul.h"
+
+// DC operating point, used as the initial state instead of Vinit and Iinit.
+//
+// Capacitors are open, inductors are their series resistance (at least
+// DCOP_MIN_R), switches keep their current state, ideal diodes are opened
+// and closed until they are consistent and Shockley diodes are solved by
+// Newton iteration. Transformer windings are open and transformers start
+// demagnetized, as a DC flux can't be determined without the magnetizing
+// current path. Every node has a small conductance to ground so that nodes
+// connected only through capacitors or transformers are at 0 V instead of
+// making the matrix singular.
+
+#define DCOP_MIN_R 1e-6
+#define DCOP_GMIN 1e-12
+#define DCOP_MAX_ITER 1000
+
+struct dcop_work {
+	size_t n;
+	double *G;
+	double *I;
+	int *ipiv;
+	double *Vd; // Shockley junction voltages
+	int *closed; // ideal diodes
+};
+
+static double dcop_V(const struct dcop_work *w, int node)
+{
+	return node == 0 ? 0 : w->I[node-1];
+}
+
+static void dcop_stamp(struct dcop_work *w, int n1, int n2, double G, double I)
+{
+	const size_t n = w->n;
+	if (n1 != 0)
+	{
+		w->G[(n1-1)*n+(n1-1)] += G;
+		w->I[n1-1] += I;
+	}
+	if (n2 != 0)
+	{
+		w->G[(n2-1)*n+(n2-1)] += G;
+		w->I[n2-1] -= I;
+	}
+	if (n1 != 0 && n2 != 0)
+	{
+		w->G[(n1-1)*n+(n2-1)] -= G;
+		w->G[(n2-1)*n+(n1-1)] -= G;
+	}
+}
+
+// Linearization of a Shockley diode with series resistance at junction
+// voltage Vd as a conductance G and current source I
+static void dcop_shockley(const struct element *el, double Vd, double *G, double *I)
+{
+	double e = exp(fmin(Vd, el->Vmax)/el->V_T);
+	double Id = el->I_s*(e - 1);
+	double gd = el->I_s/el->V_T*e;
+	*G = 1.0/(1.0/gd + el->R);
+	*I = *G*(Vd - Id/gd);
+}
+
+static int dcop_solve(struct libsimul_ctx *ctx, struct dcop_work *w)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	const lapack_int n = (lapack_int)w->n;
+	const lapack_int one = 1;
+	lapack_int info;
+	size_t i;
+	memset(w->G, 0, sizeof(*w->G)*w->n*w->n);
+	memset(w->I, 0, sizeof(*w->I)*w->n);
+	for (i = 0; i < w->n; i++)
+	{
+		w->G[i*w->n+i] = DCOP_GMIN;
+	}
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		const struct element *el = c->elements_used[i];
+		const struct element_state *st = &ctx->state[i];
+		double G, I;
+		switch (el->typ)
+		{
+			case TYPE_RESISTOR:
+				dcop_stamp(w, el->n1, el->n2, 1.0/el->R, 0);
+				break;
+			case TYPE_INDUCTOR:
+				dcop_stamp(w, el->n1, el->n2, 1.0/fmax(el->R, DCOP_MIN_R), 0);
+				break;
+			case TYPE_VOLTAGE:
+				dcop_stamp(w, el->n1, el->n2, 1.0/el->R, st->V/el->R);
+				break;
+			case TYPE_SWITCH:
+				if (st->current_switch_state_is_closed)
+				{
+					dcop_stamp(w, el->n1, el->n2, 1.0/el->R, 0);
+				}
+				break;
+			case TYPE_DIODE:
+				if (w->closed[i])
+				{
+					dcop_stamp(w, el->n1, el->n2, 1.0/el->R, 0);
+				}
+				break;
+			case TYPE_SHOCKLEY_DIODE:
+				dcop_shockley(el, w->Vd[i], &G, &I);
+				dcop_stamp(w, el->n1, el->n2, G, I);
+				break;
+			case TYPE_CAPACITOR:
+			case TYPE_TRANSFORMER:
+			case TYPE_TRANSFORMER_DIRECT:
+				break;
+		}
+	}
+	LAPACK_dgetrf(&n, &n, w->G, &n, w->ipiv, &info);
+	if (info != 0)
+	{
+		return -ERR_NOT_CONVERGED;
+	}
+	LAPACK_dgetrs("N", &n, &one, w->G, &n, w->ipiv, w->I, &n, &info);
+	return info == 0 ? 0 : -ERR_NOT_CONVERGED;
+}
+
+// Updates diode states from the solution, returns nonzero if anything
+// changed
+static int dcop_update_diodes(struct libsimul_ctx *ctx, struct dcop_work *w)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	int changed = 0;
+	size_t i;
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		const struct element *el = c->elements_used[i];
+		double V = dcop_V(w, el->n1) - dcop_V(w, el->n2);
+		double G, I, Vd;
+		if (el->typ == TYPE_DIODE)
+		{
+			if (w->closed[i] && V < -el->diode_threshold)
+			{
+				w->closed[i] = 0;
+				changed = 1;
+			}
+			else if (!w->closed[i] && V > el->diode_threshold)
+			{
+				w->closed[i] = 1;
+				changed = 1;
+			}
+		}
+		else if (el->typ == TYPE_SHOCKLEY_DIODE)
+		{
+			dcop_shockley(el, w->Vd[i], &G, &I);
+			Vd = V - el->R*(G*V - I);
+			// Same step limit as the transient iteration
+			if (Vd > w->Vd[i] + 0.1 && Vd > 0)
+			{
+				Vd = w->Vd[i] + 0.1;
+			}
+			if (fabs(Vd - w->Vd[i]) > 1e-9)
+			{
+				changed = 1;
+			}
+			w->Vd[i] = fmin(Vd, el->Vmax);
+		}
+	}
+	return changed;
+}
+
+// Loads the solution as the state of the context
+static void dcop_load(struct libsimul_ctx *ctx, const struct dcop_work *w)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	size_t i;
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		const struct element *el = c->elements_used[i];
+		struct element_state *st = &ctx->state[i];
+		double V = dcop_V(w, el->n1) - dcop_V(w, el->n2);
+		double e;
+		switch (el->typ)
+		{
+			case TYPE_CAPACITOR:
+				st->I_src = V/el->R;
+				break;
+			case TYPE_INDUCTOR:
+				st->I_src = -V/fmax(el->R, DCOP_MIN_R);
+				break;
+			case TYPE_DIODE:
+				st->current_switch_state_is_closed = w->closed[i];
+				break;
+			case TYPE_SHOCKLEY_DIODE:
+				e = exp(w->Vd[i]/el->V_T);
+				st->V_across_diode = w->Vd[i];
+				st->expval = e;
+				st->G_shockley = el->I_s/el->V_T*e;
+				st->G_R_shockley = 1.0/(1.0/st->G_shockley + el->R);
+				st->I_model = el->I_s*(e - 1);
+				st->I_src = el->I_s*(1+(w->Vd[i]/el->V_T-1)*e)*st->G_R_shockley/st->G_shockley;
+				break;
+			case TYPE_TRANSFORMER:
+			case TYPE_TRANSFORMER_DIRECT:
+				st->I_src = 0;
+				st->cur_phi_single = 0;
+				st->dphi_single = 0;
+				st->transformer_direct_const = 0;
+				break;
+			default:
+				break;
+		}
+	}
+	memcpy(ctx->V_vector, w->I, sizeof(*ctx->V_vector)*w->n);
+	ctx->xformerid = SIZE_MAX;
+	ctx->xformerstate = STATE_FINI;
+}
+
+// Solves the DC operating point with the current switch states and source
+// voltages and loads it into the context, after init_simulation(). Returns
+// 0, or -ERR_NOT_CONVERGED if the diode states don't settle, in which case
+// the context isn't modified.
+int libsimul_dc_operating_point(struct libsimul_ctx *ctx)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	struct dcop_work w;
+	size_t i, iter;
+	int ret = -ERR_NOT_CONVERGED;
+	if (ctx->G_matrix == NULL)
+	{
+		return -ERR_NO_DATA;
+	}
+	w.n = ctx->nodecnt;
+	w.G = malloc(sizeof(*w.G)*(w.n*w.n+1));
+	w.I = malloc(sizeof(*w.I)*(w.n+1));
+	w.ipiv = malloc(sizeof(*w.ipiv)*(w.n+1));
+	w.Vd = calloc(c->elements_used_sz+1, sizeof(*w.Vd));
+	w.closed = calloc(c->elements_used_sz+1, sizeof(*w.closed));
+	if (w.G == NULL || w.I == NULL || w.ipiv == NULL || w.Vd == NULL || w.closed == NULL)
+	{
+		ret = -ERR_NO_MEMORY;
+		goto out;
+	}
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		w.closed[i] = ctx->state[i].current_switch_state_is_closed;
+	}
+	for (iter = 0; iter < DCOP_MAX_ITER; iter++)
+	{
+		int solve_ret = dcop_solve(ctx, &w);
+		if (solve_ret != 0)
+		{
+			ret = solve_ret;
+			break;
+		}
+		if (!dcop_update_diodes(ctx, &w))
+		{
+			dcop_load(ctx, &w);
+			form_g_matrix(ctx);
+			ctx->needs_recalc = 0;
+			ret = calc_lu(ctx);
+			break;
+		}
+	}
+out:
+	free(w.G);
+	free(w.I);
+	free(w.ipiv);
+	free(w.Vd);
+	free(w.closed);
+	return ret;
+}
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+const double dt = 1e-6; // 1 us
+
+// Named and numbered nodes around subcircuit instances: the named nodes
+// must not be numbered onto node 1, which only the instances use.
+int main(int argc, char **argv)
+{
+	static const char *nodes[] = {"top", "mid"};
+	size_t i;
+	struct libsimul_ctx ctx;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "divnames.txt");
+	for (i = 0; i < sizeof(nodes)/sizeof(*nodes); i++)
+	{
+		int n = libsimul_node(&ctx, nodes[i]);
+		printf("Node %s: %d (%s)\n", nodes[i], n, libsimul_node_name(&ctx, n));
+	}
+	init_simulation(&ctx);
+	simulation_step(&ctx);
+	// In brackets with an ideal source: 12*(5/8)/(1+5/8) and 2/5 of it
+	printf("V_1 %g (%g), V_mid %g (%g)\n", get_V(&ctx, 1), 12*5.0/13,
+	       get_V(&ctx, libsimul_node(&ctx, "mid")), 12*5.0/13*0.4);
+	libsimul_free(&ctx);
+	return 0;
+}
@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+const double dt = 1e-7; // 100 ns
+
+// Input LC filter of a 2 A load with an indicator LED. Started from Vinit=0
+// the filter rings for milliseconds, started from the DC operating point the
+// voltages are constant from the first step.
+static void run(const char *title, int dcop)
+{
+	size_t i;
+	struct libsimul_ctx ctx;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "filterdcop.txt");
+	init_simulation(&ctx);
+	if (dcop && libsimul_dc_operating_point(&ctx) != 0)
+	{
+		fprintf(stderr, "DC operating point not found\n");
+		return;
+	}
+	for (i = 0; i < 100*1000; i++)
+	{
+		simulation_step(&ctx);
+		if (i % 10000 == 0)
+		{
+			printf("%s %g V_C1 %g I_L1 %g V_LED %g\n", title, ctx.t, get_V(&ctx, 3),
+				get_inductor_current(&ctx, "L1"), get_V(&ctx, 4));
+		}
+	}
+	libsimul_free(&ctx);
+}
+
+int main(int argc, char **argv)
+{
+	run("Vinit", 0);
+	run("dcop", 1);
+	return 0;
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <math.h>
+#include "libsimul.h"
+
+const double dt = 2e-8; // 20 ns
+
+enum {
+	MEAS_V_OUT,
+	MEAS_V_RIPPLE,
+	MEAS_I_XFR_PEAK,
+	MEAS_CNT,
+};
+
+// Same controller as flybackgood.c
+static int run_flyback(struct libsimul_ctx *ctx, size_t run, double *meas, void *userdata)
+{
+	const size_t steps = 1000*1000;
+	const size_t meas_start = steps*9/10;
+	const char *xformer = "X1";
+	const double V_tgt = 60;
+	size_t i;
+	int switch_state = 1;
+	int cnt_remain = 500;
+	int cnt_on = 0;
+	double last_I_xfr = 0;
+	double L = get_transformer_inductor(ctx, xformer);
+	double C = get_capacitor(ctx, "C1");
+	double R = get_resistor(ctx, "RL");
+	double V_sum = 0, V_min = INFINITY, V_max = -INFINITY, I_peak = 0;
+	if (set_switch_state(ctx, "S1", switch_state) != 0)
+	{
+		set_diode_hint(ctx, "D1", !switch_state);
+		recalc(ctx);
+	}
+	for (i = 0; i < steps; i++)
+	{
+		simulation_step(ctx);
+		double I_xfr = get_transformer_mag_current(ctx, xformer);
+		double V_out = get_V(ctx, 5) - get_V(ctx, 3);
+		double E_switch = V_tgt*V_tgt/R*dt*1000;
+		double V_new = sqrt(V_out*V_out + L/C*I_xfr*I_xfr - L/C*last_I_xfr*last_I_xfr - 2*E_switch/C);
+		if (i >= meas_start)
+		{
+			V_sum += V_out;
+			V_min = fmin(V_min, V_out);
+			V_max = fmax(V_max, V_out);
+			I_peak = fmax(I_peak, fabs(I_xfr));
+		}
+		cnt_remain--;
+		if (switch_state && (V_new > V_tgt || I_xfr > 15))
+		{
+			cnt_on++;
+			cnt_remain = 0;
+		}
+		else if (switch_state)
+		{
+			cnt_on++;
+		}
+		if (cnt_remain == 0)
+		{
+			switch_state = !switch_state;
+			if (set_switch_state(ctx, "S1", switch_state) != 0)
+			{
+				set_diode_hint(ctx, "D1", !switch_state);
+				recalc(ctx);
+			}
+			if (switch_state)
+			{
+				last_I_xfr = 0.99*last_I_xfr+0.01*I_xfr;
+				cnt_remain = 950;
+				cnt_on = 0;
+			}
+			else
+			{
+				cnt_remain = 1000-cnt_on;
+			}
+		}
+	}
+	meas[MEAS_V_OUT] = V_sum/(steps-meas_start);
+	meas[MEAS_V_RIPPLE] = V_max - V_min;
+	meas[MEAS_I_XFR_PEAK] = I_peak;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *names[MEAS_CNT] = {"V_out", "V_ripple", "I_xfr_peak"};
+	struct libsimul_ctx ctx;
+	struct libsimul_mc mc;
+	struct libsimul_mc_stats st;
+	size_t i;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "flybackgood.txt");
+	init_simulation(&ctx);
+	libsimul_mc_init(&mc, &ctx, 16, MEAS_CNT, run_flyback, NULL);
+	mc.seed = 12345;
+	libsimul_mc_add_param(&mc, "X1", MC_PARAM_XFR_L, MC_DIST_UNIFORM, 0.1);
+	libsimul_mc_add_param(&mc, "C1", MC_PARAM_C, MC_DIST_UNIFORM, 0.2);
+	libsimul_mc_add_param(&mc, "C1", MC_PARAM_R, MC_DIST_NORMAL, 0.5);
+	if (libsimul_mc_run(&mc) != 0)
+	{
+		fprintf(stderr, "Monte Carlo analysis failed\n");
+		return 1;
+	}
+	printf("%zu runs, %zu failed\n", mc.runs, (size_t)mc.failed_runs);
+	for (i = 0; i < mc.runs; i++)
+	{
+		if (mc.errors[i] != 0)
+		{
+			printf("Run %zu failed: %s\n", i, mc.errmsgs[i] ? mc.errmsgs[i] : "measurement failed");
+		}
+	}
+	for (i = 0; i < MEAS_CNT; i++)
+	{
+		if (libsimul_mc_stats(&mc, i, &st) != 0)
+		{
+			continue;
+		}
+		printf("%s: mean %g stddev %g min %g (run %zu) max %g (run %zu) p5 %g p50 %g p95 %g\n",
+		       names[i], st.mean, st.stddev, st.min, st.worst_min_run,
+		       st.max, st.worst_max_run, st.p5, st.p50, st.p95);
+	}
+	printf("Yield for V_out 57..63 V: %g\n", libsimul_mc_yield(&mc, MEAS_V_OUT, 57, 63));
+	libsimul_mc_free(&mc);
+	libsimul_free(&ctx);
+	return 0;
+}
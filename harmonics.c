@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "libsimul.h"
+
+// Per-cycle harmonic analysis of probes.
+//
+// Every analyzer runs a Goertzel filter for the fundamental and each
+// harmonic up to nharm, so a sample costs one multiplication and two
+// additions per harmonic and the memory doesn't depend on the cycle length.
+// Cycles are either exactly 1/f0 long or delimited by rising zero crossings
+// of a synchronization probe, typically the line voltage. In the latter case
+// the filters are tuned to the length of the previous cycle, so the first
+// result is available after the second complete cycle. After every cycle
+// the DC value, the peak amplitude of every harmonic and the THD (RMS of
+// harmonics 2..nharm relative to the fundamental) are latched.
+
+static const double harm_pi = 3.14159265358979323846;
+
+static void harm_tune(struct libsimul_harmonics *hm, size_t N)
+{
+	size_t k;
+	hm->N = N;
+	for (k = 0; k < hm->nharm; k++)
+	{
+		hm->coeff[k] = 2*cos(2*harm_pi*(k+1)/N);
+	}
+}
+
+static void harm_reset(struct libsimul_harmonics *hm)
+{
+	memset(hm->s1, 0, sizeof(*hm->s1)*hm->nharm);
+	memset(hm->s2, 0, sizeof(*hm->s2)*hm->nharm);
+	hm->sum = 0;
+	hm->n = 0;
+}
+
+// probe_sync is -1 for cycles of 1/f0
+int libsimul_add_harmonics(struct libsimul_ctx *ctx, int probe, int probe_sync, double f0, size_t nharm)
+{
+	struct libsimul_harmonics *hm;
+	if (probe < 0 || (size_t)probe >= ctx->probecnt ||
+	    (probe_sync >= 0 && (size_t)probe_sync >= ctx->probecnt))
+	{
+		return -ERR_NOT_FOUND;
+	}
+	if (nharm == 0 || (probe_sync < 0 && (!(f0 > 0) || 1.0/(f0*ctx->dt) < 2*nharm+1)))
+	{
+		// No harmonics, or more than the samples of a cycle resolve
+		return -ERR_INVALID;
+	}
+	if (ctx->harmcnt >= ctx->harmcap || ctx->harm == NULL)
+	{
+		size_t new_cap = 2*ctx->harmcnt+4;
+		struct libsimul_harmonics *new_harm;
+		new_harm = realloc(ctx->harm, sizeof(*ctx->harm)*new_cap);
+		if (new_harm == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		ctx->harm = new_harm;
+		ctx->harmcap = new_cap;
+	}
+	hm = &ctx->harm[ctx->harmcnt];
+	memset(hm, 0, sizeof(*hm));
+	hm->probe = (size_t)probe;
+	hm->probe_sync = probe_sync >= 0 ? (size_t)probe_sync : SIZE_MAX;
+	hm->f0 = f0;
+	hm->nharm = nharm;
+	hm->thd = NAN;
+	hm->coeff = calloc(nharm, sizeof(*hm->coeff));
+	hm->s1 = malloc(sizeof(*hm->s1)*nharm);
+	hm->s2 = malloc(sizeof(*hm->s2)*nharm);
+	hm->ampl = calloc(nharm, sizeof(*hm->ampl));
+	if (hm->coeff == NULL || hm->s1 == NULL || hm->s2 == NULL || hm->ampl == NULL)
+	{
+		free(hm->coeff);
+		free(hm->s1);
+		free(hm->s2);
+		free(hm->ampl);
+		return -ERR_NO_MEMORY;
+	}
+	harm_reset(hm);
+	if (hm->probe_sync == SIZE_MAX)
+	{
+		harm_tune(hm, (size_t)floor(1.0/(f0*ctx->dt) + 0.5));
+		hm->started = 1;
+	}
+	return (int)ctx->harmcnt++;
+}
+
+static void harm_finish(struct libsimul_ctx *ctx, struct libsimul_harmonics *hm)
+{
+	double sumsq = 0;
+	size_t k;
+	for (k = 0; k < hm->nharm; k++)
+	{
+		double s1 = hm->s1[k], s2 = hm->s2[k];
+		double mag2 = s1*s1 + s2*s2 - hm->coeff[k]*s1*s2;
+		hm->ampl[k] = 2*sqrt(fmax(0, mag2))/hm->n;
+		if (k > 0)
+		{
+			sumsq += hm->ampl[k]*hm->ampl[k];
+		}
+	}
+	hm->dc = hm->sum/hm->n;
+	hm->thd = hm->ampl[0] > 0 ? sqrt(sumsq)/hm->ampl[0] : NAN;
+	hm->t_end = ctx->t;
+	hm->cycles++;
+}
+
+// Called by simulation_step() after every step
+void libsimul_harmonics_step(struct libsimul_ctx *ctx)
+{
+	size_t j, k;
+	for (j = 0; j < ctx->harmcnt; j++)
+	{
+		struct libsimul_harmonics *hm = &ctx->harm[j];
+		double x;
+		if (hm->probe_sync != SIZE_MAX)
+		{
+			double v = libsimul_probe_value(ctx, hm->probe_sync);
+			int rising = hm->prev_sync <= 0 && v > 0;
+			hm->prev_sync = v;
+			if (rising)
+			{
+				if (hm->started && hm->N > 0)
+				{
+					harm_finish(ctx, hm);
+				}
+				if (hm->started && hm->n != hm->N && hm->n > 2*hm->nharm)
+				{
+					harm_tune(hm, hm->n);
+				}
+				hm->started = 1;
+				harm_reset(hm);
+			}
+			if (!hm->started)
+			{
+				continue;
+			}
+		}
+		x = libsimul_probe_value(ctx, hm->probe);
+		hm->sum += x;
+		// The first cycle of a synchronized analysis only measures the
+		// period, the coefficients are set at its end
+		for (k = 0; hm->N > 0 && k < hm->nharm; k++)
+		{
+			double s = x + hm->coeff[k]*hm->s1[k] - hm->s2[k];
+			hm->s2[k] = hm->s1[k];
+			hm->s1[k] = s;
+		}
+		hm->n++;
+		if (hm->probe_sync == SIZE_MAX && hm->n == hm->N)
+		{
+			harm_finish(ctx, hm);
+			harm_reset(hm);
+		}
+	}
+}
+
+// Result of the last completed cycle: THD, DC value and, if ampl isn't
+// NULL, the peak amplitudes of the fundamental and the harmonics (nharm
+// values). Returns -ERR_NO_DATA if no cycle has completed.
+int libsimul_harmonics_result(struct libsimul_ctx *ctx, int h, double *thd, double *dc, double *ampl)
+{
+	const struct libsimul_harmonics *hm;
+	if (h < 0 || (size_t)h >= ctx->harmcnt)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	hm = &ctx->harm[h];
+	if (hm->cycles == 0)
+	{
+		return -ERR_NO_DATA;
+	}
+	if (thd != NULL)
+	{
+		*thd = hm->thd;
+	}
+	if (dc != NULL)
+	{
+		*dc = hm->dc;
+	}
+	if (ampl != NULL)
+	{
+		memcpy(ampl, hm->ampl, sizeof(*ampl)*hm->nharm);
+	}
+	return 0;
+}
+
+void libsimul_free_harmonics(struct libsimul_ctx *ctx)
+{
+	size_t j;
+	for (j = 0; j < ctx->harmcnt; j++)
+	{
+		free(ctx->harm[j].coeff);
+		free(ctx->harm[j].s1);
+		free(ctx->harm[j].s2);
+		free(ctx->harm[j].ampl);
+	}
+	free(ctx->harm);
+	ctx->harm = NULL;
+	ctx->harmcnt = 0;
+	ctx->harmcap = 0;
+}
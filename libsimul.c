@@ -12,6 +12,12 @@ void LAPACK_dgetrs(const char*, const lapack_int*, const lapack_int*, const doub
 #endif
 #include <math.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "libsimul.h"
 
 int iswhiteonly(const char *ln)
@@ -30,15 +36,25 @@ int iswhiteonly(const char *ln)
 	}
 }
 
+// Offset of the first space, spaces in braces are part of an expression
 size_t spaceoff(const char *ln)
 {
 	const char *orig_ln = ln;
+	int depth = 0;
 	for (;;)
 	{
-		if (*ln == '\0' || *ln == ' ' || *ln == '\t')
+		if (*ln == '\0' || ((*ln == ' ' || *ln == '\t') && depth == 0))
 		{
 			return ln - orig_ln;
 		}
+		if (*ln == '{')
+		{
+			depth++;
+		}
+		else if (*ln == '}' && depth > 0)
+		{
+			depth--;
+		}
 		ln++;
 	}
 }
@@ -55,6 +71,29 @@ size_t nonspaceoff(const char *ln)
 	}
 }
 
+// Next whitespace-separated token of *lineptr or NULL, terminates the token
+char *next_token(char **lineptr)
+{
+	char *tok = *lineptr + nonspaceoff(*lineptr);
+	size_t sp;
+	if (!*tok)
+	{
+		*lineptr = tok;
+		return NULL;
+	}
+	sp = spaceoff(tok);
+	if (tok[sp])
+	{
+		tok[sp] = '\0';
+		*lineptr = &tok[sp+1];
+	}
+	else
+	{
+		*lineptr = &tok[sp];
+	}
+	return tok;
+}
+
 int getline_strip_comment(FILE *f, char **ln, size_t *lnsz)
 {
 	int ch;
@@ -109,132 +148,288 @@ int getline_strip_comment(FILE *f, char **ln, size_t *lnsz)
 	return 0;
 }
 
-void set_voltage_source(struct libsimul_ctx *ctx, const char *vsname, double V)
+// Netlist being read. Regular files are mapped and every line is copied
+// once to the line buffer; anything that can't be mapped, like a pipe, is
+// read with getline_strip_comment().
+struct netlist_src {
+	FILE *f;
+	const char *map;
+	size_t mapsz;
+	size_t off;
+};
+
+static int netlist_open(struct netlist_src *src, const char *fname)
+{
+	struct stat st;
+	void *map;
+	src->map = NULL;
+	src->mapsz = 0;
+	src->off = 0;
+	src->f = fopen(fname, "r");
+	if (src->f == NULL)
+	{
+		return -ERR_IO;
+	}
+	if (fstat(fileno(src->f), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+	{
+		return 0;
+	}
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(src->f), 0);
+	if (map == MAP_FAILED)
+	{
+		return 0;
+	}
+	madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+	src->map = map;
+	src->mapsz = (size_t)st.st_size;
+	return 0;
+}
+
+// Same as getline_strip_comment()
+static int netlist_getline(struct netlist_src *src, char **ln, size_t *lnsz)
 {
-	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	const char *start, *end, *comment;
+	size_t len;
+	if (src->map == NULL)
+	{
+		return getline_strip_comment(src->f, ln, lnsz);
+	}
+	if (src->off >= src->mapsz)
+	{
+		return -ERR_NO_DATA;
+	}
+	start = src->map + src->off;
+	end = memchr(start, '\n', src->mapsz - src->off);
+	if (end == NULL)
+	{
+		end = src->map + src->mapsz;
+	}
+	src->off = (size_t)(end - src->map) + 1;
+	comment = memchr(start, '#', (size_t)(end - start));
+	if (comment != NULL)
+	{
+		end = comment;
+	}
+	len = (size_t)(end - start);
+	if (len+1 > *lnsz || *ln == NULL)
 	{
-		if (strcmp(ctx->elements_used[i]->name, vsname) == 0)
+		char *newln;
+		size_t newsz = 2*(len+1)+16;
+		newln = realloc(*ln, newsz);
+		if (newln == NULL)
 		{
-			break;
+			return -ERR_NO_MEMORY;
 		}
+		*ln = newln;
+		*lnsz = newsz;
+	}
+	memcpy(*ln, start, len);
+	(*ln)[len] = '\0';
+	return 0;
+}
+
+static void netlist_close(struct netlist_src *src)
+{
+	if (src->map != NULL)
+	{
+		munmap((void *)src->map, src->mapsz);
 	}
-	if (i == ctx->elements_used_sz)
+	fclose(src->f);
+}
+
+int set_voltage_source(struct libsimul_ctx *ctx, const char *vsname, double V)
+{
+	size_t i;
+	i = libsimul_find_element(ctx->circuit, vsname);
+	if (i == SIZE_MAX)
 	{
-		fprintf(stderr, "Voltage source %s not found\n", vsname);
-		exit(1);
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Voltage source %s not found", vsname);
 	}
-	if (ctx->elements_used[i]->typ != TYPE_VOLTAGE)
+	if (ctx->circuit->elements_used[i]->typ != TYPE_VOLTAGE)
 	{
-		fprintf(stderr, "Element %s not a voltage source\n", vsname);
-		exit(1);
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a voltage source", vsname);
 	}
-	ctx->elements_used[i]->V = V;
-	ctx->elements_used[i]->I_src = V/ctx->elements_used[i]->R;
+	ctx->state[i].V = V;
+	ctx->state[i].I_src = V/ctx->circuit->elements_used[i]->R;
+	return 0;
 }
 int set_inductor(struct libsimul_ctx *ctx, const char *indname, double L)
 {
 	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	i = libsimul_find_element(ctx->circuit, indname);
+	if (i == SIZE_MAX)
 	{
-		if (strcmp(ctx->elements_used[i]->name, indname) == 0)
-		{
-			break;
-		}
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Inductor %s not found", indname);
 	}
-	if (i == ctx->elements_used_sz)
+	if (ctx->circuit->elements_used[i]->typ != TYPE_INDUCTOR)
 	{
-		fprintf(stderr, "Inductor %s not found\n", indname);
-		exit(1);
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not an inductor", indname);
 	}
-	if (ctx->elements_used[i]->typ != TYPE_INDUCTOR)
+	if (libsimul_unshare(ctx) != 0)
 	{
-		fprintf(stderr, "Element %s not an inductor\n", indname);
-		exit(1);
+		return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
 	}
-	ctx->elements_used[i]->L = L;
+	ctx->circuit->elements_used[i]->L = L;
 	return 0;
 }
 double get_inductor_current(struct libsimul_ctx *ctx, const char *indname)
 {
 	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
-	{
-		if (strcmp(ctx->elements_used[i]->name, indname) == 0)
-		{
-			break;
-		}
-	}
-	if (i == ctx->elements_used_sz)
+	i = libsimul_find_element(ctx->circuit, indname);
+	if (i == SIZE_MAX)
 	{
-		fprintf(stderr, "Inductor %s not found\n", indname);
-		exit(1);
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Inductor %s not found", indname);
+		return NAN;
 	}
-	if (ctx->elements_used[i]->typ != TYPE_INDUCTOR)
+	if (ctx->circuit->elements_used[i]->typ != TYPE_INDUCTOR)
 	{
-		fprintf(stderr, "Element %s not an inductor\n", indname);
-		exit(1);
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not an inductor", indname);
+		return NAN;
 	}
-	return ctx->elements_used[i]->I_src;
+	return ctx->state[i].I_src;
 }
 int set_resistor(struct libsimul_ctx *ctx, const char *rsname, double R)
 {
 	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	i = libsimul_find_element(ctx->circuit, rsname);
+	if (i == SIZE_MAX)
 	{
-		if (strcmp(ctx->elements_used[i]->name, rsname) == 0)
-		{
-			break;
-		}
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Resistor %s not found", rsname);
 	}
-	if (i == ctx->elements_used_sz)
+	if (ctx->circuit->elements_used[i]->typ != TYPE_RESISTOR)
 	{
-		fprintf(stderr, "Resistor %s not found\n", rsname);
-		exit(1);
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a resistor", rsname);
 	}
-	if (ctx->elements_used[i]->typ != TYPE_RESISTOR)
+	if (libsimul_unshare(ctx) != 0)
 	{
-		fprintf(stderr, "Element %s not a resistor\n", rsname);
-		exit(1);
+		return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
 	}
-	ctx->elements_used[i]->R = R;
+	ctx->circuit->elements_used[i]->R = R;
 	return ERR_HAVE_TO_SIMULATE_AGAIN;
 }
 
-int set_switch_state(struct libsimul_ctx *ctx, const char *swname, int state)
+int set_capacitor(struct libsimul_ctx *ctx, const char *capname, double C)
 {
 	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	i = libsimul_find_element(ctx->circuit, capname);
+	if (i == SIZE_MAX)
 	{
-		if (strcmp(ctx->elements_used[i]->name, swname) == 0)
-		{
-			break;
-		}
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Capacitor %s not found", capname);
 	}
-	if (i == ctx->elements_used_sz)
+	if (ctx->circuit->elements_used[i]->typ != TYPE_CAPACITOR)
 	{
-		fprintf(stderr, "Switch %s not found\n", swname);
-		exit(1);
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a capacitor", capname);
 	}
-	if (ctx->elements_used[i]->typ != TYPE_SWITCH)
+	if (C <= 0)
 	{
-		fprintf(stderr, "Element %s not a switch\n", swname);
-		exit(1);
+		return libsimul_fail(ctx, ERR_INVALID, "Invalid capacitance: %lf", C);
+	}
+	if (libsimul_unshare(ctx) != 0)
+	{
+		return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
+	}
+	ctx->circuit->elements_used[i]->C = C;
+	return 0;
+}
+// Sets the internal resistance of any element having one, e.g. the ESR of a
+// capacitor. The capacitor voltage and the voltage source voltage are kept.
+int set_element_resistance(struct libsimul_ctx *ctx, const char *elname, double R)
+{
+	struct element *el;
+	size_t i;
+	i = libsimul_find_element(ctx->circuit, elname);
+	if (i == SIZE_MAX)
+	{
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not found", elname);
+	}
+	el = ctx->circuit->elements_used[i];
+	if (el->typ == TYPE_TRANSFORMER || el->typ == TYPE_TRANSFORMER_DIRECT)
+	{
+		return libsimul_fail(ctx, ERR_INVALID, "Can't change resistance of transformer %s", elname);
+	}
+	if (el->typ == TYPE_INDUCTOR ? R < 0 : R <= 0)
+	{
+		return libsimul_fail(ctx, ERR_INVALID, "Invalid resistance: %lf", R);
+	}
+	if (libsimul_unshare(ctx) != 0)
+	{
+		return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
+	}
+	if (el->typ == TYPE_CAPACITOR)
+	{
+		ctx->state[i].I_src *= el->R/R;
+	}
+	else if (el->typ == TYPE_VOLTAGE)
+	{
+		ctx->state[i].I_src = ctx->state[i].V/R;
+	}
+	ctx->circuit->elements_used[i]->R = R;
+	return ERR_HAVE_TO_SIMULATE_AGAIN;
+}
+double get_element_resistance(struct libsimul_ctx *ctx, const char *elname)
+{
+	size_t i;
+	i = libsimul_find_element(ctx->circuit, elname);
+	if (i == SIZE_MAX)
+	{
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not found", elname);
+		return NAN;
+	}
+	return ctx->circuit->elements_used[i]->R;
+}
+int set_transformer_inductor(struct libsimul_ctx *ctx, const char *xfrname, double L)
+{
+	struct element *el;
+	size_t i;
+	i = libsimul_find_element(ctx->circuit, xfrname);
+	if (i == SIZE_MAX || !ctx->circuit->elements_used[i]->primary)
+	{
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Transformer %s not found", xfrname);
+	}
+	el = ctx->circuit->elements_used[i];
+	if (el->typ != TYPE_TRANSFORMER && el->typ != TYPE_TRANSFORMER_DIRECT)
+	{
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a transformer", xfrname);
+	}
+	if (L <= 0)
+	{
+		return libsimul_fail(ctx, ERR_INVALID, "Invalid inductance: %lf", L);
+	}
+	if (libsimul_unshare(ctx) != 0)
+	{
+		return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
+	}
+	el = ctx->circuit->elements_used[i];
+	el->Lbase = L/(el->N*el->N);
+	return 0;
+}
+
+int set_switch_state(struct libsimul_ctx *ctx, const char *swname, int state)
+{
+	size_t i;
+	i = libsimul_find_element(ctx->circuit, swname);
+	if (i == SIZE_MAX)
+	{
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Switch %s not found", swname);
+	}
+	if (ctx->circuit->elements_used[i]->typ != TYPE_SWITCH)
+	{
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a switch", swname);
 	}
-	if ((!!ctx->elements_used[i]->current_switch_state_is_closed) == (!!state))
+	if ((!!ctx->state[i].current_switch_state_is_closed) == (!!state))
 	{
 		return 0;
 	}
-	ctx->elements_used[i]->current_switch_state_is_closed = !!state;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	ctx->state[i].current_switch_state_is_closed = !!state;
+	for (i = 0; i < ctx->circuit->elements_used_sz; i++)
 	{
-		if (ctx->elements_used[i]->typ == TYPE_DIODE)
+		if (ctx->circuit->elements_used[i]->typ == TYPE_DIODE)
 		{
 			// FIXME spooky...
 			// This seems to cause more problems than it solves.
 			// At least pfc3 is negatively affected.
 #if 0
-			ctx->elements_used[i]->current_switch_state_is_closed = 1;
+			ctx->state[i].current_switch_state_is_closed = 1;
 #endif
 		}
 	}
@@ -243,24 +438,16 @@ int set_switch_state(struct libsimul_ctx *ctx, const char *swname, int state)
 int set_diode_hint(struct libsimul_ctx *ctx, const char *dname, int state)
 {
 	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
-	{
-		if (strcmp(ctx->elements_used[i]->name, dname) == 0)
-		{
-			break;
-		}
-	}
-	if (i == ctx->elements_used_sz)
+	i = libsimul_find_element(ctx->circuit, dname);
+	if (i == SIZE_MAX)
 	{
-		fprintf(stderr, "Diode %s not found\n", dname);
-		exit(1);
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Diode %s not found", dname);
 	}
-	if (ctx->elements_used[i]->typ != TYPE_DIODE)
+	if (ctx->circuit->elements_used[i]->typ != TYPE_DIODE)
 	{
-		fprintf(stderr, "Element %s not a diode\n", dname);
-		exit(1);
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a diode", dname);
 	}
-	ctx->elements_used[i]->current_switch_state_is_closed = !!state;
+	ctx->state[i].current_switch_state_is_closed = !!state;
 	return ERR_HAVE_TO_SIMULATE_AGAIN;
 }
 
@@ -273,40 +460,41 @@ void mark_node_seen(struct libsimul_ctx *ctx, int n)
 		abort();
 	}
 	nsz = (size_t)n;
-	if (ctx->node_seen == NULL || nsz >= ctx->node_seen_cap)
+	netlist_unshare(ctx);
+	if (ctx->circuit->node_seen == NULL || nsz >= ctx->circuit->node_seen_cap)
 	{
 		size_t newcap = nsz*2 + 16;
 		unsigned char *new_ns;
-		new_ns = realloc(ctx->node_seen, sizeof(*ctx->node_seen)*newcap);
+		new_ns = realloc(ctx->circuit->node_seen, sizeof(*ctx->circuit->node_seen)*newcap);
 		if (new_ns == NULL)
 		{
 			fprintf(stderr, "Out of memory\n");
 			exit(1);
 		}
-		ctx->node_seen = new_ns;
-		ctx->node_seen_cap = newcap;
-		for (i = ctx->node_seen_sz; i < newcap; i++)
+		ctx->circuit->node_seen = new_ns;
+		ctx->circuit->node_seen_cap = newcap;
+		for (i = ctx->circuit->node_seen_sz; i < newcap; i++)
 		{
 			new_ns[i] = 0;
 		}
 	}
-	ctx->node_seen[nsz] = 1;
-	if (nsz+1 > ctx->node_seen_sz)
+	ctx->circuit->node_seen[nsz] = 1;
+	if (nsz+1 > ctx->circuit->node_seen_sz)
 	{
-		ctx->node_seen_sz = nsz+1;
+		ctx->circuit->node_seen_sz = nsz+1;
 	}
 }
 void check_dense_nodes(struct libsimul_ctx *ctx)
 {
 	size_t i;
-	if (ctx->node_seen_sz < 2)
+	if (ctx->circuit->node_seen_sz < 2)
 	{
 		fprintf(stderr, "Must have at least 2 nodes\n");
 		exit(1);
 	}
-	for (i = 0; i < ctx->node_seen_sz; i++)
+	for (i = 0; i < ctx->circuit->node_seen_sz; i++)
 	{
-		if (!ctx->node_seen[i])
+		if (!ctx->circuit->node_seen[i])
 		{
 			fprintf(stderr, "Node %zu not seen\n", i);
 			exit(1);
@@ -317,6 +505,7 @@ void check_dense_nodes(struct libsimul_ctx *ctx)
 void form_g_matrix(struct libsimul_ctx *ctx)
 {
 	struct element *el;
+	struct element_state *st;
 	const size_t nodecnt = ctx->nodecnt;
 	size_t x,y;
 	size_t i;
@@ -328,18 +517,19 @@ void form_g_matrix(struct libsimul_ctx *ctx)
 			ctx->G_matrix[x*nodecnt+y] = 0;
 		}
 	}
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	for (i = 0; i < ctx->circuit->elements_used_sz; i++)
 	{
 		int n1;
 		int n2;
 		double G;
-		el = ctx->elements_used[i];
+		el = ctx->circuit->elements_used[i];
+		st = &ctx->state[i];
 		if (el->typ == TYPE_INDUCTOR)
 		{
 			continue;
 		}
 		if (((el->typ == TYPE_DIODE || el->typ == TYPE_SWITCH) &&
-		     !el->current_switch_state_is_closed))
+		     !st->current_switch_state_is_closed))
 		{
 			G = 1e-9; // FIXME this is bad.
 			continue;
@@ -348,17 +538,17 @@ void form_g_matrix(struct libsimul_ctx *ctx)
 		{
 			double V = get_V(ctx, el->n1) - get_V(ctx, el->n2);
 			double I_model, V_across_resistor;
-			I_model = V*el->G_R_shockley - el->I_src;
+			I_model = V*st->G_R_shockley - st->I_src;
 			V_across_resistor = el->R*I_model;
 			V -= V_across_resistor;
-			if (V < el->V_across_diode - 0.1 && V > 0)
+			if (V < st->V_across_diode - 0.1 && V > 0)
 			{
-				V = el->V_across_diode - 0.1;
+				V = st->V_across_diode - 0.1;
 			}
-			else if (V > el->V_across_diode + 0.1 && V > 0)
+			else if (V > st->V_across_diode + 0.1 && V > 0)
 			{
 				//printf("V was %g\n", V);
-				V = el->V_across_diode + 0.1;
+				V = st->V_across_diode + 0.1;
 				if (V < 0)
 				{
 					V = 0;
@@ -368,16 +558,16 @@ void form_g_matrix(struct libsimul_ctx *ctx)
 #if 1
 			if (V > el->Vmax)
 			{
-				//printf("Vmax hit %g %g %g\n", el->V_across_diode, V, el->Vmax);
+				//printf("Vmax hit %g %g %g\n", st->V_across_diode, V, el->Vmax);
 				V = el->Vmax;
 			}
 #endif
-			el->expval = exp(V/el->V_T);
-			el->I_model = I_model;
-			G = el->I_s/el->V_T*el->expval;
-			el->G_shockley = G; // not including resistance
+			st->expval = exp(V/el->V_T);
+			st->I_model = I_model;
+			G = el->I_s/el->V_T*st->expval;
+			st->G_shockley = G; // not including resistance
 			G = 1.0/(1.0/G + el->R);
-			el->G_R_shockley = G; // including resistance
+			st->G_R_shockley = G; // including resistance
 		}
 		else
 		{
@@ -399,14 +589,19 @@ void form_g_matrix(struct libsimul_ctx *ctx)
 			ctx->G_matrix[(n2-1)*nodecnt+(n1-1)] -= G;
 		}
 	}
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	for (i = 0; i < ctx->circuit->elements_used_sz; i++)
 	{
 		size_t j,k;
-		el = ctx->elements_used[i];
+		el = ctx->circuit->elements_used[i];
 		if (el->typ != TYPE_TRANSFORMER_DIRECT || !el->primary)
 		{
 			continue;
 		}
+		if (ctx->part != NULL)
+		{
+			// The block solver adds these as low-rank updates
+			continue;
+		}
 		for (j = 0; j < el->allptrs_size; j++)
 		{
 			for (k = 0; k < el->allptrs_size; k++)
@@ -440,39 +635,61 @@ void form_g_matrix(struct libsimul_ctx *ctx)
 			}
 		}
 	}
+	// Local ground of isolated subcircuits: V = 0 replaces the redundant
+	// current equation of the node
+	for (i = 0; i < ctx->circuit->floating_ref_cnt; i++)
+	{
+		size_t r = ctx->circuit->floating_ref[i] - 1;
+		size_t j;
+		for (j = 0; j < nodecnt; j++)
+		{
+			ctx->G_matrix[r*nodecnt+j] = 0;
+			ctx->G_matrix[j*nodecnt+r] = 0;
+		}
+		ctx->G_matrix[r*nodecnt+r] = 1;
+	}
 }
-void calc_lu(struct libsimul_ctx *ctx)
+int calc_lu(struct libsimul_ctx *ctx)
 {
 	const size_t nodecnt = ctx->nodecnt;
 	const int n = nodecnt;
 	int info = 0;
+	if (ctx->part != NULL)
+	{
+		return partition_lu(ctx);
+	}
 	memcpy(ctx->G_LU, ctx->G_matrix, sizeof(*ctx->G_LU)*nodecnt*nodecnt);
 	LAPACK_dgetrf(&n, &n, ctx->G_LU, &n, ctx->G_ipiv, &info);
 	if (info != 0)
 	{
-		fprintf(stderr, "Can't LU decompose: %d\n", info);
-		exit(1);
+		return libsimul_fail(ctx, ERR_SINGULAR, "Can't LU decompose: %d", info);
 	}
+	return 0;
 }
-void calc_V(struct libsimul_ctx *ctx)
+int calc_V(struct libsimul_ctx *ctx)
 {
 	const size_t nodecnt = ctx->nodecnt;
 	const int n = nodecnt;
 	const int one = 1;
 	int info = 0;
+	if (ctx->part != NULL)
+	{
+		return partition_solve(ctx);
+	}
 	memcpy(ctx->V_vector, ctx->Isrc_vector, sizeof(*ctx->V_vector)*nodecnt);
 	LAPACK_dgetrs("N", &n, &one, ctx->G_LU, &n, ctx->G_ipiv, ctx->V_vector, &n, &info);
 	if (info != 0)
 	{
-		fprintf(stderr, "Can't solve system of equations\n");
-		exit(1);
+		return libsimul_fail(ctx, ERR_SINGULAR, "Can't solve system of equations");
 	}
+	return 0;
 }
 void form_isrc_vector(struct libsimul_ctx *ctx)
 {
 	const size_t nodecnt = ctx->nodecnt;
-	const size_t elements_used_sz = ctx->elements_used_sz;
+	const size_t elements_used_sz = ctx->circuit->elements_used_sz;
 	struct element *el;
+	struct element_state *st;
 	size_t i;
 	size_t x;
 	for (x = 0; x < nodecnt; x++)
@@ -484,7 +701,8 @@ void form_isrc_vector(struct libsimul_ctx *ctx)
 		int n1;
 		int n2;
 		double Isrc;
-		el = ctx->elements_used[i];
+		el = ctx->circuit->elements_used[i];
+		st = &ctx->state[i];
 		if (el->typ == TYPE_TRANSFORMER_DIRECT)
 		{
 			continue;
@@ -493,18 +711,18 @@ void form_isrc_vector(struct libsimul_ctx *ctx)
 		{
 			double V = get_V(ctx, el->n1) - get_V(ctx, el->n2);
 			double I_model, V_across_resistor;
-			I_model = el->I_model;
-			//I_model = V*el->G_R_shockley - el->I_src;
+			I_model = st->I_model;
+			//I_model = V*st->G_R_shockley - st->I_src;
 			V_across_resistor = el->R*I_model;
 			V -= V_across_resistor;
-			if (V < el->V_across_diode - 0.1 && V > 0)
+			if (V < st->V_across_diode - 0.1 && V > 0)
 			{
-				V = el->V_across_diode - 0.1;
+				V = st->V_across_diode - 0.1;
 			}
-			else if (V > el->V_across_diode + 0.1 && V > 0)
+			else if (V > st->V_across_diode + 0.1 && V > 0)
 			{
 				//printf("V was %g\n", V);
-				V = el->V_across_diode + 0.1;
+				V = st->V_across_diode + 0.1;
 				if (V < 0)
 				{
 					V = 0;
@@ -514,33 +732,33 @@ void form_isrc_vector(struct libsimul_ctx *ctx)
 #if 1
 			if (V > el->Vmax)
 			{
-				//printf("Vmax hit %g %g %g\n", el->V_across_diode, V, el->Vmax);
+				//printf("Vmax hit %g %g %g\n", st->V_across_diode, V, el->Vmax);
 				V = el->Vmax;
 			}
 #endif
-			//el->expval = exp(V/el->V_T); // already calculated
-			Isrc = el->I_s*(1+(V/el->V_T-1)*el->expval);
-			// Isrc and el->G_shockley in parallel, el->R in series
+			//st->expval = exp(V/el->V_T); // already calculated
+			Isrc = el->I_s*(1+(V/el->V_T-1)*st->expval);
+			// Isrc and st->G_shockley in parallel, el->R in series
 			// converted to, in series:
-			// 1. voltage Isrc/el->G_shockley
-			// 2. resistor 1.0/el->G_shockley
+			// 1. voltage Isrc/st->G_shockley
+			// 2. resistor 1.0/st->G_shockley
 			// 3. resistor el->R
 			// converted to, in series:
-			// 1. voltage Isrc/el->G_shockley
-			// 2. resistor 1.0/el->G_shockley + el->R
+			// 1. voltage Isrc/st->G_shockley
+			// 2. resistor 1.0/st->G_shockley + el->R
 			// converted to, in parallel:
-			// 1. current src Isrc*el->G_R_shockley/el->G_shockley
-			// 2. conductance el->G_R_shockley
-			// Here (2) is el->G_R_shockley
-			if (el->G_shockley != 0)
+			// 1. current src Isrc*st->G_R_shockley/st->G_shockley
+			// 2. conductance st->G_R_shockley
+			// Here (2) is st->G_R_shockley
+			if (st->G_shockley != 0)
 			{
-				Isrc *= el->G_R_shockley/el->G_shockley;
+				Isrc *= st->G_R_shockley/st->G_shockley;
 			}
-			el->I_src = Isrc; // including resistance
+			st->I_src = Isrc; // including resistance
 		}
 		else
 		{
-			Isrc = el->I_src;
+			Isrc = st->I_src;
 		}
 		n1 = el->n1;
 		n2 = el->n2;
@@ -556,7 +774,8 @@ void form_isrc_vector(struct libsimul_ctx *ctx)
 	for (i = 0; i < elements_used_sz; i++)
 	{
 		size_t j;
-		el = ctx->elements_used[i];
+		el = ctx->circuit->elements_used[i];
+		st = &ctx->state[i];
 		if (el->typ != TYPE_TRANSFORMER_DIRECT || !el->primary)
 		{
 			continue;
@@ -568,7 +787,7 @@ void form_isrc_vector(struct libsimul_ctx *ctx)
 			int n2 = winding->n2;
 			double Isrc =
 				winding->N/el->N * 1.0/winding->R *
-				el->transformer_direct_const
+				st->transformer_direct_const
 				/ el->transformer_direct_denom;
 			if (n1 != 0)
 			{
@@ -580,6 +799,10 @@ void form_isrc_vector(struct libsimul_ctx *ctx)
 			}
 		}
 	}
+	for (i = 0; i < ctx->circuit->floating_ref_cnt; i++)
+	{
+		ctx->Isrc_vector[ctx->circuit->floating_ref[i]-1] = 0;
+	}
 }
 
 double get_V(struct libsimul_ctx *ctx, int node)
@@ -593,42 +816,43 @@ double get_V(struct libsimul_ctx *ctx, int node)
 
 int go_through_shockley_diodes(struct libsimul_ctx *ctx)
 {
-	const size_t elements_used_sz = ctx->elements_used_sz;
+	const size_t elements_used_sz = ctx->circuit->elements_used_sz;
 	size_t i;
 	double V_across_diode;
 	double V_across_resistor;
 	double I_linear, I_nonlinear;
 	for (i = 0; i < elements_used_sz; i++)
 	{
-		struct element *el = ctx->elements_used[i];
+		struct element *el = ctx->circuit->elements_used[i];
+		struct element_state *st = &ctx->state[i];
 		if (el->typ != TYPE_SHOCKLEY_DIODE)
 		{
 			continue;
 		}
 		//printf("Found Shockley diode\n");
 		V_across_diode = get_V(ctx, el->n1) - get_V(ctx, el->n2);
-		I_linear = V_across_diode*el->G_R_shockley - el->I_src;
+		I_linear = V_across_diode*st->G_R_shockley - st->I_src;
 		V_across_resistor = el->R*I_linear;
 		V_across_diode -= V_across_resistor;
 		if (V_across_diode < 0)
 		{
-			el->V_across_diode = V_across_diode;
+			st->V_across_diode = V_across_diode;
 		}
-		else if (V_across_diode > el->V_across_diode + 0.1)
+		else if (V_across_diode > st->V_across_diode + 0.1)
 		{
-			el->V_across_diode += 0.1;
-			if (el->V_across_diode < 0)
+			st->V_across_diode += 0.1;
+			if (st->V_across_diode < 0)
 			{
-				el->V_across_diode = 0;
+				st->V_across_diode = 0;
 			}
 		}
-		else if (V_across_diode < el->V_across_diode - 0.1)
+		else if (V_across_diode < st->V_across_diode - 0.1)
 		{
-			el->V_across_diode -= 0.1;
+			st->V_across_diode -= 0.1;
 		}
 		else
 		{
-			el->V_across_diode = V_across_diode;
+			st->V_across_diode = V_across_diode;
 		}
 		I_nonlinear = el->I_s*(exp(V_across_diode/el->V_T)-1);
 		//printf("V_across_diode %g\n", V_across_diode);
@@ -644,24 +868,25 @@ int go_through_shockley_diodes(struct libsimul_ctx *ctx)
 }
 int go_through_shockley_diodes_2(struct libsimul_ctx *ctx)
 {
-	const size_t elements_used_sz = ctx->elements_used_sz;
+	const size_t elements_used_sz = ctx->circuit->elements_used_sz;
 	size_t i;
 	double V_across_diode;
 	double V_across_resistor;
 	double I_model;
 	for (i = 0; i < elements_used_sz; i++)
 	{
-		struct element *el = ctx->elements_used[i];
+		struct element *el = ctx->circuit->elements_used[i];
+		struct element_state *st = &ctx->state[i];
 		if (el->typ != TYPE_SHOCKLEY_DIODE)
 		{
 			continue;
 		}
 		//printf("Found Shockley diode 2\n");
 		V_across_diode = get_V(ctx, el->n1) - get_V(ctx, el->n2);
-		I_model = V_across_diode*el->G_R_shockley - el->I_src;
+		I_model = V_across_diode*st->G_R_shockley - st->I_src;
 		V_across_resistor = el->R*I_model;
 		V_across_diode -= V_across_resistor;
-		el->V_across_diode = V_across_diode;
+		st->V_across_diode = V_across_diode;
 	}
 	return 0;
 }
@@ -670,35 +895,36 @@ int go_through_shockley_diodes_2(struct libsimul_ctx *ctx)
 // Return: -EAGAIN have to do simulation again
 int go_through_diodes(struct libsimul_ctx *ctx, int recalc_loop)
 {
-	const size_t elements_used_sz = ctx->elements_used_sz;
+	const size_t elements_used_sz = ctx->circuit->elements_used_sz;
 	size_t i;
 	int ret = 0;
 	double V_across_diode;
 	for (i = 0; i < elements_used_sz; i++)
 	{
-		struct element *el = ctx->elements_used[i];
+		struct element *el = ctx->circuit->elements_used[i];
+		struct element_state *st = &ctx->state[i];
 		if (el->typ != TYPE_DIODE)
 		{
 			continue;
 		}
 		if (recalc_loop && el->on_recalc != -1)
 		{
-			if (el->current_switch_state_is_closed != el->on_recalc)
+			if (st->current_switch_state_is_closed != el->on_recalc)
 			{
 				ret = ERR_HAVE_TO_SIMULATE_AGAIN_DIODE;
 			}
-			el->current_switch_state_is_closed = el->on_recalc;
+			st->current_switch_state_is_closed = el->on_recalc;
 			continue;
 		}
 		V_across_diode = get_V(ctx, el->n1) - get_V(ctx, el->n2);
-		if (V_across_diode < -el->diode_threshold && el->current_switch_state_is_closed)
+		if (V_across_diode < -el->diode_threshold && st->current_switch_state_is_closed)
 		{
-			el->current_switch_state_is_closed = 0;
+			st->current_switch_state_is_closed = 0;
 			ret = ERR_HAVE_TO_SIMULATE_AGAIN_DIODE;
 		}
-		if (V_across_diode > el->diode_threshold && !el->current_switch_state_is_closed)
+		if (V_across_diode > el->diode_threshold && !st->current_switch_state_is_closed)
 		{
-			el->current_switch_state_is_closed = 1;
+			st->current_switch_state_is_closed = 1;
 			ret = ERR_HAVE_TO_SIMULATE_AGAIN_DIODE;
 		}
 	}
@@ -723,15 +949,16 @@ void go_through_inductors(struct libsimul_ctx *ctx)
 	double V_across_resistor;
 	double dI;
 	int oldsign, newsign;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	for (i = 0; i < ctx->circuit->elements_used_sz; i++)
 	{
-		struct element *el = ctx->elements_used[i];
+		struct element *el = ctx->circuit->elements_used[i];
+		struct element_state *st = &ctx->state[i];
 		if (el->typ != TYPE_INDUCTOR)
 		{
 			continue;
 		}
 		V_across_inductor = get_V(ctx, el->n1) - get_V(ctx, el->n2);
-		V_across_resistor = -el->R*el->I_src;
+		V_across_resistor = -el->R*st->I_src;
 		V_across_inductor -= V_across_resistor;
 		dI = -V_across_inductor/el->L*ctx->dt;
 #if 0
@@ -741,22 +968,22 @@ void go_through_inductors(struct libsimul_ctx *ctx)
 			exit(1);
 		}
 #endif
-		oldsign = signum(el->I_src);
-		el->I_src += dI;
-		newsign = signum(el->I_src);
+		oldsign = signum(st->I_src);
+		st->I_src += dI;
+		newsign = signum(st->I_src);
 		if (oldsign != 0 && newsign != 0 && oldsign != newsign)
 		{
 			// Probably wisest to reset to zero
-			el->I_src = 0;
+			st->I_src = 0;
 		}
 #if 0
-		if (fabs(el->I_src) > 100)
+		if (fabs(st->I_src) > 100)
 		{
 			fprintf(stderr, "Limit2 reached\n");
 			exit(1);
 		}
 #endif
-		//fprintf(stderr, "Inductor V_across %g I_src %g\n", V_across_inductor, el->I_src);
+		//fprintf(stderr, "Inductor V_across %g I_src %g\n", V_across_inductor, st->I_src);
 	}
 }
 void go_through_capacitors(struct libsimul_ctx *ctx)
@@ -766,55 +993,58 @@ void go_through_capacitors(struct libsimul_ctx *ctx)
 	double I_R;
 	double I_tot;
 	double dU;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	for (i = 0; i < ctx->circuit->elements_used_sz; i++)
 	{
-		struct element *el = ctx->elements_used[i];
+		struct element *el = ctx->circuit->elements_used[i];
+		struct element_state *st = &ctx->state[i];
 		if (el->typ != TYPE_CAPACITOR)
 		{
 			continue;
 		}
 		V_across_capacitor = get_V(ctx, el->n1) - get_V(ctx, el->n2);
 		I_R = V_across_capacitor/el->R;
-		I_tot = el->I_src - I_R;
+		I_tot = st->I_src - I_R;
 		// Positive I_tot: discharge
 		// Negative I_tot: charge
 		dU = -I_tot/el->C*ctx->dt;
-		el->I_src += dU/el->R;
+		st->I_src += dU/el->R;
 	}
 }
 double get_transformer_dphi_single(struct libsimul_ctx *ctx, size_t el_id)
 {
 	double V_trial;
-	V_trial = ctx->elements_used[el_id]->R * ctx->elements_used[el_id]->I_src;
-	return V_trial*ctx->dt/ctx->elements_used[el_id]->N;
+	V_trial = ctx->circuit->elements_used[el_id]->R * ctx->state[el_id].I_src;
+	return V_trial*ctx->dt/ctx->circuit->elements_used[el_id]->N;
 }
 void go_through_transformers(struct libsimul_ctx *ctx)
 {
 	size_t i;
 	int oldsign, newsign;
 	double dphi_single;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	for (i = 0; i < ctx->circuit->elements_used_sz; i++)
 	{
-		struct element *el = ctx->elements_used[i];
+		struct element *el = ctx->circuit->elements_used[i];
+		struct element_state *st = &ctx->state[i];
 		if (el->typ != TYPE_TRANSFORMER || !el->primary)
 		{
 			continue;
 		}
 		dphi_single = get_transformer_dphi_single(ctx, i);
-		oldsign = signum(el->cur_phi_single);
-		el->cur_phi_single += dphi_single;
-		newsign = signum(el->cur_phi_single);
+		oldsign = signum(st->cur_phi_single);
+		st->cur_phi_single += dphi_single;
+		newsign = signum(st->cur_phi_single);
 		if (oldsign != 0 && newsign != 0 && oldsign != newsign)
 		{
 			// Probably wisest to reset to zero
-			el->cur_phi_single = 0;
+			st->cur_phi_single = 0;
 		}
 	}
 }
 double get_transformer_direct_dconst(struct libsimul_ctx *ctx, size_t i)
 {
-	struct element *el = ctx->elements_used[i];
-	const double Const = el->transformer_direct_const;
+	struct element *el = ctx->circuit->elements_used[i];
+	struct element_state *st = &ctx->state[i];
+	const double Const = st->transformer_direct_const;
 	const double denom = el->transformer_direct_denom;
 	//denom = (N_3/N_1*N_3/N_1*1/R_3 + N_2/N_1*N_2/N_1*1/R_2 + N_1/N_1*N_1/N_1*1/R_1)
 	//double V_1 = {Const + (V_nc1-V_nc2)/R_3*N_3/N_1 + (V_nb1-V_nb2)/R_2*N_2/N_1 + (V_na1-V_na2)/R_1*N_1/N_1}/denom;
@@ -834,65 +1064,53 @@ double get_transformer_direct_dconst(struct libsimul_ctx *ctx, size_t i)
 double get_transformer_mag_current(struct libsimul_ctx *ctx, const char *xfrname)
 {
 	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	i = libsimul_find_element(ctx->circuit, xfrname);
+	if (i == SIZE_MAX || !ctx->circuit->elements_used[i]->primary)
 	{
-		if (strcmp(ctx->elements_used[i]->name, xfrname) == 0 && ctx->elements_used[i]->primary)
-		{
-			break;
-		}
-	}
-	if (i == ctx->elements_used_sz)
-	{
-		fprintf(stderr, "Transformer %s not found\n", xfrname);
-		exit(1);
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Transformer %s not found", xfrname);
+		return NAN;
 	}
-	if (ctx->elements_used[i]->typ == TYPE_TRANSFORMER_DIRECT)
+	if (ctx->circuit->elements_used[i]->typ == TYPE_TRANSFORMER_DIRECT)
 	{
-		return -ctx->elements_used[i]->transformer_direct_const;
+		return -ctx->state[i].transformer_direct_const;
 	}
-	else if (ctx->elements_used[i]->typ == TYPE_TRANSFORMER)
+	else if (ctx->circuit->elements_used[i]->typ == TYPE_TRANSFORMER)
 	{
-		return ctx->elements_used[i]->cur_phi_single
-		       / ctx->elements_used[i]->Lbase
-		       / ctx->elements_used[i]->N;
+		return ctx->state[i].cur_phi_single
+		       / ctx->circuit->elements_used[i]->Lbase
+		       / ctx->circuit->elements_used[i]->N;
 	}
 	else
 	{
-		fprintf(stderr, "Element %s not a transformer\n", xfrname);
-		exit(1);
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a transformer", xfrname);
+		return NAN;
 	}
 }
 double get_transformer_inductor(struct libsimul_ctx *ctx, const char *xfrname)
 {
 	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
-	{
-		if (strcmp(ctx->elements_used[i]->name, xfrname) == 0 && ctx->elements_used[i]->primary)
-		{
-			break;
-		}
-	}
-	if (i == ctx->elements_used_sz)
+	i = libsimul_find_element(ctx->circuit, xfrname);
+	if (i == SIZE_MAX || !ctx->circuit->elements_used[i]->primary)
 	{
-		fprintf(stderr, "Transformer %s not found\n", xfrname);
-		exit(1);
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Transformer %s not found", xfrname);
+		return NAN;
 	}
-	if (ctx->elements_used[i]->typ == TYPE_TRANSFORMER_DIRECT)
+	if (ctx->circuit->elements_used[i]->typ == TYPE_TRANSFORMER_DIRECT)
 	{
-		return ctx->elements_used[i]->Lbase
-		       * ctx->elements_used[i]->N
-		       * ctx->elements_used[i]->N;
+		return ctx->circuit->elements_used[i]->Lbase
+		       * ctx->circuit->elements_used[i]->N
+		       * ctx->circuit->elements_used[i]->N;
 	}
-	else if (ctx->elements_used[i]->typ == TYPE_TRANSFORMER)
+	else if (ctx->circuit->elements_used[i]->typ == TYPE_TRANSFORMER)
 	{
-		return ctx->elements_used[i]->Lbase
-		       * ctx->elements_used[i]->N
-		       * ctx->elements_used[i]->N;
+		return ctx->circuit->elements_used[i]->Lbase
+		       * ctx->circuit->elements_used[i]->N
+		       * ctx->circuit->elements_used[i]->N;
 	}
 	else
 	{
-		fprintf(stderr, "Element %s not a transformer\n", xfrname);
-		exit(1);
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a transformer", xfrname);
+		return NAN;
 	}
 }
 void go_through_direct_transformers(struct libsimul_ctx *ctx)
@@ -900,21 +1118,22 @@ void go_through_direct_transformers(struct libsimul_ctx *ctx)
 	size_t i;
 	int oldsign, newsign;
 	double dconst;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	for (i = 0; i < ctx->circuit->elements_used_sz; i++)
 	{
-		struct element *el = ctx->elements_used[i];
+		struct element *el = ctx->circuit->elements_used[i];
+		struct element_state *st = &ctx->state[i];
 		if (el->typ != TYPE_TRANSFORMER_DIRECT || !el->primary)
 		{
 			continue;
 		}
 		dconst = get_transformer_direct_dconst(ctx, i);
-		oldsign = signum(el->transformer_direct_const);
-		el->transformer_direct_const -= dconst;
-		newsign = signum(el->transformer_direct_const);
+		oldsign = signum(st->transformer_direct_const);
+		st->transformer_direct_const -= dconst;
+		newsign = signum(st->transformer_direct_const);
 		if (oldsign != 0 && newsign != 0 && oldsign != newsign)
 		{
 			// Probably wisest to reset to zero
-			el->transformer_direct_const = 0;
+			st->transformer_direct_const = 0;
 		}
 	}
 }
@@ -938,11 +1157,11 @@ void set_transformer_voltage(struct libsimul_ctx *ctx, size_t el_id, double V)
 		}
 	}
 #else
-	for (i = 0; i < ctx->elements_used[el_id]->allptrs_size; i++)
+	for (i = 0; i < ctx->circuit->elements_used[el_id]->allptrs_size; i++)
 	{
-		struct element *el = ctx->elements_used[el_id]->allptrs[i];
-		el->I_src = 
-			V / el->R * el->N / ctx->elements_used[el_id]->N;
+		struct element *el = ctx->circuit->elements_used[el_id]->allptrs[i];
+		ctx->state[el->idx].I_src = 
+			V / el->R * el->N / ctx->circuit->elements_used[el_id]->N;
 	}
 #endif
 }
@@ -979,14 +1198,14 @@ double get_transformer_trial_phi_single(struct libsimul_ctx *ctx, size_t el_id)
 		}
 	}
 #else
-	for (i = 0; i < ctx->elements_used[el_id]->allptrs_size; i++)
+	for (i = 0; i < ctx->circuit->elements_used[el_id]->allptrs_size; i++)
 	{
-		struct element *el = ctx->elements_used[el_id]->allptrs[i];
+		struct element *el = ctx->circuit->elements_used[el_id]->allptrs[i];
 		V_across_winding = get_V(ctx, el->n1) - get_V(ctx, el->n2);
 		I_R = V_across_winding/el->R;
-		I_tot = el->I_src - I_R;
+		I_tot = ctx->state[el->idx].I_src - I_R;
 		phi_single -=
-			I_tot * ctx->elements_used[el_id]->Lbase * el->N;
+			I_tot * ctx->circuit->elements_used[el_id]->Lbase * el->N;
 	}
 #endif
 	return phi_single;
@@ -1005,6 +1224,8 @@ int double_cmp(double a, double b)
 	return 0;
 }
 
+// Returns 0 once the step is done, ERR_HAVE_TO_SIMULATE_AGAIN_* to solve
+// again and -ERR_NOT_CONVERGED if the transformer voltage search failed
 int go_through_all(struct libsimul_ctx *ctx, int recalc_loop)
 {
 	int ret = 0;
@@ -1021,40 +1242,40 @@ int go_through_all(struct libsimul_ctx *ctx, int recalc_loop)
 	if (ctx->xformerstate == STATE_FINI && ctx->xformerid == SIZE_MAX)
 	{
 		size_t i;
-		for (i = 0; i < ctx->elements_used_sz; i++)
+		for (i = 0; i < ctx->circuit->elements_used_sz; i++)
 		{
-			struct element *el = ctx->elements_used[i];
+			struct element *el = ctx->circuit->elements_used[i];
 			if (el->typ == TYPE_TRANSFORMER && el->primary)
 			{
 				break;
 			}
 		}
 		ctx->xformerid = i;
-		if (ctx->xformerid < ctx->elements_used_sz)
+		if (ctx->xformerid < ctx->circuit->elements_used_sz)
 		{
 			ctx->xformerstate = STATE_LOBO;
 		}
 	}
-	else if (ctx->xformerstate == STATE_FINI && ctx->xformerid < ctx->elements_used_sz)
+	else if (ctx->xformerstate == STATE_FINI && ctx->xformerid < ctx->circuit->elements_used_sz)
 	{
 		size_t i;
-		for (i = ctx->xformerid+1; i < ctx->elements_used_sz; i++)
+		for (i = ctx->xformerid+1; i < ctx->circuit->elements_used_sz; i++)
 		{
-			struct element *el = ctx->elements_used[i];
+			struct element *el = ctx->circuit->elements_used[i];
 			if (el->typ == TYPE_TRANSFORMER && el->primary)
 			{
 				break;
 			}
 		}
 		ctx->xformerid = i;
-		if (ctx->xformerid < ctx->elements_used_sz)
+		if (ctx->xformerid < ctx->circuit->elements_used_sz)
 		{
 			ctx->xformerstate = STATE_LOBO;
 		}
 	}
 	if (ctx->xformerstate == STATE_LOBO)
 	{
-		ctx->loboV = ctx->elements_used[ctx->xformerid]->Vmin;
+		ctx->loboV = ctx->circuit->elements_used[ctx->xformerid]->Vmin;
 		set_transformer_voltage(ctx, ctx->xformerid, ctx->loboV);
 		ctx->xformerstate = STATE_LOBOPOST;
 		return ERR_HAVE_TO_SIMULATE_AGAIN_TRANSFORMER;
@@ -1063,7 +1284,7 @@ int go_through_all(struct libsimul_ctx *ctx, int recalc_loop)
 	{
 		int l;
 		ctx->lobophi = get_transformer_trial_phi_single(ctx, ctx->xformerid);
-		l = double_cmp(ctx->lobophi, ctx->elements_used[ctx->xformerid]->cur_phi_single);
+		l = double_cmp(ctx->lobophi, ctx->state[ctx->xformerid].cur_phi_single);
 		if (l == 0)
 		{
 			ctx->trialV = ctx->loboV;
@@ -1075,7 +1296,7 @@ int go_through_all(struct libsimul_ctx *ctx, int recalc_loop)
 	}
 	if (ctx->xformerstate == STATE_HIBO)
 	{
-		ctx->hiboV = ctx->elements_used[ctx->xformerid]->Vmax;
+		ctx->hiboV = ctx->circuit->elements_used[ctx->xformerid]->Vmax;
 		set_transformer_voltage(ctx, ctx->xformerid, ctx->hiboV);
 		ctx->xformerstate = STATE_HIBOPOST;
 		return ERR_HAVE_TO_SIMULATE_AGAIN_TRANSFORMER;
@@ -1084,8 +1305,8 @@ int go_through_all(struct libsimul_ctx *ctx, int recalc_loop)
 	{
 		int l, h;
 		ctx->hibophi = get_transformer_trial_phi_single(ctx, ctx->xformerid);
-		l = double_cmp(ctx->lobophi, ctx->elements_used[ctx->xformerid]->cur_phi_single);
-		h = double_cmp(ctx->hibophi, ctx->elements_used[ctx->xformerid]->cur_phi_single);
+		l = double_cmp(ctx->lobophi, ctx->state[ctx->xformerid].cur_phi_single);
+		h = double_cmp(ctx->hibophi, ctx->state[ctx->xformerid].cur_phi_single);
 		if (h == 0)
 		{
 			ctx->trialV = ctx->hiboV;
@@ -1097,7 +1318,7 @@ int go_through_all(struct libsimul_ctx *ctx, int recalc_loop)
 		{
 			const double arbitrary_threshold = 1e-12;
 			const double cur_phi_single =
-				ctx->elements_used[ctx->xformerid]->cur_phi_single;
+				ctx->state[ctx->xformerid].cur_phi_single;
 			if (fabs(cur_phi_single) < arbitrary_threshold)
 			{
 				if (fabs(ctx->lobophi) < arbitrary_threshold ||
@@ -1116,11 +1337,10 @@ int go_through_all(struct libsimul_ctx *ctx, int recalc_loop)
 					return ERR_HAVE_TO_SIMULATE_AGAIN_TRANSFORMER;
 				}
 			}
-			fprintf(stderr, "Cur phi single: %g\n", ctx->elements_used[ctx->xformerid]->cur_phi_single);
-			fprintf(stderr, "Lobo phi: %g\n", ctx->lobophi);
-			fprintf(stderr, "Hibo phi: %g\n", ctx->hibophi);
-			fprintf(stderr, "Transformer out of voltage bounds\n");
-			exit(1);
+			return libsimul_fail(ctx, ERR_NOT_CONVERGED,
+				"Transformer %s out of voltage bounds: cur phi %g, lobo phi %g, hibo phi %g",
+				ctx->circuit->elements_used[ctx->xformerid]->name,
+				ctx->state[ctx->xformerid].cur_phi_single, ctx->lobophi, ctx->hibophi);
 		}
 		ctx->xformerstate = STATE_ITER;
 	}
@@ -1129,9 +1349,9 @@ int go_through_all(struct libsimul_ctx *ctx, int recalc_loop)
 		int l, h, t;
 		double iterphi;
 		iterphi = get_transformer_trial_phi_single(ctx, ctx->xformerid);
-		l = double_cmp(ctx->lobophi, ctx->elements_used[ctx->xformerid]->cur_phi_single);
-		h = double_cmp(ctx->hibophi, ctx->elements_used[ctx->xformerid]->cur_phi_single);
-		t = double_cmp(iterphi, ctx->elements_used[ctx->xformerid]->cur_phi_single);
+		l = double_cmp(ctx->lobophi, ctx->state[ctx->xformerid].cur_phi_single);
+		h = double_cmp(ctx->hibophi, ctx->state[ctx->xformerid].cur_phi_single);
+		t = double_cmp(iterphi, ctx->state[ctx->xformerid].cur_phi_single);
 		if (fabs(ctx->hiboV - ctx->loboV) < 1e-9)
 		{
 			//set_transformer_voltage(ctx, ctx->xformerid, trialV);
@@ -1156,7 +1376,8 @@ int go_through_all(struct libsimul_ctx *ctx, int recalc_loop)
 			}
 			else
 			{
-				abort();
+				return libsimul_fail(ctx, ERR_NOT_CONVERGED, "Transformer %s voltage search failed",
+					ctx->circuit->elements_used[ctx->xformerid]->name);
 			}
 		}
 		else if (l > 0 && h < 0)
@@ -1171,12 +1392,14 @@ int go_through_all(struct libsimul_ctx *ctx, int recalc_loop)
 			}
 			else
 			{
-				abort();
+				return libsimul_fail(ctx, ERR_NOT_CONVERGED, "Transformer %s voltage search failed",
+					ctx->circuit->elements_used[ctx->xformerid]->name);
 			}
 		}
 		else
 		{
-			abort();
+			return libsimul_fail(ctx, ERR_NOT_CONVERGED, "Transformer %s voltage search failed",
+				ctx->circuit->elements_used[ctx->xformerid]->name);
 		}
 		ctx->xformerstate = STATE_ITER;
 	}
@@ -1196,6 +1419,43 @@ int go_through_all(struct libsimul_ctx *ctx, int recalc_loop)
 	return 0;
 }
 
+void init_element_state(const struct element *el, struct element_state *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->current_switch_state_is_closed = 1;
+	st->V = el->V;
+	if (el->typ == TYPE_VOLTAGE)
+	{
+		st->I_src = el->V/el->R;
+	}
+	if (el->typ == TYPE_CAPACITOR)
+	{
+		st->I_src = el->Vinit/el->R;
+	}
+	if (el->typ == TYPE_INDUCTOR)
+	{
+		st->I_src = el->Iinit;
+	}
+}
+
+struct element_dup {
+	enum element_type typ;
+	int primary;
+};
+
+// Windings of the same transformer share a name, anything else is a
+// duplicate
+static int element_conflicts(const struct element *el, void *arg)
+{
+	const struct element_dup *dup = arg;
+	if ((el->typ == TYPE_TRANSFORMER || el->typ == TYPE_TRANSFORMER_DIRECT) &&
+	    el->typ == dup->typ && !(el->primary && dup->primary))
+	{
+		return 0;
+	}
+	return 1;
+}
+
 int add_element_used(struct libsimul_ctx *ctx, const char *element, int n1, int n2, enum element_type typ,
 	double V,
 	double Vinit,
@@ -1214,7 +1474,7 @@ int add_element_used(struct libsimul_ctx *ctx, const char *element, int n1, int
 	double Is,
 	double Iaccuracy)
 {
-	size_t i;
+	struct element_dup dup;
 	struct element *el;
 
 	if (typ == TYPE_INDUCTOR && L <= 0)
@@ -1243,38 +1503,54 @@ int add_element_used(struct libsimul_ctx *ctx, const char *element, int n1, int
 		exit(1);
 	}
 
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	dup.typ = typ;
+	dup.primary = primary;
+	if (nametab_foreach(ctx->circuit, element, element_conflicts, &dup))
+	{
+		fprintf(stderr, "Element %s already used\n", element);
+		exit(1);
+	}
+	netlist_unshare(ctx);
+	ctx->circuit->floating_found = 0;
+	if (typ == TYPE_TRANSFORMER || typ == TYPE_TRANSFORMER_DIRECT)
 	{
-		if (strcmp(ctx->elements_used[i]->name, element) == 0)
+		ctx->circuit->windings_grouped = 0;
+	}
+	if (ctx->circuit->elements_used_sz >= ctx->circuit->elements_used_cap || ctx->circuit->elements_used == NULL)
+	{
+		struct element **new_eu;
+		size_t new_cap = 2*ctx->circuit->elements_used_sz+16;
+		new_eu = realloc(ctx->circuit->elements_used, sizeof(*ctx->circuit->elements_used)*new_cap);
+		if (new_eu == NULL)
 		{
-			if (ctx->elements_used[i]->typ == TYPE_TRANSFORMER && typ == TYPE_TRANSFORMER && !(ctx->elements_used[i]->primary && primary))
-			{
-				continue;
-			}
-			if (ctx->elements_used[i]->typ == TYPE_TRANSFORMER_DIRECT && typ == TYPE_TRANSFORMER_DIRECT && !(ctx->elements_used[i]->primary && primary))
-			{
-				continue;
-			}
-			fprintf(stderr, "Element %s already used\n", element);
+			fprintf(stderr, "Out of memory\n");
 			exit(1);
 		}
+		ctx->circuit->elements_used = new_eu;
+		ctx->circuit->elements_used_cap = new_cap;
 	}
-	if (ctx->elements_used_sz >= ctx->elements_used_cap || ctx->elements_used == NULL)
+	if (ctx->circuit->elements_used_sz >= ctx->state_cap || ctx->state == NULL)
 	{
-		struct element **new_eu;
-		size_t new_cap = 2*ctx->elements_used_sz+16;
-		new_eu = realloc(ctx->elements_used, sizeof(*ctx->elements_used)*new_cap);
-		if (new_eu == NULL)
+		struct element_state *new_st;
+		size_t new_cap = 2*ctx->circuit->elements_used_sz+16;
+		new_st = realloc(ctx->state, sizeof(*ctx->state)*new_cap);
+		if (new_st == NULL)
 		{
 			fprintf(stderr, "Out of memory\n");
 			exit(1);
 		}
-		ctx->elements_used = new_eu;
-		ctx->elements_used_cap = new_cap;
+		ctx->state = new_st;
+		ctx->state_cap = new_cap;
+	}
+	el = malloc(sizeof(**ctx->circuit->elements_used));
+	if (el == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
 	}
-	el = malloc(sizeof(**ctx->elements_used));
-	ctx->elements_used[ctx->elements_used_sz] = el;
+	ctx->circuit->elements_used[ctx->circuit->elements_used_sz] = el;
 	el->name = strdup(element);
+	el->idx = ctx->circuit->elements_used_sz;
 	el->n1 = n1;
 	el->n2 = n2;
 	el->typ = typ;
@@ -1284,7 +1560,6 @@ int add_element_used(struct libsimul_ctx *ctx, const char *element, int n1, int
 	el->L = L;
 	el->R = R;
 	el->C = C;
-	el->I_src = 0;
 	el->N = N;
 	el->Vmin = Vmin;
 	el->Vmax = Vmax;
@@ -1294,46 +1569,44 @@ int add_element_used(struct libsimul_ctx *ctx, const char *element, int n1, int
 	el->allptrs = NULL;
 	el->allptrs_size = 0;
 	el->allptrs_capacity = 0;
-	el->cur_phi_single = 0;
-	el->dphi_single = 0;
 	el->transformer_direct_denom = 0;
-	el->transformer_direct_const = 0;
-	el->current_switch_state_is_closed = 1;
 	el->diode_threshold = diode_threshold;
 	el->on_recalc = on_recalc;
 	el->I_s = Is;
 	el->I_accuracy = Iaccuracy;
 	el->V_T = VT;
-	el->V_across_diode = 0;
-	if (typ == TYPE_VOLTAGE)
-	{
-		el->I_src = V/R;
-	}
-	if (typ == TYPE_CAPACITOR)
-	{
-		el->I_src = Vinit/R;
-	}
-	if (typ == TYPE_INDUCTOR)
+	init_element_state(el, &ctx->state[el->idx]);
+	ctx->circuit->elements_used_sz++;
+	if (el->name == NULL || nametab_insert(ctx->circuit, el->idx) != 0)
 	{
-		el->I_src = Iinit;
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
 	}
-	ctx->elements_used_sz++;
 	if (typ == TYPE_SHOCKLEY_DIODE)
 	{
-		ctx->has_shockley = 1;
+		ctx->circuit->has_shockley = 1;
 	}
 	return 0;
 }
 
-void check_at_most_one_transformer(struct libsimul_ctx *ctx)
+// Groups the windings of the transformer, -ERR_NO_MEMORY if out of memory
+int check_at_most_one_transformer(struct libsimul_ctx *ctx)
 {
-	const size_t elements_used_sz = ctx->elements_used_sz;
+	const size_t elements_used_sz = ctx->circuit->elements_used_sz;
 	size_t i;
 	size_t j;
 	int cnt = 0;
+	if (ctx->circuit->windings_grouped)
+	{
+		return 0;
+	}
+	if (libsimul_unshare(ctx) != 0)
+	{
+		return -ERR_NO_MEMORY;
+	}
 	for (i = 0; i < elements_used_sz; i++)
 	{
-		if (ctx->elements_used[i]->typ == TYPE_TRANSFORMER && ctx->elements_used[i]->primary)
+		if (ctx->circuit->elements_used[i]->typ == TYPE_TRANSFORMER && ctx->circuit->elements_used[i]->primary)
 		{
 			cnt++;
 		}
@@ -1343,66 +1616,60 @@ void check_at_most_one_transformer(struct libsimul_ctx *ctx)
 		fprintf(stderr, "Can have at most one transformer.\n");
 		exit(1);
 	}
+	// Windings are appended to their primary in element order
 	for (i = 0; i < elements_used_sz; i++)
 	{
-		if (ctx->elements_used[i]->typ == TYPE_TRANSFORMER)
+		struct element *winding = ctx->circuit->elements_used[i];
+		struct element *primary;
+		// Grouped by an earlier call if elements were added since
+		if ((winding->typ != TYPE_TRANSFORMER && winding->typ != TYPE_TRANSFORMER_DIRECT) ||
+		    winding->primaryptr != NULL)
 		{
-			for (j = 0; j < elements_used_sz; j++)
-			{
-				if (ctx->elements_used[j]->typ == TYPE_TRANSFORMER && ctx->elements_used[j]->primary && strcmp(ctx->elements_used[i]->name, ctx->elements_used[j]->name) == 0)
-				{
-					ctx->elements_used[i]->primaryptr = ctx->elements_used[j];
-					if (ctx->elements_used[j]->allptrs == NULL || ctx->elements_used[j]->allptrs_size >= ctx->elements_used[j]->allptrs_capacity)
-					{
-						struct element **sec2;
-						size_t new_cap = ctx->elements_used[j]->allptrs_size*2+16;
-						sec2 = realloc(ctx->elements_used[j]->allptrs, sizeof(*sec2)*new_cap);
-						if (sec2 == NULL)
-						{
-							fprintf(stderr, "Out of memory\n");
-							exit(1);
-						}
-						ctx->elements_used[j]->allptrs = sec2;
-					}
-					ctx->elements_used[j]->allptrs[ctx->elements_used[j]->allptrs_size++] = ctx->elements_used[i];
-				}
-			}
+			continue;
 		}
-	}
-	for (i = 0; i < elements_used_sz; i++)
-	{
-		if (ctx->elements_used[i]->typ == TYPE_TRANSFORMER_DIRECT)
+		j = libsimul_find_element(ctx->circuit, winding->name);
+		primary = ctx->circuit->elements_used[j];
+		if (primary->typ != winding->typ || !primary->primary)
 		{
-			for (j = 0; j < elements_used_sz; j++)
+			continue;
+		}
+		winding->primaryptr = primary;
+		if (primary->allptrs == NULL || primary->allptrs_size >= primary->allptrs_capacity)
+		{
+			struct element **sec2;
+			size_t new_cap = primary->allptrs_size*2+16;
+			sec2 = realloc(primary->allptrs, sizeof(*sec2)*new_cap);
+			if (sec2 == NULL)
 			{
-				if (ctx->elements_used[j]->typ == TYPE_TRANSFORMER_DIRECT && ctx->elements_used[j]->primary && strcmp(ctx->elements_used[i]->name, ctx->elements_used[j]->name) == 0)
-				{
-					ctx->elements_used[i]->primaryptr = ctx->elements_used[j];
-					if (ctx->elements_used[j]->allptrs == NULL || ctx->elements_used[j]->allptrs_size >= ctx->elements_used[j]->allptrs_capacity)
-					{
-						struct element **sec2;
-						size_t new_cap = ctx->elements_used[j]->allptrs_size*2+16;
-						sec2 = realloc(ctx->elements_used[j]->allptrs, sizeof(*sec2)*new_cap);
-						if (sec2 == NULL)
-						{
-							fprintf(stderr, "Out of memory\n");
-							exit(1);
-						}
-						ctx->elements_used[j]->allptrs = sec2;
-					}
-					ctx->elements_used[j]->allptrs[ctx->elements_used[j]->allptrs_size++] = ctx->elements_used[i];
-				}
+				// Grouping continues after the windings already grouped
+				// when called again
+				winding->primaryptr = NULL;
+				return -ERR_NO_MEMORY;
 			}
+			primary->allptrs = sec2;
+			primary->allptrs_capacity = new_cap;
 		}
+		primary->allptrs[primary->allptrs_size++] = winding;
 	}
-	for (i = 0; i < elements_used_sz; i++)
+	transformer_direct_denoms(ctx->circuit);
+	ctx->circuit->windings_grouped = 1;
+	return 0;
+}
+
+// Denominators of the direct transformers of grouped windings, again after
+// turns ratios or resistances have changed
+void transformer_direct_denoms(struct libsimul_circuit *c)
+{
+	size_t i, j;
+	for (i = 0; i < c->elements_used_sz; i++)
 	{
-		if (ctx->elements_used[i]->typ == TYPE_TRANSFORMER_DIRECT && ctx->elements_used[i]->primary)
+		if (c->elements_used[i]->typ == TYPE_TRANSFORMER_DIRECT && c->elements_used[i]->primary)
 		{
-			struct element *primary = ctx->elements_used[i];
-			for (j = 0; j < ctx->elements_used[i]->allptrs_size; j++)
+			struct element *primary = c->elements_used[i];
+			primary->transformer_direct_denom = 0;
+			for (j = 0; j < primary->allptrs_size; j++)
 			{
-				struct element *winding = ctx->elements_used[i]->allptrs[j];
+				struct element *winding = primary->allptrs[j];
 				// For three-winding transformer:
 				// denom = (N_3/N_1*N_3/N_1*1/R_3 + N_2/N_1*N_2/N_1*1/R_2 + N_1/N_1*N_1/N_1*1/R_1)
 				primary->transformer_direct_denom +=
@@ -1412,468 +1679,546 @@ void check_at_most_one_transformer(struct libsimul_ctx *ctx)
 	}
 }
 
-void read_file(struct libsimul_ctx *ctx, const char *fname)
+// Value of the element being read
+static double element_value(struct libsimul_ctx *ctx, const char *val, size_t off, enum libsimul_param_check check)
 {
-	char *line = NULL;
-	size_t linesz = 0;
-	FILE *f;
-	f = fopen(fname, "r");
-	if (f == NULL)
+	return netlist_value(ctx, val, PARAM_ELEMENT, ctx->circuit->elements_used_sz, off, check);
+}
+
+// Parses one line of a netlist, without comments
+void read_netlist_line(struct libsimul_ctx *ctx, char *line)
+{
+	int has_more;
+	enum element_type typ;
+	int n1, n2;
+	char *first, *second, *third, *endptr;
+	char *lineptr;
+	char typch;
+	size_t sp;
+	int has_voltage = 0;
+	double R = 0;
+	double V = 0;
+	int has_vmin = 0, has_vmax = 0;
+	double L = 0;
+	double C = 0;
+	double Vinit = 0;
+	double Iinit = 0;
+	double N = 0;
+	double Vmin = 0;
+	double Vmax = 0;
+	int primary = 0;
+	int on_recalc = -1;
+	double Lbase = 0;
+	double diode_threshold = 0;
+	double Is = 1e-12;
+	double VT = 26e-3;
+	double Iaccuracy = 1e-6;
+	if (iswhiteonly(line))
 	{
-		fprintf(stderr, "Can't open file %s\n", fname);
-		exit(1);
+		return;
 	}
-	while (!feof(f)) {
-		int ret;
-		int has_more;
-		long ln1, ln2;
-		enum element_type typ;
-		int n1, n2;
-		char *first, *second, *third, *endptr;
-		char *lineptr;
-		size_t sp;
-		int has_voltage = 0;
-		double R = 0;
-		double V = 0;
-		int has_vmin = 0, has_vmax = 0;
-		double L = 0;
-		double C = 0;
-		double Vinit = 0;
-		double Iinit = 0;
-		double N = 0;
-		double Vmin = 0;
-		double Vmax = 0;
-		int primary = 0;
-		int on_recalc = -1;
-		double Lbase = 0;
-		double diode_threshold = 0;
-		double Is = 1e-12;
-		double VT = 26e-3;
-		double Iaccuracy = 1e-6;
-		ret = getline_strip_comment(f, &line, &linesz);
-		if (ret == -ERR_NO_DATA)
+	if (ctx->circuit->subckt_open != SIZE_MAX)
+	{
+		subckt_add_line(ctx, line);
+		return;
+	}
+	//printf("Line: %s\n", line);
+	lineptr = line;
+	first = lineptr + nonspaceoff(lineptr);
+	if (!*first)
+	{
+		fprintf(stderr, "Invalid line: %s\n", line);
+	}
+	sp = spaceoff(first);
+	if (!first[sp])
+	{
+		fprintf(stderr, "Invalid line: %s\n", line);
+	}
+	first[sp] = '\0';
+	lineptr = &first[sp+1];
+	if (*first == '.')
+	{
+		if (strcmp(first, ".pwm") == 0)
 		{
-			break;
+			pwm_read_directive(ctx, lineptr);
+			return;
 		}
-		if (ret == -ERR_NO_MEMORY)
+		if (strcmp(first, ".sine") == 0)
 		{
-			fprintf(stderr, "Out of memory\n");
-			exit(1);
-		}
-		if (ret != 0)
-		{
-			fprintf(stderr, "Unexpected error\n");
-			abort();
+			wave_read_directive(ctx, WAVE_SINE, lineptr);
+			return;
 		}
-		if (iswhiteonly(line))
+		if (strcmp(first, ".pulse") == 0)
 		{
-			continue;
+			wave_read_directive(ctx, WAVE_PULSE, lineptr);
+			return;
 		}
-		//printf("Line: %s\n", line);
-		lineptr = line;
-		first = lineptr + nonspaceoff(lineptr);
-		if (!*first)
+		if (strcmp(first, ".pwl") == 0)
 		{
-			fprintf(stderr, "Invalid line: %s\n", line);
+			wave_read_directive(ctx, WAVE_PWL, lineptr);
+			return;
 		}
-		sp = spaceoff(first);
-		if (!first[sp])
+		if (strcmp(first, ".ctl") == 0)
 		{
-			fprintf(stderr, "Invalid line: %s\n", line);
+			ctl_read_directive(ctx, lineptr);
+			return;
 		}
-		first[sp] = '\0';
-		lineptr = &first[sp+1];
-		second = lineptr + nonspaceoff(lineptr);
-		if (!*second)
+		if (strcmp(first, ".subckt") == 0)
 		{
-			fprintf(stderr, "Invalid line: %s\n", line);
+			subckt_read_directive(ctx, lineptr);
+			return;
 		}
-		sp = spaceoff(second);
-		if (!second[sp])
+		if (strcmp(first, ".inst") == 0)
 		{
-			fprintf(stderr, "Invalid line: %s\n", line);
+			subckt_read_instance(ctx, lineptr);
+			return;
 		}
-		second[sp] = '\0';
-		lineptr = &second[sp+1];
-		third = lineptr + nonspaceoff(lineptr);
-		if (!*third)
+		if (strcmp(first, ".param") == 0)
 		{
-			fprintf(stderr, "Invalid line: %s\n", line);
+			param_read_directive(ctx, lineptr);
+			return;
 		}
-		sp = spaceoff(third);
-		has_more = !!third[sp];
-		third[sp] = '\0';
-		lineptr = &third[sp+1];
-		ln1 = strtol(first, &endptr, 10);
-		if (ln1 < 0 || *first == '\0' || *endptr != '\0' || (long)(int)ln1 != ln1)
-		{
-			fprintf(stderr, "Not an int node: %ld\n", ln1);
+		fprintf(stderr, "Invalid directive: %s\n", first);
+		exit(1);
+	}
+	second = lineptr + nonspaceoff(lineptr);
+	if (!*second)
+	{
+		fprintf(stderr, "Invalid line: %s\n", line);
+	}
+	sp = spaceoff(second);
+	if (!second[sp])
+	{
+		fprintf(stderr, "Invalid line: %s\n", line);
+	}
+	second[sp] = '\0';
+	lineptr = &second[sp+1];
+	third = lineptr + nonspaceoff(lineptr);
+	if (!*third)
+	{
+		fprintf(stderr, "Invalid line: %s\n", line);
+	}
+	sp = spaceoff(third);
+	has_more = !!third[sp];
+	third[sp] = '\0';
+	lineptr = &third[sp+1];
+	// Named nodes are numbered when read_file() ends
+	n1 = node_parse(ctx, first);
+	n2 = node_parse(ctx, second);
+	if (n1 == n2)
+	{
+		fprintf(stderr, "Two same nodes %s %s for %s\n", first, second, third);
+		exit(1);
+	}
+	if (n1 >= 0)
+	{
+		mark_node_seen(ctx, n1);
+	}
+	if (n2 >= 0)
+	{
+		mark_node_seen(ctx, n2);
+	}
+	//printf("Mandatory tokens: %s %s %s\n", first, second, third);
+	// The type of elements of subcircuit instances, e.g. U1.L1, is the
+	// first letter of the last part of the name
+	typch = strrchr(third, '.') != NULL ? strrchr(third, '.')[1] : *third;
+	switch (typch)
+	{
+		case 'C':
+			//printf("It's a capacitor\n");
+			typ = TYPE_CAPACITOR;
+			break;
+		case 'L':
+			//printf("It's an inductor\n");
+			typ = TYPE_INDUCTOR;
+			break;
+		case 'V':
+			//printf("It's a voltage source\n");
+			typ = TYPE_VOLTAGE;
+			break;
+		case 'S':
+			//printf("It's a switch\n");
+			typ = TYPE_SWITCH;
+			break;
+		case 'D':
+			//printf("It's a diode\n");
+			typ = TYPE_DIODE;
+			break;
+		case 'd':
+			//printf("It's a Shockley diode\n");
+			typ = TYPE_SHOCKLEY_DIODE;
+			break;
+		case 'R':
+			//printf("It's a resistor\n");
+			typ = TYPE_RESISTOR;
+			break;
+		case 'T':
+			//printf("It's a transformer\n");
+			typ = TYPE_TRANSFORMER;
+			break;
+		case 'X':
+			//printf("It's a transformer\n");
+			typ = TYPE_TRANSFORMER_DIRECT;
+			break;
+		default:
+			fprintf(stderr, "Can't determine what %s is\n", third);
 			exit(1);
+	}
+	while (has_more)
+	{
+		char *more = lineptr + nonspaceoff(lineptr);
+		char *equals;
+		char *val;
+		if (!*more)
+		{
+			break;
 		}
-		ln2 = strtol(second, &endptr, 10);
-		if (ln2 < 0 || *first == '\0' || *endptr != '\0' || (long)(int)ln2 != ln2)
+		sp = spaceoff(more);
+		if (!more[sp])
 		{
-			fprintf(stderr, "Not an int node: %ld\n", ln2);
-			exit(1);
+			has_more = 0;
 		}
-		n1 = (int)ln1;
-		n2 = (int)ln2;
-		if (n1 == n2)
+		more[sp] = '\0';
+		lineptr = &more[sp+1];
+		//printf("Extra token: %s\n", more);
+		equals = strchr(more, '=');
+		if (equals == NULL)
 		{
-			fprintf(stderr, "Two same nodes %d %d for %s\n", n1, n2, third);
+			fprintf(stderr, "Extra token no equals sign\n");
 			exit(1);
 		}
-		mark_node_seen(ctx, n1);
-		mark_node_seen(ctx, n2);
-		//printf("Mandatory tokens: %s %s %s\n", first, second, third);
-		switch (*third)
+		*equals = '\0';
+		val = &equals[1];
+		if (strcmp(more, "R") == 0)
 		{
-			case 'C':
-				//printf("It's a capacitor\n");
-				typ = TYPE_CAPACITOR;
-				break;
-			case 'L':
-				//printf("It's an inductor\n");
-				typ = TYPE_INDUCTOR;
-				break;
-			case 'V':
-				//printf("It's a voltage source\n");
-				typ = TYPE_VOLTAGE;
-				break;
-			case 'S':
-				//printf("It's a switch\n");
-				typ = TYPE_SWITCH;
-				break;
-			case 'D':
-				//printf("It's a diode\n");
-				typ = TYPE_DIODE;
-				break;
-			case 'd':
-				//printf("It's a Shockley diode\n");
-				typ = TYPE_SHOCKLEY_DIODE;
-				break;
-			case 'R':
-				//printf("It's a resistor\n");
-				typ = TYPE_RESISTOR;
-				break;
-			case 'T':
-				//printf("It's a transformer\n");
-				typ = TYPE_TRANSFORMER;
-				break;
-			case 'X':
-				//printf("It's a transformer\n");
-				typ = TYPE_TRANSFORMER_DIRECT;
-				break;
-			default:
-				fprintf(stderr, "Can't determine what %s is\n", third);
+			R = element_value(ctx, val, offsetof(struct element, R), PARAM_POSITIVE);
+			if (R <= 0)
+			{
+				fprintf(stderr, "Invalid resistance: %lf\n", R);
 				exit(1);
+			}
 		}
-		while (has_more)
+		else if (strcmp(more, "C") == 0)
 		{
-			char *more = lineptr + nonspaceoff(lineptr);
-			char *equals;
-			char *val;
-			if (!*more)
-			{
-				break;
-			}
-			sp = spaceoff(more);
-			if (!more[sp])
+			if (typ != TYPE_CAPACITOR)
 			{
-				has_more = 0;
+				fprintf(stderr, "Only capacitors have capacitance\n");
+				exit(1);
 			}
-			more[sp] = '\0';
-			lineptr = &more[sp+1];
-			//printf("Extra token: %s\n", more);
-			equals = strchr(more, '=');
-			if (equals == NULL)
+			C = element_value(ctx, val, offsetof(struct element, C), PARAM_POSITIVE);
+			if (C <= 0)
 			{
-				fprintf(stderr, "Extra token no equals sign\n");
+				fprintf(stderr, "Invalid capacitance: %lf\n", C);
 				exit(1);
 			}
-			*equals = '\0';
-			val = &equals[1];
-			if (strcmp(more, "R") == 0)
+		}
+		else if (strcmp(more, "L") == 0)
+		{
+			if (typ != TYPE_INDUCTOR)
 			{
-				R = strtod(val, &endptr);
-				if (R <= 0)
-				{
-					fprintf(stderr, "Invalid resistance: %lf\n", R);
-					exit(1);
-				}
+				fprintf(stderr, "Only inductors have inductance\n");
+				exit(1);
 			}
-			else if (strcmp(more, "C") == 0)
+			L = element_value(ctx, val, offsetof(struct element, L), PARAM_POSITIVE);
+			if (L <= 0)
 			{
-				if (typ != TYPE_CAPACITOR)
-				{
-					fprintf(stderr, "Only capacitors have capacitance\n");
-					exit(1);
-				}
-				C = strtod(val, &endptr);
-				if (C <= 0)
-				{
-					fprintf(stderr, "Invalid capacitance: %lf\n", C);
-					exit(1);
-				}
+				fprintf(stderr, "Invalid inductance: %lf\n", L);
+				exit(1);
 			}
-			else if (strcmp(more, "L") == 0)
+		}
+		else if (strcmp(more, "V") == 0)
+		{
+			if (typ != TYPE_VOLTAGE)
 			{
-				if (typ != TYPE_INDUCTOR)
-				{
-					fprintf(stderr, "Only inductors have inductance\n");
-					exit(1);
-				}
-				L = strtod(val, &endptr);
-				if (L <= 0)
-				{
-					fprintf(stderr, "Invalid inductance: %lf\n", L);
-					exit(1);
-				}
+				fprintf(stderr, "Only voltage sources have voltage\n");
+				exit(1);
 			}
-			else if (strcmp(more, "V") == 0)
+			V = element_value(ctx, val, offsetof(struct element, V), PARAM_ANY);
+			has_voltage = 1;
+		}
+		else if (strcmp(more, "Vinit") == 0)
+		{
+			if (typ != TYPE_CAPACITOR)
 			{
-				if (typ != TYPE_VOLTAGE)
-				{
-					fprintf(stderr, "Only voltage sources have voltage\n");
-					exit(1);
-				}
-				V = strtod(val, &endptr);
-				has_voltage = 1;
+				fprintf(stderr, "Only capacitors have initial voltage\n");
+				exit(1);
 			}
-			else if (strcmp(more, "Vinit") == 0)
+			Vinit = element_value(ctx, val, offsetof(struct element, Vinit), PARAM_ANY);
+		}
+		else if (strcmp(more, "Iinit") == 0)
+		{
+			if (typ != TYPE_INDUCTOR)
 			{
-				if (typ != TYPE_CAPACITOR)
-				{
-					fprintf(stderr, "Only capacitors have initial voltage\n");
-					exit(1);
-				}
-				Vinit = strtod(val, &endptr);
+				fprintf(stderr, "Only inductors have initial current\n");
+				exit(1);
 			}
-			else if (strcmp(more, "Iinit") == 0)
+			Iinit = element_value(ctx, val, offsetof(struct element, Iinit), PARAM_ANY);
+		}
+		else if (strcmp(more, "N") == 0)
+		{
+			if (typ != TYPE_TRANSFORMER && typ != TYPE_TRANSFORMER_DIRECT)
 			{
-				if (typ != TYPE_INDUCTOR)
-				{
-					fprintf(stderr, "Only inductors have initial current\n");
-					exit(1);
-				}
-				Iinit = strtod(val, &endptr);
+				fprintf(stderr, "Only transformers have turns ratios\n");
+				exit(1);
 			}
-			else if (strcmp(more, "N") == 0)
+			N = element_value(ctx, val, offsetof(struct element, N), PARAM_POSITIVE);
+			if (N <= 0)
 			{
-				if (typ != TYPE_TRANSFORMER && typ != TYPE_TRANSFORMER_DIRECT)
-				{
-					fprintf(stderr, "Only transformers have turns ratios\n");
-					exit(1);
-				}
-				N = strtod(val, &endptr);
-				if (N <= 0)
-				{
-					fprintf(stderr, "Invalid turns ratio: %lf\n", N);
-					exit(1);
-				}
+				fprintf(stderr, "Invalid turns ratio: %lf\n", N);
+				exit(1);
 			}
-			else if (strcmp(more, "Lbase") == 0)
+		}
+		else if (strcmp(more, "Lbase") == 0)
+		{
+			if (typ != TYPE_TRANSFORMER && typ != TYPE_TRANSFORMER_DIRECT)
 			{
-				if (typ != TYPE_TRANSFORMER && typ != TYPE_TRANSFORMER_DIRECT)
-				{
-					fprintf(stderr, "Only transformers have base inductance\n");
-					exit(1);
-				}
-				Lbase = strtod(val, &endptr);
-				if (Lbase <= 0)
-				{
-					fprintf(stderr, "Invalid base inductance: %lf\n", Lbase);
-					exit(1);
-				}
+				fprintf(stderr, "Only transformers have base inductance\n");
+				exit(1);
 			}
-			else if (strcmp(more, "primary") == 0)
+			Lbase = element_value(ctx, val, offsetof(struct element, Lbase), PARAM_POSITIVE);
+			if (Lbase <= 0)
 			{
-				long lprimary;
-				if (typ != TYPE_TRANSFORMER && typ != TYPE_TRANSFORMER_DIRECT)
-				{
-					fprintf(stderr, "Only transformers have primary and secondary windings\n");
-					exit(1);
-				}
-				lprimary = strtol(val, &endptr, 10);
-				if (lprimary != 0 && lprimary != 1)
-				{
-					fprintf(stderr, "Valid values for primary are 0 and 1\n");
-					exit(1);
-				}
-				primary = !!lprimary;
+				fprintf(stderr, "Invalid base inductance: %lf\n", Lbase);
+				exit(1);
 			}
-			else if (strcmp(more, "Vmin") == 0)
+		}
+		else if (strcmp(more, "primary") == 0)
+		{
+			long lprimary;
+			if (typ != TYPE_TRANSFORMER && typ != TYPE_TRANSFORMER_DIRECT)
 			{
-				//if (typ != TYPE_TRANSFORMER)
-				if (typ != TYPE_TRANSFORMER && typ != TYPE_TRANSFORMER_DIRECT)
-				{
-					fprintf(stderr, "Only transformers have minimum search voltage\n");
-					exit(1);
-				}
-				Vmin = strtod(val, &endptr);
-				has_vmin = 1;
+				fprintf(stderr, "Only transformers have primary and secondary windings\n");
+				exit(1);
 			}
-			else if (strcmp(more, "Vmax") == 0)
+			lprimary = strtol(val, &endptr, 10);
+			if (lprimary != 0 && lprimary != 1)
 			{
-				//if (typ != TYPE_TRANSFORMER)
-				if (typ != TYPE_TRANSFORMER && typ != TYPE_TRANSFORMER_DIRECT && typ != TYPE_SHOCKLEY_DIODE)
-				{
-					fprintf(stderr, "Only transformers and Shockley diodes have maximum search voltage\n");
-					exit(1);
-				}
-				Vmax = strtod(val, &endptr);
-				has_vmax = 1;
+				fprintf(stderr, "Valid values for primary are 0 and 1\n");
+				exit(1);
 			}
-			else if (strcmp(more, "diode_threshold") == 0)
+			primary = !!lprimary;
+		}
+		else if (strcmp(more, "Vmin") == 0)
+		{
+			//if (typ != TYPE_TRANSFORMER)
+			if (typ != TYPE_TRANSFORMER && typ != TYPE_TRANSFORMER_DIRECT)
 			{
-				if (typ != TYPE_DIODE)
-				{
-					fprintf(stderr, "Only diodes have threshold\n");
-					exit(1);
-				}
-				diode_threshold = strtod(val, &endptr);
-				if (diode_threshold < 0)
-				{
-					fprintf(stderr, "Invalid diode threshold: %lf\n", diode_threshold);
-					exit(1);
-				}
+				fprintf(stderr, "Only transformers have minimum search voltage\n");
+				exit(1);
 			}
-			else if (strcmp(more, "on_recalc") == 0)
+			Vmin = element_value(ctx, val, offsetof(struct element, Vmin), PARAM_ANY);
+			has_vmin = 1;
+		}
+		else if (strcmp(more, "Vmax") == 0)
+		{
+			//if (typ != TYPE_TRANSFORMER)
+			if (typ != TYPE_TRANSFORMER && typ != TYPE_TRANSFORMER_DIRECT && typ != TYPE_SHOCKLEY_DIODE)
 			{
-				long on_recalc_l;
-				if (typ != TYPE_DIODE)
-				{
-					fprintf(stderr, "Only diodes have on_recalc\n");
-					exit(1);
-				}
-				on_recalc_l = strtol(val, &endptr, 10);
-				if (on_recalc_l != 0 && on_recalc_l != 1)
-				{
-					fprintf(stderr, "Invalid on_recalc: %d\n", on_recalc);
-					exit(1);
-				}
-				on_recalc = on_recalc_l;
+				fprintf(stderr, "Only transformers and Shockley diodes have maximum search voltage\n");
+				exit(1);
 			}
-			else if (strcmp(more, "VT") == 0)
+			Vmax = element_value(ctx, val, offsetof(struct element, Vmax), PARAM_ANY);
+			has_vmax = 1;
+		}
+		else if (strcmp(more, "diode_threshold") == 0)
+		{
+			if (typ != TYPE_DIODE)
 			{
-				if (typ != TYPE_SHOCKLEY_DIODE)
-				{
-					fprintf(stderr, "Only Shockley diodes have thermal voltage");
-					exit(1);
-				}
-				VT = strtod(val, &endptr);
-				if (VT <= 0)
-				{
-					fprintf(stderr, "Invalid thermal voltage: %lf\n", VT);
-					exit(1);
-				}
+				fprintf(stderr, "Only diodes have threshold\n");
+				exit(1);
 			}
-			else if (strcmp(more, "Is") == 0)
+			diode_threshold = element_value(ctx, val, offsetof(struct element, diode_threshold), PARAM_NONNEGATIVE);
+			if (diode_threshold < 0)
 			{
-				if (typ != TYPE_SHOCKLEY_DIODE)
-				{
-					fprintf(stderr, "Only Shockley diodes have saturation current");
-					exit(1);
-				}
-				Is = strtod(val, &endptr);
-				if (Is <= 0)
-				{
-					fprintf(stderr, "Invalid saturation current: %lf\n", Is);
-					exit(1);
-				}
+				fprintf(stderr, "Invalid diode threshold: %lf\n", diode_threshold);
+				exit(1);
 			}
-			else if (strcmp(more, "Iaccuracy") == 0)
+		}
+		else if (strcmp(more, "on_recalc") == 0)
+		{
+			long on_recalc_l;
+			if (typ != TYPE_DIODE)
 			{
-				if (typ != TYPE_SHOCKLEY_DIODE)
-				{
-					fprintf(stderr, "Only Shockley diodes have current accuracy");
-					exit(1);
-				}
-				Iaccuracy = strtod(val, &endptr);
-				if (Iaccuracy <= 0)
-				{
-					fprintf(stderr, "Invalid current accuracy: %lf\n", Iaccuracy);
-					exit(1);
-				}
+				fprintf(stderr, "Only diodes have on_recalc\n");
+				exit(1);
 			}
-			else
+			on_recalc_l = strtol(val, &endptr, 10);
+			if (on_recalc_l != 0 && on_recalc_l != 1)
 			{
-				fprintf(stderr, "Invalid parameter: %s\n", more);
+				fprintf(stderr, "Invalid on_recalc: %d\n", on_recalc);
 				exit(1);
 			}
+			on_recalc = on_recalc_l;
 		}
-		if (typ == TYPE_VOLTAGE && !has_voltage)
-		{
-			fprintf(stderr, "Voltage source %s must have voltage\n", third);
-			exit(1);
-		}
-		if (typ == TYPE_TRANSFORMER && primary && !has_vmin)
-		{
-			fprintf(stderr, "Transformer primary %s must have minimum search voltage\n", third);
-			exit(1);
-		}
-		if (typ == TYPE_TRANSFORMER && primary && !has_vmax)
+		else if (strcmp(more, "VT") == 0)
 		{
-			fprintf(stderr, "Transformer primary %s must have maximum search voltage\n", third);
-			exit(1);
+			if (typ != TYPE_SHOCKLEY_DIODE)
+			{
+				fprintf(stderr, "Only Shockley diodes have thermal voltage");
+				exit(1);
+			}
+			VT = element_value(ctx, val, offsetof(struct element, V_T), PARAM_POSITIVE);
+			if (VT <= 0)
+			{
+				fprintf(stderr, "Invalid thermal voltage: %lf\n", VT);
+				exit(1);
+			}
 		}
-		if (typ == TYPE_SHOCKLEY_DIODE && !has_vmax)
+		else if (strcmp(more, "Is") == 0)
 		{
-			Vmax = 1.5; // default value
+			if (typ != TYPE_SHOCKLEY_DIODE)
+			{
+				fprintf(stderr, "Only Shockley diodes have saturation current");
+				exit(1);
+			}
+			Is = element_value(ctx, val, offsetof(struct element, I_s), PARAM_POSITIVE);
+			if (Is <= 0)
+			{
+				fprintf(stderr, "Invalid saturation current: %lf\n", Is);
+				exit(1);
+			}
 		}
-		if ((typ == TYPE_TRANSFORMER || typ == TYPE_TRANSFORMER_DIRECT) && primary && Lbase <= 0)
+		else if (strcmp(more, "Iaccuracy") == 0)
 		{
-			fprintf(stderr, "Transformer primary %s must have base inductance\n", third);
-			exit(1);
+			if (typ != TYPE_SHOCKLEY_DIODE)
+			{
+				fprintf(stderr, "Only Shockley diodes have current accuracy");
+				exit(1);
+			}
+			Iaccuracy = element_value(ctx, val, offsetof(struct element, I_accuracy), PARAM_POSITIVE);
+			if (Iaccuracy <= 0)
+			{
+				fprintf(stderr, "Invalid current accuracy: %lf\n", Iaccuracy);
+				exit(1);
+			}
 		}
-		if ((typ == TYPE_TRANSFORMER || typ == TYPE_TRANSFORMER_DIRECT) && !primary && has_vmin)
+		else
 		{
-			fprintf(stderr, "Transformer secondary %s must not have minimum search voltage\n", third);
+			fprintf(stderr, "Invalid parameter: %s\n", more);
 			exit(1);
 		}
-		if ((typ == TYPE_TRANSFORMER || typ == TYPE_TRANSFORMER_DIRECT) && !primary && has_vmax)
+	}
+	if (typ == TYPE_VOLTAGE && !has_voltage)
+	{
+		fprintf(stderr, "Voltage source %s must have voltage\n", third);
+		exit(1);
+	}
+	if (typ == TYPE_TRANSFORMER && primary && !has_vmin)
+	{
+		fprintf(stderr, "Transformer primary %s must have minimum search voltage\n", third);
+		exit(1);
+	}
+	if (typ == TYPE_TRANSFORMER && primary && !has_vmax)
+	{
+		fprintf(stderr, "Transformer primary %s must have maximum search voltage\n", third);
+		exit(1);
+	}
+	if (typ == TYPE_SHOCKLEY_DIODE && !has_vmax)
+	{
+		Vmax = 1.5; // default value
+	}
+	if ((typ == TYPE_TRANSFORMER || typ == TYPE_TRANSFORMER_DIRECT) && primary && Lbase <= 0)
+	{
+		fprintf(stderr, "Transformer primary %s must have base inductance\n", third);
+		exit(1);
+	}
+	if ((typ == TYPE_TRANSFORMER || typ == TYPE_TRANSFORMER_DIRECT) && !primary && has_vmin)
+	{
+		fprintf(stderr, "Transformer secondary %s must not have minimum search voltage\n", third);
+		exit(1);
+	}
+	if ((typ == TYPE_TRANSFORMER || typ == TYPE_TRANSFORMER_DIRECT) && !primary && has_vmax)
+	{
+		fprintf(stderr, "Transformer secondary %s must not have maximum search voltage\n", third);
+		exit(1);
+	}
+	if ((typ == TYPE_TRANSFORMER || typ == TYPE_TRANSFORMER_DIRECT) && !primary && Lbase > 0)
+	{
+		fprintf(stderr, "Transformer secondary %s must not have base inductance\n", third);
+		exit(1);
+	}
+	if ((typ == TYPE_TRANSFORMER || typ == TYPE_TRANSFORMER_DIRECT) && N <= 0)
+	{
+		fprintf(stderr, "Transformer %s must have turns ratio\n", third);
+		exit(1);
+	}
+	add_element_used(ctx, third, n1, n2, typ,
+		V,
+		Vinit,
+		Iinit,
+		L,
+		R,
+		C,
+		N,
+		Vmin,
+		Vmax,
+		Lbase,
+		primary,
+		diode_threshold,
+		on_recalc,
+		VT,
+		Is,
+		Iaccuracy);
+}
+
+void read_file(struct libsimul_ctx *ctx, const char *fname)
+{
+	char *line = NULL;
+	size_t linesz = 0;
+	size_t first;
+	struct netlist_src src;
+	if (netlist_open(&src, fname) != 0)
+	{
+		fprintf(stderr, "Can't open file %s\n", fname);
+		exit(1);
+	}
+	for (;;) {
+		int ret;
+		ret = netlist_getline(&src, &line, &linesz);
+		if (ret == -ERR_NO_DATA)
 		{
-			fprintf(stderr, "Transformer secondary %s must not have maximum search voltage\n", third);
-			exit(1);
+			break;
 		}
-		if ((typ == TYPE_TRANSFORMER || typ == TYPE_TRANSFORMER_DIRECT) && !primary && Lbase > 0)
+		if (ret == -ERR_NO_MEMORY)
 		{
-			fprintf(stderr, "Transformer secondary %s must not have base inductance\n", third);
+			fprintf(stderr, "Out of memory\n");
 			exit(1);
 		}
-		if ((typ == TYPE_TRANSFORMER || typ == TYPE_TRANSFORMER_DIRECT) && N <= 0)
+		if (ret != 0)
 		{
-			fprintf(stderr, "Transformer %s must have turns ratio\n", third);
-			exit(1);
+			fprintf(stderr, "Unexpected error\n");
+			abort();
 		}
-		add_element_used(ctx, third, n1, n2, typ,
-			V,
-			Vinit,
-			Iinit,
-			L,
-			R,
-			C,
-			N,
-			Vmin,
-			Vmax,
-			Lbase,
-			primary,
-			diode_threshold,
-			on_recalc,
-			VT,
-			Is,
-			Iaccuracy);
-	}
-	fclose(f);
+		read_netlist_line(ctx, line);
+	}
+	netlist_close(&src);
 	free(line);
+	first = nodes_number(ctx);
+	subckt_flatten(ctx);
+	nodes_check(ctx, first);
+	// Done here once, so that initializing the clones of this context
+	// doesn't have to modify the shared circuit
+	if (check_at_most_one_transformer(ctx) != 0 || partition_find_floating(ctx) != 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
 	linesz = 0;
 }
 
-void init_simulation(struct libsimul_ctx *ctx)
+// Returns 0 or -ERR_* with the message in libsimul_error() if the matrix
+// is singular or a control block, PWM or waveform can't be set up. The
+// netlist itself is checked by read_file().
+int init_simulation(struct libsimul_ctx *ctx)
 {
+	int ret;
+	nodes_check(ctx, nodes_number(ctx));
 	check_dense_nodes(ctx);
-	check_at_most_one_transformer(ctx);
-	ctx->nodecnt = ctx->node_seen_sz - 1;
+	if (check_at_most_one_transformer(ctx) != 0 || partition_find_floating(ctx) != 0)
+	{
+		return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
+	}
+	ctx->nodecnt = ctx->circuit->node_seen_sz - 1;
 	ctx->G_matrix = malloc(sizeof(*ctx->G_matrix)*ctx->nodecnt*ctx->nodecnt);
 	ctx->G_LU = malloc(sizeof(*ctx->G_LU)*ctx->nodecnt*ctx->nodecnt);
 	ctx->G_ipiv = malloc(sizeof(*ctx->G_ipiv)*ctx->nodecnt);
@@ -1882,87 +2227,402 @@ void init_simulation(struct libsimul_ctx *ctx)
 	if (ctx->G_matrix == NULL || ctx->G_LU == NULL || ctx->G_ipiv == NULL ||
 	    ctx->Isrc_vector == NULL || ctx->V_vector == NULL)
 	{
-		fprintf(stderr, "Out of memory\n");
-		exit(1);
+		return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
+	}
+	if ((ctx->circuit->floating_ref_cnt > 0 || ctx->circuit->bordercnt > 0) &&
+	    partition_init(ctx) != 0)
+	{
+		return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
 	}
 	form_g_matrix(ctx);
-	calc_lu(ctx);
+	ret = calc_lu(ctx);
+	if (ret == 0)
+	{
+		ret = pwm_init_simulation(ctx);
+	}
+	if (ret == 0)
+	{
+		ret = wave_init_simulation(ctx);
+	}
+	if (ret == 0)
+	{
+		ret = ctl_init_simulation(ctx);
+	}
+	return ret;
 }
 
-void recalc(struct libsimul_ctx *ctx)
+int recalc(struct libsimul_ctx *ctx)
 {
+	int ret;
+	ctx->needs_recalc = 0;
 	// If there is a Shockley diode, recalc will be done anyway
-	if (!ctx->has_shockley)
+	if (!ctx->circuit->has_shockley)
 	{
 		form_g_matrix(ctx);
-		calc_lu(ctx);
+		ret = calc_lu(ctx);
+		// The next step fails the same way instead of solving with
+		// the old decomposition
+		ctx->needs_recalc = ret != 0;
+		return ret;
 	}
+	return 0;
 }
 
-void simulation_step(struct libsimul_ctx *ctx)
+// Solves the circuit again until the diodes and transformers agree with the
+// solution
+static int simulation_solve(struct libsimul_ctx *ctx, int recalc_loop)
 {
 	size_t recalccnt = 0;
 	int status;
-	int recalc_loop = 0;
-	if (ctx->has_shockley)
-	{
-		form_g_matrix(ctx);
-		calc_lu(ctx);
-	}
-	form_isrc_vector(ctx);
-	calc_V(ctx);
 	while ((status = go_through_all(ctx, recalc_loop)) != 0)
 	{
+		int ret = 0;
+		if (status < 0)
+		{
+			return status;
+		}
 		//fprintf(stderr, "Recalc\n");
 		recalccnt++;
 		if (recalccnt == 1024)
 		{
 			//fprintf(stderr, "Recalc loop\n");
-			recalc_loop = 1;
-			break;
+			return ERR_HAVE_TO_SIMULATE_AGAIN;
 		}
-		if (status != ERR_HAVE_TO_SIMULATE_AGAIN_TRANSFORMER || ctx->has_shockley)
+		if (status != ERR_HAVE_TO_SIMULATE_AGAIN_TRANSFORMER || ctx->circuit->has_shockley)
 		{
 			form_g_matrix(ctx);
-			calc_lu(ctx);
+			ret = calc_lu(ctx);
 		}
 		form_isrc_vector(ctx);
-		calc_V(ctx);
+		if (ret == 0)
+		{
+			ret = calc_V(ctx);
+		}
+		if (ret != 0)
+		{
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int simulation_substep(struct libsimul_ctx *ctx)
+{
+	int ret = 0;
+	if (ctx->circuit->wavecnt)
+	{
+		wave_apply(ctx);
+	}
+	if (ctx->needs_recalc)
+	{
+		ret = recalc(ctx);
 	}
-	if (recalc_loop)
+	if (ret == 0 && ctx->circuit->has_shockley)
 	{
-		recalccnt = 0;
-		while ((status = go_through_all(ctx, recalc_loop)) != 0)
+		form_g_matrix(ctx);
+		ret = calc_lu(ctx);
+	}
+	if (ret != 0)
+	{
+		return ret;
+	}
+	form_isrc_vector(ctx);
+	ret = calc_V(ctx);
+	if (ret == 0)
+	{
+		ret = simulation_solve(ctx, 0);
+	}
+	if (ret == ERR_HAVE_TO_SIMULATE_AGAIN)
+	{
+		ret = simulation_solve(ctx, 1);
+		if (ret == ERR_HAVE_TO_SIMULATE_AGAIN)
 		{
-			//fprintf(stderr, "Recalc\n");
-			recalccnt++;
-			if (recalccnt == 1024)
+			return libsimul_fail(ctx, ERR_NOT_CONVERGED, "Recalc loop at t=%g, can't handle", ctx->t);
+		}
+	}
+	if (ret != 0)
+	{
+		return ret;
+	}
+	go_through_shockley_diodes_2(ctx);
+	return 0;
+}
+// Returns 0, or -ERR_* if the step failed, in which case the context keeps
+// the error and doesn't step any more; libsimul_error() tells why
+int simulation_step(struct libsimul_ctx *ctx)
+{
+	const double dt = ctx->dt;
+	const double t_end = ctx->t + dt;
+	int ret = 0;
+	if (ctx->err != 0)
+	{
+		return ctx->err;
+	}
+	if (ctx->circuit->pwmcnt == 0)
+	{
+		ret = simulation_substep(ctx);
+	}
+	else
+	{
+		// Split the step at PWM edges
+		pwm_apply(ctx);
+		for (;;)
+		{
+			double t_edge = pwm_next_edge(ctx);
+			if (t_edge >= t_end - 1e-9*dt)
 			{
-				fprintf(stderr, "Recalc loop, can't handle\n");
-				exit(1);
+				ctx->dt = t_end - ctx->t;
+				ret = simulation_substep(ctx);
+				break;
 			}
-			if (status != ERR_HAVE_TO_SIMULATE_AGAIN_TRANSFORMER || ctx->has_shockley)
+			ctx->dt = t_edge - ctx->t;
+			ret = simulation_substep(ctx);
+			if (ret != 0)
 			{
-				form_g_matrix(ctx);
-				calc_lu(ctx);
+				break;
 			}
-			form_isrc_vector(ctx);
-			calc_V(ctx);
+			ctx->t = t_edge;
+			pwm_apply(ctx);
 		}
+		ctx->dt = dt;
+	}
+	if (ret != 0)
+	{
+		ctx->err = ret;
+		return ret;
+	}
+	ctx->t = t_end;
+	if (ctx->circuit->ctlcnt)
+	{
+		ctl_run(ctx);
+	}
+	if (ctx->meascnt)
+	{
+		libsimul_measure_step(ctx);
+	}
+	if (ctx->harmcnt)
+	{
+		libsimul_harmonics_step(ctx);
+	}
+	if (ctx->recorder != NULL)
+	{
+		libsimul_record_step(ctx);
+	}
+	if (ctx->live != NULL)
+	{
+		libsimul_live_step(ctx);
+	}
+	return 0;
+}
+
+static struct libsimul_circuit *circuit_new(void)
+{
+	struct libsimul_circuit *c;
+	c = malloc(sizeof(*c));
+	if (c == NULL)
+	{
+		return NULL;
+	}
+	atomic_init(&c->refcnt, 1);
+	c->has_shockley = 0;
+	c->windings_grouped = 0;
+	c->elements_used = NULL;
+	c->elements_used_sz = 0;
+	c->elements_used_cap = 0;
+	c->name_tab = NULL;
+	c->name_tab_cap = 0;
+	c->node_names = NULL;
+	c->node_namecnt = 0;
+	c->node_namecap = 0;
+	c->node_numbered = 0;
+	c->node_tab = NULL;
+	c->node_tab_cap = 0;
+	c->node_seen = NULL;
+	c->node_seen_sz = 0;
+	c->node_seen_cap = 0;
+	c->floating_ref = NULL;
+	c->floating_ref_cnt = 0;
+	c->floating_found = 0;
+	c->border = NULL;
+	c->bordercnt = 0;
+	c->pwms = NULL;
+	c->pwmcnt = 0;
+	c->pwmcap = 0;
+	c->waves = NULL;
+	c->wavecnt = 0;
+	c->wavecap = 0;
+	c->ctls = NULL;
+	c->ctlcnt = 0;
+	c->ctlcap = 0;
+	c->ctl_bufsz = 0;
+	c->subckts = NULL;
+	c->subcktcnt = 0;
+	c->subcktcap = 0;
+	c->subckt_open = SIZE_MAX;
+	c->insts = NULL;
+	c->instcnt = 0;
+	c->instcap = 0;
+	c->inst_pending = NULL;
+	c->inst_pendingcnt = 0;
+	c->inst_pendingcap = 0;
+	c->params = NULL;
+	c->paramcnt = 0;
+	c->paramcap = 0;
+	c->param_uses = NULL;
+	c->param_usecnt = 0;
+	c->param_usecap = 0;
+	return c;
+}
+
+static void circuit_put(struct libsimul_circuit *c)
+{
+	size_t i;
+	if (c == NULL)
+	{
+		return;
+	}
+	if (atomic_fetch_sub(&c->refcnt, 1) != 1)
+	{
+		return;
+	}
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		free(c->elements_used[i]->allptrs);
+		free(c->elements_used[i]->name);
+		free(c->elements_used[i]);
+	}
+	free(c->elements_used);
+	nametab_free(c);
+	nodes_free(c);
+	free(c->node_seen);
+	free(c->floating_ref);
+	free(c->border);
+	pwm_free_defs(c);
+	wave_free_defs(c);
+	ctl_free_defs(c);
+	subckt_free_defs(c);
+	params_free_defs(c);
+	free(c);
+}
+
+// Gives the context a private copy of the circuit if it's shared with other
+// contexts, so that netlist constants can be modified without affecting them.
+// Returns -ERR_NO_MEMORY if the copy can't be made, the context then keeps
+// sharing the circuit.
+int libsimul_unshare(struct libsimul_ctx *ctx)
+{
+	struct libsimul_circuit *old = ctx->circuit;
+	struct libsimul_circuit *c;
+	size_t i, j;
+	if (atomic_load(&old->refcnt) == 1)
+	{
+		return 0;
+	}
+	c = circuit_new();
+	if (c == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c->has_shockley = old->has_shockley;
+	c->windings_grouped = old->windings_grouped;
+	c->node_seen_sz = old->node_seen_sz;
+	c->node_seen_cap = old->node_seen_sz;
+	c->elements_used_cap = old->elements_used_sz;
+	c->floating_ref_cnt = old->floating_ref_cnt;
+	c->floating_found = old->floating_found;
+	c->node_seen = malloc(sizeof(*c->node_seen)*(c->node_seen_cap+1));
+	c->elements_used = malloc(sizeof(*c->elements_used)*(c->elements_used_cap+1));
+	c->floating_ref = malloc(sizeof(*c->floating_ref)*(c->floating_ref_cnt+1));
+	c->bordercnt = old->bordercnt;
+	c->border = malloc(sizeof(*c->border)*(c->bordercnt+1));
+	// The copy functions count what they have copied, so that circuit_put()
+	// frees a partial copy
+	if (c->node_seen == NULL || c->elements_used == NULL || c->floating_ref == NULL ||
+	    c->border == NULL || nametab_copy(c, old) != 0 || nodes_copy(c, old) != 0 ||
+	    pwm_copy_defs(c, old) != 0 || wave_copy_defs(c, old) != 0 ||
+	    ctl_copy_defs(c, old) != 0 || subckt_copy_defs(c, old) != 0 ||
+	    params_copy_defs(c, old) != 0)
+	{
+		goto nomem;
+	}
+	if (old->node_seen_sz)
+	{
+		memcpy(c->node_seen, old->node_seen, sizeof(*c->node_seen)*old->node_seen_sz);
+	}
+	if (old->floating_ref_cnt)
+	{
+		memcpy(c->floating_ref, old->floating_ref, sizeof(*c->floating_ref)*old->floating_ref_cnt);
+	}
+	if (old->bordercnt)
+	{
+		memcpy(c->border, old->border, sizeof(*c->border)*old->bordercnt);
+	}
+	for (i = 0; i < old->elements_used_sz; i++)
+	{
+		struct element *el = malloc(sizeof(*el));
+		if (el == NULL)
+		{
+			goto nomem;
+		}
+		*el = *old->elements_used[i];
+		el->allptrs = NULL;
+		el->name = strdup(el->name);
+		c->elements_used[c->elements_used_sz++] = el;
+		if (el->name == NULL)
+		{
+			goto nomem;
+		}
+	}
+	// Pointers between elements must point to the new copies
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		struct element *el = c->elements_used[i];
+		struct element *oldel = old->elements_used[i];
+		if (oldel->primaryptr != NULL)
+		{
+			el->primaryptr = c->elements_used[oldel->primaryptr->idx];
+		}
+		if (oldel->allptrs != NULL)
+		{
+			el->allptrs = malloc(sizeof(*el->allptrs)*(oldel->allptrs_size+1));
+			if (el->allptrs == NULL)
+			{
+				goto nomem;
+			}
+			el->allptrs_capacity = oldel->allptrs_size+1;
+			for (j = 0; j < oldel->allptrs_size; j++)
+			{
+				el->allptrs[j] = c->elements_used[oldel->allptrs[j]->idx];
+			}
+		}
+	}
+	ctx->circuit = c;
+	circuit_put(old);
+	return 0;
+nomem:
+	circuit_put(c);
+	return -ERR_NO_MEMORY;
+}
+
+// libsimul_unshare() while reading the netlist, where running out of memory
+// ends the process like the errors of the netlist itself
+void netlist_unshare(struct libsimul_ctx *ctx)
+{
+	if (libsimul_unshare(ctx) != 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
 	}
-	go_through_shockley_diodes_2(ctx);
 }
 
-void libsimul_init(struct libsimul_ctx *ctx, double dt)
+// Returns -ERR_NO_MEMORY if the circuit can't be allocated. The context
+// must then only be passed to libsimul_free().
+int libsimul_init(struct libsimul_ctx *ctx, double dt)
 {
-	ctx->has_shockley = 0;
+	ctx->state = NULL;
+	ctx->state_cap = 0;
 	ctx->dt = dt;
-	ctx->elements_used = NULL;
-	ctx->elements_used_sz = 0;
-	ctx->elements_used_cap = 0;
-	ctx->node_seen = NULL;
-	ctx->node_seen_sz = 0;
-	ctx->node_seen_cap = 0;
+	ctx->nodecnt = 0;
 	ctx->xformerid = SIZE_MAX;
 	ctx->xformerstate = STATE_FINI;
 	ctx->Isrc_vector = NULL;
@@ -1970,90 +2630,273 @@ void libsimul_init(struct libsimul_ctx *ctx, double dt)
 	ctx->G_matrix = NULL;
 	ctx->G_LU = NULL;
 	ctx->G_ipiv = NULL;
+	ctx->t = 0;
+	ctx->needs_recalc = 0;
+	ctx->pwm_state = NULL;
+	ctx->wave_state = NULL;
+	ctx->wave_src = NULL;
+	ctx->wave_srccnt = 0;
+	ctx->ctl_state = NULL;
+	ctx->ctl_buf = NULL;
+	ctx->part = NULL;
+	ctx->probes = NULL;
+	ctx->probecnt = 0;
+	ctx->probecap = 0;
+	ctx->recorder = NULL;
+	ctx->live = NULL;
+	ctx->meas = NULL;
+	ctx->meascnt = 0;
+	ctx->meascap = 0;
+	ctx->harm = NULL;
+	ctx->harmcnt = 0;
+	ctx->harmcap = 0;
+	ctx->err = 0;
+	ctx->errmsg[0] = '\0';
+	ctx->circuit = circuit_new();
+	if (ctx->circuit == NULL)
+	{
+		return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
+	}
+	return 0;
 }
-void libsimul_free(struct libsimul_ctx *ctx)
+
+// Records the message of an error of the context and returns -err, so
+// that a failed job of a sweep can be reported without ending the process
+int libsimul_fail(struct libsimul_ctx *ctx, int err, const char *fmt, ...)
 {
-	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(ctx->errmsg, sizeof(ctx->errmsg), fmt, ap);
+	va_end(ap);
+	return -err;
+}
+
+// Message of the last error of the context, empty if there was none
+const char *libsimul_error(const struct libsimul_ctx *ctx)
+{
+	return ctx->errmsg;
+}
+
+// Creates a new context sharing the immutable circuit of src. Only the
+// per-context state and the solver work areas are copied, so dst continues
+// the simulation exactly where src currently is. src is not modified and may
+// be cloned concurrently from several threads.
+int libsimul_clone(struct libsimul_ctx *dst, const struct libsimul_ctx *src)
+{
+	const size_t elcnt = src->circuit->elements_used_sz;
+	const size_t nodecnt = src->nodecnt;
+	atomic_fetch_add(&src->circuit->refcnt, 1);
+	dst->circuit = src->circuit;
+	dst->dt = src->dt;
+	dst->diode_threshold = src->diode_threshold;
+	dst->nodecnt = nodecnt;
+	dst->xformerid = src->xformerid;
+	dst->xformerstate = src->xformerstate;
+	dst->loboV = src->loboV;
+	dst->hiboV = src->hiboV;
+	dst->trialV = src->trialV;
+	dst->lobophi = src->lobophi;
+	dst->hibophi = src->hibophi;
+	dst->trialphi = src->trialphi;
+	dst->t = src->t;
+	dst->needs_recalc = src->needs_recalc;
+	dst->pwm_state = NULL;
+	dst->wave_state = NULL;
+	dst->wave_src = NULL;
+	dst->wave_srccnt = 0;
+	dst->ctl_state = NULL;
+	dst->ctl_buf = NULL;
+	dst->part = NULL;
+	// Probes, measurements and recording are set up separately for every
+	// context
+	dst->probes = NULL;
+	dst->probecnt = 0;
+	dst->probecap = 0;
+	dst->recorder = NULL;
+	dst->live = NULL;
+	dst->meas = NULL;
+	dst->meascnt = 0;
+	dst->meascap = 0;
+	dst->harm = NULL;
+	dst->harmcnt = 0;
+	dst->harmcap = 0;
+	dst->err = src->err;
+	memcpy(dst->errmsg, src->errmsg, sizeof(dst->errmsg));
+	dst->state = malloc(sizeof(*dst->state)*(elcnt+1));
+	dst->state_cap = elcnt+1;
+	dst->Isrc_vector = NULL;
+	dst->V_vector = NULL;
+	dst->G_matrix = NULL;
+	dst->G_LU = NULL;
+	dst->G_ipiv = NULL;
+	if (dst->state == NULL)
+	{
+		libsimul_free(dst);
+		return -ERR_NO_MEMORY;
+	}
+	if (elcnt)
+	{
+		memcpy(dst->state, src->state, sizeof(*dst->state)*elcnt);
+	}
+	if (src->pwm_state != NULL)
+	{
+		const size_t pwmcnt = src->circuit->pwmcnt;
+		dst->pwm_state = malloc(sizeof(*dst->pwm_state)*pwmcnt);
+		if (dst->pwm_state == NULL)
+		{
+			libsimul_free(dst);
+			return -ERR_NO_MEMORY;
+		}
+		memcpy(dst->pwm_state, src->pwm_state, sizeof(*dst->pwm_state)*pwmcnt);
+	}
+	if (src->wave_state != NULL)
+	{
+		const size_t wavecnt = src->circuit->wavecnt;
+		dst->wave_state = malloc(sizeof(*dst->wave_state)*wavecnt);
+		dst->wave_src = malloc(sizeof(*dst->wave_src)*(src->wave_srccnt+1));
+		dst->wave_srccnt = src->wave_srccnt;
+		if (dst->wave_state == NULL || dst->wave_src == NULL)
+		{
+			libsimul_free(dst);
+			return -ERR_NO_MEMORY;
+		}
+		memcpy(dst->wave_state, src->wave_state, sizeof(*dst->wave_state)*wavecnt);
+		memcpy(dst->wave_src, src->wave_src, sizeof(*dst->wave_src)*src->wave_srccnt);
+	}
+	if (src->ctl_state != NULL)
 	{
-		free(ctx->elements_used[i]->allptrs);
-		free(ctx->elements_used[i]->name);
-		free(ctx->elements_used[i]);
+		const size_t ctlcnt = src->circuit->ctlcnt;
+		const size_t bufsz = src->circuit->ctl_bufsz;
+		dst->ctl_state = malloc(sizeof(*dst->ctl_state)*ctlcnt);
+		dst->ctl_buf = malloc(sizeof(*dst->ctl_buf)*(bufsz+1));
+		if (dst->ctl_state == NULL || dst->ctl_buf == NULL)
+		{
+			libsimul_free(dst);
+			return -ERR_NO_MEMORY;
+		}
+		memcpy(dst->ctl_state, src->ctl_state, sizeof(*dst->ctl_state)*ctlcnt);
+		memcpy(dst->ctl_buf, src->ctl_buf, sizeof(*dst->ctl_buf)*bufsz);
+	}
+	if (src->G_matrix == NULL)
+	{
+		// init_simulation() not yet called
+		return 0;
 	}
-	free(ctx->elements_used);
-	free(ctx->node_seen);
+	dst->G_matrix = malloc(sizeof(*dst->G_matrix)*nodecnt*nodecnt);
+	dst->G_LU = malloc(sizeof(*dst->G_LU)*nodecnt*nodecnt);
+	dst->G_ipiv = malloc(sizeof(*dst->G_ipiv)*nodecnt);
+	dst->Isrc_vector = malloc(sizeof(*dst->Isrc_vector)*nodecnt);
+	dst->V_vector = malloc(sizeof(*dst->V_vector)*nodecnt);
+	if (dst->G_matrix == NULL || dst->G_LU == NULL || dst->G_ipiv == NULL ||
+	    dst->Isrc_vector == NULL || dst->V_vector == NULL)
+	{
+		libsimul_free(dst);
+		return -ERR_NO_MEMORY;
+	}
+	memcpy(dst->G_matrix, src->G_matrix, sizeof(*dst->G_matrix)*nodecnt*nodecnt);
+	memcpy(dst->G_LU, src->G_LU, sizeof(*dst->G_LU)*nodecnt*nodecnt);
+	memcpy(dst->G_ipiv, src->G_ipiv, sizeof(*dst->G_ipiv)*nodecnt);
+	memcpy(dst->Isrc_vector, src->Isrc_vector, sizeof(*dst->Isrc_vector)*nodecnt);
+	memcpy(dst->V_vector, src->V_vector, sizeof(*dst->V_vector)*nodecnt);
+	if (src->part != NULL)
+	{
+		// Block factorizations are rebuilt from the copied matrix
+		int ret = partition_init(dst);
+		if (ret == 0)
+		{
+			ret = calc_lu(dst);
+		}
+		if (ret != 0)
+		{
+			libsimul_free(dst);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+void libsimul_free(struct libsimul_ctx *ctx)
+{
+	libsimul_record_close(ctx);
+	libsimul_live_close(ctx);
+	libsimul_free_measurements(ctx);
+	libsimul_free_harmonics(ctx);
+	libsimul_free_probes(ctx);
+	partition_free(ctx);
+	circuit_put(ctx->circuit);
+	ctx->circuit = NULL;
+	free(ctx->state);
+	free(ctx->pwm_state);
+	ctx->pwm_state = NULL;
+	free(ctx->wave_state);
+	ctx->wave_state = NULL;
+	free(ctx->wave_src);
+	ctx->wave_src = NULL;
+	ctx->wave_srccnt = 0;
+	free(ctx->ctl_state);
+	ctx->ctl_state = NULL;
+	free(ctx->ctl_buf);
+	ctx->ctl_buf = NULL;
 	free(ctx->Isrc_vector);
 	free(ctx->V_vector);
 	free(ctx->G_matrix);
 	free(ctx->G_LU);
 	free(ctx->G_ipiv);
-	libsimul_init(ctx, 0);
+	ctx->state = NULL;
+	ctx->state_cap = 0;
+	ctx->Isrc_vector = NULL;
+	ctx->V_vector = NULL;
+	ctx->G_matrix = NULL;
+	ctx->G_LU = NULL;
+	ctx->G_ipiv = NULL;
 }
 double get_resistor(struct libsimul_ctx *ctx, const char *rsname)
 {
 	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
-	{
-		if (strcmp(ctx->elements_used[i]->name, rsname) == 0)
-		{
-			break;
-		}
-	}
-	if (i == ctx->elements_used_sz)
+	i = libsimul_find_element(ctx->circuit, rsname);
+	if (i == SIZE_MAX)
 	{
-		fprintf(stderr, "Resistor %s not found\n", rsname);
-		exit(1);
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Resistor %s not found", rsname);
+		return NAN;
 	}
-	if (ctx->elements_used[i]->typ != TYPE_RESISTOR)
+	if (ctx->circuit->elements_used[i]->typ != TYPE_RESISTOR)
 	{
-		fprintf(stderr, "Element %s not a resistor\n", rsname);
-		exit(1);
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a resistor", rsname);
+		return NAN;
 	}
-	return ctx->elements_used[i]->R;
+	return ctx->circuit->elements_used[i]->R;
 }
 double get_inductor(struct libsimul_ctx *ctx, const char *indname)
 {
 	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	i = libsimul_find_element(ctx->circuit, indname);
+	if (i == SIZE_MAX)
 	{
-		if (strcmp(ctx->elements_used[i]->name, indname) == 0)
-		{
-			break;
-		}
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Inductor %s not found", indname);
+		return NAN;
 	}
-	if (i == ctx->elements_used_sz)
+	if (ctx->circuit->elements_used[i]->typ != TYPE_INDUCTOR)
 	{
-		fprintf(stderr, "Inductor %s not found\n", indname);
-		exit(1);
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a inductor", indname);
+		return NAN;
 	}
-	if (ctx->elements_used[i]->typ != TYPE_INDUCTOR)
-	{
-		fprintf(stderr, "Element %s not a inductor\n", indname);
-		exit(1);
-	}
-	return ctx->elements_used[i]->L;
+	return ctx->circuit->elements_used[i]->L;
 }
 double get_capacitor(struct libsimul_ctx *ctx, const char *capname)
 {
 	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
-	{
-		if (strcmp(ctx->elements_used[i]->name, capname) == 0)
-		{
-			break;
-		}
-	}
-	if (i == ctx->elements_used_sz)
+	i = libsimul_find_element(ctx->circuit, capname);
+	if (i == SIZE_MAX)
 	{
-		fprintf(stderr, "Capacitor %s not found\n", capname);
-		exit(1);
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Capacitor %s not found", capname);
+		return NAN;
 	}
-	if (ctx->elements_used[i]->typ != TYPE_CAPACITOR)
+	if (ctx->circuit->elements_used[i]->typ != TYPE_CAPACITOR)
 	{
-		fprintf(stderr, "Element %s not a capacitor\n", capname);
-		exit(1);
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a capacitor", capname);
+		return NAN;
 	}
-	return ctx->elements_used[i]->C;
+	return ctx->circuit->elements_used[i]->C;
 }
 double get_voltage_source_current(struct libsimul_ctx *ctx, const char *vsname)
 {
@@ -2064,51 +2907,38 @@ double get_voltage_source_current(struct libsimul_ctx *ctx, const char *vsname)
 	double V;
 	double V_ext;
 	double V_diff;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	i = libsimul_find_element(ctx->circuit, vsname);
+	if (i == SIZE_MAX)
 	{
-		if (strcmp(ctx->elements_used[i]->name, vsname) == 0)
-		{
-			break;
-		}
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Voltage source %s not found", vsname);
+		return NAN;
 	}
-	if (i == ctx->elements_used_sz)
+	if (ctx->circuit->elements_used[i]->typ != TYPE_VOLTAGE)
 	{
-		fprintf(stderr, "Voltage source %s not found\n", vsname);
-		exit(1);
+		libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a voltage source", vsname);
+		return NAN;
 	}
-	if (ctx->elements_used[i]->typ != TYPE_VOLTAGE)
-	{
-		fprintf(stderr, "Element %s not a voltage source\n", vsname);
-		exit(1);
-	}
-	V1 = get_V(ctx, ctx->elements_used[i]->n1);
-	V2 = get_V(ctx, ctx->elements_used[i]->n2);
-	R = ctx->elements_used[i]->R;
-	V = ctx->elements_used[i]->V;
+	V1 = get_V(ctx, ctx->circuit->elements_used[i]->n1);
+	V2 = get_V(ctx, ctx->circuit->elements_used[i]->n2);
+	R = ctx->circuit->elements_used[i]->R;
+	V = ctx->state[i].V;
 	V_ext = V1 - V2;
 	V_diff = V - V_ext;
 	//printf("V1 %g V2 %g R %g V %g V_ext %g V_diff %g I %g\n", V1, V2, R, V, V_ext, V_diff, V_diff/R);
 	return V_diff/R;
 }
-void set_capacitor_voltage(struct libsimul_ctx *ctx, const char *capname, double V)
+int set_capacitor_voltage(struct libsimul_ctx *ctx, const char *capname, double V)
 {
 	size_t i;
-	for (i = 0; i < ctx->elements_used_sz; i++)
+	i = libsimul_find_element(ctx->circuit, capname);
+	if (i == SIZE_MAX)
 	{
-		if (strcmp(ctx->elements_used[i]->name, capname) == 0)
-		{
-			break;
-		}
-	}
-	if (i == ctx->elements_used_sz)
-	{
-		fprintf(stderr, "Capacitor %s not found\n", capname);
-		exit(1);
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Capacitor %s not found", capname);
 	}
-	if (ctx->elements_used[i]->typ != TYPE_CAPACITOR)
+	if (ctx->circuit->elements_used[i]->typ != TYPE_CAPACITOR)
 	{
-		fprintf(stderr, "Element %s not a capacitor\n", capname);
-		exit(1);
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a capacitor", capname);
 	}
-	ctx->elements_used[i]->I_src = V/ctx->elements_used[i]->R;
+	ctx->state[i].I_src = V/ctx->circuit->elements_used[i]->R;
+	return 0;
 }
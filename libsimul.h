@@ -1,6 +1,12 @@
 #ifndef _LIBSIMUL_H_
 #define _LIBSIMUL_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <pthread.h>
+
 enum {
 	ERR_NO_ERROR = 0,
 	ERR_HAVE_TO_SIMULATE_AGAIN = 1,
@@ -9,12 +15,24 @@ enum {
 	ERR_HAVE_TO_SIMULATE_AGAIN_SHOCKLEY_DIODE = 4,
 	ERR_NO_MEMORY = 5,
 	ERR_NO_DATA = 6,
+	ERR_NOT_FOUND = 7,
+	ERR_BUSY = 8,
+	ERR_IO = 9,
+	ERR_NOT_CONVERGED = 10,
+	ERR_ABORTED = 11,
+	ERR_MISMATCH = 12,
+	ERR_SINGULAR = 13,
+	ERR_INVALID = 14,
 };
 
+// Size of the error message of a context, see libsimul_error()
+#define LIBSIMUL_ERRMSG_SZ 256
+
 int iswhiteonly(const char *ln);
 size_t spaceoff(const char *ln);
 size_t nonspaceoff(const char *ln);
 int getline_strip_comment(FILE *f, char **ln, size_t *lnsz);
+char *next_token(char **lineptr);
 
 enum element_type {
 	TYPE_RESISTOR,
@@ -32,22 +50,21 @@ enum element_type {
 // Convention: V is V_n_1 - V_n_2
 // Then positive V is positive I_src
 // Diode convention: arrow pointing from n1 (anode) to n2 (cathode)
+//
+// struct element holds the netlist constants and is shared between all
+// contexts cloned from the same circuit. Everything that changes while the
+// simulation runs lives in struct element_state, indexed by idx.
 struct element {
 	char *name;
+	size_t idx;
 	int n1;
 	int n2;
-	int current_switch_state_is_closed;
 	enum element_type typ;
-	double V_across_diode;
-	double V;
-	double I_src;
-	double I_model;
+	double V; // netlist value, current value is in element_state
 	double Vinit;
 	double Iinit;
 	double L;
 	double R;
-	double G_shockley;
-	double G_R_shockley;
 	double C;
 	double N;
 	double Vmin;
@@ -56,18 +73,305 @@ struct element {
 	double I_s; // Shockley diode saturation current
 	double V_T; // Shockley diode thermal voltage
 	double I_accuracy; // Shockley diode current accuracy
-	double cur_phi_single; // only for primary
-	double dphi_single; // only for primary
 	int primary;
 	struct element *primaryptr;
 	struct element **allptrs;
 	size_t allptrs_size;
 	size_t allptrs_capacity;
 	double transformer_direct_denom;
-	double transformer_direct_const;
 	double diode_threshold;
 	int on_recalc;
+};
+
+struct element_state {
+	int current_switch_state_is_closed;
+	double V;
+	double V_across_diode;
+	double I_src;
+	double I_model;
+	double G_shockley;
+	double G_R_shockley;
 	double expval;
+	double cur_phi_single; // only for primary
+	double dphi_single; // only for primary
+	double transformer_direct_const; // only for primary
+};
+
+// PWM modulator driving a switch and optionally its complement, see pwm.c
+struct libsimul_pwm {
+	char *name;
+	double f;
+	double deadtime;
+	double phase; // degrees of the carrier period
+	double duty_init;
+	char *high_name;
+	char *low_name; // NULL if no complementary switch
+};
+
+struct libsimul_pwm_state {
+	double duty_cmd; // set by set_pwm_duty()
+	double duty; // latched at the start of every carrier period
+	double period_start;
+	// Resolved by pwm_init_simulation(), per context like the control
+	// block handles
+	size_t high_idx;
+	size_t low_idx; // SIZE_MAX if no complementary switch
+};
+
+// Time-dependent voltage sources, see wave.c
+enum libsimul_wave_type {
+	WAVE_SINE,
+	WAVE_PULSE,
+	WAVE_PWL,
+};
+
+struct libsimul_wave_src {
+	char *name;
+	double ph_c; // cos and sin of the phase lag of this phase
+	double ph_s;
+};
+
+struct libsimul_wave {
+	enum libsimul_wave_type typ;
+	struct libsimul_wave_src *srcs; // all phases of a multiphase sine
+	size_t srccnt;
+	double ampl; // sine
+	double f;
+	double phase; // degrees
+	double offset;
+	double low; // pulse
+	double high;
+	double delay;
+	double rise;
+	double fall;
+	double width;
+	double period; // pulse and PWL, 0 if not repeating
+	double *pwl; // time and voltage pairs
+	size_t pwlcnt;
+};
+
+struct libsimul_wave_state {
+	double t; // time of c and s
+	double c; // cos and sin of the sine phase at t
+	double s;
+	double rot_dt; // time step of rot_c and rot_s
+	double rot_c;
+	double rot_s;
+	size_t rotations; // since the last exact evaluation
+	size_t pwl_seg;
+	size_t src_first; // of the resolved sources in ctx->wave_src
+};
+
+// Discrete-time control blocks, see ctl.c
+enum libsimul_ctl_type {
+	CTL_PI,
+	CTL_PID,
+	CTL_LIMIT,
+	CTL_AVG,
+	CTL_RMS,
+	CTL_CMP,
+	CTL_SH,
+};
+
+enum libsimul_signal_type {
+	SIGNAL_CONST,
+	SIGNAL_VOLTAGE,
+	SIGNAL_CURRENT,
+	SIGNAL_BLOCK,
+};
+
+struct libsimul_signal {
+	enum libsimul_signal_type typ;
+	double val; // constant
+	int n1; // voltage V_n1 - V_n2
+	int n2;
+	char *name; // element or block
+};
+
+enum libsimul_ctl_out_type {
+	CTL_OUT_NONE,
+	CTL_OUT_PWM, // duty cycle
+	CTL_OUT_SWITCH, // closed if output > 0.5
+};
+
+struct libsimul_ctl {
+	char *name;
+	enum libsimul_ctl_type typ;
+	struct libsimul_signal in;
+	struct libsimul_signal ref; // setpoint, threshold or sample trigger
+	int has_ref;
+	double Ts; // 0: every time step
+	double kp;
+	double ki;
+	double kd;
+	double min;
+	double max;
+	double hyst;
+	double init; // output before the first sample
+	size_t n; // window of avg and rms in samples
+	size_t bufoff; // of the window in ctx->ctl_buf
+	char *out_name;
+};
+
+struct libsimul_ctl_state {
+	double out;
+	double integ;
+	double prev_err;
+	double prev_trig;
+	double sum; // of the window
+	size_t pos; // in the window
+	size_t fill;
+	double next_sample;
+	// Resolved by ctl_init_simulation(), per context so that clones keep
+	// sharing the circuit
+	size_t in_idx; // element handle or block of in
+	size_t ref_idx;
+	enum libsimul_ctl_out_type out_typ;
+	size_t out_idx; // PWM or element handle
+};
+
+// Subcircuit definitions and instances, see subckt.c
+struct libsimul_subckt {
+	char *name;
+	size_t portcnt;
+	size_t internalcnt;
+	// Local node to port index, or portcnt + internal node index; -1 if
+	// the node isn't used
+	int *localmap;
+	int maxnode;
+	char **param_names;
+	char **param_values;
+	size_t paramcnt;
+	size_t paramcap;
+	char **lines;
+	size_t linecnt;
+	size_t linecap;
+};
+
+// Instance of a subcircuit, flattened to the elements el_first ..
+// el_first+el_cnt-1 and the internal nodes node_first ..
+// node_first+node_cnt-1. Nested instances are within the ranges of their
+// parent.
+struct libsimul_instance {
+	char *name; // full name, e.g. U1.X2
+	size_t subckt;
+	size_t parent; // SIZE_MAX for top-level instances
+	int *ports;
+	size_t portcnt;
+	char **params; // values of the parameters of the subcircuit
+	size_t el_first;
+	size_t el_cnt;
+	int node_first;
+	size_t node_cnt;
+};
+
+// Netlist parameters, see params.c
+struct libsimul_param {
+	char *name;
+	char *expr;
+	double val;
+	int overridden; // by libsimul_set_param(), expr isn't evaluated
+};
+
+enum libsimul_param_target {
+	PARAM_ELEMENT,
+	PARAM_PWM,
+	PARAM_WAVE,
+	PARAM_CTL,
+	PARAM_PWL, // points of a PWL waveform
+};
+
+enum libsimul_param_check {
+	PARAM_ANY,
+	PARAM_POSITIVE,
+	PARAM_NONNEGATIVE,
+};
+
+// Netlist value given by an expression, evaluated again when a parameter is
+// overridden
+struct libsimul_param_use {
+	enum libsimul_param_target target;
+	size_t idx; // of the element, PWM, wave or control block
+	size_t off; // of the double in its struct or in the PWL points
+	enum libsimul_param_check check;
+	char *expr;
+};
+
+// Named node, see nodes.c
+struct libsimul_node_name {
+	char *name;
+	int node; // -1 until numbered
+	size_t uses; // element terminals
+};
+
+// Compiled circuit, immutable once init_simulation() has been called and
+// shared by reference counting between cloned contexts. Setters that change
+// netlist constants unshare it first (copy on write).
+struct libsimul_circuit {
+	atomic_size_t refcnt;
+	int has_shockley;
+	int windings_grouped;
+
+	struct element **elements_used;
+	size_t elements_used_sz;
+	size_t elements_used_cap;
+
+	// Element indices by name, see nametab.c
+	size_t *name_tab;
+	size_t name_tab_cap;
+
+	// Named nodes, see nodes.c
+	struct libsimul_node_name *node_names;
+	size_t node_namecnt;
+	size_t node_namecap;
+	size_t node_numbered; // names before this are numbered
+	size_t *node_tab; // indices to node_names by name
+	size_t node_tab_cap;
+
+	unsigned char *node_seen;
+	size_t node_seen_sz;
+	size_t node_seen_cap;
+
+	// Lowest node of every galvanically isolated subcircuit, used as its
+	// local ground
+	int *floating_ref;
+	size_t floating_ref_cnt;
+	int floating_found; // floating_ref is of the current elements
+
+	// Nodes shared by the blocks of the block solver
+	int *border;
+	size_t bordercnt;
+
+	struct libsimul_pwm *pwms;
+	size_t pwmcnt;
+	size_t pwmcap;
+
+	struct libsimul_wave *waves;
+	size_t wavecnt;
+	size_t wavecap;
+
+	struct libsimul_ctl *ctls;
+	size_t ctlcnt;
+	size_t ctlcap;
+	size_t ctl_bufsz;
+
+	struct libsimul_subckt *subckts;
+	size_t subcktcnt;
+	size_t subcktcap;
+	size_t subckt_open; // definition being read, SIZE_MAX if none
+	struct libsimul_instance *insts;
+	size_t instcnt;
+	size_t instcap;
+	char **inst_pending; // top-level .inst lines until read_file() ends
+	size_t inst_pendingcnt;
+	size_t inst_pendingcap;
+
+	struct libsimul_param *params;
+	size_t paramcnt;
+	size_t paramcap;
+	struct libsimul_param_use *param_uses;
+	size_t param_usecnt;
+	size_t param_usecap;
 };
 
 enum xformerstatetype {
@@ -80,8 +384,273 @@ enum xformerstatetype {
         STATE_FINI,
 };
 
+enum probe_type {
+	PROBE_VOLTAGE,
+	PROBE_INDUCTOR_CURRENT,
+	PROBE_SOURCE_CURRENT,
+	PROBE_TRANSFORMER_CURRENT,
+};
+
+struct libsimul_probe {
+	char *name;
+	enum probe_type typ;
+	int n1;
+	int n2;
+	size_t elidx;
+};
+
+enum record_format {
+	RECORD_TEXT,
+	RECORD_BINARY,
+	RECORD_CHUNKED, // compressed chunks with a time index, see recfile.c
+};
+
+enum record_trigger_type {
+	TRIGGER_RISING, // probe crosses level upwards
+	TRIGGER_FALLING, // probe crosses level downwards
+	TRIGGER_CROSSING, // either
+	TRIGGER_DIODE, // diode turns on or off
+};
+
+// Condition that starts a recording window, see libsimul_record_set_window()
+struct libsimul_rec_trigger {
+	enum record_trigger_type typ;
+	size_t idx; // probe, or element of TRIGGER_DIODE
+	double level;
+	double prev; // value or diode state at the previous recorded frame
+	int has_prev;
+};
+
+#define RECORD_BINARY_MAGIC "RLCW"
+#define RECORD_BINARY_VERSION 1
+
+#define RECORD_CHUNKED_MAGIC "RLCZ"
+#define RECORD_CHUNKED_VERSION 1
+#define RECORD_CHUNK_MAGIC "RLCK"
+#define RECORD_INDEX_MAGIC "RLCI"
+#define RECORD_END_MAGIC "RLCE"
+#define RECORD_CHUNK_FRAMES 4096
+
+// Entry of the chunk index of a chunked recording, stored as is
+struct libsimul_rec_chunk {
+	double t_first;
+	double t_last;
+	uint64_t offset; // of the chunk header
+	uint64_t frames;
+};
+
+#define CHECKPOINT_MAGIC "RLCS"
+#define CHECKPOINT_VERSION 1
+
+#define NETCACHE_MAGIC "RLCN"
+#define NETCACHE_VERSION 4
+
+// Probe samples go through a lock-free single-producer single-consumer ring
+// to a writer thread, see record.c
+struct libsimul_recorder {
+	enum record_format format;
+	FILE *f;
+	size_t framesz; // doubles per frame: time and probes
+	double *ring;
+	size_t ring_frames; // power of two
+	atomic_size_t head; // written by simulation thread
+	atomic_size_t tail; // written by writer thread
+	atomic_int stop;
+	pthread_t writer;
+	size_t decimation;
+	size_t decimation_cnt;
+	size_t frame_cnt;
+	size_t stall_cnt;
+	size_t max_fill;
+	// RECORD_CHUNKED, used by the writer thread only
+	double *chunk; // chunk_frames frames
+	size_t chunk_fill;
+	uint8_t *zbuf;
+	uint8_t *syms;
+	struct libsimul_rec_chunk *index;
+	size_t indexcnt;
+	size_t indexcap;
+	int failed; // -ERR_NO_MEMORY if the index couldn't be kept
+	// Triggered windows, pre is NULL if every frame is recorded
+	double *pre; // circular history of pre_cap frames
+	size_t pre_cap;
+	size_t pre_pos;
+	size_t pre_cnt;
+	size_t post_frames;
+	size_t post_remain; // frames still to write after a trigger
+	struct libsimul_rec_trigger *triggers;
+	size_t triggercnt;
+	int forced; // libsimul_record_trigger() called
+	size_t window_cnt;
+};
+
+// Reader of a chunked recording, see recfile.c
+struct libsimul_recfile {
+	FILE *f;
+	size_t probecnt;
+	char **names;
+	size_t chunk_frames;
+	struct libsimul_rec_chunk *chunks;
+	size_t chunkcnt;
+	double *frames; // decoded frames of the current chunk
+	size_t chunk; // current chunk, SIZE_MAX if none
+	size_t next_chunk;
+	size_t pos; // next frame of the current chunk
+	uint8_t *buf;
+	size_t bufsz;
+};
+
+// Live ring of probe samples in shared memory, see live.c
+#define LIVE_MAGIC "RLCL"
+#define LIVE_VERSION 1
+#define LIVE_NAME_SZ 32
+enum live_state {
+	LIVE_RUNNING = 1,
+	LIVE_DONE = 2,
+};
+
+// Start of the shared memory, followed by the ring of ring_frames frames of
+// 1+probecnt doubles (time and probes). Frame k is in slot
+// k & (ring_frames-1) and complete once head > k.
+struct libsimul_live_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t probecnt;
+	atomic_uint state;
+	uint64_t ring_frames;
+	uint64_t decimation;
+	double dt;
+	atomic_uint_least64_t head; // frames written
+	char names[]; // probecnt names of LIVE_NAME_SZ bytes
+};
+
+// Simulation side
+struct libsimul_live {
+	struct libsimul_live_header *hdr;
+	_Atomic double *ring;
+	size_t mapsz;
+	size_t framesz;
+	size_t ring_frames;
+	size_t decimation;
+	size_t decimation_cnt;
+	char *name;
+};
+
+// Viewer side
+struct libsimul_live_view {
+	const struct libsimul_live_header *hdr;
+	const _Atomic double *ring;
+	size_t mapsz;
+	size_t probecnt;
+	size_t framesz; // doubles per frame
+};
+
+// Streaming measurement over fixed windows or zero-crossing cycles of a
+// voltage probe, see measure.c
+struct libsimul_measurement_result {
+	double t_end;
+	double duration;
+	double avg;
+	double rms;
+	double min;
+	double max;
+	double pp;
+	double i_avg; // if there is a current probe
+	double i_rms;
+	double power; // average of v*i
+	double pf; // power/(rms*i_rms)
+};
+
+struct libsimul_measurement {
+	size_t probe_v;
+	size_t probe_i; // SIZE_MAX if none
+	double window; // seconds, 0 for cycle windows
+	size_t cycles;
+	int started; // cycle windows start at the first rising zero crossing
+	size_t crossings;
+	double prev_v;
+	double sum_w; // time in the current window
+	double sum_v;
+	double sum_v2;
+	double sum_i;
+	double sum_i2;
+	double sum_vi;
+	double v_min;
+	double v_max;
+	size_t windows; // completed
+	struct libsimul_measurement_result res; // of the last completed window
+};
+
+// Per-cycle harmonic analysis of a probe by a bank of Goertzel filters,
+// see harmonics.c
+struct libsimul_harmonics {
+	size_t probe;
+	size_t probe_sync; // SIZE_MAX if cycles are 1/f0 long
+	double f0;
+	size_t nharm; // fundamental and harmonics up to nharm*f0
+	size_t N; // samples per cycle the filters are tuned for, 0 if unknown
+	size_t n; // samples in the current cycle
+	int started;
+	double prev_sync;
+	double sum;
+	double *coeff; // 2*cos(2*pi*k/N)
+	double *s1;
+	double *s2;
+	size_t cycles; // completed
+	double t_end;
+	double dc;
+	double thd;
+	double *ampl; // peak amplitudes of the last completed cycle
+};
+
+// One block of the block solver, see partition.c
+struct libsimul_block {
+	size_t n;
+	size_t *nodes; // V_vector index of every unknown
+	double *G; // block, block to border and border to block entries
+	double *G_new;
+	double *LU;
+	int *ipiv;
+	double *AinvC; // A^-1 C, n*bordercnt
+	double *W; // R A^-1 C, bordercnt*bordercnt
+	double *tmp; // n*max(1,xfrcnt)
+	int factored;
+};
+
+// Bordered block diagonal solver. Blocks are coupled by border nodes
+// (Schur complement) and by X transformers (low-rank updates, Woodbury
+// identity).
+struct libsimul_partition {
+	struct libsimul_block *blocks;
+	size_t blockcnt;
+	size_t *border; // V_vector index of every border node
+	size_t bordercnt;
+	double *SB; // Schur complement of the border nodes
+	int *SB_ipiv;
+	double *xb; // bordercnt*max(1,xfrcnt)
+	size_t *xfr_el; // element index of every X transformer primary
+	size_t xfrcnt;
+	double *U; // nodecnt*xfrcnt
+	double *Z; // A^-1 U
+	double *S; // D - U^T Z
+	int *S_ipiv;
+	double *w;
+	size_t block_factor_cnt; // block refactorizations done
+};
+
+struct libsimul_record_stats {
+	size_t frame_cnt;
+	size_t stall_cnt; // times the simulation had to wait for the writer
+	size_t max_fill;
+	size_t ring_frames;
+	size_t window_cnt; // triggered windows written
+};
+
 struct libsimul_ctx {
-	int has_shockley;
+	struct libsimul_circuit *circuit;
+	struct element_state *state;
+	size_t state_cap;
+
 	double dt;
 	double diode_threshold;
 
@@ -92,14 +661,6 @@ struct libsimul_ctx {
 	int *G_ipiv;
 	size_t nodecnt;
 
-	struct element **elements_used;
-	size_t elements_used_sz;
-	size_t elements_used_cap;
-
-	unsigned char *node_seen;
-	size_t node_seen_sz;
-	size_t node_seen_cap;
-
 	size_t xformerid;
 	enum xformerstatetype xformerstate;
 	double loboV;
@@ -108,16 +669,171 @@ struct libsimul_ctx {
 	double lobophi;
 	double hibophi;
 	double trialphi;
+
+	double t;
+	int needs_recalc; // set by handle-based setters
+
+	struct libsimul_pwm_state *pwm_state;
+	struct libsimul_wave_state *wave_state;
+	size_t *wave_src; // element handles of the waveform sources
+	size_t wave_srccnt;
+	struct libsimul_ctl_state *ctl_state;
+	double *ctl_buf; // windows of avg and rms blocks
+
+	struct libsimul_partition *part; // NULL: dense solver
+
+	struct libsimul_probe *probes;
+	size_t probecnt;
+	size_t probecap;
+	struct libsimul_recorder *recorder;
+	struct libsimul_live *live;
+
+	struct libsimul_measurement *meas;
+	size_t meascnt;
+	size_t meascap;
+
+	struct libsimul_harmonics *harm;
+	size_t harmcnt;
+	size_t harmcap;
+
+	int err; // -ERR_* of a failed step, the context can't step any more
+	char errmsg[LIBSIMUL_ERRMSG_SZ]; // of the last error
+};
+
+enum {
+	BATCH_LANE_DIRTY = 1,
+	BATCH_LANE_ACTIVE = 2,
+	BATCH_LANE_SOLVE = 4,
+	BATCH_LANE_RECALC_LOOP = 8,
+};
+
+// Lockstep simulation of width instances of the same circuit topology,
+// matrices stored lane-interleaved (see batch.c)
+struct libsimul_batch {
+	size_t width;
+	size_t nodecnt;
+	struct libsimul_ctx *lanes;
+	size_t lanecnt_initialized;
+	unsigned *lane_flags;
+	size_t *lane_recalccnt;
+	double *G_soa;
+	double *LU_soa;
+	double *Isrc_soa;
+	double *V_soa;
+};
+
+enum mc_param_kind {
+	MC_PARAM_R, // resistance of any element, e.g. capacitor ESR
+	MC_PARAM_L,
+	MC_PARAM_C,
+	MC_PARAM_XFR_L, // transformer primary inductance
+};
+
+enum mc_dist {
+	MC_DIST_UNIFORM, // uniform in [-tol, +tol]
+	MC_DIST_NORMAL, // tol is 3 sigma, truncated at +-tol
+};
+
+struct libsimul_mc_param {
+	char *element;
+	enum mc_param_kind kind;
+	enum mc_dist dist;
+	double tol; // relative, 0.1 means 10 %
 };
 
-void libsimul_init(struct libsimul_ctx *ctx, double dt);
+// Fills meas[0..nmeas-1], returns 0 on success. Called concurrently from
+// several threads, each with its own ctx.
+typedef int (*libsimul_mc_run_fn)(struct libsimul_ctx *ctx, size_t run, double *meas, void *userdata);
+
+struct libsimul_mc {
+	const struct libsimul_ctx *proto;
+	struct libsimul_mc_param *params;
+	size_t paramcnt;
+	size_t paramcap;
+	size_t runs;
+	size_t nmeas;
+	uint64_t seed;
+	size_t threads; // 0: one per CPU
+	libsimul_mc_run_fn fn;
+	void *userdata;
+	double *results; // runs*nmeas, NAN for failed runs
+	double *deviations; // runs*paramcnt
+	int *errors; // runs, 0 or the -ERR_* of a failed run
+	char **errmsgs; // runs, NULL or the error message of a failed run
+	atomic_size_t next_run;
+	atomic_size_t failed_runs;
+};
+
+// Called after simulation steps, ctl_state is the controller's own state
+// (see struct libsimul_parareal). Return 0 to continue, nonzero to stop.
+typedef int (*libsimul_controller_fn)(struct libsimul_ctx *ctx, void *ctl_state, void *userdata);
+
+// Parareal time-parallel integration, see parareal.c
+struct libsimul_parareal {
+	const struct libsimul_ctx *proto;
+	double t_start;
+	double t_end;
+	size_t windows;
+	size_t coarse_ratio; // coarse dt is coarse_ratio times the fine dt
+	double tol; // relative change of window boundary states
+	size_t max_iter;
+	size_t threads; // 0: one per CPU
+	libsimul_controller_fn ctl;
+	size_t ctl_state_size;
+	const void *ctl_init;
+	void *userdata;
+
+	size_t iterations;
+	double defect;
+
+	struct libsimul_ctx *U; // window boundary states, windows+1
+	struct libsimul_ctx *F; // fine propagation results, windows
+	unsigned char *U_ctl;
+	unsigned char *F_ctl;
+	size_t nvar;
+	size_t *var_el;
+	unsigned char *var_kind;
+	double *G_old; // coarse results of the previous iteration
+	double *x_new;
+	double *x_old;
+	double *x_fine;
+	double *scale;
+	atomic_size_t next_window;
+	atomic_int failed;
+};
+
+struct libsimul_mc_stats {
+	size_t cnt;
+	double mean;
+	double stddev;
+	double min;
+	double max;
+	double p1;
+	double p5;
+	double p50;
+	double p95;
+	double p99;
+	size_t worst_min_run;
+	size_t worst_max_run;
+};
+
+int libsimul_init(struct libsimul_ctx *ctx, double dt);
 void libsimul_free(struct libsimul_ctx *ctx);
+int libsimul_fail(struct libsimul_ctx *ctx, int err, const char *fmt, ...);
+const char *libsimul_error(const struct libsimul_ctx *ctx);
+int libsimul_clone(struct libsimul_ctx *dst, const struct libsimul_ctx *src);
+int libsimul_unshare(struct libsimul_ctx *ctx);
+void netlist_unshare(struct libsimul_ctx *ctx);
 
 double get_voltage_source_current(struct libsimul_ctx *ctx, const char *vsname);
-void set_voltage_source(struct libsimul_ctx *ctx, const char *vsname, double V);
-void set_capacitor_voltage(struct libsimul_ctx *ctx, const char *capname, double V);
+int set_voltage_source(struct libsimul_ctx *ctx, const char *vsname, double V);
+int set_capacitor_voltage(struct libsimul_ctx *ctx, const char *capname, double V);
 int set_resistor(struct libsimul_ctx *ctx, const char *rsname, double R);
 int set_inductor(struct libsimul_ctx *ctx, const char *indname, double L);
+int set_capacitor(struct libsimul_ctx *ctx, const char *capname, double C);
+int set_element_resistance(struct libsimul_ctx *ctx, const char *elname, double R);
+double get_element_resistance(struct libsimul_ctx *ctx, const char *elname);
+int set_transformer_inductor(struct libsimul_ctx *ctx, const char *xfrname, double L);
 double get_resistor(struct libsimul_ctx *ctx, const char *rsname);
 double get_inductor(struct libsimul_ctx *ctx, const char *indname);
 double get_capacitor(struct libsimul_ctx *ctx, const char *capname);
@@ -128,8 +844,8 @@ int set_switch_state(struct libsimul_ctx *ctx, const char *swname, int state);
 void mark_node_seen(struct libsimul_ctx *ctx, int n);
 void check_dense_nodes(struct libsimul_ctx *ctx);
 void form_g_matrix(struct libsimul_ctx *ctx);
-void calc_lu(struct libsimul_ctx *ctx);
-void calc_V(struct libsimul_ctx *ctx);
+int calc_lu(struct libsimul_ctx *ctx);
+int calc_V(struct libsimul_ctx *ctx);
 void form_isrc_vector(struct libsimul_ctx *ctx);
 double get_V(struct libsimul_ctx *ctx, int node);
 int go_through_diodes(struct libsimul_ctx *ctx, int recalc_loop);
@@ -137,6 +853,7 @@ int signum(double d);
 void go_through_inductors(struct libsimul_ctx *ctx);
 void go_through_capacitors(struct libsimul_ctx *ctx);
 int go_through_all(struct libsimul_ctx *ctx, int recalc_loop);
+void init_element_state(const struct element *el, struct element_state *st);
 int add_element_used(
 	struct libsimul_ctx *ctx,
 	const char *element, int n1, int n2, enum element_type typ,
@@ -156,11 +873,169 @@ int add_element_used(
 	double VT,
 	double Is,
 	double Iaccuracy);
+void read_netlist_line(struct libsimul_ctx *ctx, char *line);
 void read_file(struct libsimul_ctx *ctx, const char *fname);
-void init_simulation(struct libsimul_ctx *ctx);
-void recalc(struct libsimul_ctx *ctx);
-void simulation_step(struct libsimul_ctx *ctx);
-void check_at_most_one_transformer(struct libsimul_ctx *ctx);
+int init_simulation(struct libsimul_ctx *ctx);
+int recalc(struct libsimul_ctx *ctx);
+int simulation_step(struct libsimul_ctx *ctx);
+int check_at_most_one_transformer(struct libsimul_ctx *ctx);
+void transformer_direct_denoms(struct libsimul_circuit *c);
 int set_diode_hint(struct libsimul_ctx *ctx, const char *dname, int state);
+int go_through_shockley_diodes_2(struct libsimul_ctx *ctx);
+
+int partition_find_floating(struct libsimul_ctx *ctx);
+int partition_init(struct libsimul_ctx *ctx);
+void partition_free(struct libsimul_ctx *ctx);
+int partition_lu(struct libsimul_ctx *ctx);
+int partition_solve(struct libsimul_ctx *ctx);
+int libsimul_set_partitioning(struct libsimul_ctx *ctx, int enable);
+int libsimul_set_block_border(struct libsimul_ctx *ctx, const int *nodes, size_t cnt);
+
+size_t nametab_hash(const char *name);
+int nametab_insert(struct libsimul_circuit *c, size_t idx);
+int nametab_foreach(const struct libsimul_circuit *c, const char *name,
+                    int (*fn)(const struct element *el, void *arg), void *arg);
+size_t libsimul_find_element(const struct libsimul_circuit *c, const char *name);
+int nametab_copy(struct libsimul_circuit *dst, const struct libsimul_circuit *src);
+void nametab_free(struct libsimul_circuit *c);
+int node_parse(struct libsimul_ctx *ctx, const char *tok);
+int node_lookup(const struct libsimul_circuit *c, const char *tok);
+size_t nodes_number(struct libsimul_ctx *ctx);
+void nodes_check(struct libsimul_ctx *ctx, size_t first);
+int libsimul_node(struct libsimul_ctx *ctx, const char *name);
+const char *libsimul_node_name(struct libsimul_ctx *ctx, int node);
+int nodes_copy(struct libsimul_circuit *dst, const struct libsimul_circuit *src);
+void nodes_free(struct libsimul_circuit *c);
+
+int libsimul_element_handle(struct libsimul_ctx *ctx, const char *name);
+int libsimul_handle_set_switch(struct libsimul_ctx *ctx, int h, int state);
+int libsimul_handle_set_source(struct libsimul_ctx *ctx, int h, double V);
+double libsimul_handle_voltage(struct libsimul_ctx *ctx, int h);
+double libsimul_handle_current(struct libsimul_ctx *ctx, int h);
+int pwm_valid(const struct libsimul_pwm *pwm);
+int pwm_read_directive(struct libsimul_ctx *ctx, char *lineptr);
+int pwm_init_simulation(struct libsimul_ctx *ctx);
+int pwm_copy_defs(struct libsimul_circuit *dst, const struct libsimul_circuit *src);
+void pwm_free_defs(struct libsimul_circuit *c);
+void pwm_apply(struct libsimul_ctx *ctx);
+double pwm_next_edge(struct libsimul_ctx *ctx);
+int set_pwm_duty(struct libsimul_ctx *ctx, const char *pwmname, double duty);
+double get_pwm_duty(struct libsimul_ctx *ctx, const char *pwmname);
+int libsimul_pwm_handle(struct libsimul_ctx *ctx, const char *pwmname);
+int libsimul_handle_set_pwm_duty(struct libsimul_ctx *ctx, int h, double duty);
+int wave_valid(const struct libsimul_wave *w);
+int wave_read_directive(struct libsimul_ctx *ctx, enum libsimul_wave_type typ, char *lineptr);
+int wave_init_simulation(struct libsimul_ctx *ctx);
+int wave_copy_defs(struct libsimul_circuit *dst, const struct libsimul_circuit *src);
+void wave_free_defs(struct libsimul_circuit *c);
+void wave_apply(struct libsimul_ctx *ctx);
+int ctl_valid(const struct libsimul_ctl *ctl);
+int ctl_read_directive(struct libsimul_ctx *ctx, char *lineptr);
+int ctl_init_simulation(struct libsimul_ctx *ctx);
+int ctl_copy_defs(struct libsimul_circuit *dst, const struct libsimul_circuit *src);
+void ctl_free_defs(struct libsimul_circuit *c);
+void ctl_run(struct libsimul_ctx *ctx);
+int set_control_param(struct libsimul_ctx *ctx, const char *blockname, const char *param, double val);
+double get_control_output(struct libsimul_ctx *ctx, const char *blockname);
+int subckt_read_directive(struct libsimul_ctx *ctx, char *lineptr);
+int subckt_add_line(struct libsimul_ctx *ctx, const char *line);
+int subckt_read_instance(struct libsimul_ctx *ctx, char *lineptr);
+void subckt_flatten(struct libsimul_ctx *ctx);
+int subckt_copy_defs(struct libsimul_circuit *dst, const struct libsimul_circuit *src);
+void subckt_free_defs(struct libsimul_circuit *c);
+int param_eval(const struct libsimul_circuit *c, const char *expr, double *val);
+double netlist_value(struct libsimul_ctx *ctx, const char *val, enum libsimul_param_target target,
+                     size_t idx, size_t off, enum libsimul_param_check check);
+char *param_subst(const char *val, char *const *names, char *const *values, size_t cnt);
+int param_read_directive(struct libsimul_ctx *ctx, char *lineptr);
+int params_copy_defs(struct libsimul_circuit *dst, const struct libsimul_circuit *src);
+void params_free_defs(struct libsimul_circuit *c);
+int libsimul_set_param(struct libsimul_ctx *ctx, const char *name, double val);
+double libsimul_get_param(struct libsimul_ctx *ctx, const char *name);
+int libsimul_find_instance(struct libsimul_ctx *ctx, const char *name);
+int libsimul_instance_node(struct libsimul_ctx *ctx, int inst, int node);
+int libsimul_set_instance_blocks(struct libsimul_ctx *ctx);
+
+uint64_t libsimul_circuit_hash(const struct libsimul_ctx *ctx);
+int libsimul_checkpoint_save(const struct libsimul_ctx *ctx, void **blob, size_t *blobsz);
+int libsimul_checkpoint_restore(struct libsimul_ctx *ctx, const void *blob, size_t blobsz);
+int libsimul_checkpoint_write(const struct libsimul_ctx *ctx, const char *fname);
+int libsimul_checkpoint_read(struct libsimul_ctx *ctx, const char *fname);
+
+int libsimul_dc_operating_point(struct libsimul_ctx *ctx);
+
+int libsimul_netlist_cache_write(struct libsimul_ctx *ctx, const char *netlist, const char *cache);
+int libsimul_netlist_cache_read(struct libsimul_ctx *ctx, const char *netlist, const char *cache);
+void read_file_cached(struct libsimul_ctx *ctx, const char *netlist, const char *cache);
+
+void read_spice_file(struct libsimul_ctx *ctx, const char *fname, double *tstep, double *tstop);
+
+int libsimul_run(struct libsimul_ctx *ctx, double t_end, libsimul_controller_fn ctl,
+                 double period, void *ctl_state, void *userdata);
+
+void libsimul_parareal_init(struct libsimul_parareal *pr, const struct libsimul_ctx *proto,
+                            double t_end, size_t windows, libsimul_controller_fn ctl,
+                            size_t ctl_state_size, const void *ctl_init, void *userdata);
+int libsimul_parareal_run(struct libsimul_parareal *pr);
+int libsimul_parareal_result(const struct libsimul_parareal *pr, struct libsimul_ctx *out, void *ctl_out);
+void libsimul_parareal_free(struct libsimul_parareal *pr);
+
+int libsimul_batch_init(struct libsimul_batch *b, const struct libsimul_ctx *proto, size_t width);
+void libsimul_batch_free(struct libsimul_batch *b);
+struct libsimul_ctx *libsimul_batch_lane(struct libsimul_batch *b, size_t lane);
+int libsimul_batch_recalc(struct libsimul_batch *b, size_t lane);
+int libsimul_batch_step(struct libsimul_batch *b);
+
+int libsimul_add_probe_voltage(struct libsimul_ctx *ctx, const char *name, int n1, int n2);
+int libsimul_add_probe_node_voltage(struct libsimul_ctx *ctx, const char *name, const char *n1, const char *n2);
+int libsimul_add_probe_inductor_current(struct libsimul_ctx *ctx, const char *name, const char *indname);
+int libsimul_add_probe_source_current(struct libsimul_ctx *ctx, const char *name, const char *vsname);
+int libsimul_add_probe_transformer_current(struct libsimul_ctx *ctx, const char *name, const char *xfrname);
+double libsimul_probe_value(struct libsimul_ctx *ctx, size_t probe);
+void libsimul_free_probes(struct libsimul_ctx *ctx);
+int libsimul_record_open(struct libsimul_ctx *ctx, const char *fname, enum record_format format,
+                         size_t ring_frames, size_t decimation);
+void libsimul_record_step(struct libsimul_ctx *ctx);
+void libsimul_record_get_stats(struct libsimul_ctx *ctx, struct libsimul_record_stats *st);
+int libsimul_record_close(struct libsimul_ctx *ctx);
+int libsimul_record_set_window(struct libsimul_ctx *ctx, size_t pre_frames, size_t post_frames);
+int libsimul_record_add_trigger(struct libsimul_ctx *ctx, enum record_trigger_type typ, int probe, double level);
+int libsimul_record_add_diode_trigger(struct libsimul_ctx *ctx, const char *dname);
+int libsimul_record_trigger(struct libsimul_ctx *ctx);
+uint64_t recfile_hash(const uint8_t *p, size_t sz);
+size_t recfile_encode_bound(size_t cnt, size_t framesz);
+size_t recfile_encode(const double *frames, size_t cnt, size_t framesz, uint8_t *out, uint8_t *syms);
+int libsimul_recfile_open(struct libsimul_recfile *rf, const char *fname);
+int libsimul_recfile_probe(const struct libsimul_recfile *rf, const char *name);
+int libsimul_recfile_seek(struct libsimul_recfile *rf, double t);
+int libsimul_recfile_next(struct libsimul_recfile *rf, const double **frame);
+void libsimul_recfile_close(struct libsimul_recfile *rf);
+int libsimul_live_open(struct libsimul_ctx *ctx, const char *name, size_t ring_frames, size_t decimation);
+void libsimul_live_step(struct libsimul_ctx *ctx);
+int libsimul_live_close(struct libsimul_ctx *ctx);
+int libsimul_live_attach(struct libsimul_live_view *v, const char *name);
+const char *libsimul_live_probe_name(const struct libsimul_live_view *v, size_t i);
+int libsimul_live_running(const struct libsimul_live_view *v);
+size_t libsimul_live_latest(const struct libsimul_live_view *v, double *frames, size_t maxframes);
+void libsimul_live_detach(struct libsimul_live_view *v);
+int libsimul_add_measurement_fixed(struct libsimul_ctx *ctx, int probe_v, int probe_i, double window);
+int libsimul_add_measurement_cycles(struct libsimul_ctx *ctx, int probe_v, int probe_i, size_t cycles);
+void libsimul_measure_step(struct libsimul_ctx *ctx);
+int libsimul_measurement_result(struct libsimul_ctx *ctx, int h, struct libsimul_measurement_result *res);
+void libsimul_free_measurements(struct libsimul_ctx *ctx);
+int libsimul_add_harmonics(struct libsimul_ctx *ctx, int probe, int probe_sync, double f0, size_t nharm);
+void libsimul_harmonics_step(struct libsimul_ctx *ctx);
+int libsimul_harmonics_result(struct libsimul_ctx *ctx, int h, double *thd, double *dc, double *ampl);
+void libsimul_free_harmonics(struct libsimul_ctx *ctx);
+
+void libsimul_mc_init(struct libsimul_mc *mc, const struct libsimul_ctx *proto,
+                      size_t runs, size_t nmeas, libsimul_mc_run_fn fn, void *userdata);
+int libsimul_mc_add_param(struct libsimul_mc *mc, const char *element,
+                          enum mc_param_kind kind, enum mc_dist dist, double tol);
+int libsimul_mc_run(struct libsimul_mc *mc);
+int libsimul_mc_stats(const struct libsimul_mc *mc, size_t meas, struct libsimul_mc_stats *st);
+double libsimul_mc_percentile_sorted(const double *sorted, size_t cnt, double pct);
+double libsimul_mc_yield(const struct libsimul_mc *mc, size_t meas, double lo, double hi);
+void libsimul_mc_free(struct libsimul_mc *mc);
 
 #endif
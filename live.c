@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libsimul.h"
+
+// Live ring of probe samples in POSIX shared memory for a viewer process.
+//
+// The shared memory holds a header, the probe names and a ring of frames
+// (time followed by all probes, like a recording). The simulation thread
+// writes a frame in place and publishes it by a release store of head; it
+// never waits, old frames are simply overwritten. A viewer copies the
+// latest frames and reads head again afterwards: the frames whose slots the
+// writer may have reached in the meantime are dropped from the copy, so the
+// viewer gets a consistent window without ever blocking the simulation.
+// This is a seqlock with head as the sequence: the writer has a release
+// fence between taking a slot and writing it, the viewer an acquire fence
+// between copying and reading head again. The ring is accessed with
+// relaxed atomics, plain loads and stores on the usual CPUs.
+
+static size_t live_map_size(size_t probecnt, size_t ring_frames)
+{
+	return sizeof(struct libsimul_live_header) + LIVE_NAME_SZ*probecnt +
+	       sizeof(double)*(1+probecnt)*ring_frames;
+}
+
+// Creates the shared memory ring name (e.g. "/libsimul-buck") with
+// ring_frames frames, rounded up to a power of two, and writes every
+// decimation'th step to it from now on. An existing ring of the same name
+// is replaced.
+int libsimul_live_open(struct libsimul_ctx *ctx, const char *name, size_t ring_frames, size_t decimation)
+{
+	struct libsimul_live *live;
+	struct libsimul_live_header *hdr;
+	size_t cap = 1;
+	size_t i;
+	void *p;
+	int fd;
+	if (ctx->live != NULL)
+	{
+		return -ERR_BUSY;
+	}
+	while (cap < ring_frames || cap < 2)
+	{
+		cap *= 2;
+	}
+	live = calloc(1, sizeof(*live));
+	if (live == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	live->name = strdup(name);
+	if (live->name == NULL)
+	{
+		free(live);
+		return -ERR_NO_MEMORY;
+	}
+	live->framesz = 1 + ctx->probecnt;
+	live->ring_frames = cap;
+	live->decimation = decimation ? decimation : 1;
+	live->mapsz = live_map_size(ctx->probecnt, cap);
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+	{
+		free(live->name);
+		free(live);
+		return -ERR_IO;
+	}
+	if (ftruncate(fd, (off_t)live->mapsz) != 0)
+	{
+		close(fd);
+		shm_unlink(name);
+		free(live->name);
+		free(live);
+		return -ERR_IO;
+	}
+	p = mmap(NULL, live->mapsz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		shm_unlink(name);
+		free(live->name);
+		free(live);
+		return -ERR_NO_MEMORY;
+	}
+	hdr = p;
+	hdr->version = LIVE_VERSION;
+	hdr->probecnt = (uint32_t)ctx->probecnt;
+	hdr->ring_frames = cap;
+	hdr->decimation = live->decimation;
+	hdr->dt = ctx->dt;
+	atomic_init(&hdr->state, LIVE_RUNNING);
+	atomic_init(&hdr->head, 0);
+	for (i = 0; i < ctx->probecnt; i++)
+	{
+		// Zero padded by ftruncate
+		strncpy(&hdr->names[i*LIVE_NAME_SZ], ctx->probes[i].name, LIVE_NAME_SZ-1);
+	}
+	// A viewer that sees the magic sees the rest of the header
+	atomic_thread_fence(memory_order_release);
+	memcpy(hdr->magic, LIVE_MAGIC, 4);
+	live->hdr = hdr;
+	live->ring = (_Atomic double*)&hdr->names[ctx->probecnt*LIVE_NAME_SZ];
+	ctx->live = live;
+	return 0;
+}
+
+// Called at the end of every simulation step
+void libsimul_live_step(struct libsimul_ctx *ctx)
+{
+	struct libsimul_live *live = ctx->live;
+	uint64_t head;
+	_Atomic double *frame;
+	size_t i;
+	if (++live->decimation_cnt < live->decimation)
+	{
+		return;
+	}
+	live->decimation_cnt = 0;
+	head = atomic_load_explicit(&live->hdr->head, memory_order_relaxed);
+	frame = &live->ring[(head & (live->ring_frames-1))*live->framesz];
+	// A viewer that sees any store to the slot also sees head reach it
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&frame[0], ctx->t, memory_order_relaxed);
+	for (i = 0; i < ctx->probecnt; i++)
+	{
+		atomic_store_explicit(&frame[i+1], libsimul_probe_value(ctx, i), memory_order_relaxed);
+	}
+	atomic_store_explicit(&live->hdr->head, head+1, memory_order_release);
+}
+
+// Tells the viewers that the simulation has ended and removes the ring. An
+// attached viewer keeps its mapping until it detaches.
+int libsimul_live_close(struct libsimul_ctx *ctx)
+{
+	struct libsimul_live *live = ctx->live;
+	int ret = 0;
+	if (live == NULL)
+	{
+		return 0;
+	}
+	atomic_store_explicit(&live->hdr->state, LIVE_DONE, memory_order_release);
+	munmap(live->hdr, live->mapsz);
+	if (shm_unlink(live->name) != 0)
+	{
+		ret = -ERR_IO;
+	}
+	free(live->name);
+	free(live);
+	ctx->live = NULL;
+	return ret;
+}
+
+// Maps the ring name of a running simulation read-only. Returns
+// -ERR_NOT_FOUND if there is none (yet) and -ERR_MISMATCH if it isn't a
+// live ring of this version.
+int libsimul_live_attach(struct libsimul_live_view *v, const char *name)
+{
+	const struct libsimul_live_header *hdr;
+	struct stat sb;
+	void *p;
+	int fd;
+	memset(v, 0, sizeof(*v));
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(*hdr))
+	{
+		close(fd);
+		return -ERR_MISMATCH;
+	}
+	p = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	hdr = p;
+	if (memcmp(hdr->magic, LIVE_MAGIC, 4) != 0 || hdr->version != LIVE_VERSION ||
+	    hdr->ring_frames == 0 || (hdr->ring_frames & (hdr->ring_frames-1)) != 0 ||
+	    hdr->ring_frames > (size_t)sb.st_size ||
+	    live_map_size(hdr->probecnt, hdr->ring_frames) != (size_t)sb.st_size)
+	{
+		munmap(p, (size_t)sb.st_size);
+		return -ERR_MISMATCH;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	v->hdr = hdr;
+	v->mapsz = (size_t)sb.st_size;
+	v->probecnt = hdr->probecnt;
+	v->framesz = 1 + hdr->probecnt;
+	v->ring = (const _Atomic double*)&hdr->names[hdr->probecnt*LIVE_NAME_SZ];
+	return 0;
+}
+
+// Name of probe i, the frames have it in column i+1
+const char *libsimul_live_probe_name(const struct libsimul_live_view *v, size_t i)
+{
+	return &v->hdr->names[i*LIVE_NAME_SZ];
+}
+
+// Nonzero until the simulation closes the ring
+int libsimul_live_running(const struct libsimul_live_view *v)
+{
+	return atomic_load_explicit(&v->hdr->state, memory_order_acquire) == LIVE_RUNNING;
+}
+
+// Copies up to maxframes of the latest frames to frames, oldest first.
+// Returns the number of frames copied, fewer if the simulation has just
+// started or has overwritten some of them while they were copied.
+size_t libsimul_live_latest(const struct libsimul_live_view *v, double *frames, size_t maxframes)
+{
+	const uint64_t R = v->hdr->ring_frames;
+	const size_t fsz = v->framesz;
+	uint64_t head, first, valid, k;
+	size_t cnt, drop, i;
+	head = atomic_load_explicit(&v->hdr->head, memory_order_acquire);
+	cnt = maxframes;
+	if (cnt > head)
+	{
+		cnt = (size_t)head;
+	}
+	if (cnt > R-1)
+	{
+		cnt = (size_t)(R-1);
+	}
+	first = head - cnt;
+	for (k = first; k < head; k++)
+	{
+		const _Atomic double *src = &v->ring[(k & (R-1))*fsz];
+		double *dst = &frames[(k-first)*fsz];
+		for (i = 0; i < fsz; i++)
+		{
+			dst[i] = atomic_load_explicit(&src[i], memory_order_relaxed);
+		}
+	}
+	atomic_thread_fence(memory_order_acquire);
+	// Frame k is intact unless the writer has started on frame k+R
+	head = atomic_load_explicit(&v->hdr->head, memory_order_relaxed);
+	valid = head >= R ? head - R + 1 : 0;
+	if (valid <= first)
+	{
+		return cnt;
+	}
+	drop = valid - first >= cnt ? cnt : (size_t)(valid - first);
+	memmove(frames, &frames[drop*fsz], sizeof(*frames)*fsz*(cnt-drop));
+	return cnt - drop;
+}
+
+void libsimul_live_detach(struct libsimul_live_view *v)
+{
+	if (v->hdr != NULL)
+	{
+		munmap((void*)v->hdr, v->mapsz);
+	}
+	memset(v, 0, sizeof(*v));
+}
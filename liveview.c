@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libsimul.h"
+
+#define WINDOW 4096
+
+static void sleep_ms(long ms)
+{
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+	nanosleep(&ts, NULL);
+}
+
+// Prints the time span and the range of every probe in the latest window
+static void show(const struct libsimul_live_view *v, const double *frames, size_t cnt)
+{
+	size_t i, j;
+	if (cnt == 0)
+	{
+		return;
+	}
+	printf("t %.6f .. %.6f", frames[0], frames[(cnt-1)*v->framesz]);
+	for (j = 1; j < v->framesz; j++)
+	{
+		double mn = frames[j], mx = frames[j];
+		for (i = 1; i < cnt; i++)
+		{
+			double x = frames[i*v->framesz + j];
+			mn = x < mn ? x : mn;
+			mx = x > mx ? x : mx;
+		}
+		printf("  %s %g .. %g", libsimul_live_probe_name(v, j-1), mn, mx);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+// Watches a simulation such as bucklive through its shared memory ring,
+// printing the latest window ten times a second until the simulation ends.
+int main(int argc, char **argv)
+{
+	const char *name = argc > 1 ? argv[1] : "/libsimul-bucklive";
+	struct libsimul_live_view v;
+	double *frames;
+	size_t cnt;
+	int tries = 0;
+	int running;
+	while (libsimul_live_attach(&v, name) != 0)
+	{
+		if (++tries == 100)
+		{
+			fprintf(stderr, "No live simulation %s\n", name);
+			return 1;
+		}
+		sleep_ms(100);
+	}
+	printf("%s: %zu probes, ring of %llu frames, dt %g, every %llu steps\n", name,
+	       v.probecnt, (unsigned long long)v.hdr->ring_frames, v.hdr->dt,
+	       (unsigned long long)v.hdr->decimation);
+	frames = malloc(sizeof(*frames)*v.framesz*WINDOW);
+	if (frames == NULL)
+	{
+		libsimul_live_detach(&v);
+		return 1;
+	}
+	do
+	{
+		running = libsimul_live_running(&v);
+		cnt = libsimul_live_latest(&v, frames, WINDOW);
+		show(&v, frames, cnt);
+		if (running)
+		{
+			sleep_ms(100);
+		}
+	}
+	while (running);
+	free(frames);
+	libsimul_live_detach(&v);
+	return 0;
+}
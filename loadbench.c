@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libsimul.h"
+
+// Load time of generated battery pack netlists: a string of cells with a
+// balancing resistor each and an isolated converter on every tenth cell.
+// Reading, which includes grouping the windings, and looking every element
+// up by name should both scale linearly with the element count, and loading the compiled cache
+// should be faster still. The circuits are too large for the dense solver,
+// so they aren't simulated.
+
+static const char *fname = "loadbench.tmp";
+static const char *cachename = "loadbench.cache";
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Returns the element count
+static size_t write_pack(size_t cells)
+{
+	FILE *f = fopen(fname, "w");
+	size_t i;
+	size_t cnt = 0;
+	int node = (int)cells+1;
+	if (f == NULL)
+	{
+		fprintf(stderr, "Can't open file %s\n", fname);
+		exit(1);
+	}
+	fprintf(f, "# Generated battery pack, %zu cells\n", cells);
+	for (i = 0; i < cells; i++)
+	{
+		fprintf(f, "%zu %zu VC%zu V=3.7 R=1e-3\n", i+1, i, i);
+		fprintf(f, "%zu %zu RB%zu R=1e3\n", i+1, i, i);
+		cnt += 2;
+		if (i % 10 == 0)
+		{
+			fprintf(f, "%zu %zu XM%zu N=10 primary=1 Lbase=1e-4 Vmin=-100 Vmax=100 R=1e-2\n", i+1, i, i);
+			fprintf(f, "%d %d XM%zu N=1 primary=0 R=1e-3\n", node, node+1, i);
+			fprintf(f, "%d %d RM%zu R=10\n", node, node+1, i);
+			node += 2;
+			cnt += 3;
+		}
+	}
+	if (fclose(f) != 0)
+	{
+		fprintf(stderr, "Can't write file %s\n", fname);
+		exit(1);
+	}
+	return cnt;
+}
+
+static void bench(size_t cells)
+{
+	struct libsimul_ctx ctx;
+	size_t cnt = write_pack(cells);
+	size_t i;
+	double t0, t1, t2, t3, t4;
+	libsimul_init(&ctx, 1e-6);
+	t0 = now();
+	read_file(&ctx, fname);
+	t1 = now();
+	for (i = 0; i < cnt; i++)
+	{
+		if (libsimul_element_handle(&ctx, ctx.circuit->elements_used[i]->name) < 0)
+		{
+			fprintf(stderr, "Element %s not found\n", ctx.circuit->elements_used[i]->name);
+			exit(1);
+		}
+	}
+	t2 = now();
+	if (libsimul_netlist_cache_write(&ctx, fname, cachename) != 0)
+	{
+		fprintf(stderr, "Can't write cache %s\n", cachename);
+		exit(1);
+	}
+	libsimul_free(&ctx);
+	libsimul_init(&ctx, 1e-6);
+	t3 = now();
+	if (libsimul_netlist_cache_read(&ctx, fname, cachename) != 0)
+	{
+		fprintf(stderr, "Can't read cache %s\n", cachename);
+		exit(1);
+	}
+	t4 = now();
+	printf("%7zu elements: read %8.2f ms (%5.0f ns/element) lookup %6.2f ms cached %8.2f ms\n",
+		cnt, (t1-t0)*1e3, (t1-t0)*1e9/cnt, (t2-t1)*1e3, (t4-t3)*1e3);
+	libsimul_free(&ctx);
+}
+
+int main(int argc, char **argv)
+{
+	size_t cells;
+	for (cells = 1000; cells <= 100*1000; cells *= 10)
+	{
+		bench(cells);
+	}
+	remove(fname);
+	remove(cachename);
+	return 0;
+}
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "libsimul.h"
+
+// Streaming measurements of probes.
+//
+// A measurement accumulates a voltage (or any) probe and optionally a
+// current probe over a window and keeps only running sums, so nothing is
+// stored per sample. The window is either a fixed length of simulation time
+// or a number of cycles of the voltage probe, delimited by its rising zero
+// crossings. When a window completes, average, RMS, minimum, maximum and
+// peak-to-peak of the voltage, average and RMS of the current, real power
+// (average of v*i) and power factor are latched and can be read until the
+// next window completes. Like probes, measurements belong to one context
+// and aren't cloned.
+
+static int meas_add(struct libsimul_ctx *ctx, int probe_v, int probe_i, double window, size_t cycles)
+{
+	struct libsimul_measurement *m;
+	if (probe_v < 0 || (size_t)probe_v >= ctx->probecnt ||
+	    (probe_i >= 0 && (size_t)probe_i >= ctx->probecnt))
+	{
+		return -ERR_NOT_FOUND;
+	}
+	if (ctx->meascnt >= ctx->meascap || ctx->meas == NULL)
+	{
+		size_t new_cap = 2*ctx->meascnt+8;
+		struct libsimul_measurement *new_meas;
+		new_meas = realloc(ctx->meas, sizeof(*ctx->meas)*new_cap);
+		if (new_meas == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		ctx->meas = new_meas;
+		ctx->meascap = new_cap;
+	}
+	m = &ctx->meas[ctx->meascnt];
+	memset(m, 0, sizeof(*m));
+	m->probe_v = (size_t)probe_v;
+	m->probe_i = probe_i >= 0 ? (size_t)probe_i : SIZE_MAX;
+	m->window = window;
+	m->cycles = cycles;
+	m->started = (cycles == 0);
+	m->v_min = INFINITY;
+	m->v_max = -INFINITY;
+	return (int)ctx->meascnt++;
+}
+
+// probe_i is -1 if there's no current probe
+int libsimul_add_measurement_fixed(struct libsimul_ctx *ctx, int probe_v, int probe_i, double window)
+{
+	if (!(window > 0))
+	{
+		return -ERR_INVALID;
+	}
+	return meas_add(ctx, probe_v, probe_i, window, 0);
+}
+
+int libsimul_add_measurement_cycles(struct libsimul_ctx *ctx, int probe_v, int probe_i, size_t cycles)
+{
+	if (cycles == 0)
+	{
+		return -ERR_INVALID;
+	}
+	return meas_add(ctx, probe_v, probe_i, 0, cycles);
+}
+
+static void meas_finish(struct libsimul_ctx *ctx, struct libsimul_measurement *m)
+{
+	struct libsimul_measurement_result *r = &m->res;
+	const double w = m->sum_w;
+	if (w > 0)
+	{
+		r->t_end = ctx->t;
+		r->duration = w;
+		r->avg = m->sum_v/w;
+		r->rms = sqrt(fmax(0, m->sum_v2/w));
+		r->min = m->v_min;
+		r->max = m->v_max;
+		r->pp = m->v_max - m->v_min;
+		r->i_avg = m->sum_i/w;
+		r->i_rms = sqrt(fmax(0, m->sum_i2/w));
+		r->power = m->sum_vi/w;
+		r->pf = (r->rms > 0 && r->i_rms > 0) ? r->power/(r->rms*r->i_rms) : NAN;
+		m->windows++;
+	}
+	m->sum_w = 0;
+	m->sum_v = 0;
+	m->sum_v2 = 0;
+	m->sum_i = 0;
+	m->sum_i2 = 0;
+	m->sum_vi = 0;
+	m->v_min = INFINITY;
+	m->v_max = -INFINITY;
+	m->crossings = 0;
+}
+
+// Called by simulation_step() after every step
+void libsimul_measure_step(struct libsimul_ctx *ctx)
+{
+	const double dt = ctx->dt;
+	size_t j;
+	for (j = 0; j < ctx->meascnt; j++)
+	{
+		struct libsimul_measurement *m = &ctx->meas[j];
+		double v = libsimul_probe_value(ctx, m->probe_v);
+		double i = m->probe_i != SIZE_MAX ? libsimul_probe_value(ctx, m->probe_i) : 0;
+		if (m->cycles)
+		{
+			int rising = m->prev_v <= 0 && v > 0;
+			m->prev_v = v;
+			if (rising)
+			{
+				if (!m->started)
+				{
+					m->started = 1;
+				}
+				else if (++m->crossings == m->cycles)
+				{
+					meas_finish(ctx, m);
+				}
+			}
+			if (!m->started)
+			{
+				continue;
+			}
+		}
+		m->sum_w += dt;
+		m->sum_v += v*dt;
+		m->sum_v2 += v*v*dt;
+		m->sum_i += i*dt;
+		m->sum_i2 += i*i*dt;
+		m->sum_vi += v*i*dt;
+		m->v_min = fmin(m->v_min, v);
+		m->v_max = fmax(m->v_max, v);
+		if (m->window > 0 && m->sum_w >= m->window - 1e-9*dt)
+		{
+			meas_finish(ctx, m);
+		}
+	}
+}
+
+// Result of the last completed window, -ERR_NO_DATA if none has completed
+int libsimul_measurement_result(struct libsimul_ctx *ctx, int h, struct libsimul_measurement_result *res)
+{
+	if (h < 0 || (size_t)h >= ctx->meascnt)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	if (ctx->meas[h].windows == 0)
+	{
+		return -ERR_NO_DATA;
+	}
+	*res = ctx->meas[h].res;
+	return 0;
+}
+
+void libsimul_free_measurements(struct libsimul_ctx *ctx)
+{
+	free(ctx->meas);
+	ctx->meas = NULL;
+	ctx->meascnt = 0;
+	ctx->meascap = 0;
+}
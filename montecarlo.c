@@ -0,0 +1,405 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "libsimul.h"
+
+// Monte Carlo component tolerance analysis.
+//
+// Every run is a clone of an initialized prototype context, so the netlist
+// is parsed once. A run's random numbers depend only on the seed and the run
+// number, so results are reproducible regardless of the thread count and of
+// which thread happens to execute which run. A run that fails doesn't stop
+// the others, its error and message are kept in errors and errmsgs.
+
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+// Uniform in [0,1)
+static double mc_uniform(uint64_t *rng)
+{
+	return (splitmix64(rng) >> 11) * (1.0/9007199254740992.0);
+}
+
+static double mc_normal(uint64_t *rng)
+{
+	double u1, u2;
+	do {
+		u1 = mc_uniform(rng);
+	} while (u1 <= 0);
+	u2 = mc_uniform(rng);
+	return sqrt(-2*log(u1))*cos(2*3.14159265358979*u2);
+}
+
+// Relative deviation of one parameter, e.g. 0.1 means +10 %
+static double mc_deviation(const struct libsimul_mc_param *p, uint64_t *rng)
+{
+	double x;
+	switch (p->dist)
+	{
+		case MC_DIST_UNIFORM:
+			return p->tol*(2*mc_uniform(rng)-1);
+		case MC_DIST_NORMAL:
+			// tol is the 3 sigma limit, truncated at it
+			do {
+				x = mc_normal(rng)/3;
+			} while (x < -1 || x > 1);
+			return p->tol*x;
+	}
+	abort();
+}
+
+static int mc_apply(struct libsimul_ctx *ctx, const struct libsimul_mc_param *p, double dev)
+{
+	const double k = 1.0 + dev;
+	switch (p->kind)
+	{
+		case MC_PARAM_R:
+			return set_element_resistance(ctx, p->element,
+				k*get_element_resistance(ctx, p->element));
+		case MC_PARAM_L:
+			return set_inductor(ctx, p->element, k*get_inductor(ctx, p->element));
+		case MC_PARAM_C:
+			return set_capacitor(ctx, p->element, k*get_capacitor(ctx, p->element));
+		case MC_PARAM_XFR_L:
+			return set_transformer_inductor(ctx, p->element,
+				k*get_transformer_inductor(ctx, p->element));
+	}
+	abort();
+}
+
+static int mc_one_run(struct libsimul_mc *mc, size_t run)
+{
+	struct libsimul_ctx ctx;
+	uint64_t rng = mc->seed ^ (0xD1B54A32D192ED03ULL*(uint64_t)(run+1));
+	double *meas = &mc->results[run*mc->nmeas];
+	size_t i;
+	int ret;
+	if (libsimul_clone(&ctx, mc->proto) != 0)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	for (i = 0; i < mc->nmeas; i++)
+	{
+		meas[i] = NAN;
+	}
+	ret = 0;
+	for (i = 0; i < mc->paramcnt; i++)
+	{
+		double dev = mc_deviation(&mc->params[i], &rng);
+		mc->deviations[run*mc->paramcnt + i] = dev;
+		if (ret == 0)
+		{
+			// The setters return ERR_HAVE_TO_SIMULATE_AGAIN on success
+			int set_ret = mc_apply(&ctx, &mc->params[i], dev);
+			ret = set_ret < 0 ? set_ret : 0;
+		}
+	}
+	if (ret == 0)
+	{
+		ret = recalc(&ctx);
+	}
+	if (ret == 0)
+	{
+		ret = mc->fn(&ctx, run, meas, mc->userdata);
+		// A failed step fails the run even if fn didn't check it
+		if (ctx.err != 0)
+		{
+			ret = ctx.err;
+		}
+		else if (ret > 0)
+		{
+			ret = -ERR_ABORTED;
+		}
+	}
+	if (ret != 0 && libsimul_error(&ctx)[0] != '\0')
+	{
+		mc->errmsgs[run] = strdup(libsimul_error(&ctx));
+	}
+	libsimul_free(&ctx);
+	return ret;
+}
+
+static void *mc_thread(void *arg)
+{
+	struct libsimul_mc *mc = arg;
+	for (;;)
+	{
+		size_t run = atomic_fetch_add(&mc->next_run, 1);
+		size_t i;
+		if (run >= mc->runs)
+		{
+			break;
+		}
+		mc->errors[run] = mc_one_run(mc, run);
+		if (mc->errors[run] != 0)
+		{
+			for (i = 0; i < mc->nmeas; i++)
+			{
+				mc->results[run*mc->nmeas + i] = NAN;
+			}
+			atomic_fetch_add(&mc->failed_runs, 1);
+		}
+	}
+	return NULL;
+}
+
+void libsimul_mc_init(struct libsimul_mc *mc, const struct libsimul_ctx *proto,
+                      size_t runs, size_t nmeas, libsimul_mc_run_fn fn, void *userdata)
+{
+	mc->proto = proto;
+	mc->params = NULL;
+	mc->paramcnt = 0;
+	mc->paramcap = 0;
+	mc->runs = runs;
+	mc->nmeas = nmeas;
+	mc->seed = 1;
+	mc->threads = 0;
+	mc->fn = fn;
+	mc->userdata = userdata;
+	mc->results = NULL;
+	mc->deviations = NULL;
+	mc->errors = NULL;
+	mc->errmsgs = NULL;
+	atomic_init(&mc->next_run, 0);
+	atomic_init(&mc->failed_runs, 0);
+}
+
+int libsimul_mc_add_param(struct libsimul_mc *mc, const char *element,
+                          enum mc_param_kind kind, enum mc_dist dist, double tol)
+{
+	struct libsimul_mc_param *p;
+	if (mc->paramcnt >= mc->paramcap || mc->params == NULL)
+	{
+		size_t new_cap = 2*mc->paramcnt+16;
+		struct libsimul_mc_param *new_params;
+		new_params = realloc(mc->params, sizeof(*mc->params)*new_cap);
+		if (new_params == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		mc->params = new_params;
+		mc->paramcap = new_cap;
+	}
+	p = &mc->params[mc->paramcnt];
+	p->element = strdup(element);
+	if (p->element == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	p->kind = kind;
+	p->dist = dist;
+	p->tol = tol;
+	mc->paramcnt++;
+	return 0;
+}
+
+static void mc_free_errors(struct libsimul_mc *mc)
+{
+	size_t run;
+	if (mc->errmsgs != NULL)
+	{
+		for (run = 0; run < mc->runs; run++)
+		{
+			free(mc->errmsgs[run]);
+		}
+	}
+	free(mc->errors);
+	free(mc->errmsgs);
+	mc->errors = NULL;
+	mc->errmsgs = NULL;
+}
+
+int libsimul_mc_run(struct libsimul_mc *mc)
+{
+	pthread_t *tids;
+	size_t threads = mc->threads;
+	size_t i;
+	free(mc->results);
+	free(mc->deviations);
+	mc_free_errors(mc);
+	mc->results = malloc(sizeof(*mc->results)*(mc->runs*mc->nmeas+1));
+	mc->deviations = malloc(sizeof(*mc->deviations)*(mc->runs*mc->paramcnt+1));
+	mc->errors = calloc(mc->runs+1, sizeof(*mc->errors));
+	mc->errmsgs = calloc(mc->runs+1, sizeof(*mc->errmsgs));
+	if (mc->results == NULL || mc->deviations == NULL ||
+	    mc->errors == NULL || mc->errmsgs == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	atomic_store(&mc->next_run, 0);
+	atomic_store(&mc->failed_runs, 0);
+	if (threads == 0)
+	{
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = n > 0 ? (size_t)n : 1;
+	}
+	if (threads > mc->runs)
+	{
+		threads = mc->runs;
+	}
+	if (threads <= 1)
+	{
+		mc_thread(mc);
+		return 0;
+	}
+	tids = malloc(sizeof(*tids)*threads);
+	if (tids == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	for (i = 0; i < threads; i++)
+	{
+		if (pthread_create(&tids[i], NULL, mc_thread, mc) != 0)
+		{
+			break;
+		}
+	}
+	if (i == 0)
+	{
+		// Couldn't start any thread, do the work here
+		mc_thread(mc);
+	}
+	threads = i;
+	for (i = 0; i < threads; i++)
+	{
+		pthread_join(tids[i], NULL);
+	}
+	free(tids);
+	return 0;
+}
+
+static int double_ptr_cmp(const void *a, const void *b)
+{
+	double da = *(const double*)a;
+	double db = *(const double*)b;
+	if (da < db)
+	{
+		return -1;
+	}
+	if (da > db)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+// Statistics of measurement meas over the successful runs. Percentiles use
+// linear interpolation between the closest ranks.
+int libsimul_mc_stats(const struct libsimul_mc *mc, size_t meas, struct libsimul_mc_stats *st)
+{
+	double *sorted;
+	double sum = 0, sumsq = 0;
+	size_t cnt = 0;
+	size_t run;
+	if (meas >= mc->nmeas || mc->results == NULL)
+	{
+		return -ERR_NO_DATA;
+	}
+	sorted = malloc(sizeof(*sorted)*(mc->runs+1));
+	if (sorted == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	st->worst_min_run = SIZE_MAX;
+	st->worst_max_run = SIZE_MAX;
+	for (run = 0; run < mc->runs; run++)
+	{
+		double x = mc->results[run*mc->nmeas + meas];
+		if (isnan(x))
+		{
+			continue;
+		}
+		if (cnt == 0 || x < st->min)
+		{
+			st->min = x;
+			st->worst_min_run = run;
+		}
+		if (cnt == 0 || x > st->max)
+		{
+			st->max = x;
+			st->worst_max_run = run;
+		}
+		sum += x;
+		sumsq += x*x;
+		sorted[cnt++] = x;
+	}
+	st->cnt = cnt;
+	if (cnt == 0)
+	{
+		free(sorted);
+		return -ERR_NO_DATA;
+	}
+	st->mean = sum/cnt;
+	st->stddev = cnt > 1 ? sqrt(fmax(0, (sumsq - sum*sum/cnt)/(cnt-1))) : 0;
+	qsort(sorted, cnt, sizeof(*sorted), double_ptr_cmp);
+	st->p1 = libsimul_mc_percentile_sorted(sorted, cnt, 1);
+	st->p5 = libsimul_mc_percentile_sorted(sorted, cnt, 5);
+	st->p50 = libsimul_mc_percentile_sorted(sorted, cnt, 50);
+	st->p95 = libsimul_mc_percentile_sorted(sorted, cnt, 95);
+	st->p99 = libsimul_mc_percentile_sorted(sorted, cnt, 99);
+	free(sorted);
+	return 0;
+}
+
+double libsimul_mc_percentile_sorted(const double *sorted, size_t cnt, double pct)
+{
+	double pos = pct/100.0*(cnt-1);
+	size_t lo;
+	if (pos <= 0)
+	{
+		return sorted[0];
+	}
+	if (pos >= cnt-1)
+	{
+		return sorted[cnt-1];
+	}
+	lo = (size_t)pos;
+	return sorted[lo] + (pos-lo)*(sorted[lo+1]-sorted[lo]);
+}
+
+// Fraction of successful runs where lo <= measurement <= hi
+double libsimul_mc_yield(const struct libsimul_mc *mc, size_t meas, double lo, double hi)
+{
+	size_t run, ok = 0;
+	if (meas >= mc->nmeas || mc->results == NULL || mc->runs == 0)
+	{
+		return NAN;
+	}
+	for (run = 0; run < mc->runs; run++)
+	{
+		double x = mc->results[run*mc->nmeas + meas];
+		if (!isnan(x) && x >= lo && x <= hi)
+		{
+			ok++;
+		}
+	}
+	return (double)ok/mc->runs;
+}
+
+void libsimul_mc_free(struct libsimul_mc *mc)
+{
+	size_t i;
+	for (i = 0; i < mc->paramcnt; i++)
+	{
+		free(mc->params[i].element);
+	}
+	free(mc->params);
+	free(mc->results);
+	free(mc->deviations);
+	mc_free_errors(mc);
+	mc->params = NULL;
+	mc->paramcnt = 0;
+	mc->paramcap = 0;
+	mc->results = NULL;
+	mc->deviations = NULL;
+}
@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "libsimul.h"
+
+// Hash table of element names, so that loading a netlist and looking
+// elements up by name don't scan all elements.
+//
+// The table has open addressing with linear probing and holds element
+// indices, SIZE_MAX marking free slots. Its size is a power of two and at
+// least twice the element count. Transformer windings share the name of the
+// transformer, so a name can have several entries; they're all in the same
+// probe sequence.
+
+size_t nametab_hash(const char *name)
+{
+	uint64_t h = 14695981039346656037ULL;
+	while (*name)
+	{
+		h ^= (unsigned char)*name++;
+		h *= 1099511628211ULL;
+	}
+	return (size_t)(h ^ (h >> 32));
+}
+
+static void nametab_put(size_t *tab, size_t cap, const struct element *el)
+{
+	size_t pos = nametab_hash(el->name) & (cap-1);
+	while (tab[pos] != SIZE_MAX)
+	{
+		pos = (pos+1) & (cap-1);
+	}
+	tab[pos] = el->idx;
+}
+
+// Adds the element elements_used[idx], called by add_element_used() after
+// the element has been appended
+int nametab_insert(struct libsimul_circuit *c, size_t idx)
+{
+	size_t i;
+	if (c->name_tab == NULL || 2*c->elements_used_sz > c->name_tab_cap)
+	{
+		size_t new_cap = c->name_tab_cap ? 2*c->name_tab_cap : 64;
+		size_t *new_tab;
+		while (2*c->elements_used_sz > new_cap)
+		{
+			new_cap *= 2;
+		}
+		new_tab = malloc(sizeof(*new_tab)*new_cap);
+		if (new_tab == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		for (i = 0; i < new_cap; i++)
+		{
+			new_tab[i] = SIZE_MAX;
+		}
+		for (i = 0; i < c->elements_used_sz; i++)
+		{
+			if (i != idx)
+			{
+				nametab_put(new_tab, new_cap, c->elements_used[i]);
+			}
+		}
+		free(c->name_tab);
+		c->name_tab = new_tab;
+		c->name_tab_cap = new_cap;
+	}
+	nametab_put(c->name_tab, c->name_tab_cap, c->elements_used[idx]);
+	return 0;
+}
+
+// Calls fn for every element named name, stops if it returns nonzero and
+// returns its return value
+int nametab_foreach(const struct libsimul_circuit *c, const char *name,
+                    int (*fn)(const struct element *el, void *arg), void *arg)
+{
+	const size_t mask = c->name_tab_cap-1;
+	size_t pos;
+	int ret;
+	if (c->name_tab == NULL)
+	{
+		return 0;
+	}
+	for (pos = nametab_hash(name) & mask; c->name_tab[pos] != SIZE_MAX; pos = (pos+1) & mask)
+	{
+		const struct element *el = c->elements_used[c->name_tab[pos]];
+		if (strcmp(el->name, name) == 0)
+		{
+			ret = fn(el, arg);
+			if (ret != 0)
+			{
+				return ret;
+			}
+		}
+	}
+	return 0;
+}
+
+static int nametab_find_cb(const struct element *el, void *arg)
+{
+	size_t *found = arg;
+	if (el->primary)
+	{
+		*found = el->idx;
+		return 1;
+	}
+	if (*found == SIZE_MAX || el->idx < *found)
+	{
+		*found = el->idx;
+	}
+	return 0;
+}
+
+// Index of the element named name or SIZE_MAX if there's none. For
+// transformers, the index of the primary winding, or of the first winding
+// if the transformer has no primary.
+size_t libsimul_find_element(const struct libsimul_circuit *c, const char *name)
+{
+	size_t found = SIZE_MAX;
+	nametab_foreach(c, name, nametab_find_cb, &found);
+	return found;
+}
+
+int nametab_copy(struct libsimul_circuit *dst, const struct libsimul_circuit *src)
+{
+	dst->name_tab = NULL;
+	dst->name_tab_cap = 0;
+	if (src->name_tab == NULL)
+	{
+		return 0;
+	}
+	dst->name_tab = malloc(sizeof(*dst->name_tab)*src->name_tab_cap);
+	if (dst->name_tab == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	memcpy(dst->name_tab, src->name_tab, sizeof(*dst->name_tab)*src->name_tab_cap);
+	dst->name_tab_cap = src->name_tab_cap;
+	return 0;
+}
+
+void nametab_free(struct libsimul_circuit *c)
+{
+	free(c->name_tab);
+	c->name_tab = NULL;
+	c->name_tab_cap = 0;
+}
@@ -0,0 +1,1178 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libsimul.h"
+
+// Compiled netlist cache.
+//
+// The cache is a binary image of the circuit after read_file() and the
+// load-time part of init_simulation(): elements with their values, node
+// usage and names, transformer winding groups, galvanically isolated
+// parts, block border, name table, PWM modulators, waveforms, control
+// blocks, subcircuit instances and parameters with the values that use
+// them. The cache of a circuit with overridden parameters isn't written.
+// It starts with a magic, a version and the FNV-1a hash of the netlist
+// text, so a cache of an edited netlist is never used. Everything is in
+// native byte order, strings are a 32-bit length and the bytes. The cache
+// is mapped with a single mmap() and decoded without any parsing or name
+// lookups. The decoder checks every count, index and enum, and the values
+// of PWM modulators, waveforms and control blocks like the netlist reader,
+// so a damaged cache can't make the simulation access memory it doesn't
+// own; a damaged element value isn't detected.
+
+#define NETCACHE_NULL_STR UINT32_MAX
+
+struct netcache_writer {
+	unsigned char *p;
+	size_t off;
+	size_t cap;
+	int oom;
+};
+
+struct netcache_reader {
+	const unsigned char *p;
+	size_t off;
+	size_t sz;
+	int bad; // read past the end
+};
+
+static void put_bytes(struct netcache_writer *w, const void *data, size_t sz)
+{
+	if (w->oom)
+	{
+		return;
+	}
+	if (w->off + sz > w->cap)
+	{
+		size_t new_cap = 2*(w->off + sz) + 4096;
+		unsigned char *new_p = realloc(w->p, new_cap);
+		if (new_p == NULL)
+		{
+			w->oom = 1;
+			return;
+		}
+		w->p = new_p;
+		w->cap = new_cap;
+	}
+	if (sz)
+	{
+		memcpy(&w->p[w->off], data, sz);
+	}
+	w->off += sz;
+}
+
+static void put_u32(struct netcache_writer *w, uint32_t u)
+{
+	put_bytes(w, &u, sizeof(u));
+}
+
+static void put_u64(struct netcache_writer *w, uint64_t u)
+{
+	put_bytes(w, &u, sizeof(u));
+}
+
+static void put_size(struct netcache_writer *w, size_t s)
+{
+	put_u64(w, s == SIZE_MAX ? UINT64_MAX : (uint64_t)s);
+}
+
+static void put_int(struct netcache_writer *w, int i)
+{
+	put_u32(w, (uint32_t)i);
+}
+
+static void put_double(struct netcache_writer *w, double d)
+{
+	put_bytes(w, &d, sizeof(d));
+}
+
+static void put_str(struct netcache_writer *w, const char *s)
+{
+	if (s == NULL)
+	{
+		put_u32(w, NETCACHE_NULL_STR);
+		return;
+	}
+	put_u32(w, (uint32_t)strlen(s));
+	put_bytes(w, s, strlen(s));
+}
+
+static const void *get_bytes(struct netcache_reader *r, size_t sz)
+{
+	const void *p;
+	if (r->bad || sz > r->sz - r->off)
+	{
+		r->bad = 1;
+		return NULL;
+	}
+	p = &r->p[r->off];
+	r->off += sz;
+	return p;
+}
+
+static uint32_t get_u32(struct netcache_reader *r)
+{
+	uint32_t u = 0;
+	const void *p = get_bytes(r, sizeof(u));
+	if (p != NULL)
+	{
+		memcpy(&u, p, sizeof(u));
+	}
+	return u;
+}
+
+static uint64_t get_u64(struct netcache_reader *r)
+{
+	uint64_t u = 0;
+	const void *p = get_bytes(r, sizeof(u));
+	if (p != NULL)
+	{
+		memcpy(&u, p, sizeof(u));
+	}
+	return u;
+}
+
+static size_t get_size(struct netcache_reader *r)
+{
+	uint64_t u = get_u64(r);
+	return u == UINT64_MAX ? SIZE_MAX : (size_t)u;
+}
+
+// Count of objects that follow, each at least minsz bytes
+static size_t get_count(struct netcache_reader *r, size_t minsz)
+{
+	uint64_t u = get_u64(r);
+	if (u > (r->sz - r->off)/minsz)
+	{
+		r->bad = 1;
+		return 0;
+	}
+	return (size_t)u;
+}
+
+static int get_int(struct netcache_reader *r)
+{
+	return (int)get_u32(r);
+}
+
+static double get_double(struct netcache_reader *r)
+{
+	double d = 0;
+	const void *p = get_bytes(r, sizeof(d));
+	if (p != NULL)
+	{
+		memcpy(&d, p, sizeof(d));
+	}
+	return d;
+}
+
+// Allocated string, NULL for a NULL string or an error, which sets *err
+static char *get_str(struct netcache_reader *r, int *err)
+{
+	uint32_t len = get_u32(r);
+	const char *p;
+	char *s;
+	if (len == NETCACHE_NULL_STR)
+	{
+		return NULL;
+	}
+	p = get_bytes(r, len);
+	if (p == NULL)
+	{
+		*err = 1;
+		return NULL;
+	}
+	s = malloc((size_t)len+1);
+	if (s == NULL)
+	{
+		*err = 1;
+		return NULL;
+	}
+	memcpy(s, p, len);
+	s[len] = '\0';
+	return s;
+}
+
+struct netcache_map {
+	const unsigned char *p;
+	size_t sz;
+};
+
+static int map_file(const char *fname, struct netcache_map *m)
+{
+	struct stat st;
+	void *p;
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0)
+	{
+		return -ERR_NO_DATA;
+	}
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return -ERR_IO;
+	}
+	m->sz = (size_t)st.st_size;
+	m->p = NULL;
+	if (m->sz == 0)
+	{
+		close(fd);
+		return 0;
+	}
+	p = mmap(NULL, m->sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		return -ERR_IO;
+	}
+	m->p = p;
+	return 0;
+}
+
+static void unmap_file(struct netcache_map *m)
+{
+	if (m->p != NULL)
+	{
+		munmap((void *)m->p, m->sz);
+	}
+}
+
+// FNV-1a hash of the netlist text and the cache format
+static int netlist_hash(const char *netlist, uint64_t *hash)
+{
+	struct netcache_map m;
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+	int ret = map_file(netlist, &m);
+	if (ret != 0)
+	{
+		return ret == -ERR_NO_DATA ? -ERR_IO : ret;
+	}
+	for (i = 0; i < m.sz; i++)
+	{
+		h ^= m.p[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= NETCACHE_VERSION;
+	h *= 1099511628211ULL;
+	unmap_file(&m);
+	*hash = h;
+	return 0;
+}
+
+static void put_signal(struct netcache_writer *w, const struct libsimul_signal *sig)
+{
+	put_u32(w, sig->typ);
+	put_double(w, sig->val);
+	put_int(w, sig->n1);
+	put_int(w, sig->n2);
+	put_str(w, sig->name);
+}
+
+static void get_signal(struct netcache_reader *r, struct libsimul_signal *sig, int *err)
+{
+	sig->typ = (enum libsimul_signal_type)get_u32(r);
+	sig->val = get_double(r);
+	sig->n1 = get_int(r);
+	sig->n2 = get_int(r);
+	sig->name = get_str(r, err);
+}
+
+static void put_element(struct netcache_writer *w, const struct element *el)
+{
+	size_t j;
+	put_str(w, el->name);
+	put_int(w, el->n1);
+	put_int(w, el->n2);
+	put_u32(w, el->typ);
+	put_double(w, el->V);
+	put_double(w, el->Vinit);
+	put_double(w, el->Iinit);
+	put_double(w, el->L);
+	put_double(w, el->R);
+	put_double(w, el->C);
+	put_double(w, el->N);
+	put_double(w, el->Vmin);
+	put_double(w, el->Vmax);
+	put_double(w, el->Lbase);
+	put_double(w, el->I_s);
+	put_double(w, el->V_T);
+	put_double(w, el->I_accuracy);
+	put_double(w, el->transformer_direct_denom);
+	put_double(w, el->diode_threshold);
+	put_int(w, el->primary);
+	put_int(w, el->on_recalc);
+	put_size(w, el->primaryptr != NULL ? el->primaryptr->idx : SIZE_MAX);
+	put_u64(w, el->allptrs_size);
+	for (j = 0; j < el->allptrs_size; j++)
+	{
+		put_u64(w, el->allptrs[j]->idx);
+	}
+}
+
+// Writes the cache of the circuit read from netlist. Groups transformer
+// windings and finds the isolated parts of the circuit first, like
+// init_simulation().
+int libsimul_netlist_cache_write(struct libsimul_ctx *ctx, const char *netlist, const char *cache)
+{
+	const struct libsimul_circuit *c;
+	struct netcache_writer w = {NULL, 0, 0, 0};
+	uint64_t hash;
+	size_t i, j;
+	FILE *f;
+	int ret;
+	for (i = 0; i < ctx->circuit->paramcnt; i++)
+	{
+		// The cache is of the netlist, not of a modified circuit
+		if (ctx->circuit->params[i].overridden)
+		{
+			return -ERR_BUSY;
+		}
+	}
+	ret = netlist_hash(netlist, &hash);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	check_dense_nodes(ctx);
+	if (check_at_most_one_transformer(ctx) != 0 || partition_find_floating(ctx) != 0)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c = ctx->circuit;
+
+	put_bytes(&w, NETCACHE_MAGIC, 4);
+	put_u32(&w, NETCACHE_VERSION);
+	put_u64(&w, hash);
+	put_int(&w, c->has_shockley);
+	put_int(&w, c->windings_grouped);
+
+	put_u64(&w, c->elements_used_sz);
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		put_element(&w, c->elements_used[i]);
+	}
+	put_u64(&w, c->name_tab_cap);
+	for (i = 0; i < c->name_tab_cap; i++)
+	{
+		put_size(&w, c->name_tab[i]);
+	}
+	put_u64(&w, c->node_seen_sz);
+	put_bytes(&w, c->node_seen, c->node_seen_sz);
+	put_u64(&w, c->node_namecnt);
+	for (i = 0; i < c->node_namecnt; i++)
+	{
+		put_str(&w, c->node_names[i].name);
+		put_int(&w, c->node_names[i].node);
+		put_u64(&w, c->node_names[i].uses);
+	}
+	put_u64(&w, c->node_tab_cap);
+	for (i = 0; i < c->node_tab_cap; i++)
+	{
+		put_size(&w, c->node_tab[i]);
+	}
+	put_u64(&w, c->floating_ref_cnt);
+	for (i = 0; i < c->floating_ref_cnt; i++)
+	{
+		put_int(&w, c->floating_ref[i]);
+	}
+	put_u64(&w, c->bordercnt);
+	for (i = 0; i < c->bordercnt; i++)
+	{
+		put_int(&w, c->border[i]);
+	}
+
+	put_u64(&w, c->pwmcnt);
+	for (i = 0; i < c->pwmcnt; i++)
+	{
+		const struct libsimul_pwm *pwm = &c->pwms[i];
+		put_str(&w, pwm->name);
+		put_double(&w, pwm->f);
+		put_double(&w, pwm->deadtime);
+		put_double(&w, pwm->phase);
+		put_double(&w, pwm->duty_init);
+		put_str(&w, pwm->high_name);
+		put_str(&w, pwm->low_name);
+	}
+	put_u64(&w, c->wavecnt);
+	for (i = 0; i < c->wavecnt; i++)
+	{
+		const struct libsimul_wave *wv = &c->waves[i];
+		put_u32(&w, wv->typ);
+		put_u64(&w, wv->srccnt);
+		for (j = 0; j < wv->srccnt; j++)
+		{
+			put_str(&w, wv->srcs[j].name);
+			put_double(&w, wv->srcs[j].ph_c);
+			put_double(&w, wv->srcs[j].ph_s);
+		}
+		put_double(&w, wv->ampl);
+		put_double(&w, wv->f);
+		put_double(&w, wv->phase);
+		put_double(&w, wv->offset);
+		put_double(&w, wv->low);
+		put_double(&w, wv->high);
+		put_double(&w, wv->delay);
+		put_double(&w, wv->rise);
+		put_double(&w, wv->fall);
+		put_double(&w, wv->width);
+		put_double(&w, wv->period);
+		put_u64(&w, wv->pwlcnt);
+		for (j = 0; j < 2*wv->pwlcnt; j++)
+		{
+			put_double(&w, wv->pwl[j]);
+		}
+	}
+	put_u64(&w, c->ctlcnt);
+	for (i = 0; i < c->ctlcnt; i++)
+	{
+		const struct libsimul_ctl *ctl = &c->ctls[i];
+		put_str(&w, ctl->name);
+		put_u32(&w, ctl->typ);
+		put_signal(&w, &ctl->in);
+		put_signal(&w, &ctl->ref);
+		put_int(&w, ctl->has_ref);
+		put_double(&w, ctl->Ts);
+		put_double(&w, ctl->kp);
+		put_double(&w, ctl->ki);
+		put_double(&w, ctl->kd);
+		put_double(&w, ctl->min);
+		put_double(&w, ctl->max);
+		put_double(&w, ctl->hyst);
+		put_double(&w, ctl->init);
+		put_u64(&w, ctl->n);
+		put_u64(&w, ctl->bufoff);
+		put_str(&w, ctl->out_name);
+	}
+	put_u64(&w, c->ctl_bufsz);
+
+	put_u64(&w, c->subcktcnt);
+	for (i = 0; i < c->subcktcnt; i++)
+	{
+		const struct libsimul_subckt *sc = &c->subckts[i];
+		put_str(&w, sc->name);
+		put_u64(&w, sc->portcnt);
+		put_u64(&w, sc->internalcnt);
+		put_int(&w, sc->maxnode);
+		for (j = 0; j <= (size_t)sc->maxnode; j++)
+		{
+			put_int(&w, sc->localmap[j]);
+		}
+		put_u64(&w, sc->paramcnt);
+		for (j = 0; j < sc->paramcnt; j++)
+		{
+			put_str(&w, sc->param_names[j]);
+			put_str(&w, sc->param_values[j]);
+		}
+		put_u64(&w, sc->linecnt);
+		for (j = 0; j < sc->linecnt; j++)
+		{
+			put_str(&w, sc->lines[j]);
+		}
+	}
+	put_u64(&w, c->instcnt);
+	for (i = 0; i < c->instcnt; i++)
+	{
+		const struct libsimul_instance *in = &c->insts[i];
+		put_str(&w, in->name);
+		put_u64(&w, in->subckt);
+		put_size(&w, in->parent);
+		put_u64(&w, in->portcnt);
+		for (j = 0; j < in->portcnt; j++)
+		{
+			put_int(&w, in->ports[j]);
+		}
+		for (j = 0; j < c->subckts[in->subckt].paramcnt; j++)
+		{
+			put_str(&w, in->params[j]);
+		}
+		put_u64(&w, in->el_first);
+		put_u64(&w, in->el_cnt);
+		put_int(&w, in->node_first);
+		put_u64(&w, in->node_cnt);
+	}
+	put_u64(&w, c->paramcnt);
+	for (i = 0; i < c->paramcnt; i++)
+	{
+		put_str(&w, c->params[i].name);
+		put_str(&w, c->params[i].expr);
+		put_double(&w, c->params[i].val);
+	}
+	put_u64(&w, c->param_usecnt);
+	for (i = 0; i < c->param_usecnt; i++)
+	{
+		const struct libsimul_param_use *use = &c->param_uses[i];
+		put_int(&w, (int)use->target);
+		put_u64(&w, use->idx);
+		put_u64(&w, use->off);
+		put_int(&w, (int)use->check);
+		put_str(&w, use->expr);
+	}
+	if (w.oom)
+	{
+		free(w.p);
+		return -ERR_NO_MEMORY;
+	}
+
+	f = fopen(cache, "wb");
+	if (f == NULL)
+	{
+		free(w.p);
+		return -ERR_IO;
+	}
+	ret = (fwrite(w.p, 1, w.off, f) == w.off) ? 0 : -ERR_IO;
+	if (fclose(f) != 0)
+	{
+		ret = -ERR_IO;
+	}
+	free(w.p);
+	if (ret != 0)
+	{
+		remove(cache);
+	}
+	return ret;
+}
+
+static int get_elements(struct netcache_reader *r, struct libsimul_ctx *ctx)
+{
+	struct libsimul_circuit *c = ctx->circuit;
+	size_t cnt = get_count(r, 8);
+	size_t i, j;
+	int err = 0;
+	c->elements_used = malloc(sizeof(*c->elements_used)*(cnt+1));
+	ctx->state = malloc(sizeof(*ctx->state)*(cnt+1));
+	if (c->elements_used == NULL || ctx->state == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c->elements_used_cap = cnt+1;
+	ctx->state_cap = cnt+1;
+	for (i = 0; i < cnt; i++)
+	{
+		struct element *el = calloc(1, sizeof(*el));
+		size_t primary_idx;
+		if (el == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		c->elements_used[c->elements_used_sz++] = el;
+		el->idx = i;
+		el->name = get_str(r, &err);
+		el->n1 = get_int(r);
+		el->n2 = get_int(r);
+		el->typ = (enum element_type)get_u32(r);
+		el->V = get_double(r);
+		el->Vinit = get_double(r);
+		el->Iinit = get_double(r);
+		el->L = get_double(r);
+		el->R = get_double(r);
+		el->C = get_double(r);
+		el->N = get_double(r);
+		el->Vmin = get_double(r);
+		el->Vmax = get_double(r);
+		el->Lbase = get_double(r);
+		el->I_s = get_double(r);
+		el->V_T = get_double(r);
+		el->I_accuracy = get_double(r);
+		el->transformer_direct_denom = get_double(r);
+		el->diode_threshold = get_double(r);
+		el->primary = get_int(r);
+		el->on_recalc = get_int(r);
+		primary_idx = get_size(r);
+		// Resolved when all elements exist
+		el->primaryptr = (struct element *)(uintptr_t)(primary_idx == SIZE_MAX ? 0 : primary_idx+1);
+		el->allptrs_size = get_count(r, 8);
+		if (el->allptrs_size)
+		{
+			el->allptrs = malloc(sizeof(*el->allptrs)*el->allptrs_size);
+			if (el->allptrs == NULL)
+			{
+				return -ERR_NO_MEMORY;
+			}
+			el->allptrs_capacity = el->allptrs_size;
+			for (j = 0; j < el->allptrs_size; j++)
+			{
+				el->allptrs[j] = (struct element *)(uintptr_t)get_u64(r);
+			}
+		}
+		if (err || r->bad || el->name == NULL || (unsigned)el->typ > TYPE_TRANSFORMER_DIRECT)
+		{
+			return err ? -ERR_NO_MEMORY : -ERR_MISMATCH;
+		}
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		struct element *el = c->elements_used[i];
+		uintptr_t p = (uintptr_t)el->primaryptr;
+		if (p > cnt)
+		{
+			return -ERR_MISMATCH;
+		}
+		el->primaryptr = p ? c->elements_used[p-1] : NULL;
+		for (j = 0; j < el->allptrs_size; j++)
+		{
+			uintptr_t k = (uintptr_t)el->allptrs[j];
+			if (k >= cnt)
+			{
+				return -ERR_MISMATCH;
+			}
+			el->allptrs[j] = c->elements_used[k];
+		}
+		init_element_state(el, &ctx->state[i]);
+	}
+	return 0;
+}
+
+static int get_nodes(struct netcache_reader *r, struct libsimul_circuit *c)
+{
+	const void *p;
+	size_t cnt, i;
+	int err = 0;
+	cnt = get_count(r, 8);
+	// Probed with a mask, see nametab.c
+	if (cnt == 0 || (cnt & (cnt-1)))
+	{
+		return -ERR_MISMATCH;
+	}
+	c->name_tab = malloc(sizeof(*c->name_tab)*(cnt+1));
+	if (c->name_tab == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c->name_tab_cap = cnt;
+	for (i = 0; i < cnt; i++)
+	{
+		c->name_tab[i] = get_size(r);
+		if (c->name_tab[i] != SIZE_MAX && c->name_tab[i] >= c->elements_used_sz)
+		{
+			return -ERR_MISMATCH;
+		}
+	}
+	cnt = get_count(r, 1);
+	p = get_bytes(r, cnt);
+	c->node_seen = malloc(cnt+1);
+	if (c->node_seen == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	if (p != NULL)
+	{
+		memcpy(c->node_seen, p, cnt);
+	}
+	c->node_seen_sz = cnt;
+	c->node_seen_cap = cnt;
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		const struct element *el = c->elements_used[i];
+		if (el->n1 < 0 || el->n2 < 0 || (size_t)el->n1 >= cnt || (size_t)el->n2 >= cnt)
+		{
+			return -ERR_MISMATCH;
+		}
+	}
+	cnt = get_count(r, 4);
+	c->node_names = calloc(cnt+1, sizeof(*c->node_names));
+	if (c->node_names == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c->node_namecap = cnt+1;
+	for (i = 0; i < cnt; i++)
+	{
+		struct libsimul_node_name *nn = &c->node_names[c->node_namecnt++];
+		nn->name = get_str(r, &err);
+		nn->node = get_int(r);
+		nn->uses = get_u64(r);
+		if (err || r->bad || nn->name == NULL || nn->node < 0 || (size_t)nn->node >= c->node_seen_sz)
+		{
+			return err ? -ERR_NO_MEMORY : -ERR_MISMATCH;
+		}
+	}
+	c->node_numbered = cnt;
+	cnt = get_count(r, 8);
+	if (cnt & (cnt-1))
+	{
+		return -ERR_MISMATCH;
+	}
+	c->node_tab = malloc(sizeof(*c->node_tab)*(cnt+1));
+	if (c->node_tab == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c->node_tab_cap = cnt;
+	for (i = 0; i < cnt; i++)
+	{
+		c->node_tab[i] = get_size(r);
+		if (c->node_tab[i] != SIZE_MAX && c->node_tab[i] >= c->node_namecnt)
+		{
+			return -ERR_MISMATCH;
+		}
+	}
+	cnt = get_count(r, 4);
+	c->floating_ref = malloc(sizeof(*c->floating_ref)*(cnt+1));
+	if (c->floating_ref == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		c->floating_ref[i] = get_int(r);
+		if (c->floating_ref[i] <= 0 || (size_t)c->floating_ref[i] >= c->node_seen_sz)
+		{
+			return -ERR_MISMATCH;
+		}
+	}
+	c->floating_ref_cnt = cnt;
+	c->floating_found = 1;
+	cnt = get_count(r, 4);
+	c->border = malloc(sizeof(*c->border)*(cnt+1));
+	if (c->border == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		c->border[i] = get_int(r);
+		if (c->border[i] <= 0 || (size_t)c->border[i] >= c->node_seen_sz)
+		{
+			return -ERR_MISMATCH;
+		}
+	}
+	c->bordercnt = cnt;
+	return 0;
+}
+
+static int get_defs(struct netcache_reader *r, struct libsimul_circuit *c)
+{
+	size_t cnt, i, j;
+	int err = 0;
+	cnt = get_count(r, 4);
+	c->pwms = calloc(cnt+1, sizeof(*c->pwms));
+	if (c->pwms == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c->pwmcnt = cnt;
+	c->pwmcap = cnt+1;
+	for (i = 0; i < cnt; i++)
+	{
+		struct libsimul_pwm *pwm = &c->pwms[i];
+		pwm->name = get_str(r, &err);
+		pwm->f = get_double(r);
+		pwm->deadtime = get_double(r);
+		pwm->phase = get_double(r);
+		pwm->duty_init = get_double(r);
+		pwm->high_name = get_str(r, &err);
+		pwm->low_name = get_str(r, &err);
+		if (!r->bad && !pwm_valid(pwm))
+		{
+			return -ERR_MISMATCH;
+		}
+	}
+	cnt = get_count(r, 4);
+	c->waves = calloc(cnt+1, sizeof(*c->waves));
+	if (c->waves == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c->wavecnt = cnt;
+	c->wavecap = cnt+1;
+	for (i = 0; i < cnt && !err && !r->bad; i++)
+	{
+		struct libsimul_wave *wv = &c->waves[i];
+		size_t srccnt;
+		wv->typ = (enum libsimul_wave_type)get_u32(r);
+		if ((unsigned)wv->typ > WAVE_PWL)
+		{
+			return -ERR_MISMATCH;
+		}
+		srccnt = get_count(r, 4);
+		wv->srcs = calloc(srccnt+1, sizeof(*wv->srcs));
+		if (wv->srcs == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		wv->srccnt = srccnt;
+		for (j = 0; j < srccnt; j++)
+		{
+			wv->srcs[j].name = get_str(r, &err);
+			wv->srcs[j].ph_c = get_double(r);
+			wv->srcs[j].ph_s = get_double(r);
+		}
+		wv->ampl = get_double(r);
+		wv->f = get_double(r);
+		wv->phase = get_double(r);
+		wv->offset = get_double(r);
+		wv->low = get_double(r);
+		wv->high = get_double(r);
+		wv->delay = get_double(r);
+		wv->rise = get_double(r);
+		wv->fall = get_double(r);
+		wv->width = get_double(r);
+		wv->period = get_double(r);
+		wv->pwlcnt = get_count(r, 16);
+		wv->pwl = malloc(sizeof(*wv->pwl)*(2*wv->pwlcnt+1));
+		if (wv->pwl == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		for (j = 0; j < 2*wv->pwlcnt; j++)
+		{
+			wv->pwl[j] = get_double(r);
+		}
+		if (!r->bad && !wave_valid(wv))
+		{
+			return -ERR_MISMATCH;
+		}
+	}
+	cnt = get_count(r, 4);
+	c->ctls = calloc(cnt+1, sizeof(*c->ctls));
+	if (c->ctls == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c->ctlcnt = cnt;
+	c->ctlcap = cnt+1;
+	for (i = 0; i < cnt; i++)
+	{
+		struct libsimul_ctl *ctl = &c->ctls[i];
+		ctl->name = get_str(r, &err);
+		ctl->typ = (enum libsimul_ctl_type)get_u32(r);
+		get_signal(r, &ctl->in, &err);
+		get_signal(r, &ctl->ref, &err);
+		ctl->has_ref = get_int(r);
+		ctl->Ts = get_double(r);
+		ctl->kp = get_double(r);
+		ctl->ki = get_double(r);
+		ctl->kd = get_double(r);
+		ctl->min = get_double(r);
+		ctl->max = get_double(r);
+		ctl->hyst = get_double(r);
+		ctl->init = get_double(r);
+		ctl->n = (size_t)get_u64(r);
+		ctl->bufoff = (size_t)get_u64(r);
+		ctl->out_name = get_str(r, &err);
+	}
+	c->ctl_bufsz = (size_t)get_u64(r);
+	if (err)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	// The windows follow each other in the order of the blocks
+	for (i = 0, j = 0; i < c->ctlcnt; i++)
+	{
+		const struct libsimul_ctl *ctl = &c->ctls[i];
+		if ((unsigned)ctl->typ > CTL_SH || !ctl_valid(ctl) ||
+		    ctl->bufoff != j || ctl->n > c->ctl_bufsz - j)
+		{
+			return -ERR_MISMATCH;
+		}
+		j += ctl->n;
+	}
+	if (j != c->ctl_bufsz)
+	{
+		return -ERR_MISMATCH;
+	}
+	return r->bad ? -ERR_MISMATCH : 0;
+}
+
+static int get_instances(struct netcache_reader *r, struct libsimul_circuit *c)
+{
+	size_t cnt, i, j;
+	int err = 0;
+	cnt = get_count(r, 4);
+	c->subckts = calloc(cnt+1, sizeof(*c->subckts));
+	if (c->subckts == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c->subcktcnt = cnt;
+	c->subcktcap = cnt+1;
+	for (i = 0; i < cnt && !err && !r->bad; i++)
+	{
+		struct libsimul_subckt *sc = &c->subckts[i];
+		size_t n;
+		sc->name = get_str(r, &err);
+		sc->portcnt = (size_t)get_u64(r);
+		sc->internalcnt = (size_t)get_u64(r);
+		sc->maxnode = get_int(r);
+		n = sc->maxnode < 0 ? 0 : (size_t)sc->maxnode+1;
+		if (n > (r->sz - r->off)/4)
+		{
+			return -ERR_MISMATCH;
+		}
+		sc->localmap = malloc(sizeof(*sc->localmap)*(n+1));
+		if (sc->localmap == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		for (j = 0; j < n; j++)
+		{
+			sc->localmap[j] = get_int(r);
+		}
+		n = get_count(r, 8);
+		sc->param_names = calloc(n+1, sizeof(*sc->param_names));
+		sc->param_values = calloc(n+1, sizeof(*sc->param_values));
+		if (sc->param_names == NULL || sc->param_values == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		sc->paramcnt = n;
+		sc->paramcap = n+1;
+		for (j = 0; j < n; j++)
+		{
+			sc->param_names[j] = get_str(r, &err);
+			sc->param_values[j] = get_str(r, &err);
+		}
+		n = get_count(r, 4);
+		sc->lines = calloc(n+1, sizeof(*sc->lines));
+		if (sc->lines == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		sc->linecnt = n;
+		sc->linecap = n+1;
+		for (j = 0; j < n; j++)
+		{
+			sc->lines[j] = get_str(r, &err);
+		}
+	}
+	if (err || r->bad)
+	{
+		return err ? -ERR_NO_MEMORY : -ERR_MISMATCH;
+	}
+	cnt = get_count(r, 4);
+	c->insts = calloc(cnt+1, sizeof(*c->insts));
+	if (c->insts == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c->instcap = cnt+1;
+	for (i = 0; i < cnt && !err && !r->bad; i++)
+	{
+		struct libsimul_instance *in = &c->insts[i];
+		size_t subckt;
+		in->name = get_str(r, &err);
+		subckt = (size_t)get_u64(r);
+		if (subckt >= c->subcktcnt)
+		{
+			free(in->name);
+			return -ERR_MISMATCH;
+		}
+		in->subckt = subckt;
+		c->instcnt++;
+		in->parent = get_size(r);
+		in->portcnt = get_count(r, 4);
+		in->ports = malloc(sizeof(*in->ports)*(in->portcnt+1));
+		in->params = calloc(c->subckts[subckt].paramcnt+1, sizeof(*in->params));
+		if (in->ports == NULL || in->params == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		for (j = 0; j < in->portcnt; j++)
+		{
+			in->ports[j] = get_int(r);
+		}
+		for (j = 0; j < c->subckts[subckt].paramcnt; j++)
+		{
+			in->params[j] = get_str(r, &err);
+		}
+		in->el_first = (size_t)get_u64(r);
+		in->el_cnt = (size_t)get_u64(r);
+		in->node_first = get_int(r);
+		in->node_cnt = (size_t)get_u64(r);
+	}
+	if (err)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	return r->bad ? -ERR_MISMATCH : 0;
+}
+
+static int get_params(struct netcache_reader *r, struct libsimul_circuit *c)
+{
+	size_t cnt, i;
+	int err = 0;
+	cnt = get_count(r, 16);
+	c->params = calloc(cnt+1, sizeof(*c->params));
+	if (c->params == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c->paramcap = cnt+1;
+	for (i = 0; i < cnt && !err && !r->bad; i++)
+	{
+		struct libsimul_param *p = &c->params[i];
+		p->name = get_str(r, &err);
+		p->expr = get_str(r, &err);
+		p->val = get_double(r);
+		c->paramcnt++;
+	}
+	if (err || r->bad)
+	{
+		return err ? -ERR_NO_MEMORY : -ERR_MISMATCH;
+	}
+	cnt = get_count(r, 28);
+	c->param_uses = calloc(cnt+1, sizeof(*c->param_uses));
+	if (c->param_uses == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	c->param_usecap = cnt+1;
+	for (i = 0; i < cnt && !err && !r->bad; i++)
+	{
+		struct libsimul_param_use *use = &c->param_uses[i];
+		size_t objcnt, objsz;
+		use->target = (enum libsimul_param_target)get_int(r);
+		use->idx = (size_t)get_u64(r);
+		use->off = (size_t)get_u64(r);
+		use->check = (enum libsimul_param_check)get_int(r);
+		use->expr = get_str(r, &err);
+		c->param_usecnt++;
+		// The offset is written to, so it must be a double of the object
+		switch (use->target)
+		{
+			case PARAM_ELEMENT:
+				objcnt = c->elements_used_sz;
+				objsz = sizeof(struct element);
+				break;
+			case PARAM_PWM:
+				objcnt = c->pwmcnt;
+				objsz = sizeof(struct libsimul_pwm);
+				break;
+			case PARAM_WAVE:
+				objcnt = c->wavecnt;
+				objsz = sizeof(struct libsimul_wave);
+				break;
+			case PARAM_CTL:
+				objcnt = c->ctlcnt;
+				objsz = sizeof(struct libsimul_ctl);
+				break;
+			case PARAM_PWL:
+				objcnt = c->wavecnt;
+				objsz = use->idx < objcnt ? sizeof(double)*2*c->waves[use->idx].pwlcnt : 0;
+				break;
+			default:
+				return -ERR_MISMATCH;
+		}
+		if (use->idx >= objcnt || objsz < sizeof(double) || use->off > objsz - sizeof(double) ||
+		    (unsigned)use->check > PARAM_NONNEGATIVE)
+		{
+			return -ERR_MISMATCH;
+		}
+	}
+	if (err)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	return r->bad ? -ERR_MISMATCH : 0;
+}
+
+// Loads the circuit from the cache into a context that hasn't read a
+// netlist yet, instead of read_file(netlist). Returns -ERR_NO_DATA if
+// there's no cache and -ERR_MISMATCH if it's for another version of the
+// netlist or fails the checks of the decoder, in which case the context
+// isn't modified.
+int libsimul_netlist_cache_read(struct libsimul_ctx *ctx, const char *netlist, const char *cache)
+{
+	struct libsimul_ctx tmp;
+	struct netcache_reader r;
+	struct netcache_map m;
+	struct libsimul_circuit *c;
+	const void *magic;
+	uint64_t hash;
+	int ret;
+	if (ctx->circuit->elements_used_sz != 0 || ctx->circuit->node_seen_sz != 0)
+	{
+		return -ERR_BUSY;
+	}
+	ret = netlist_hash(netlist, &hash);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	ret = map_file(cache, &m);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	r.p = m.p;
+	r.off = 0;
+	r.sz = m.sz;
+	r.bad = 0;
+	magic = get_bytes(&r, 4);
+	if (magic == NULL || memcmp(magic, NETCACHE_MAGIC, 4) != 0 ||
+	    get_u32(&r) != NETCACHE_VERSION || get_u64(&r) != hash)
+	{
+		unmap_file(&m);
+		return -ERR_MISMATCH;
+	}
+	// Built in a temporary context, so that a damaged cache leaves ctx
+	// as it was
+	if (libsimul_init(&tmp, ctx->dt) != 0)
+	{
+		unmap_file(&m);
+		libsimul_free(&tmp);
+		return -ERR_NO_MEMORY;
+	}
+	c = tmp.circuit;
+	c->has_shockley = get_int(&r);
+	c->windings_grouped = get_int(&r);
+	ret = get_elements(&r, &tmp);
+	if (ret == 0)
+	{
+		ret = get_nodes(&r, c);
+	}
+	if (ret == 0)
+	{
+		ret = get_defs(&r, c);
+	}
+	if (ret == 0)
+	{
+		ret = get_instances(&r, c);
+	}
+	if (ret == 0)
+	{
+		ret = get_params(&r, c);
+	}
+	if (ret == 0 && (r.bad || r.off != r.sz))
+	{
+		ret = -ERR_MISMATCH;
+	}
+	unmap_file(&m);
+	if (ret == 0)
+	{
+		struct libsimul_circuit *old = ctx->circuit;
+		struct element_state *old_state = ctx->state;
+		ctx->circuit = tmp.circuit;
+		ctx->state = tmp.state;
+		ctx->state_cap = tmp.state_cap;
+		tmp.circuit = old;
+		tmp.state = old_state;
+	}
+	libsimul_free(&tmp);
+	return ret;
+}
+
+// read_file() through the cache: loads the cache if it's up to date, and
+// otherwise reads the netlist and writes the cache. Failing to write the
+// cache isn't an error.
+void read_file_cached(struct libsimul_ctx *ctx, const char *netlist, const char *cache)
+{
+	int ret = libsimul_netlist_cache_read(ctx, netlist, cache);
+	if (ret == 0)
+	{
+		return;
+	}
+	if (ret == -ERR_BUSY)
+	{
+		fprintf(stderr, "Netlist already read\n");
+		exit(1);
+	}
+	read_file(ctx, netlist);
+	libsimul_netlist_cache_write(ctx, netlist, cache);
+}
@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include "libsimul.h"
+
+// Symbolic node names.
+//
+// A node of a netlist line is either a number, which is the node index as
+// before, or a name starting with a letter or an underscore. gnd in any case
+// is the ground like 0. Named nodes are numbered when read_file() ends, after
+// the largest numbered node and in the order of their first appearance, so a
+// netlist can mix both and a netlist of names needs no numbering at all.
+// Until then elements and control block inputs refer to the named node k as
+// -(k+1). Once the subcircuit instances are flattened, a named node used by a
+// single element terminal is most likely a typo, so it's reported.
+//
+// Names are in a hash table of indices to node_names, organized like the
+// element name table.
+
+static int node_is_ground(const char *tok)
+{
+	return strcmp(tok, "0") == 0 || strcasecmp(tok, "gnd") == 0;
+}
+
+static int node_is_name(const char *tok)
+{
+	return isalpha((unsigned char)*tok) || *tok == '_';
+}
+
+static void nodetab_put(size_t *tab, size_t cap, const struct libsimul_node_name *nn, size_t k)
+{
+	size_t pos = nametab_hash(nn[k].name) & (cap-1);
+	while (tab[pos] != SIZE_MAX)
+	{
+		pos = (pos+1) & (cap-1);
+	}
+	tab[pos] = k;
+}
+
+static size_t nodetab_find(const struct libsimul_circuit *c, const char *name)
+{
+	const size_t mask = c->node_tab_cap-1;
+	size_t pos;
+	if (c->node_tab == NULL)
+	{
+		return SIZE_MAX;
+	}
+	for (pos = nametab_hash(name) & mask; c->node_tab[pos] != SIZE_MAX; pos = (pos+1) & mask)
+	{
+		if (strcmp(c->node_names[c->node_tab[pos]].name, name) == 0)
+		{
+			return c->node_tab[pos];
+		}
+	}
+	return SIZE_MAX;
+}
+
+static size_t node_add_name(struct libsimul_circuit *c, const char *name)
+{
+	size_t k = c->node_namecnt;
+	size_t i;
+	if (c->node_names == NULL || k >= c->node_namecap)
+	{
+		size_t new_cap = 2*k+16;
+		struct libsimul_node_name *new_names;
+		new_names = realloc(c->node_names, sizeof(*c->node_names)*new_cap);
+		if (new_names == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		c->node_names = new_names;
+		c->node_namecap = new_cap;
+	}
+	c->node_names[k].name = strdup(name);
+	if (c->node_names[k].name == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	c->node_names[k].node = -1;
+	c->node_names[k].uses = 0;
+	c->node_namecnt++;
+	if (c->node_tab == NULL || 2*c->node_namecnt > c->node_tab_cap)
+	{
+		size_t new_cap = c->node_tab_cap ? 2*c->node_tab_cap : 64;
+		size_t *new_tab;
+		while (2*c->node_namecnt > new_cap)
+		{
+			new_cap *= 2;
+		}
+		new_tab = malloc(sizeof(*new_tab)*new_cap);
+		if (new_tab == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		for (i = 0; i < new_cap; i++)
+		{
+			new_tab[i] = SIZE_MAX;
+		}
+		for (i = 0; i < k; i++)
+		{
+			nodetab_put(new_tab, new_cap, c->node_names, i);
+		}
+		free(c->node_tab);
+		c->node_tab = new_tab;
+		c->node_tab_cap = new_cap;
+	}
+	nodetab_put(c->node_tab, c->node_tab_cap, c->node_names, k);
+	return k;
+}
+
+// Node of the netlist token tok, a number, a name or gnd. A new name is
+// added. A name that isn't numbered yet gives -(k+1).
+int node_parse(struct libsimul_ctx *ctx, const char *tok)
+{
+	struct libsimul_circuit *c;
+	size_t k;
+	if (node_is_ground(tok))
+	{
+		return 0;
+	}
+	if (!node_is_name(tok))
+	{
+		char *endptr;
+		long l = strtol(tok, &endptr, 10);
+		if (l < 0 || *tok == '\0' || *endptr != '\0' || (long)(int)l != l)
+		{
+			fprintf(stderr, "Invalid node: %s\n", tok);
+			exit(1);
+		}
+		return (int)l;
+	}
+	netlist_unshare(ctx);
+	c = ctx->circuit;
+	k = nodetab_find(c, tok);
+	if (k == SIZE_MAX)
+	{
+		k = node_add_name(c, tok);
+	}
+	if (c->node_names[k].node >= 0)
+	{
+		return c->node_names[k].node;
+	}
+	return -(int)k-1;
+}
+
+// Node of a token of a numbered circuit, -ERR_NOT_FOUND if it's an unknown
+// name
+int node_lookup(const struct libsimul_circuit *c, const char *tok)
+{
+	size_t k;
+	if (node_is_ground(tok))
+	{
+		return 0;
+	}
+	if (!node_is_name(tok))
+	{
+		char *endptr;
+		long l = strtol(tok, &endptr, 10);
+		if (l < 0 || *tok == '\0' || *endptr != '\0' || (long)(int)l != l)
+		{
+			return -ERR_NOT_FOUND;
+		}
+		return (int)l;
+	}
+	k = nodetab_find(c, tok);
+	if (k == SIZE_MAX || c->node_names[k].node < 0)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	return c->node_names[k].node;
+}
+
+static int node_final(const struct libsimul_circuit *c, int n)
+{
+	return n < 0 ? c->node_names[-(n+1)].node : n;
+}
+
+// Numbers the named nodes that aren't numbered yet and replaces their
+// temporary numbers, called at the end of read_file(). Returns the first name
+// numbered for nodes_check().
+size_t nodes_number(struct libsimul_ctx *ctx)
+{
+	struct libsimul_circuit *c = ctx->circuit;
+	size_t i, k, first = c->node_numbered;
+	int next;
+	if (c->node_numbered == c->node_namecnt)
+	{
+		return first;
+	}
+	netlist_unshare(ctx);
+	c = ctx->circuit;
+	next = (int)(c->node_seen_sz ? c->node_seen_sz : 1);
+	for (k = c->node_numbered; k < c->node_namecnt; k++)
+	{
+		struct libsimul_node_name *nn = &c->node_names[k];
+		nn->node = next++;
+		mark_node_seen(ctx, nn->node);
+		c = ctx->circuit;
+	}
+	c->node_numbered = c->node_namecnt;
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		struct element *el = c->elements_used[i];
+		el->n1 = node_final(c, el->n1);
+		el->n2 = node_final(c, el->n2);
+	}
+	for (i = 0; i < c->ctlcnt; i++)
+	{
+		struct libsimul_ctl *ctl = &c->ctls[i];
+		if (ctl->in.typ == SIGNAL_VOLTAGE)
+		{
+			ctl->in.n1 = node_final(c, ctl->in.n1);
+			ctl->in.n2 = node_final(c, ctl->in.n2);
+		}
+		if (ctl->ref.typ == SIGNAL_VOLTAGE)
+		{
+			ctl->ref.n1 = node_final(c, ctl->ref.n1);
+			ctl->ref.n2 = node_final(c, ctl->ref.n2);
+		}
+	}
+	return first;
+}
+
+// Counts the element terminals of the named nodes from first, after the
+// instances are flattened so that the elements of an instance count for the
+// nodes of its ports
+void nodes_check(struct libsimul_ctx *ctx, size_t first)
+{
+	struct libsimul_circuit *c = ctx->circuit;
+	size_t *uses;
+	size_t i, k;
+	if (first >= c->node_namecnt)
+	{
+		return;
+	}
+	uses = calloc(c->node_seen_sz, sizeof(*uses));
+	if (uses == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		const struct element *el = c->elements_used[i];
+		uses[el->n1]++;
+		uses[el->n2]++;
+	}
+	netlist_unshare(ctx);
+	c = ctx->circuit;
+	for (k = first; k < c->node_namecnt; k++)
+	{
+		struct libsimul_node_name *nn = &c->node_names[k];
+		nn->uses = uses[nn->node];
+		if (nn->uses == 0)
+		{
+			fprintf(stderr, "Node %s isn't connected to any element\n", nn->name);
+			exit(1);
+		}
+		if (nn->uses == 1)
+		{
+			fprintf(stderr, "Warning: node %s has a single connection\n", nn->name);
+		}
+	}
+	free(uses);
+}
+
+// Node index of a node name or number, 0 for the ground, -ERR_NOT_FOUND if
+// the circuit has no such node
+int libsimul_node(struct libsimul_ctx *ctx, const char *name)
+{
+	int n = node_lookup(ctx->circuit, name);
+	if (n < 0 || (size_t)n >= ctx->circuit->node_seen_sz)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	return n;
+}
+
+// Name of a node, NULL if the node is numbered in the netlist
+const char *libsimul_node_name(struct libsimul_ctx *ctx, int node)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	size_t k;
+	for (k = 0; k < c->node_namecnt; k++)
+	{
+		if (c->node_names[k].node == node)
+		{
+			return c->node_names[k].name;
+		}
+	}
+	return NULL;
+}
+
+int nodes_copy(struct libsimul_circuit *dst, const struct libsimul_circuit *src)
+{
+	size_t k;
+	dst->node_names = NULL;
+	dst->node_namecnt = 0;
+	dst->node_namecap = 0;
+	dst->node_numbered = src->node_numbered;
+	dst->node_tab = NULL;
+	dst->node_tab_cap = 0;
+	if (src->node_namecnt == 0)
+	{
+		return 0;
+	}
+	dst->node_names = malloc(sizeof(*dst->node_names)*src->node_namecnt);
+	dst->node_tab = malloc(sizeof(*dst->node_tab)*src->node_tab_cap);
+	if (dst->node_names == NULL || dst->node_tab == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	dst->node_namecap = src->node_namecnt;
+	for (k = 0; k < src->node_namecnt; k++)
+	{
+		dst->node_names[k] = src->node_names[k];
+		dst->node_names[k].name = strdup(src->node_names[k].name);
+		if (dst->node_names[k].name == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		dst->node_namecnt++;
+	}
+	memcpy(dst->node_tab, src->node_tab, sizeof(*dst->node_tab)*src->node_tab_cap);
+	dst->node_tab_cap = src->node_tab_cap;
+	return 0;
+}
+
+void nodes_free(struct libsimul_circuit *c)
+{
+	size_t k;
+	for (k = 0; k < c->node_namecnt; k++)
+	{
+		free(c->node_names[k].name);
+	}
+	free(c->node_names);
+	free(c->node_tab);
+	c->node_names = NULL;
+	c->node_namecnt = 0;
+	c->node_namecap = 0;
+	c->node_numbered = 0;
+	c->node_tab = NULL;
+	c->node_tab_cap = 0;
+}
@@ -0,0 +1,786 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <math.h>
+#include "libsimul.h"
+
+// Netlist parameters and expressions:
+//
+// .param vin=24 rl={vin*vin / 50}
+// 1 0 R1 R=rl/2
+//
+// A value is a number or an expression of numbers, parameters, + - * / ^
+// (or **), parentheses and the functions sqrt exp log log10 abs sin cos tan
+// atan pow min max, with pi as a constant. Expressions may be in braces,
+// and need them to contain spaces. A parameter can use the parameters
+// defined before it. In subcircuit bodies the parameters of the subcircuit
+// are replaced by their values in parentheses when the instances are
+// flattened, see param_subst().
+//
+// Values are evaluated once when their line is read, but every value that
+// isn't a plain number is recorded with the field it was written to.
+// libsimul_set_param() overrides a parameter before init_simulation(), for
+// example in clones of a context for a sweep, and evaluates the other
+// parameters and the recorded values again in a private copy of the
+// circuit, so a sweep needs no netlist files of its own.
+
+#define PARAM_MAX_DEPTH 64
+
+static const double param_pi = 3.14159265358979323846;
+
+struct param_parser {
+	const char *p;
+	const struct libsimul_circuit *c;
+	size_t limit; // parameters before this can be used
+	int depth;
+	int err;
+};
+
+static const struct {
+	const char *name;
+	double (*fn1)(double);
+	double (*fn2)(double, double);
+} param_funcs[] = {
+	{"sqrt", sqrt, NULL},
+	{"exp", exp, NULL},
+	{"log", log, NULL},
+	{"log10", log10, NULL},
+	{"abs", fabs, NULL},
+	{"sin", sin, NULL},
+	{"cos", cos, NULL},
+	{"tan", tan, NULL},
+	{"atan", atan, NULL},
+	{"pow", NULL, pow},
+	{"min", NULL, fmin},
+	{"max", NULL, fmax},
+};
+
+static size_t param_find(const struct libsimul_circuit *c, const char *name, size_t len, size_t limit)
+{
+	size_t k;
+	for (k = 0; k < limit; k++)
+	{
+		if (strncmp(c->params[k].name, name, len) == 0 && c->params[k].name[len] == '\0')
+		{
+			return k;
+		}
+	}
+	return SIZE_MAX;
+}
+
+static double param_fail(struct param_parser *ps, int err)
+{
+	if (ps->err == 0)
+	{
+		ps->err = err;
+	}
+	return NAN;
+}
+
+static void param_skip(struct param_parser *ps)
+{
+	while (isspace((unsigned char)*ps->p))
+	{
+		ps->p++;
+	}
+}
+
+static double param_expr(struct param_parser *ps);
+static double param_unary(struct param_parser *ps);
+
+static double param_call(struct param_parser *ps, const char *name, size_t len)
+{
+	double a[2];
+	size_t i, n = 0;
+	for (i = 0; i < sizeof(param_funcs)/sizeof(*param_funcs); i++)
+	{
+		if (strncmp(param_funcs[i].name, name, len) == 0 && param_funcs[i].name[len] == '\0')
+		{
+			break;
+		}
+	}
+	if (i == sizeof(param_funcs)/sizeof(*param_funcs))
+	{
+		return param_fail(ps, -ERR_NOT_FOUND);
+	}
+	ps->p++;
+	for (;;)
+	{
+		double v = param_expr(ps);
+		if (n < 2)
+		{
+			a[n] = v;
+		}
+		n++;
+		param_skip(ps);
+		if (*ps->p != ',')
+		{
+			break;
+		}
+		ps->p++;
+	}
+	if (*ps->p != ')' || n != (param_funcs[i].fn1 != NULL ? 1 : 2))
+	{
+		return param_fail(ps, -ERR_MISMATCH);
+	}
+	ps->p++;
+	return param_funcs[i].fn1 != NULL ? param_funcs[i].fn1(a[0]) : param_funcs[i].fn2(a[0], a[1]);
+}
+
+static double param_primary(struct param_parser *ps)
+{
+	const char *start;
+	param_skip(ps);
+	start = ps->p;
+	if (*ps->p == '(')
+	{
+		double v;
+		ps->p++;
+		v = param_expr(ps);
+		param_skip(ps);
+		if (*ps->p != ')')
+		{
+			return param_fail(ps, -ERR_MISMATCH);
+		}
+		ps->p++;
+		return v;
+	}
+	if (isdigit((unsigned char)*ps->p) || *ps->p == '.')
+	{
+		char *endptr;
+		double v = strtod(ps->p, &endptr);
+		if (endptr == ps->p)
+		{
+			return param_fail(ps, -ERR_MISMATCH);
+		}
+		ps->p = endptr;
+		return v;
+	}
+	if (isalpha((unsigned char)*ps->p) || *ps->p == '_')
+	{
+		size_t len, k;
+		while (isalnum((unsigned char)*ps->p) || *ps->p == '_')
+		{
+			ps->p++;
+		}
+		len = (size_t)(ps->p - start);
+		param_skip(ps);
+		if (*ps->p == '(')
+		{
+			return param_call(ps, start, len);
+		}
+		k = param_find(ps->c, start, len, ps->limit);
+		if (k != SIZE_MAX)
+		{
+			return ps->c->params[k].val;
+		}
+		if (len == 2 && strncmp(start, "pi", 2) == 0)
+		{
+			return param_pi;
+		}
+		return param_fail(ps, -ERR_NOT_FOUND);
+	}
+	return param_fail(ps, -ERR_MISMATCH);
+}
+
+static double param_power(struct param_parser *ps)
+{
+	double v = param_primary(ps);
+	param_skip(ps);
+	if (*ps->p == '^' || (ps->p[0] == '*' && ps->p[1] == '*'))
+	{
+		ps->p += *ps->p == '^' ? 1 : 2;
+		// Right associative, and -2^2 is -4
+		return pow(v, param_unary(ps));
+	}
+	return v;
+}
+
+static double param_unary(struct param_parser *ps)
+{
+	param_skip(ps);
+	if (*ps->p == '-')
+	{
+		ps->p++;
+		return -param_unary(ps);
+	}
+	if (*ps->p == '+')
+	{
+		ps->p++;
+		return param_unary(ps);
+	}
+	return param_power(ps);
+}
+
+static double param_term(struct param_parser *ps)
+{
+	double v = param_unary(ps);
+	for (;;)
+	{
+		param_skip(ps);
+		if (ps->p[0] == '*' && ps->p[1] != '*')
+		{
+			ps->p++;
+			v *= param_unary(ps);
+		}
+		else if (*ps->p == '/')
+		{
+			ps->p++;
+			v /= param_unary(ps);
+		}
+		else
+		{
+			return v;
+		}
+	}
+}
+
+static double param_expr(struct param_parser *ps)
+{
+	double v;
+	if (++ps->depth > PARAM_MAX_DEPTH)
+	{
+		return param_fail(ps, -ERR_MISMATCH);
+	}
+	v = param_term(ps);
+	for (;;)
+	{
+		param_skip(ps);
+		if (*ps->p == '+')
+		{
+			ps->p++;
+			v += param_term(ps);
+		}
+		else if (*ps->p == '-')
+		{
+			ps->p++;
+			v -= param_term(ps);
+		}
+		else
+		{
+			break;
+		}
+	}
+	ps->depth--;
+	return v;
+}
+
+static int param_eval_limit(const struct libsimul_circuit *c, const char *expr, size_t limit, double *val)
+{
+	struct param_parser ps;
+	size_t len = strlen(expr);
+	int braces = len >= 2 && expr[0] == '{' && expr[len-1] == '}';
+	double v;
+	ps.p = braces ? expr+1 : expr;
+	ps.c = c;
+	ps.limit = limit;
+	ps.depth = 0;
+	ps.err = 0;
+	v = param_expr(&ps);
+	param_skip(&ps);
+	if (ps.err == 0 && (ps.p != expr + len - braces || !isfinite(v)))
+	{
+		ps.err = -ERR_MISMATCH;
+	}
+	if (ps.err != 0)
+	{
+		return ps.err;
+	}
+	*val = v;
+	return 0;
+}
+
+// Value of an expression with the parameters of c, -ERR_NOT_FOUND for an
+// unknown parameter or function and -ERR_MISMATCH for a syntax error or a
+// value that isn't finite
+int param_eval(const struct libsimul_circuit *c, const char *expr, double *val)
+{
+	return param_eval_limit(c, expr, c->paramcnt, val);
+}
+
+static int param_literal(const char *val)
+{
+	char *endptr;
+	strtod(val, &endptr);
+	return *val != '\0' && *endptr == '\0';
+}
+
+static int param_check_ok(enum libsimul_param_check check, double v)
+{
+	switch (check)
+	{
+		case PARAM_POSITIVE:
+			return v > 0 && isfinite(v);
+		case PARAM_NONNEGATIVE:
+			return v >= 0 && isfinite(v);
+		default:
+			return isfinite(v);
+	}
+}
+
+// Value of the netlist value val, written to the field at off of the
+// element, PWM, wave or control block idx, or to the PWL points of wave idx. An expression is recorded so
+// that a parameter override evaluates it again.
+double netlist_value(struct libsimul_ctx *ctx, const char *val, enum libsimul_param_target target,
+                     size_t idx, size_t off, enum libsimul_param_check check)
+{
+	struct libsimul_circuit *c;
+	struct libsimul_param_use *use;
+	double d;
+	int ret;
+	if (param_literal(val))
+	{
+		return strtod(val, NULL);
+	}
+	ret = param_eval(ctx->circuit, val, &d);
+	if (ret == -ERR_NOT_FOUND)
+	{
+		fprintf(stderr, "Unknown parameter or function in %s\n", val);
+		exit(1);
+	}
+	if (ret != 0 || !param_check_ok(check, d))
+	{
+		fprintf(stderr, "Invalid value: %s\n", val);
+		exit(1);
+	}
+	netlist_unshare(ctx);
+	c = ctx->circuit;
+	if (c->param_uses == NULL || c->param_usecnt >= c->param_usecap)
+	{
+		size_t new_cap = 2*c->param_usecnt+16;
+		struct libsimul_param_use *new_uses = realloc(c->param_uses, sizeof(*new_uses)*new_cap);
+		if (new_uses == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		c->param_uses = new_uses;
+		c->param_usecap = new_cap;
+	}
+	use = &c->param_uses[c->param_usecnt];
+	use->target = target;
+	use->idx = idx;
+	use->off = off;
+	use->check = check;
+	use->expr = strdup(val);
+	if (use->expr == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	c->param_usecnt++;
+	return d;
+}
+
+struct param_buf {
+	char *buf;
+	size_t sz;
+	size_t cap;
+	int oom;
+};
+
+static void param_append(struct param_buf *b, const char *s, size_t len)
+{
+	if (b->buf == NULL || b->sz + len + 1 > b->cap)
+	{
+		size_t new_cap = 2*(b->sz + len + 1);
+		char *new_buf = realloc(b->buf, new_cap);
+		if (new_buf == NULL)
+		{
+			b->oom = 1;
+			return;
+		}
+		b->buf = new_buf;
+		b->cap = new_cap;
+	}
+	memcpy(b->buf + b->sz, s, len);
+	b->sz += len;
+	b->buf[b->sz] = '\0';
+}
+
+// Value val with the parameters names replaced by values in parentheses, a
+// new string in braces, or a copy of val if it's a number. NULL if out of
+// memory.
+char *param_subst(const char *val, char *const *names, char *const *values, size_t cnt)
+{
+	struct param_buf b = {NULL, 0, 0, 0};
+	const char *p = val;
+	const char *end = val + strlen(val);
+	if (param_literal(val))
+	{
+		return strdup(val);
+	}
+	if (end - p >= 2 && *p == '{' && end[-1] == '}')
+	{
+		p++;
+		end--;
+	}
+	param_append(&b, "{", 1);
+	while (p < end)
+	{
+		const char *q = p+1;
+		if (isdigit((unsigned char)*p) || *p == '.')
+		{
+			char *endptr;
+			strtod(p, &endptr);
+			if (endptr > p && endptr <= end)
+			{
+				q = endptr;
+			}
+		}
+		else if (isalpha((unsigned char)*p) || *p == '_')
+		{
+			const char *r;
+			size_t i = cnt;
+			while (q < end && (isalnum((unsigned char)*q) || *q == '_'))
+			{
+				q++;
+			}
+			for (r = q; r < end && isspace((unsigned char)*r); r++)
+			{
+			}
+			// Not a function
+			if (r == end || *r != '(')
+			{
+				for (i = 0; i < cnt; i++)
+				{
+					if (strncmp(names[i], p, (size_t)(q-p)) == 0 && names[i][q-p] == '\0')
+					{
+						break;
+					}
+				}
+			}
+			if (i < cnt)
+			{
+				const char *v = values[i];
+				size_t vlen = strlen(v);
+				if (vlen >= 2 && v[0] == '{' && v[vlen-1] == '}')
+				{
+					v++;
+					vlen -= 2;
+				}
+				param_append(&b, "(", 1);
+				param_append(&b, v, vlen);
+				param_append(&b, ")", 1);
+				p = q;
+				continue;
+			}
+		}
+		param_append(&b, p, (size_t)(q-p));
+		p = q;
+	}
+	param_append(&b, "}", 1);
+	if (b.oom)
+	{
+		free(b.buf);
+		return NULL;
+	}
+	return b.buf;
+}
+
+// .param name=value ...
+int param_read_directive(struct libsimul_ctx *ctx, char *lineptr)
+{
+	char *tok;
+	while ((tok = next_token(&lineptr)) != NULL)
+	{
+		char *equals = strchr(tok, '=');
+		struct libsimul_circuit *c;
+		struct libsimul_param *par;
+		const char *p;
+		double val;
+		int ret;
+		if (equals == NULL || equals == tok || !(isalpha((unsigned char)*tok) || *tok == '_'))
+		{
+			fprintf(stderr, "Invalid parameter: %s\n", tok);
+			exit(1);
+		}
+		*equals = '\0';
+		for (p = tok; *p; p++)
+		{
+			if (!isalnum((unsigned char)*p) && *p != '_')
+			{
+				fprintf(stderr, "Invalid parameter name: %s\n", tok);
+				exit(1);
+			}
+		}
+		if (param_find(ctx->circuit, tok, strlen(tok), ctx->circuit->paramcnt) != SIZE_MAX)
+		{
+			fprintf(stderr, "Duplicate parameter %s\n", tok);
+			exit(1);
+		}
+		ret = param_eval(ctx->circuit, &equals[1], &val);
+		if (ret != 0)
+		{
+			fprintf(stderr, "Invalid value of parameter %s: %s\n", tok, &equals[1]);
+			exit(1);
+		}
+		netlist_unshare(ctx);
+		c = ctx->circuit;
+		if (c->params == NULL || c->paramcnt >= c->paramcap)
+		{
+			size_t new_cap = 2*c->paramcnt+8;
+			struct libsimul_param *new_params = realloc(c->params, sizeof(*new_params)*new_cap);
+			if (new_params == NULL)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+			c->params = new_params;
+			c->paramcap = new_cap;
+		}
+		par = &c->params[c->paramcnt];
+		par->name = strdup(tok);
+		par->expr = strdup(&equals[1]);
+		par->val = val;
+		par->overridden = 0;
+		if (par->name == NULL || par->expr == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		c->paramcnt++;
+	}
+	return 0;
+}
+
+static void *param_target(struct libsimul_circuit *c, const struct libsimul_param_use *use)
+{
+	switch (use->target)
+	{
+		case PARAM_ELEMENT:
+			return c->elements_used[use->idx];
+		case PARAM_PWM:
+			return &c->pwms[use->idx];
+		case PARAM_WAVE:
+			return &c->waves[use->idx];
+		case PARAM_PWL:
+			return c->waves[use->idx].pwl;
+		default:
+			return &c->ctls[use->idx];
+	}
+}
+
+static int param_target_valid(struct libsimul_circuit *c, const struct libsimul_param_use *use)
+{
+	switch (use->target)
+	{
+		case PARAM_PWM:
+			return pwm_valid(&c->pwms[use->idx]);
+		case PARAM_WAVE:
+		case PARAM_PWL:
+			return wave_valid(&c->waves[use->idx]);
+		case PARAM_CTL:
+			return ctl_valid(&c->ctls[use->idx]);
+		default:
+			// Fully checked by use->check
+			return 1;
+	}
+}
+
+// Evaluates the parameters and the recorded values again with the parameter
+// k set to val, with the range checks of the netlist directives. Nothing is
+// changed if a value is invalid.
+static int params_apply(struct libsimul_ctx *ctx, size_t k, double val)
+{
+	struct libsimul_circuit *c = ctx->circuit;
+	double *old = malloc(sizeof(*old)*(c->paramcnt + 2*c->param_usecnt + 1));
+	double *vals, *old_vals;
+	const int old_overridden = c->params[k].overridden;
+	size_t i;
+	int ret = 0;
+	if (old == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	vals = old + c->paramcnt;
+	old_vals = vals + c->param_usecnt;
+	for (i = 0; i < c->paramcnt; i++)
+	{
+		old[i] = c->params[i].val;
+	}
+	c->params[k].val = val;
+	c->params[k].overridden = 1;
+	for (i = 0; i < c->paramcnt && ret == 0; i++)
+	{
+		if (!c->params[i].overridden)
+		{
+			ret = param_eval_limit(c, c->params[i].expr, i, &c->params[i].val);
+		}
+		if (ret == 0 && !isfinite(c->params[i].val))
+		{
+			ret = -ERR_INVALID;
+		}
+	}
+	for (i = 0; i < c->param_usecnt && ret == 0; i++)
+	{
+		ret = param_eval(c, c->param_uses[i].expr, &vals[i]);
+		if (ret == 0 && !param_check_ok(c->param_uses[i].check, vals[i]))
+		{
+			ret = -ERR_INVALID;
+		}
+	}
+	if (ret == 0)
+	{
+		for (i = 0; i < c->param_usecnt; i++)
+		{
+			const struct libsimul_param_use *use = &c->param_uses[i];
+			char *field = (char *)param_target(c, use) + use->off;
+			memcpy(&old_vals[i], field, sizeof(old_vals[i]));
+			memcpy(field, &vals[i], sizeof(vals[i]));
+		}
+		for (i = 0; i < c->param_usecnt && ret == 0; i++)
+		{
+			if (!param_target_valid(c, &c->param_uses[i]))
+			{
+				ret = -ERR_INVALID;
+			}
+		}
+		if (ret != 0)
+		{
+			// Backwards, in case a field is used twice
+			for (i = c->param_usecnt; i-- > 0; )
+			{
+				const struct libsimul_param_use *use = &c->param_uses[i];
+				memcpy((char *)param_target(c, use) + use->off, &old_vals[i], sizeof(old_vals[i]));
+			}
+		}
+	}
+	if (ret != 0)
+	{
+		for (i = 0; i < c->paramcnt; i++)
+		{
+			c->params[i].val = old[i];
+		}
+		c->params[k].overridden = old_overridden;
+		free(old);
+		return ret;
+	}
+	// Sources and initial conditions are copied to the element state
+	for (i = 0; i < c->param_usecnt; i++)
+	{
+		const struct libsimul_param_use *use = &c->param_uses[i];
+		if (use->target == PARAM_ELEMENT)
+		{
+			init_element_state(c->elements_used[use->idx], &ctx->state[use->idx]);
+		}
+	}
+	if (c->windings_grouped)
+	{
+		transformer_direct_denoms(c);
+	}
+	free(old);
+	return 0;
+}
+
+// Overrides a parameter of the netlist before init_simulation(),
+// -ERR_NOT_FOUND if there's no such parameter, -ERR_BUSY after
+// init_simulation() and -ERR_INVALID if a value would become invalid
+int libsimul_set_param(struct libsimul_ctx *ctx, const char *name, double val)
+{
+	size_t k = param_find(ctx->circuit, name, strlen(name), ctx->circuit->paramcnt);
+	int ret = -ERR_INVALID;
+	if (k == SIZE_MAX)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	if (ctx->G_matrix != NULL)
+	{
+		return -ERR_BUSY;
+	}
+	if (isfinite(val))
+	{
+		if (libsimul_unshare(ctx) != 0)
+		{
+			return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
+		}
+		ret = params_apply(ctx, k, val);
+	}
+	if (ret == -ERR_INVALID)
+	{
+		return libsimul_fail(ctx, ERR_INVALID, "Parameter %s = %g makes a value invalid", name, val);
+	}
+	return ret;
+}
+
+// Value of a parameter, NAN if there's no such parameter
+double libsimul_get_param(struct libsimul_ctx *ctx, const char *name)
+{
+	size_t k = param_find(ctx->circuit, name, strlen(name), ctx->circuit->paramcnt);
+	return k == SIZE_MAX ? NAN : ctx->circuit->params[k].val;
+}
+
+int params_copy_defs(struct libsimul_circuit *dst, const struct libsimul_circuit *src)
+{
+	size_t i;
+	dst->params = NULL;
+	dst->paramcnt = 0;
+	dst->paramcap = 0;
+	dst->param_uses = NULL;
+	dst->param_usecnt = 0;
+	dst->param_usecap = 0;
+	if (src->paramcnt)
+	{
+		dst->params = malloc(sizeof(*dst->params)*src->paramcnt);
+		if (dst->params == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		dst->paramcap = src->paramcnt;
+		for (i = 0; i < src->paramcnt; i++)
+		{
+			dst->params[i] = src->params[i];
+			dst->params[i].name = strdup(src->params[i].name);
+			dst->params[i].expr = strdup(src->params[i].expr);
+			dst->paramcnt++;
+			if (dst->params[i].name == NULL || dst->params[i].expr == NULL)
+			{
+				return -ERR_NO_MEMORY;
+			}
+		}
+	}
+	if (src->param_usecnt)
+	{
+		dst->param_uses = malloc(sizeof(*dst->param_uses)*src->param_usecnt);
+		if (dst->param_uses == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		dst->param_usecap = src->param_usecnt;
+		for (i = 0; i < src->param_usecnt; i++)
+		{
+			dst->param_uses[i] = src->param_uses[i];
+			dst->param_uses[i].expr = strdup(src->param_uses[i].expr);
+			dst->param_usecnt++;
+			if (dst->param_uses[i].expr == NULL)
+			{
+				return -ERR_NO_MEMORY;
+			}
+		}
+	}
+	return 0;
+}
+
+void params_free_defs(struct libsimul_circuit *c)
+{
+	size_t i;
+	for (i = 0; i < c->paramcnt; i++)
+	{
+		free(c->params[i].name);
+		free(c->params[i].expr);
+	}
+	for (i = 0; i < c->param_usecnt; i++)
+	{
+		free(c->param_uses[i].expr);
+	}
+	free(c->params);
+	free(c->param_uses);
+	c->params = NULL;
+	c->paramcnt = 0;
+	c->paramcap = 0;
+	c->param_uses = NULL;
+	c->param_usecnt = 0;
+	c->param_usecap = 0;
+}
@@ -0,0 +1,475 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "libsimul.h"
+
+// Parareal time-parallel integration.
+//
+// The run is split into windows. A coarse propagator (the same simulation
+// with a dt coarse_ratio times longer) gives the first guess of the state at
+// every window boundary. Every iteration then runs the fine propagator over
+// all windows in parallel, each from its current boundary state, and
+// corrects the boundary states sequentially:
+//
+//   U[n+1] = G(U[n]) + F(U_old[n]) - G(U_old[n])
+//
+// The correction applies to the continuous state: inductor and capacitor
+// currents and transformer magnetization. Switch and diode states and the
+// controller state are taken from the fine solution. After k iterations the
+// first k windows are exact, so the iteration always terminates.
+//
+// The controller is called after every step of both propagators, so it has
+// to work from ctx->t and ctx->dt instead of counting steps.
+
+enum parareal_var {
+	PR_VAR_I_SRC,
+	PR_VAR_PHI,
+	PR_VAR_XFR_CONST,
+};
+
+static void pr_find_vars(struct libsimul_parareal *pr)
+{
+	const struct libsimul_circuit *c = pr->proto->circuit;
+	size_t i;
+	pr->nvar = 0;
+	for (i = 0; i < c->elements_used_sz; i++)
+	{
+		const struct element *el = c->elements_used[i];
+		int kind;
+		switch (el->typ)
+		{
+			case TYPE_INDUCTOR:
+			case TYPE_CAPACITOR:
+				kind = PR_VAR_I_SRC;
+				break;
+			case TYPE_TRANSFORMER:
+				if (!el->primary)
+				{
+					continue;
+				}
+				kind = PR_VAR_PHI;
+				break;
+			case TYPE_TRANSFORMER_DIRECT:
+				if (!el->primary)
+				{
+					continue;
+				}
+				kind = PR_VAR_XFR_CONST;
+				break;
+			default:
+				continue;
+		}
+		pr->var_el[pr->nvar] = i;
+		pr->var_kind[pr->nvar] = (unsigned char)kind;
+		pr->nvar++;
+	}
+}
+
+static void pr_get_vars(const struct libsimul_parareal *pr, const struct libsimul_ctx *ctx, double *x)
+{
+	size_t v;
+	for (v = 0; v < pr->nvar; v++)
+	{
+		const struct element_state *st = &ctx->state[pr->var_el[v]];
+		switch (pr->var_kind[v])
+		{
+			case PR_VAR_I_SRC:
+				x[v] = st->I_src;
+				break;
+			case PR_VAR_PHI:
+				x[v] = st->cur_phi_single;
+				break;
+			case PR_VAR_XFR_CONST:
+				x[v] = st->transformer_direct_const;
+				break;
+		}
+	}
+}
+
+static void pr_set_vars(const struct libsimul_parareal *pr, struct libsimul_ctx *ctx, const double *x)
+{
+	size_t v;
+	for (v = 0; v < pr->nvar; v++)
+	{
+		struct element_state *st = &ctx->state[pr->var_el[v]];
+		switch (pr->var_kind[v])
+		{
+			case PR_VAR_I_SRC:
+				st->I_src = x[v];
+				break;
+			case PR_VAR_PHI:
+				st->cur_phi_single = x[v];
+				break;
+			case PR_VAR_XFR_CONST:
+				st->transformer_direct_const = x[v];
+				break;
+		}
+	}
+}
+
+static double pr_window_start(const struct libsimul_parareal *pr, size_t n)
+{
+	return pr->t_start + (pr->t_end - pr->t_start)*n/pr->windows;
+}
+
+// Propagates ctx over window n with the fine or the coarse dt. Returns the
+// error of a failed step or -ERR_ABORTED if the controller stopped.
+static int pr_propagate(struct libsimul_parareal *pr, struct libsimul_ctx *ctx, void *ctl_state,
+                        size_t n, int coarse)
+{
+	const double fine_dt = pr->proto->dt;
+	const double t0 = pr_window_start(pr, n);
+	const double t1 = pr_window_start(pr, n+1);
+	size_t steps = (size_t)llround((t1 - t0)/fine_dt);
+	size_t coarse_steps = coarse ? steps/pr->coarse_ratio : 0;
+	size_t i;
+	int ret;
+	ctx->t = t0;
+	// Fine steps make up for the remainder of the coarse steps
+	steps -= coarse_steps*pr->coarse_ratio;
+	ctx->dt = fine_dt*pr->coarse_ratio;
+	for (i = 0; i < coarse_steps; i++)
+	{
+		ret = simulation_step(ctx);
+		if (ret == 0 && pr->ctl(ctx, ctl_state, pr->userdata) != 0)
+		{
+			ret = -ERR_ABORTED;
+		}
+		if (ret != 0)
+		{
+			ctx->dt = fine_dt;
+			return ret;
+		}
+	}
+	ctx->dt = fine_dt;
+	for (i = 0; i < steps; i++)
+	{
+		ret = simulation_step(ctx);
+		if (ret == 0 && pr->ctl(ctx, ctl_state, pr->userdata) != 0)
+		{
+			ret = -ERR_ABORTED;
+		}
+		if (ret != 0)
+		{
+			return ret;
+		}
+	}
+	ctx->t = t1;
+	return 0;
+}
+
+static void *pr_fine_thread(void *arg)
+{
+	struct libsimul_parareal *pr = arg;
+	for (;;)
+	{
+		size_t n = atomic_fetch_add(&pr->next_window, 1);
+		void *ctl;
+		int ret;
+		if (n >= pr->windows)
+		{
+			break;
+		}
+		libsimul_free(&pr->F[n]);
+		ret = libsimul_clone(&pr->F[n], &pr->U[n]);
+		if (ret == 0)
+		{
+			ctl = &pr->F_ctl[n*pr->ctl_state_size];
+			memcpy(ctl, &pr->U_ctl[n*pr->ctl_state_size], pr->ctl_state_size);
+			ret = pr_propagate(pr, &pr->F[n], ctl, n, 0);
+		}
+		if (ret != 0)
+		{
+			atomic_store(&pr->failed, ret);
+		}
+	}
+	return NULL;
+}
+
+static int pr_fine_all(struct libsimul_parareal *pr, size_t first)
+{
+	pthread_t *tids;
+	size_t threads = pr->threads;
+	size_t i;
+	atomic_store(&pr->next_window, first);
+	if (threads == 0)
+	{
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = n > 0 ? (size_t)n : 1;
+	}
+	if (threads > pr->windows - first)
+	{
+		threads = pr->windows - first;
+	}
+	tids = malloc(sizeof(*tids)*(threads+1));
+	if (threads <= 1 || tids == NULL)
+	{
+		free(tids);
+		pr_fine_thread(pr);
+		return atomic_load(&pr->failed);
+	}
+	for (i = 0; i < threads; i++)
+	{
+		if (pthread_create(&tids[i], NULL, pr_fine_thread, pr) != 0)
+		{
+			break;
+		}
+	}
+	if (i == 0)
+	{
+		pr_fine_thread(pr);
+	}
+	threads = i;
+	for (i = 0; i < threads; i++)
+	{
+		pthread_join(tids[i], NULL);
+	}
+	free(tids);
+	return atomic_load(&pr->failed);
+}
+
+// Coarse propagation of boundary n, result to U[n+1] and x
+static int pr_coarse(struct libsimul_parareal *pr, size_t n, double *x)
+{
+	const size_t csz = pr->ctl_state_size;
+	int ret;
+	libsimul_free(&pr->U[n+1]);
+	ret = libsimul_clone(&pr->U[n+1], &pr->U[n]);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	memcpy(&pr->U_ctl[(n+1)*csz], &pr->U_ctl[n*csz], csz);
+	ret = pr_propagate(pr, &pr->U[n+1], &pr->U_ctl[(n+1)*csz], n, 1);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	pr_get_vars(pr, &pr->U[n+1], x);
+	return 0;
+}
+
+void libsimul_parareal_init(struct libsimul_parareal *pr, const struct libsimul_ctx *proto,
+                            double t_end, size_t windows, libsimul_controller_fn ctl,
+                            size_t ctl_state_size, const void *ctl_init, void *userdata)
+{
+	memset(pr, 0, sizeof(*pr));
+	pr->proto = proto;
+	pr->t_start = proto->t;
+	pr->t_end = t_end;
+	pr->windows = windows;
+	pr->coarse_ratio = 10;
+	pr->tol = 1e-6;
+	pr->max_iter = windows;
+	pr->threads = 0;
+	pr->ctl = ctl;
+	pr->ctl_state_size = ctl_state_size;
+	pr->ctl_init = ctl_init;
+	pr->userdata = userdata;
+	atomic_init(&pr->next_window, 0);
+	atomic_init(&pr->failed, 0);
+}
+
+static void pr_free_contexts(struct libsimul_parareal *pr)
+{
+	size_t n;
+	if (pr->U != NULL)
+	{
+		for (n = 0; n <= pr->windows; n++)
+		{
+			libsimul_free(&pr->U[n]);
+		}
+	}
+	if (pr->F != NULL)
+	{
+		for (n = 0; n < pr->windows; n++)
+		{
+			libsimul_free(&pr->F[n]);
+		}
+	}
+}
+
+void libsimul_parareal_free(struct libsimul_parareal *pr)
+{
+	pr_free_contexts(pr);
+	free(pr->U);
+	free(pr->F);
+	free(pr->U_ctl);
+	free(pr->F_ctl);
+	free(pr->var_el);
+	free(pr->var_kind);
+	free(pr->G_old);
+	free(pr->x_new);
+	free(pr->x_old);
+	free(pr->x_fine);
+	free(pr->scale);
+	pr->U = NULL;
+	pr->F = NULL;
+	pr->U_ctl = NULL;
+	pr->F_ctl = NULL;
+	pr->var_el = NULL;
+	pr->var_kind = NULL;
+	pr->G_old = NULL;
+	pr->x_new = NULL;
+	pr->x_old = NULL;
+	pr->x_fine = NULL;
+	pr->scale = NULL;
+}
+
+// Runs Parareal iterations until the boundary states change by less than
+// tol (relative to the largest magnitude of every state variable) or
+// max_iter is reached. Returns 0 if converged, -ERR_NOT_CONVERGED if not,
+// or the error of a failed step of either propagator.
+int libsimul_parareal_run(struct libsimul_parareal *pr)
+{
+	const size_t W = pr->windows;
+	const size_t csz = pr->ctl_state_size;
+	const size_t elcnt = pr->proto->circuit->elements_used_sz;
+	size_t n, v, k;
+	int ret;
+	if (W == 0 || pr->coarse_ratio == 0 || pr->proto->G_matrix == NULL)
+	{
+		return -ERR_NO_DATA;
+	}
+	libsimul_parareal_free(pr);
+	// Zeroed contexts can be freed safely before their first use
+	pr->U = calloc(W+1, sizeof(*pr->U));
+	pr->F = calloc(W, sizeof(*pr->F));
+	pr->U_ctl = malloc(csz*(W+1)+1);
+	pr->F_ctl = malloc(csz*W+1);
+	pr->var_el = malloc(sizeof(*pr->var_el)*(elcnt+1));
+	pr->var_kind = malloc(sizeof(*pr->var_kind)*(elcnt+1));
+	pr->G_old = malloc(sizeof(*pr->G_old)*(elcnt*W+1));
+	pr->x_new = malloc(sizeof(*pr->x_new)*(elcnt+1));
+	pr->x_old = malloc(sizeof(*pr->x_old)*(elcnt+1));
+	pr->x_fine = malloc(sizeof(*pr->x_fine)*(elcnt+1));
+	pr->scale = malloc(sizeof(*pr->scale)*(elcnt+1));
+	if (pr->U == NULL || pr->F == NULL || pr->U_ctl == NULL || pr->F_ctl == NULL ||
+	    pr->var_el == NULL || pr->var_kind == NULL || pr->G_old == NULL ||
+	    pr->x_new == NULL || pr->x_old == NULL || pr->x_fine == NULL ||
+	    pr->scale == NULL)
+	{
+		libsimul_parareal_free(pr);
+		return -ERR_NO_MEMORY;
+	}
+	pr_find_vars(pr);
+	if (libsimul_clone(&pr->U[0], pr->proto) != 0)
+	{
+		libsimul_parareal_free(pr);
+		return -ERR_NO_MEMORY;
+	}
+	if (csz)
+	{
+		memcpy(pr->U_ctl, pr->ctl_init, csz);
+	}
+	atomic_store(&pr->failed, 0);
+	pr->iterations = 0;
+	pr->defect = INFINITY;
+	// Initial guess by the coarse propagator
+	for (n = 0; n < W; n++)
+	{
+		ret = pr_coarse(pr, n, &pr->G_old[n*pr->nvar]);
+		if (ret != 0)
+		{
+			return ret;
+		}
+	}
+	for (v = 0; v < pr->nvar; v++)
+	{
+		pr->scale[v] = 0;
+		for (n = 0; n < W; n++)
+		{
+			if (fabs(pr->G_old[n*pr->nvar+v]) > pr->scale[v])
+			{
+				pr->scale[v] = fabs(pr->G_old[n*pr->nvar+v]);
+			}
+		}
+	}
+	for (k = 0; k < pr->max_iter && k < W; k++)
+	{
+		double defect = 0;
+		ret = pr_fine_all(pr, k);
+		if (ret != 0)
+		{
+			return ret;
+		}
+		// Window k is now exact: its boundary state is F of an exact state
+		for (n = k; n < W; n++)
+		{
+			struct libsimul_ctx *U = &pr->U[n+1];
+			pr_get_vars(pr, U, pr->x_old);
+			pr_get_vars(pr, &pr->F[n], pr->x_fine);
+			if (n == k)
+			{
+				memcpy(pr->x_new, pr->x_fine, sizeof(*pr->x_new)*pr->nvar);
+			}
+			else
+			{
+				ret = pr_coarse(pr, n, pr->x_new);
+				if (ret != 0)
+				{
+					return ret;
+				}
+				for (v = 0; v < pr->nvar; v++)
+				{
+					double g_new = pr->x_new[v];
+					pr->x_new[v] = g_new + pr->x_fine[v] - pr->G_old[n*pr->nvar+v];
+					pr->G_old[n*pr->nvar+v] = g_new;
+				}
+			}
+			// The fine solution carries the switch, diode and controller
+			// states, the continuous state is the corrected one
+			libsimul_free(U);
+			ret = libsimul_clone(U, &pr->F[n]);
+			if (ret != 0)
+			{
+				return ret;
+			}
+			memcpy(&pr->U_ctl[(n+1)*csz], &pr->F_ctl[n*csz], csz);
+			pr_set_vars(pr, U, pr->x_new);
+			for (v = 0; v < pr->nvar; v++)
+			{
+				if (fabs(pr->x_new[v]) > pr->scale[v])
+				{
+					pr->scale[v] = fabs(pr->x_new[v]);
+				}
+			}
+			for (v = 0; v < pr->nvar; v++)
+			{
+				double d = fabs(pr->x_new[v] - pr->x_old[v]);
+				if (d > 0 && d/pr->scale[v] > defect)
+				{
+					defect = d/pr->scale[v];
+				}
+			}
+		}
+		pr->iterations = k+1;
+		pr->defect = defect;
+		if (defect <= pr->tol || k+1 == W)
+		{
+			// After the last window has been refined, everything is exact
+			return 0;
+		}
+	}
+	return -ERR_NOT_CONVERGED;
+}
+
+// Clones the state at t_end to out, and copies the controller state to
+// ctl_out if it isn't NULL
+int libsimul_parareal_result(const struct libsimul_parareal *pr, struct libsimul_ctx *out, void *ctl_out)
+{
+	if (pr->U == NULL || pr->U[pr->windows].circuit == NULL)
+	{
+		return -ERR_NO_DATA;
+	}
+	if (ctl_out != NULL && pr->ctl_state_size)
+	{
+		memcpy(ctl_out, &pr->U_ctl[pr->windows*pr->ctl_state_size], pr->ctl_state_size);
+	}
+	return libsimul_clone(out, &pr->U[pr->windows]);
+}
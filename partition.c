@@ -0,0 +1,695 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#if 0
+#include <lapack.h>
+#else
+#define lapack_int int
+#define LAPACK_dgetrf dgetrf_
+void LAPACK_dgetrf(const lapack_int*, const lapack_int*, double*, const lapack_int*, lapack_int*, lapack_int*);
+#define LAPACK_dgetrs dgetrs_
+void LAPACK_dgetrs(const char*, const lapack_int*, const lapack_int*, const double*, const lapack_int*, const lapack_int*, double*, const lapack_int*, lapack_int*);
+#endif
+#include "libsimul.h"
+
+// Partitioning of the circuit into blocks that are solved separately.
+//
+// Only X transformers couple nodes without a conducting element between
+// them. A subcircuit that isn't connected to ground by any element would
+// have a singular nodal matrix, so its lowest node is pinned to 0 V and used
+// as the local ground of the subcircuit. This is done for the dense solver
+// too, and replaces the high-value bypass resistors netlists used to need.
+//
+// The block solver orders the unknowns as blocks followed by border nodes.
+// Blocks are the parts of the circuit that remain connected when ground,
+// the pinned nodes and the border nodes are removed, e.g. the phases of an
+// interleaved converter when their common input and output nodes are
+// declared as border. With A_i the block matrices, C_i and R_i their
+// coupling to the border and D_B the border matrix, the border voltages are
+// solved from the Schur complement D_B - sum R_i A_i^-1 C_i. A block is
+// refactorized only if its entries changed, so a switch event costs one
+// small block factorization and the factorization of the Schur complement.
+//
+// The X transformer stamps are left out of G_matrix; each transformer adds
+// the rank one term -u u^T / denom where u has N/(N_p R) for every winding at
+// n1 and the negation at n2. For G = A - U D^-1 U^T the Woodbury identity
+// gives G^-1 b = y + Z (D - U^T Z)^-1 U^T y where y = A^-1 b and Z = A^-1 U,
+// so besides the blocks only the k*k matrix S = D - U^T Z is factorized.
+
+static size_t uf_find(size_t *parent, size_t x)
+{
+	while (parent[x] != x)
+	{
+		parent[x] = parent[parent[x]];
+		x = parent[x];
+	}
+	return x;
+}
+
+// parent[0..nodecnt] describes the galvanically connected components
+static size_t *partition_components(struct libsimul_ctx *ctx, size_t nodecnt)
+{
+	size_t *parent = malloc(sizeof(*parent)*(nodecnt+1));
+	size_t i;
+	if (parent == NULL)
+	{
+		return NULL;
+	}
+	for (i = 0; i <= nodecnt; i++)
+	{
+		parent[i] = i;
+	}
+	for (i = 0; i < ctx->circuit->elements_used_sz; i++)
+	{
+		struct element *el = ctx->circuit->elements_used[i];
+		size_t r1 = uf_find(parent, el->n1);
+		size_t r2 = uf_find(parent, el->n2);
+		// Keep the lowest node as the root
+		if (r1 < r2)
+		{
+			parent[r2] = r1;
+		}
+		else if (r2 < r1)
+		{
+			parent[r1] = r2;
+		}
+	}
+	return parent;
+}
+
+// Computed once per circuit by read_file(); init_simulation() only does it
+// again if elements have been added since. -ERR_NO_MEMORY if out of memory.
+int partition_find_floating(struct libsimul_ctx *ctx)
+{
+	const size_t nodecnt = ctx->circuit->node_seen_sz - 1;
+	size_t *parent;
+	size_t i;
+	// Without nodes check_dense_nodes() fails later
+	if (ctx->circuit->floating_found || ctx->circuit->node_seen_sz == 0)
+	{
+		return 0;
+	}
+	if (libsimul_unshare(ctx) != 0)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	parent = partition_components(ctx, nodecnt);
+	free(ctx->circuit->floating_ref);
+	ctx->circuit->floating_ref = malloc(sizeof(*ctx->circuit->floating_ref)*(nodecnt+1));
+	ctx->circuit->floating_ref_cnt = 0;
+	if (parent == NULL || ctx->circuit->floating_ref == NULL)
+	{
+		free(parent);
+		return -ERR_NO_MEMORY;
+	}
+	for (i = 1; i <= nodecnt; i++)
+	{
+		// Roots are the lowest nodes of their components
+		if (uf_find(parent, i) == i)
+		{
+			ctx->circuit->floating_ref[ctx->circuit->floating_ref_cnt++] = (int)i;
+		}
+	}
+	ctx->circuit->floating_found = 1;
+	free(parent);
+	return 0;
+}
+
+void partition_free(struct libsimul_ctx *ctx)
+{
+	struct libsimul_partition *p = ctx->part;
+	size_t i;
+	if (p == NULL)
+	{
+		return;
+	}
+	for (i = 0; i < p->blockcnt; i++)
+	{
+		free(p->blocks[i].nodes);
+		free(p->blocks[i].G);
+		free(p->blocks[i].G_new);
+		free(p->blocks[i].LU);
+		free(p->blocks[i].ipiv);
+		free(p->blocks[i].AinvC);
+		free(p->blocks[i].W);
+		free(p->blocks[i].tmp);
+	}
+	free(p->blocks);
+	free(p->border);
+	free(p->SB);
+	free(p->SB_ipiv);
+	free(p->xb);
+	free(p->xfr_el);
+	free(p->U);
+	free(p->Z);
+	free(p->S);
+	free(p->S_ipiv);
+	free(p->w);
+	free(p);
+	ctx->part = NULL;
+}
+
+enum {
+	NODE_BLOCK,
+	NODE_PINNED,
+	NODE_BORDER,
+};
+
+int partition_init(struct libsimul_ctx *ctx)
+{
+	const size_t nodecnt = ctx->nodecnt;
+	struct libsimul_partition *p;
+	size_t *parent;
+	size_t *root_block;
+	unsigned char *kind;
+	size_t i, k, m, nrhs;
+	partition_free(ctx);
+	p = calloc(1, sizeof(*p));
+	parent = malloc(sizeof(*parent)*(nodecnt+1));
+	root_block = malloc(sizeof(*root_block)*(nodecnt+1));
+	kind = calloc(nodecnt+1, sizeof(*kind));
+	if (p == NULL || parent == NULL || root_block == NULL || kind == NULL)
+	{
+		free(p);
+		free(parent);
+		free(root_block);
+		free(kind);
+		return -ERR_NO_MEMORY;
+	}
+	ctx->part = p;
+	for (i = 0; i < ctx->circuit->bordercnt; i++)
+	{
+		kind[ctx->circuit->border[i]] = NODE_BORDER;
+	}
+	for (i = 0; i < ctx->circuit->floating_ref_cnt; i++)
+	{
+		kind[ctx->circuit->floating_ref[i]] = NODE_PINNED;
+	}
+	// Blocks: connected without going through ground or border nodes
+	for (i = 0; i <= nodecnt; i++)
+	{
+		parent[i] = i;
+		root_block[i] = SIZE_MAX;
+	}
+	for (i = 0; i < ctx->circuit->elements_used_sz; i++)
+	{
+		struct element *el = ctx->circuit->elements_used[i];
+		size_t r1, r2;
+		if (el->n1 == 0 || el->n2 == 0 ||
+		    kind[el->n1] != NODE_BLOCK || kind[el->n2] != NODE_BLOCK)
+		{
+			continue;
+		}
+		r1 = uf_find(parent, el->n1);
+		r2 = uf_find(parent, el->n2);
+		if (r1 < r2)
+		{
+			parent[r2] = r1;
+		}
+		else if (r2 < r1)
+		{
+			parent[r1] = r2;
+		}
+	}
+	for (i = 0; i < ctx->circuit->elements_used_sz; i++)
+	{
+		struct element *el = ctx->circuit->elements_used[i];
+		if (el->typ == TYPE_TRANSFORMER_DIRECT && el->primary)
+		{
+			p->xfrcnt++;
+		}
+	}
+	for (i = 1; i <= nodecnt; i++)
+	{
+		if (kind[i] == NODE_BORDER)
+		{
+			p->bordercnt++;
+		}
+	}
+	k = p->xfrcnt;
+	m = p->bordercnt;
+	nrhs = k > 0 ? k : 1;
+	p->border = malloc(sizeof(*p->border)*(m+1));
+	p->SB = malloc(sizeof(*p->SB)*(m*m+1));
+	p->SB_ipiv = malloc(sizeof(*p->SB_ipiv)*(m+1));
+	p->xb = malloc(sizeof(*p->xb)*(m*nrhs+1));
+	p->xfr_el = malloc(sizeof(*p->xfr_el)*(k+1));
+	p->U = malloc(sizeof(*p->U)*(nodecnt*k+1));
+	p->Z = malloc(sizeof(*p->Z)*(nodecnt*k+1));
+	p->S = malloc(sizeof(*p->S)*(k*k+1));
+	p->S_ipiv = malloc(sizeof(*p->S_ipiv)*(k+1));
+	p->w = malloc(sizeof(*p->w)*(k+1));
+	p->blocks = calloc(nodecnt+1, sizeof(*p->blocks));
+	if (p->border == NULL || p->SB == NULL || p->SB_ipiv == NULL || p->xb == NULL ||
+	    p->xfr_el == NULL || p->U == NULL || p->Z == NULL || p->S == NULL ||
+	    p->S_ipiv == NULL || p->w == NULL || p->blocks == NULL)
+	{
+		goto nomem;
+	}
+	k = 0;
+	for (i = 0; i < ctx->circuit->elements_used_sz; i++)
+	{
+		struct element *el = ctx->circuit->elements_used[i];
+		if (el->typ == TYPE_TRANSFORMER_DIRECT && el->primary)
+		{
+			p->xfr_el[k++] = i;
+		}
+	}
+	m = 0;
+	for (i = 1; i <= nodecnt; i++)
+	{
+		size_t r;
+		if (kind[i] == NODE_BORDER)
+		{
+			p->border[m++] = i-1;
+		}
+		if (kind[i] != NODE_BLOCK)
+		{
+			continue;
+		}
+		r = uf_find(parent, i);
+		if (root_block[r] == SIZE_MAX)
+		{
+			root_block[r] = p->blockcnt++;
+		}
+		p->blocks[root_block[r]].n++;
+	}
+	for (i = 0; i < p->blockcnt; i++)
+	{
+		struct libsimul_block *b = &p->blocks[i];
+		size_t n = b->n;
+		b->nodes = malloc(sizeof(*b->nodes)*n);
+		b->G = malloc(sizeof(*b->G)*(n*n+2*n*m));
+		b->G_new = malloc(sizeof(*b->G_new)*(n*n+2*n*m));
+		b->LU = malloc(sizeof(*b->LU)*n*n);
+		b->ipiv = malloc(sizeof(*b->ipiv)*n);
+		b->AinvC = malloc(sizeof(*b->AinvC)*(n*m+1));
+		b->W = malloc(sizeof(*b->W)*(m*m+1));
+		b->tmp = malloc(sizeof(*b->tmp)*n*nrhs);
+		if (b->nodes == NULL || b->G == NULL || b->G_new == NULL ||
+		    b->LU == NULL || b->ipiv == NULL || b->AinvC == NULL ||
+		    b->W == NULL || b->tmp == NULL)
+		{
+			goto nomem;
+		}
+		b->n = 0;
+		b->factored = 0;
+	}
+	for (i = 1; i <= nodecnt; i++)
+	{
+		struct libsimul_block *b;
+		if (kind[i] != NODE_BLOCK)
+		{
+			continue;
+		}
+		b = &p->blocks[root_block[uf_find(parent, i)]];
+		b->nodes[b->n++] = i-1;
+	}
+	free(parent);
+	free(root_block);
+	free(kind);
+	return 0;
+nomem:
+	free(parent);
+	free(root_block);
+	free(kind);
+	partition_free(ctx);
+	return -ERR_NO_MEMORY;
+}
+
+static void partition_form_u(struct libsimul_ctx *ctx)
+{
+	struct libsimul_partition *p = ctx->part;
+	const size_t nodecnt = ctx->nodecnt;
+	size_t t, j;
+	memset(p->U, 0, sizeof(*p->U)*nodecnt*p->xfrcnt);
+	for (t = 0; t < p->xfrcnt; t++)
+	{
+		struct element *el = ctx->circuit->elements_used[p->xfr_el[t]];
+		double *u = &p->U[t*nodecnt];
+		for (j = 0; j < el->allptrs_size; j++)
+		{
+			struct element *winding = el->allptrs[j];
+			double coeff = winding->N/(winding->R*el->N);
+			if (winding->n1 != 0)
+			{
+				u[winding->n1-1] += coeff;
+			}
+			if (winding->n2 != 0)
+			{
+				u[winding->n2-1] -= coeff;
+			}
+		}
+	}
+}
+
+// x = A^-1 b for nrhs right-hand sides, A being G_matrix without the
+// X transformer stamps. b and x are nodecnt*nrhs.
+static int bbd_solve(struct libsimul_ctx *ctx, const double *b_in, double *x, size_t nrhs)
+{
+	struct libsimul_partition *p = ctx->part;
+	const size_t nodecnt = ctx->nodecnt;
+	const size_t m = p->bordercnt;
+	const int mi = (int)m;
+	const int nrhsi = (int)nrhs;
+	size_t i, j, l, q, r;
+	int info = 0;
+	memset(x, 0, sizeof(*x)*nodecnt*nrhs);
+	for (q = 0; q < nrhs; q++)
+	{
+		for (j = 0; j < m; j++)
+		{
+			p->xb[q*m+j] = b_in[q*nodecnt+p->border[j]];
+		}
+	}
+	for (i = 0; i < p->blockcnt; i++)
+	{
+		struct libsimul_block *b = &p->blocks[i];
+		const size_t n = b->n;
+		const int ni = (int)n;
+		const double *R = &b->G[n*n+n*m];
+		for (q = 0; q < nrhs; q++)
+		{
+			for (r = 0; r < n; r++)
+			{
+				b->tmp[q*n+r] = b_in[q*nodecnt+b->nodes[r]];
+			}
+		}
+		LAPACK_dgetrs("N", &ni, &nrhsi, b->LU, &ni, b->ipiv, b->tmp, &ni, &info);
+		if (info != 0)
+		{
+			return libsimul_fail(ctx, ERR_SINGULAR, "Can't solve system of equations");
+		}
+		for (q = 0; q < nrhs; q++)
+		{
+			for (l = 0; l < n; l++)
+			{
+				for (j = 0; j < m; j++)
+				{
+					p->xb[q*m+j] -= R[l*m+j]*b->tmp[q*n+l];
+				}
+			}
+		}
+	}
+	if (m > 0)
+	{
+		LAPACK_dgetrs("N", &mi, &nrhsi, p->SB, &mi, p->SB_ipiv, p->xb, &mi, &info);
+		if (info != 0)
+		{
+			return libsimul_fail(ctx, ERR_SINGULAR, "Can't solve system of equations");
+		}
+	}
+	for (i = 0; i < p->blockcnt; i++)
+	{
+		struct libsimul_block *b = &p->blocks[i];
+		const size_t n = b->n;
+		for (q = 0; q < nrhs; q++)
+		{
+			for (j = 0; j < m; j++)
+			{
+				for (r = 0; r < n; r++)
+				{
+					b->tmp[q*n+r] -= b->AinvC[j*n+r]*p->xb[q*m+j];
+				}
+			}
+			for (r = 0; r < n; r++)
+			{
+				x[q*nodecnt+b->nodes[r]] = b->tmp[q*n+r];
+			}
+		}
+	}
+	for (q = 0; q < nrhs; q++)
+	{
+		for (j = 0; j < m; j++)
+		{
+			x[q*nodecnt+p->border[j]] = p->xb[q*m+j];
+		}
+	}
+	return 0;
+}
+
+// Factorizes the block if its entries changed since the last time
+static int partition_factor_block(struct libsimul_ctx *ctx, struct libsimul_block *b, size_t id)
+{
+	struct libsimul_partition *p = ctx->part;
+	const size_t nodecnt = ctx->nodecnt;
+	const size_t n = b->n;
+	const size_t m = p->bordercnt;
+	const int ni = (int)n;
+	const int mi = (int)m;
+	const double *G = ctx->G_matrix;
+	double *A = b->G_new;
+	double *C = &b->G_new[n*n];
+	double *R = &b->G_new[n*n+n*m];
+	double *swp;
+	size_t r, c, j, l;
+	int info = 0;
+	// G_matrix is column major like all LAPACK matrices
+	for (c = 0; c < n; c++)
+	{
+		for (r = 0; r < n; r++)
+		{
+			A[c*n+r] = G[b->nodes[c]*nodecnt+b->nodes[r]];
+		}
+	}
+	for (j = 0; j < m; j++)
+	{
+		for (r = 0; r < n; r++)
+		{
+			C[j*n+r] = G[p->border[j]*nodecnt+b->nodes[r]];
+		}
+	}
+	for (c = 0; c < n; c++)
+	{
+		for (j = 0; j < m; j++)
+		{
+			R[c*m+j] = G[b->nodes[c]*nodecnt+p->border[j]];
+		}
+	}
+	if (b->factored && memcmp(b->G, b->G_new, sizeof(*b->G)*(n*n+2*n*m)) == 0)
+	{
+		return 0;
+	}
+	swp = b->G;
+	b->G = b->G_new;
+	b->G_new = swp;
+	memcpy(b->LU, b->G, sizeof(*b->LU)*n*n);
+	LAPACK_dgetrf(&ni, &ni, b->LU, &ni, b->ipiv, &info);
+	if (info != 0)
+	{
+		// Factorized again next time
+		b->factored = 0;
+		return libsimul_fail(ctx, ERR_SINGULAR, "Can't LU decompose block %zu: %d", id, info);
+	}
+	b->factored = 1;
+	p->block_factor_cnt++;
+	if (m == 0)
+	{
+		return 0;
+	}
+	C = &b->G[n*n];
+	R = &b->G[n*n+n*m];
+	memcpy(b->AinvC, C, sizeof(*b->AinvC)*n*m);
+	LAPACK_dgetrs("N", &ni, &mi, b->LU, &ni, b->ipiv, b->AinvC, &ni, &info);
+	if (info != 0)
+	{
+		b->factored = 0;
+		return libsimul_fail(ctx, ERR_SINGULAR, "Can't solve system of equations");
+	}
+	// W = R A^-1 C, the contribution of the block to the Schur complement
+	for (c = 0; c < m; c++)
+	{
+		for (j = 0; j < m; j++)
+		{
+			double s = 0;
+			for (l = 0; l < n; l++)
+			{
+				s += R[l*m+j]*b->AinvC[c*n+l];
+			}
+			b->W[c*m+j] = s;
+		}
+	}
+	return 0;
+}
+
+int partition_lu(struct libsimul_ctx *ctx)
+{
+	struct libsimul_partition *p = ctx->part;
+	const size_t nodecnt = ctx->nodecnt;
+	const size_t m = p->bordercnt;
+	const int mi = (int)m;
+	const int k = (int)p->xfrcnt;
+	size_t i, r, c;
+	int info = 0;
+	int ret;
+	for (i = 0; i < p->blockcnt; i++)
+	{
+		ret = partition_factor_block(ctx, &p->blocks[i], i);
+		if (ret != 0)
+		{
+			return ret;
+		}
+	}
+	if (m > 0)
+	{
+		for (c = 0; c < m; c++)
+		{
+			for (r = 0; r < m; r++)
+			{
+				p->SB[c*m+r] = ctx->G_matrix[p->border[c]*nodecnt+p->border[r]];
+			}
+		}
+		for (i = 0; i < p->blockcnt; i++)
+		{
+			for (r = 0; r < m*m; r++)
+			{
+				p->SB[r] -= p->blocks[i].W[r];
+			}
+		}
+		LAPACK_dgetrf(&mi, &mi, p->SB, &mi, p->SB_ipiv, &info);
+		if (info != 0)
+		{
+			return libsimul_fail(ctx, ERR_SINGULAR, "Can't LU decompose border nodes: %d", info);
+		}
+	}
+	if (k == 0)
+	{
+		return 0;
+	}
+	partition_form_u(ctx);
+	ret = bbd_solve(ctx, p->U, p->Z, p->xfrcnt);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	// S = D - U^T Z
+	for (c = 0; c < p->xfrcnt; c++)
+	{
+		for (r = 0; r < p->xfrcnt; r++)
+		{
+			double s = 0;
+			for (i = 0; i < nodecnt; i++)
+			{
+				s += p->U[r*nodecnt+i]*p->Z[c*nodecnt+i];
+			}
+			if (r == c)
+			{
+				s = ctx->circuit->elements_used[p->xfr_el[r]]->transformer_direct_denom - s;
+			}
+			else
+			{
+				s = -s;
+			}
+			p->S[c*p->xfrcnt+r] = s;
+		}
+	}
+	LAPACK_dgetrf(&k, &k, p->S, &k, p->S_ipiv, &info);
+	if (info != 0)
+	{
+		return libsimul_fail(ctx, ERR_SINGULAR, "Can't LU decompose transformer coupling: %d", info);
+	}
+	return 0;
+}
+
+int partition_solve(struct libsimul_ctx *ctx)
+{
+	struct libsimul_partition *p = ctx->part;
+	const size_t nodecnt = ctx->nodecnt;
+	const int k = (int)p->xfrcnt;
+	const int one = 1;
+	size_t i, j;
+	int info = 0;
+	int ret = bbd_solve(ctx, ctx->Isrc_vector, ctx->V_vector, 1);
+	if (ret != 0 || k == 0)
+	{
+		return ret;
+	}
+	for (j = 0; j < p->xfrcnt; j++)
+	{
+		double s = 0;
+		for (i = 0; i < nodecnt; i++)
+		{
+			s += p->U[j*nodecnt+i]*ctx->V_vector[i];
+		}
+		p->w[j] = s;
+	}
+	LAPACK_dgetrs("N", &k, &one, p->S, &k, p->S_ipiv, p->w, &k, &info);
+	if (info != 0)
+	{
+		return libsimul_fail(ctx, ERR_SINGULAR, "Can't solve system of equations");
+	}
+	for (j = 0; j < p->xfrcnt; j++)
+	{
+		for (i = 0; i < nodecnt; i++)
+		{
+			ctx->V_vector[i] += p->Z[j*nodecnt+i]*p->w[j];
+		}
+	}
+	return 0;
+}
+
+// Selects the block solver (enable=1) or the dense solver (enable=0). The
+// block solver is selected automatically by init_simulation() if the circuit
+// has galvanically isolated parts or border nodes.
+int libsimul_set_partitioning(struct libsimul_ctx *ctx, int enable)
+{
+	int ret;
+	if (ctx->G_matrix == NULL)
+	{
+		return -ERR_NO_DATA;
+	}
+	if (!enable)
+	{
+		partition_free(ctx);
+	}
+	else
+	{
+		ret = partition_init(ctx);
+		if (ret != 0)
+		{
+			return ret;
+		}
+	}
+	form_g_matrix(ctx);
+	return calc_lu(ctx);
+}
+
+// Declares the nodes shared by otherwise separate parts of the circuit, e.g.
+// the input and output nodes of the phases of an interleaved converter. The
+// parts are then solved as blocks of the block solver.
+int libsimul_set_block_border(struct libsimul_ctx *ctx, const int *nodes, size_t cnt)
+{
+	int *border;
+	size_t i;
+	for (i = 0; i < cnt; i++)
+	{
+		if (nodes[i] <= 0 || (size_t)nodes[i] >= ctx->circuit->node_seen_sz)
+		{
+			return -ERR_NOT_FOUND;
+		}
+	}
+	border = malloc(sizeof(*border)*(cnt+1));
+	if (border == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	if (cnt)
+	{
+		memcpy(border, nodes, sizeof(*border)*cnt);
+	}
+	if (libsimul_unshare(ctx) != 0)
+	{
+		free(border);
+		return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
+	}
+	free(ctx->circuit->border);
+	ctx->circuit->border = border;
+	ctx->circuit->bordercnt = cnt;
+	if (ctx->G_matrix == NULL)
+	{
+		// init_simulation() selects the block solver
+		return 0;
+	}
+	return libsimul_set_partitioning(ctx, cnt > 0 || ctx->circuit->floating_ref_cnt > 0);
+}
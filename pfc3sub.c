@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+const double dt = 1e-6; // 1 us
+
+// Three-phase PFC built of three instances of a rectifier and boost stage.
+// The instances are solved as blocks of the block solver and every stage is
+// probed through its local node numbers.
+int main(int argc, char **argv)
+{
+	static const char *names[] = {"U1", "U2", "U3"};
+	size_t i, k;
+	int insts[3], probes[3];
+	struct libsimul_ctx ctx;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "pfc3sub.txt");
+	for (k = 0; k < 3; k++)
+	{
+		int inst = libsimul_find_instance(&ctx, names[k]);
+		const struct libsimul_instance *in;
+		if (inst < 0)
+		{
+			fprintf(stderr, "Instance %s not found\n", names[k]);
+			return 1;
+		}
+		in = &ctx.circuit->insts[inst];
+		printf("%s: %zu elements from %zu, %zu internal nodes from %d, L=%s\n",
+			in->name, in->el_cnt, in->el_first, in->node_cnt, in->node_first, in->params[0]);
+		insts[k] = inst;
+	}
+	init_simulation(&ctx);
+	for (k = 0; k < 3; k++)
+	{
+		char probename[32];
+		// Rectified voltage, nodes 4 and 5 of the subcircuit
+		snprintf(probename, sizeof(probename), "V_rect_%s", names[k]);
+		probes[k] = libsimul_add_probe_voltage(&ctx, probename,
+			libsimul_instance_node(&ctx, insts[k], 4), libsimul_instance_node(&ctx, insts[k], 5));
+	}
+	if (libsimul_set_instance_blocks(&ctx) != 0)
+	{
+		fprintf(stderr, "Can't solve instances as blocks\n");
+		return 1;
+	}
+	for (i = 0; i < 100*1000; i++)
+	{
+		simulation_step(&ctx);
+		if (i % 10000 == 0)
+		{
+			printf("%g V_out %g I_L1a %g %g %g V_rect %g %g %g\n", ctx.t,
+				get_V(&ctx, 4) - get_V(&ctx, 5),
+				get_inductor_current(&ctx, "U1.L1a"),
+				get_inductor_current(&ctx, "U2.L1a"),
+				get_inductor_current(&ctx, "U3.L1a"),
+				libsimul_probe_value(&ctx, probes[0]),
+				libsimul_probe_value(&ctx, probes[1]),
+				libsimul_probe_value(&ctx, probes[2]));
+		}
+	}
+	libsimul_free(&ctx);
+	return 0;
+}
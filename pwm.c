@@ -0,0 +1,419 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include "libsimul.h"
+
+// PWM modulators declared in the netlist:
+//
+// .pwm PWM1 f=10e3 duty=0.5 high=S1 low=S2 deadtime=200e-9 phase=0
+//
+// Every carrier period starts with the low switch (if any) turning off, the
+// high switch turns on after the dead time, off at duty*period, and the low
+// switch on again after another dead time. The duty cycle set from C takes
+// effect at the start of the next carrier period. simulation_step() splits
+// its step at every switching edge so that the edges are at exact times
+// regardless of dt.
+
+// Value of the PWM being read
+static double pwm_read_double(struct libsimul_ctx *ctx, const char *val, size_t off, enum libsimul_param_check check)
+{
+	return netlist_value(ctx, val, PARAM_PWM, ctx->circuit->pwmcnt-1, off, check);
+}
+
+// Range checks of the values of a PWM, applied again when a parameter is
+// overridden
+int pwm_valid(const struct libsimul_pwm *pwm)
+{
+	return pwm->f > 0 && pwm->duty_init >= 0 && pwm->duty_init <= 1 &&
+	       pwm->deadtime >= 0 && 2*pwm->deadtime < 1.0/pwm->f;
+}
+
+int pwm_read_directive(struct libsimul_ctx *ctx, char *lineptr)
+{
+	struct libsimul_circuit *c;
+	struct libsimul_pwm *pwm;
+	char *name = next_token(&lineptr);
+	char *tok;
+	size_t i;
+	if (name == NULL)
+	{
+		fprintf(stderr, "PWM must have name\n");
+		exit(1);
+	}
+	netlist_unshare(ctx);
+	c = ctx->circuit;
+	for (i = 0; i < c->pwmcnt; i++)
+	{
+		if (strcmp(c->pwms[i].name, name) == 0)
+		{
+			fprintf(stderr, "Duplicate PWM %s\n", name);
+			exit(1);
+		}
+	}
+	if (c->pwmcnt >= c->pwmcap || c->pwms == NULL)
+	{
+		size_t new_cap = 2*c->pwmcnt+4;
+		struct libsimul_pwm *new_pwms;
+		new_pwms = realloc(c->pwms, sizeof(*c->pwms)*new_cap);
+		if (new_pwms == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		c->pwms = new_pwms;
+		c->pwmcap = new_cap;
+	}
+	pwm = &c->pwms[c->pwmcnt];
+	memset(pwm, 0, sizeof(*pwm));
+	pwm->name = strdup(name);
+	pwm->duty_init = 0;
+	if (pwm->name == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	c->pwmcnt++;
+	while ((tok = next_token(&lineptr)) != NULL)
+	{
+		char *equals = strchr(tok, '=');
+		char *val;
+		if (equals == NULL)
+		{
+			fprintf(stderr, "Extra token no equals sign\n");
+			exit(1);
+		}
+		*equals = '\0';
+		val = &equals[1];
+		if (strcmp(tok, "f") == 0)
+		{
+			pwm->f = pwm_read_double(ctx, val, offsetof(struct libsimul_pwm, f), PARAM_POSITIVE);
+			if (pwm->f <= 0)
+			{
+				fprintf(stderr, "Invalid PWM frequency: %lf\n", pwm->f);
+				exit(1);
+			}
+		}
+		else if (strcmp(tok, "duty") == 0)
+		{
+			pwm->duty_init = pwm_read_double(ctx, val, offsetof(struct libsimul_pwm, duty_init), PARAM_NONNEGATIVE);
+			if (pwm->duty_init < 0 || pwm->duty_init > 1)
+			{
+				fprintf(stderr, "Invalid duty cycle: %lf\n", pwm->duty_init);
+				exit(1);
+			}
+		}
+		else if (strcmp(tok, "deadtime") == 0)
+		{
+			pwm->deadtime = pwm_read_double(ctx, val, offsetof(struct libsimul_pwm, deadtime), PARAM_NONNEGATIVE);
+			if (pwm->deadtime < 0)
+			{
+				fprintf(stderr, "Invalid dead time: %lf\n", pwm->deadtime);
+				exit(1);
+			}
+		}
+		else if (strcmp(tok, "phase") == 0)
+		{
+			pwm->phase = pwm_read_double(ctx, val, offsetof(struct libsimul_pwm, phase), PARAM_ANY);
+		}
+		else if (strcmp(tok, "high") == 0)
+		{
+			free(pwm->high_name);
+			pwm->high_name = strdup(val);
+			if (pwm->high_name == NULL)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		else if (strcmp(tok, "low") == 0)
+		{
+			free(pwm->low_name);
+			pwm->low_name = strdup(val);
+			if (pwm->low_name == NULL)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Invalid parameter: %s\n", tok);
+			exit(1);
+		}
+	}
+	if (pwm->f <= 0)
+	{
+		fprintf(stderr, "PWM %s must have frequency\n", pwm->name);
+		exit(1);
+	}
+	if (pwm->high_name == NULL)
+	{
+		fprintf(stderr, "PWM %s must have high switch\n", pwm->name);
+		exit(1);
+	}
+	if (!pwm_valid(pwm))
+	{
+		fprintf(stderr, "PWM %s dead time too long\n", pwm->name);
+		exit(1);
+	}
+	return 0;
+}
+
+int pwm_copy_defs(struct libsimul_circuit *dst, const struct libsimul_circuit *src)
+{
+	size_t i;
+	dst->pwms = NULL;
+	dst->pwmcnt = 0;
+	dst->pwmcap = 0;
+	if (src->pwmcnt == 0)
+	{
+		return 0;
+	}
+	dst->pwms = malloc(sizeof(*dst->pwms)*src->pwmcnt);
+	if (dst->pwms == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	dst->pwmcap = src->pwmcnt;
+	for (i = 0; i < src->pwmcnt; i++)
+	{
+		struct libsimul_pwm *pwm = &dst->pwms[i];
+		*pwm = src->pwms[i];
+		pwm->name = strdup(pwm->name);
+		pwm->high_name = strdup(pwm->high_name);
+		pwm->low_name = pwm->low_name ? strdup(pwm->low_name) : NULL;
+		dst->pwmcnt++;
+		if (pwm->name == NULL || pwm->high_name == NULL ||
+		    (src->pwms[i].low_name != NULL && pwm->low_name == NULL))
+		{
+			return -ERR_NO_MEMORY;
+		}
+	}
+	return 0;
+}
+
+void pwm_free_defs(struct libsimul_circuit *c)
+{
+	size_t i;
+	for (i = 0; i < c->pwmcnt; i++)
+	{
+		free(c->pwms[i].name);
+		free(c->pwms[i].high_name);
+		free(c->pwms[i].low_name);
+	}
+	free(c->pwms);
+	c->pwms = NULL;
+	c->pwmcnt = 0;
+	c->pwmcap = 0;
+}
+
+static int pwm_find_switch(struct libsimul_ctx *ctx, const struct libsimul_pwm *pwm, const char *swname, size_t *idx)
+{
+	size_t i;
+	i = libsimul_find_element(ctx->circuit, swname);
+	if (i == SIZE_MAX)
+	{
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Switch %s of PWM %s not found", swname, pwm->name);
+	}
+	if (ctx->circuit->elements_used[i]->typ != TYPE_SWITCH)
+	{
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s of PWM %s not a switch", swname, pwm->name);
+	}
+	*idx = i;
+	return 0;
+}
+
+// Resolves switch names, they may be defined after the PWM
+int pwm_init_simulation(struct libsimul_ctx *ctx)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	size_t i;
+	int ret;
+	if (c->pwmcnt == 0)
+	{
+		return 0;
+	}
+	free(ctx->pwm_state);
+	ctx->pwm_state = malloc(sizeof(*ctx->pwm_state)*c->pwmcnt);
+	if (ctx->pwm_state == NULL)
+	{
+		return libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory");
+	}
+	for (i = 0; i < c->pwmcnt; i++)
+	{
+		const struct libsimul_pwm *pwm = &c->pwms[i];
+		struct libsimul_pwm_state *st = &ctx->pwm_state[i];
+		const double T = 1.0/pwm->f;
+		const double t_off = pwm->phase/360.0*T;
+		ret = pwm_find_switch(ctx, pwm, pwm->high_name, &st->high_idx);
+		if (ret == 0 && pwm->low_name != NULL)
+		{
+			ret = pwm_find_switch(ctx, pwm, pwm->low_name, &st->low_idx);
+		}
+		else if (ret == 0)
+		{
+			st->low_idx = SIZE_MAX;
+		}
+		if (ret != 0)
+		{
+			free(ctx->pwm_state);
+			ctx->pwm_state = NULL;
+			return ret;
+		}
+		st->duty_cmd = pwm->duty_init;
+		st->duty = pwm->duty_init;
+		st->period_start = t_off + floor((ctx->t - t_off)/T)*T;
+	}
+	pwm_apply(ctx);
+	return 0;
+}
+
+static void pwm_set_switch(struct libsimul_ctx *ctx, size_t idx, int state)
+{
+	if ((!!ctx->state[idx].current_switch_state_is_closed) != state)
+	{
+		ctx->state[idx].current_switch_state_is_closed = state;
+		ctx->needs_recalc = 1;
+	}
+}
+
+// Sets the switches to their states from ctx->t on
+void pwm_apply(struct libsimul_ctx *ctx)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	size_t i;
+	for (i = 0; i < c->pwmcnt; i++)
+	{
+		const struct libsimul_pwm *pwm = &c->pwms[i];
+		struct libsimul_pwm_state *st = &ctx->pwm_state[i];
+		const double T = 1.0/pwm->f;
+		const double eps = 1e-9*T;
+		const int has_low = st->low_idx != SIZE_MAX;
+		double x;
+		while (ctx->t >= st->period_start + T - eps)
+		{
+			st->period_start += T;
+			st->duty = st->duty_cmd;
+		}
+		x = ctx->t - st->period_start;
+		pwm_set_switch(ctx, st->high_idx,
+			x >= (has_low ? pwm->deadtime : 0) - eps && x < st->duty*T - eps);
+		if (has_low)
+		{
+			pwm_set_switch(ctx, st->low_idx, x >= st->duty*T + pwm->deadtime - eps);
+		}
+	}
+}
+
+// Time of the next switching edge or carrier period start after ctx->t
+double pwm_next_edge(struct libsimul_ctx *ctx)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	double next = INFINITY;
+	size_t i, j;
+	for (i = 0; i < c->pwmcnt; i++)
+	{
+		const struct libsimul_pwm *pwm = &c->pwms[i];
+		const struct libsimul_pwm_state *st = &ctx->pwm_state[i];
+		const double T = 1.0/pwm->f;
+		const double eps = 1e-9*T;
+		const int has_low = st->low_idx != SIZE_MAX;
+		double edges[4];
+		edges[0] = has_low ? pwm->deadtime : 0;
+		edges[1] = st->duty*T;
+		edges[2] = has_low ? st->duty*T + pwm->deadtime : T;
+		edges[3] = T;
+		for (j = 0; j < 4; j++)
+		{
+			double te = st->period_start + edges[j];
+			if (te > ctx->t + eps && te < next)
+			{
+				next = te;
+			}
+		}
+	}
+	return next;
+}
+
+static int pwm_find_state(struct libsimul_ctx *ctx, const char *pwmname, struct libsimul_pwm_state **st)
+{
+	size_t i;
+	for (i = 0; i < ctx->circuit->pwmcnt; i++)
+	{
+		if (strcmp(ctx->circuit->pwms[i].name, pwmname) == 0)
+		{
+			break;
+		}
+	}
+	if (i == ctx->circuit->pwmcnt)
+	{
+		return libsimul_fail(ctx, ERR_NOT_FOUND, "PWM %s not found", pwmname);
+	}
+	if (ctx->pwm_state == NULL)
+	{
+		return libsimul_fail(ctx, ERR_NO_DATA, "PWM %s used before init_simulation", pwmname);
+	}
+	*st = &ctx->pwm_state[i];
+	return 0;
+}
+
+// Takes effect at the start of the next carrier period
+int set_pwm_duty(struct libsimul_ctx *ctx, const char *pwmname, double duty)
+{
+	struct libsimul_pwm_state *st = NULL;
+	int ret = pwm_find_state(ctx, pwmname, &st);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	if (duty < 0 || duty > 1)
+	{
+		return libsimul_fail(ctx, ERR_INVALID, "Invalid duty cycle: %lf", duty);
+	}
+	st->duty_cmd = duty;
+	return 0;
+}
+
+double get_pwm_duty(struct libsimul_ctx *ctx, const char *pwmname)
+{
+	struct libsimul_pwm_state *st = NULL;
+	if (pwm_find_state(ctx, pwmname, &st) != 0)
+	{
+		return NAN;
+	}
+	return st->duty_cmd;
+}
+
+int libsimul_pwm_handle(struct libsimul_ctx *ctx, const char *pwmname)
+{
+	size_t i;
+	for (i = 0; i < ctx->circuit->pwmcnt; i++)
+	{
+		if (strcmp(ctx->circuit->pwms[i].name, pwmname) == 0)
+		{
+			return (int)i;
+		}
+	}
+	return -ERR_NOT_FOUND;
+}
+
+int libsimul_handle_set_pwm_duty(struct libsimul_ctx *ctx, int h, double duty)
+{
+	if (h < 0 || (size_t)h >= ctx->circuit->pwmcnt || ctx->pwm_state == NULL)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	if (duty < 0)
+	{
+		duty = 0;
+	}
+	if (duty > 1)
+	{
+		duty = 1;
+	}
+	ctx->pwm_state[h].duty_cmd = duty;
+	return 0;
+}
@@ -0,0 +1,719 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/types.h>
+#include "libsimul.h"
+
+// Chunked compressed recordings: the codec used by the writer thread of
+// record.c and the reader.
+//
+// A chunk holds up to chunk_frames frames and is compressed column by
+// column, so that every chunk can be decoded on its own. Each value is
+// predicted from the two previous values of its column, either as the last
+// value or by linear extrapolation, and the bits of the value are XORed with
+// the bits of the closer prediction. For slowly varying signals and for the
+// time the residual has many leading zero bytes. The predictor and the count
+// of leading zero bytes form one of REC_SYMS symbols, which are Huffman
+// coded per column and chunk; the remaining residual bytes are stored as is.
+//
+// Column layout: REC_SYMS code lengths, the length and the bytes of the
+// Huffman coded symbols, the length and the bytes of the residuals. A chunk
+// header has the FNV-1a hash of the payload, so that a damaged chunk is
+// reported instead of decoded to wrong values. The chunk index at the end
+// of the file gives random access by time. If the recording wasn't closed,
+// the chunks are found by scanning the file.
+
+#define REC_SYMS 18 // 2 predictors times 0..8 leading zero bytes
+#define REC_MAX_BITS 15
+
+static uint64_t rec_bits(double x)
+{
+	uint64_t u;
+	memcpy(&u, &x, sizeof(u));
+	return u;
+}
+
+static double rec_double(uint64_t u)
+{
+	double x;
+	memcpy(&x, &u, sizeof(x));
+	return x;
+}
+
+// Linear extrapolation without a multiplication, so that the compiler can't
+// fuse it differently in the writer and in the reader
+static uint64_t rec_pred_lin(double x1, double x2)
+{
+	double p = x1 + (x1 - x2);
+	return isnan(p) ? rec_bits(x1) : rec_bits(p);
+}
+
+static int rec_lzb(uint64_t r)
+{
+	int n = 0;
+	while (n < 8 && (r >> (56 - 8*n)) == 0)
+	{
+		n++;
+	}
+	return n;
+}
+
+// Huffman code lengths of the symbol counts, at most REC_MAX_BITS
+static void rec_huff_lengths(const size_t *cnt, uint8_t *len)
+{
+	size_t w[2*REC_SYMS];
+	int parent[2*REC_SYMS];
+	int alive[2*REC_SYMS];
+	size_t scale = 0;
+	int nodes, used, i, maxlen;
+	for (;;)
+	{
+		nodes = 0;
+		used = 0;
+		for (i = 0; i < REC_SYMS; i++)
+		{
+			// Halving the counts flattens the tree if it's too deep
+			w[i] = cnt[i] ? (cnt[i] >> scale) + 1 : 0;
+			parent[i] = -1;
+			alive[i] = cnt[i] != 0;
+			used += alive[i];
+			len[i] = 0;
+		}
+		nodes = REC_SYMS;
+		if (used == 0)
+		{
+			return;
+		}
+		if (used == 1)
+		{
+			for (i = 0; i < REC_SYMS; i++)
+			{
+				len[i] = alive[i];
+			}
+			return;
+		}
+		while (used > 1)
+		{
+			int a = -1, b = -1;
+			for (i = 0; i < nodes; i++)
+			{
+				if (!alive[i])
+				{
+					continue;
+				}
+				if (a < 0 || w[i] < w[a])
+				{
+					b = a;
+					a = i;
+				}
+				else if (b < 0 || w[i] < w[b])
+				{
+					b = i;
+				}
+			}
+			w[nodes] = w[a] + w[b];
+			parent[nodes] = -1;
+			alive[nodes] = 1;
+			parent[a] = nodes;
+			parent[b] = nodes;
+			alive[a] = 0;
+			alive[b] = 0;
+			nodes++;
+			used--;
+		}
+		maxlen = 0;
+		for (i = 0; i < REC_SYMS; i++)
+		{
+			int p;
+			if (cnt[i] == 0)
+			{
+				continue;
+			}
+			for (p = parent[i]; p >= 0; p = parent[p])
+			{
+				len[i]++;
+			}
+			if (len[i] > maxlen)
+			{
+				maxlen = len[i];
+			}
+		}
+		if (maxlen <= REC_MAX_BITS)
+		{
+			return;
+		}
+		scale++;
+	}
+}
+
+// Canonical codes of the lengths, shorter codes and then lower symbols first
+static void rec_huff_codes(const uint8_t *len, uint16_t *code)
+{
+	uint16_t next[REC_MAX_BITS+2];
+	size_t bl_cnt[REC_MAX_BITS+1] = {0};
+	int i, b;
+	uint16_t c = 0;
+	for (i = 0; i < REC_SYMS; i++)
+	{
+		bl_cnt[len[i]]++;
+	}
+	bl_cnt[0] = 0;
+	for (b = 1; b <= REC_MAX_BITS; b++)
+	{
+		c = (c + bl_cnt[b-1]) << 1;
+		next[b] = c;
+	}
+	for (i = 0; i < REC_SYMS; i++)
+	{
+		if (len[i])
+		{
+			code[i] = next[len[i]]++;
+		}
+	}
+}
+
+struct rec_bitwriter {
+	uint8_t *p;
+	size_t len;
+	unsigned acc;
+	int nbits;
+};
+
+static void rec_put_bits(struct rec_bitwriter *bw, unsigned code, int nbits)
+{
+	bw->acc = (bw->acc << nbits) | code;
+	bw->nbits += nbits;
+	while (bw->nbits >= 8)
+	{
+		bw->nbits -= 8;
+		bw->p[bw->len++] = (uint8_t)(bw->acc >> bw->nbits);
+	}
+	bw->acc &= (1u << bw->nbits) - 1;
+}
+
+static void rec_put_u32(uint8_t *p, uint32_t u)
+{
+	memcpy(p, &u, sizeof(u));
+}
+
+static uint32_t rec_get_u32(const uint8_t *p)
+{
+	uint32_t u;
+	memcpy(&u, p, sizeof(u));
+	return u;
+}
+
+uint64_t recfile_hash(const uint8_t *p, size_t sz)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < sz; i++)
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// Upper bound of the compressed size of cnt frames of framesz doubles
+size_t recfile_encode_bound(size_t cnt, size_t framesz)
+{
+	return framesz*(REC_SYMS + 8 + cnt*(2+8));
+}
+
+// Compresses cnt frames of framesz doubles to out, returns the size
+size_t recfile_encode(const double *frames, size_t cnt, size_t framesz, uint8_t *out, uint8_t *syms)
+{
+	size_t off = 0;
+	size_t col, i;
+	for (col = 0; col < framesz; col++)
+	{
+		size_t cnts[REC_SYMS] = {0};
+		uint8_t len[REC_SYMS];
+		uint16_t code[REC_SYMS];
+		struct rec_bitwriter bw;
+		size_t res_off;
+		double x1 = 0, x2 = 0;
+		uint8_t *res;
+		// Residual bytes go after the symbols, whose size isn't known yet,
+		// so they are collected at the worst case offset and moved
+		res = out + off + REC_SYMS + 8 + 2*cnt;
+		res_off = 0;
+		for (i = 0; i < cnt; i++)
+		{
+			const double x = frames[i*framesz+col];
+			const uint64_t u = rec_bits(x);
+			const uint64_t r_last = u ^ rec_bits(x1);
+			const uint64_t r_lin = u ^ rec_pred_lin(x1, x2);
+			const int sel = r_lin < r_last;
+			const uint64_t r = sel ? r_lin : r_last;
+			const int lzb = rec_lzb(r);
+			int b;
+			syms[i] = (uint8_t)(sel*9 + lzb);
+			cnts[syms[i]]++;
+			for (b = 0; b < 8-lzb; b++)
+			{
+				res[res_off++] = (uint8_t)(r >> (8*b));
+			}
+			x2 = x1;
+			x1 = x;
+		}
+		rec_huff_lengths(cnts, len);
+		rec_huff_codes(len, code);
+		memcpy(out + off, len, REC_SYMS);
+		off += REC_SYMS;
+		bw.p = out + off + 4;
+		bw.len = 0;
+		bw.acc = 0;
+		bw.nbits = 0;
+		for (i = 0; i < cnt; i++)
+		{
+			rec_put_bits(&bw, code[syms[i]], len[syms[i]]);
+		}
+		if (bw.nbits > 0)
+		{
+			rec_put_bits(&bw, 0, 8 - bw.nbits);
+		}
+		rec_put_u32(out + off, (uint32_t)bw.len);
+		off += 4 + bw.len;
+		rec_put_u32(out + off, (uint32_t)res_off);
+		off += 4;
+		memmove(out + off, res, res_off);
+		off += res_off;
+	}
+	return off;
+}
+
+// Decodes cnt frames of framesz doubles of a payload of sz bytes, returns
+// 0 or -ERR_MISMATCH if it's corrupt
+static int recfile_decode(const uint8_t *in, size_t sz, size_t cnt, size_t framesz, double *frames)
+{
+	size_t off = 0;
+	size_t col, i;
+	for (col = 0; col < framesz; col++)
+	{
+		uint8_t len[REC_SYMS];
+		uint8_t sorted[REC_SYMS];
+		size_t bl_cnt[REC_MAX_BITS+1] = {0};
+		const uint8_t *bits, *res;
+		size_t bits_len, res_len, bitpos = 0, res_off = 0;
+		double x1 = 0, x2 = 0;
+		int b, n = 0;
+		if (sz - off < REC_SYMS + 4)
+		{
+			return -ERR_MISMATCH;
+		}
+		memcpy(len, in + off, REC_SYMS);
+		off += REC_SYMS;
+		for (i = 0; i < REC_SYMS; i++)
+		{
+			if (len[i] > REC_MAX_BITS)
+			{
+				return -ERR_MISMATCH;
+			}
+			bl_cnt[len[i]]++;
+		}
+		for (b = 1; b <= REC_MAX_BITS; b++)
+		{
+			for (i = 0; i < REC_SYMS; i++)
+			{
+				if (len[i] == b)
+				{
+					sorted[n++] = (uint8_t)i;
+				}
+			}
+		}
+		bits_len = rec_get_u32(in + off);
+		off += 4;
+		if (sz - off < bits_len || sz - off - bits_len < 4)
+		{
+			return -ERR_MISMATCH;
+		}
+		bits = in + off;
+		off += bits_len;
+		res_len = rec_get_u32(in + off);
+		off += 4;
+		if (sz - off < res_len)
+		{
+			return -ERR_MISMATCH;
+		}
+		res = in + off;
+		off += res_len;
+		for (i = 0; i < cnt; i++)
+		{
+			// Canonical decoding one bit at a time
+			int code = 0, first = 0, index = 0, sym = -1;
+			int lzb, sel, k;
+			uint64_t r = 0;
+			for (b = 1; b <= REC_MAX_BITS; b++)
+			{
+				int c = (int)bl_cnt[b];
+				if (bitpos >= 8*bits_len)
+				{
+					return -ERR_MISMATCH;
+				}
+				code |= (bits[bitpos >> 3] >> (7 - (bitpos & 7))) & 1;
+				bitpos++;
+				if (code - first < c)
+				{
+					sym = sorted[index + code - first];
+					break;
+				}
+				index += c;
+				first = (first + c) << 1;
+				code <<= 1;
+			}
+			if (sym < 0)
+			{
+				return -ERR_MISMATCH;
+			}
+			sel = sym / 9;
+			lzb = sym % 9;
+			if (res_len - res_off < (size_t)(8-lzb))
+			{
+				return -ERR_MISMATCH;
+			}
+			for (k = 0; k < 8-lzb; k++)
+			{
+				r |= (uint64_t)res[res_off++] << (8*k);
+			}
+			r ^= sel ? rec_pred_lin(x1, x2) : rec_bits(x1);
+			x2 = x1;
+			x1 = rec_double(r);
+			frames[i*framesz+col] = x1;
+		}
+	}
+	return off == sz ? 0 : -ERR_MISMATCH;
+}
+
+static int rec_read(FILE *f, void *p, size_t sz)
+{
+	return fread(p, 1, sz, f) == sz ? 0 : -ERR_MISMATCH;
+}
+
+// Reads the chunk header at the current position of the file
+static int recfile_read_chunk_header(FILE *f, struct libsimul_rec_chunk *ch, uint64_t *payload,
+                                     uint64_t *hash)
+{
+	char magic[4];
+	uint32_t frames;
+	ch->offset = (uint64_t)ftello(f);
+	if (rec_read(f, magic, 4) != 0 || memcmp(magic, RECORD_CHUNK_MAGIC, 4) != 0 ||
+	    rec_read(f, &frames, sizeof(frames)) != 0 ||
+	    rec_read(f, &ch->t_first, sizeof(ch->t_first)) != 0 ||
+	    rec_read(f, &ch->t_last, sizeof(ch->t_last)) != 0 ||
+	    rec_read(f, payload, sizeof(*payload)) != 0 ||
+	    rec_read(f, hash, sizeof(*hash)) != 0)
+	{
+		return -ERR_MISMATCH;
+	}
+	ch->frames = frames;
+	return 0;
+}
+
+static int recfile_add_chunk(struct libsimul_recfile *rf, const struct libsimul_rec_chunk *ch, size_t *cap)
+{
+	if (rf->chunkcnt >= *cap || rf->chunks == NULL)
+	{
+		size_t new_cap = 2*rf->chunkcnt+16;
+		struct libsimul_rec_chunk *new_chunks;
+		new_chunks = realloc(rf->chunks, sizeof(*rf->chunks)*new_cap);
+		if (new_chunks == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		rf->chunks = new_chunks;
+		*cap = new_cap;
+	}
+	rf->chunks[rf->chunkcnt++] = *ch;
+	return 0;
+}
+
+// Index at the end of a closed recording
+static int recfile_read_index(struct libsimul_recfile *rf, off_t data_start, off_t end)
+{
+	char magic[4];
+	uint64_t idx_off, cnt, i;
+	size_t cap = 0;
+	if (end - data_start < 12 || fseeko(rf->f, end - 12, SEEK_SET) != 0 ||
+	    rec_read(rf->f, &idx_off, sizeof(idx_off)) != 0 || rec_read(rf->f, magic, 4) != 0 ||
+	    memcmp(magic, RECORD_END_MAGIC, 4) != 0 ||
+	    idx_off < (uint64_t)data_start || idx_off > (uint64_t)end - 12 ||
+	    fseeko(rf->f, (off_t)idx_off, SEEK_SET) != 0 ||
+	    rec_read(rf->f, magic, 4) != 0 || memcmp(magic, RECORD_INDEX_MAGIC, 4) != 0 ||
+	    rec_read(rf->f, &cnt, sizeof(cnt)) != 0 ||
+	    cnt > ((uint64_t)end - idx_off)/sizeof(*rf->chunks))
+	{
+		return -ERR_MISMATCH;
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		struct libsimul_rec_chunk ch;
+		int ret;
+		if (rec_read(rf->f, &ch, sizeof(ch)) != 0 || ch.frames == 0 ||
+		    ch.frames > rf->chunk_frames || ch.offset < (uint64_t)data_start ||
+		    ch.offset >= idx_off)
+		{
+			return -ERR_MISMATCH;
+		}
+		ret = recfile_add_chunk(rf, &ch, &cap);
+		if (ret != 0)
+		{
+			return ret;
+		}
+	}
+	return 0;
+}
+
+// Finds the chunks of a recording that wasn't closed. A chunk cut short at
+// the end of the file is left out.
+static int recfile_scan(struct libsimul_recfile *rf, off_t data_start, off_t end)
+{
+	size_t cap = 0;
+	off_t off = data_start;
+	rf->chunkcnt = 0;
+	while (fseeko(rf->f, off, SEEK_SET) == 0)
+	{
+		struct libsimul_rec_chunk ch;
+		uint64_t payload, hash;
+		int ret;
+		if (recfile_read_chunk_header(rf->f, &ch, &payload, &hash) != 0 ||
+		    ch.frames == 0 || ch.frames > rf->chunk_frames ||
+		    payload > (uint64_t)(end - ftello(rf->f)))
+		{
+			break;
+		}
+		ret = recfile_add_chunk(rf, &ch, &cap);
+		if (ret != 0)
+		{
+			return ret;
+		}
+		off = ftello(rf->f) + (off_t)payload;
+	}
+	return 0;
+}
+
+// Opens a recording of format RECORD_CHUNKED for reading. Returns 0,
+// -ERR_IO if it can't be opened or -ERR_MISMATCH if it isn't a chunked
+// recording.
+int libsimul_recfile_open(struct libsimul_recfile *rf, const char *fname)
+{
+	char magic[4];
+	uint32_t hdr[3];
+	off_t data_start, end;
+	size_t i;
+	int ret;
+	memset(rf, 0, sizeof(*rf));
+	rf->chunk = SIZE_MAX;
+	rf->f = fopen(fname, "rb");
+	if (rf->f == NULL)
+	{
+		return -ERR_IO;
+	}
+	if (rec_read(rf->f, magic, 4) != 0 || memcmp(magic, RECORD_CHUNKED_MAGIC, 4) != 0 ||
+	    rec_read(rf->f, hdr, sizeof(hdr)) != 0 || hdr[0] != RECORD_CHUNKED_VERSION ||
+	    hdr[2] == 0)
+	{
+		libsimul_recfile_close(rf);
+		return -ERR_MISMATCH;
+	}
+	rf->probecnt = hdr[1];
+	rf->chunk_frames = hdr[2];
+	rf->names = calloc(rf->probecnt+1, sizeof(*rf->names));
+	if (rf->names == NULL)
+	{
+		libsimul_recfile_close(rf);
+		return -ERR_NO_MEMORY;
+	}
+	for (i = 0; i < rf->probecnt; i++)
+	{
+		uint16_t len;
+		if (rec_read(rf->f, &len, sizeof(len)) != 0)
+		{
+			libsimul_recfile_close(rf);
+			return -ERR_MISMATCH;
+		}
+		rf->names[i] = malloc((size_t)len+1);
+		if (rf->names[i] == NULL)
+		{
+			libsimul_recfile_close(rf);
+			return -ERR_NO_MEMORY;
+		}
+		if (rec_read(rf->f, rf->names[i], len) != 0)
+		{
+			libsimul_recfile_close(rf);
+			return -ERR_MISMATCH;
+		}
+		rf->names[i][len] = '\0';
+	}
+	data_start = ftello(rf->f);
+	if (fseeko(rf->f, 0, SEEK_END) != 0)
+	{
+		libsimul_recfile_close(rf);
+		return -ERR_IO;
+	}
+	end = ftello(rf->f);
+	ret = recfile_read_index(rf, data_start, end);
+	if (ret == -ERR_MISMATCH)
+	{
+		ret = recfile_scan(rf, data_start, end);
+	}
+	if (ret == 0)
+	{
+		rf->frames = malloc(sizeof(*rf->frames)*rf->chunk_frames*(rf->probecnt+1));
+		if (rf->frames == NULL)
+		{
+			ret = -ERR_NO_MEMORY;
+		}
+	}
+	if (ret != 0)
+	{
+		libsimul_recfile_close(rf);
+	}
+	return ret;
+}
+
+// Column of a probe in the frames returned by libsimul_recfile_next(),
+// after the time in column 0
+int libsimul_recfile_probe(const struct libsimul_recfile *rf, const char *name)
+{
+	size_t i;
+	for (i = 0; i < rf->probecnt; i++)
+	{
+		if (strcmp(rf->names[i], name) == 0)
+		{
+			return (int)i+1;
+		}
+	}
+	return -ERR_NOT_FOUND;
+}
+
+static int recfile_load(struct libsimul_recfile *rf, size_t idx)
+{
+	const struct libsimul_rec_chunk *ch = &rf->chunks[idx];
+	struct libsimul_rec_chunk hdr;
+	uint64_t payload, hash;
+	int ret;
+	if (fseeko(rf->f, (off_t)ch->offset, SEEK_SET) != 0)
+	{
+		return -ERR_IO;
+	}
+	if (recfile_read_chunk_header(rf->f, &hdr, &payload, &hash) != 0 || hdr.frames != ch->frames)
+	{
+		return -ERR_MISMATCH;
+	}
+	if (payload > rf->bufsz)
+	{
+		uint8_t *new_buf = realloc(rf->buf, payload);
+		if (new_buf == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		rf->buf = new_buf;
+		rf->bufsz = payload;
+	}
+	if (rec_read(rf->f, rf->buf, payload) != 0 || recfile_hash(rf->buf, payload) != hash)
+	{
+		return -ERR_MISMATCH;
+	}
+	rf->chunk = SIZE_MAX;
+	ret = recfile_decode(rf->buf, payload, ch->frames, rf->probecnt+1, rf->frames);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	rf->chunk = idx;
+	rf->next_chunk = idx+1;
+	rf->pos = 0;
+	return 0;
+}
+
+// Positions at the first frame at or after time t. Only the chunk of that
+// frame is read. Returns -ERR_NO_DATA if the recording ends before t.
+int libsimul_recfile_seek(struct libsimul_recfile *rf, double t)
+{
+	size_t lo = 0, hi = rf->chunkcnt;
+	const double *fr;
+	int ret;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi-lo)/2;
+		if (rf->chunks[mid].t_last < t)
+		{
+			lo = mid+1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	if (lo == rf->chunkcnt)
+	{
+		rf->chunk = SIZE_MAX;
+		rf->next_chunk = rf->chunkcnt;
+		return -ERR_NO_DATA;
+	}
+	if (rf->chunk != lo)
+	{
+		ret = recfile_load(rf, lo);
+		if (ret != 0)
+		{
+			return ret;
+		}
+	}
+	rf->next_chunk = lo+1;
+	fr = rf->frames;
+	for (rf->pos = 0; rf->pos < rf->chunks[lo].frames; rf->pos++)
+	{
+		if (fr[rf->pos*(rf->probecnt+1)] >= t)
+		{
+			break;
+		}
+	}
+	return 0;
+}
+
+// Returns 1 and the next frame (time and probes), 0 at the end of the
+// recording, or a negative error code
+int libsimul_recfile_next(struct libsimul_recfile *rf, const double **frame)
+{
+	int ret;
+	while (rf->chunk == SIZE_MAX || rf->pos >= rf->chunks[rf->chunk].frames)
+	{
+		if (rf->next_chunk >= rf->chunkcnt)
+		{
+			return 0;
+		}
+		ret = recfile_load(rf, rf->next_chunk);
+		if (ret != 0)
+		{
+			return ret;
+		}
+	}
+	*frame = &rf->frames[rf->pos*(rf->probecnt+1)];
+	rf->pos++;
+	return 1;
+}
+
+void libsimul_recfile_close(struct libsimul_recfile *rf)
+{
+	size_t i;
+	if (rf->names != NULL)
+	{
+		for (i = 0; i < rf->probecnt; i++)
+		{
+			free(rf->names[i]);
+		}
+	}
+	if (rf->f != NULL)
+	{
+		fclose(rf->f);
+	}
+	free(rf->names);
+	free(rf->chunks);
+	free(rf->frames);
+	free(rf->buf);
+	memset(rf, 0, sizeof(*rf));
+}
@@ -0,0 +1,686 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include "libsimul.h"
+
+// Probes and recording of probe samples.
+//
+// The simulation thread only evaluates the probes and copies one frame
+// (time followed by all probe values) into a single-producer single-consumer
+// ring buffer. A background writer thread formats and writes the frames.
+// Neither side takes a lock: the producer publishes frames by a release
+// store of head and the consumer frees them by a release store of tail. The
+// producer waits only if the ring is full, and every such wait is counted.
+// For RECORD_CHUNKED the writer also collects the frames into chunks and
+// compresses them (see recfile.c), the chunk index is written on close.
+//
+// With libsimul_record_set_window() only windows around trigger events are
+// recorded: the simulation thread keeps the latest frames in a small
+// circular history and passes them to the writer together with the frames
+// following a trigger. Other frames never reach the ring.
+
+static int probe_add(struct libsimul_ctx *ctx, const char *name, enum probe_type typ,
+                     int n1, int n2, size_t elidx)
+{
+	struct libsimul_probe *p;
+	if (ctx->recorder != NULL || ctx->live != NULL)
+	{
+		// Frame layout is fixed once recording has started
+		return -ERR_BUSY;
+	}
+	if (ctx->probecnt >= ctx->probecap || ctx->probes == NULL)
+	{
+		size_t new_cap = 2*ctx->probecnt+16;
+		struct libsimul_probe *new_probes;
+		new_probes = realloc(ctx->probes, sizeof(*ctx->probes)*new_cap);
+		if (new_probes == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		ctx->probes = new_probes;
+		ctx->probecap = new_cap;
+	}
+	p = &ctx->probes[ctx->probecnt];
+	p->name = strdup(name);
+	if (p->name == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	p->typ = typ;
+	p->n1 = n1;
+	p->n2 = n2;
+	p->elidx = elidx;
+	return (int)ctx->probecnt++;
+}
+
+static size_t probe_find_element(struct libsimul_ctx *ctx, const char *elname, enum element_type typ)
+{
+	size_t i = libsimul_find_element(ctx->circuit, elname);
+	const struct element *el;
+	if (i == SIZE_MAX)
+	{
+		return SIZE_MAX;
+	}
+	el = ctx->circuit->elements_used[i];
+	if (el->typ != typ || (typ == TYPE_TRANSFORMER_DIRECT && !el->primary))
+	{
+		return SIZE_MAX;
+	}
+	return i;
+}
+
+// Voltage V_n1 - V_n2, returns the probe handle or negative error code
+int libsimul_add_probe_voltage(struct libsimul_ctx *ctx, const char *name, int n1, int n2)
+{
+	if (n1 < 0 || n2 < 0 || (size_t)n1 > ctx->nodecnt || (size_t)n2 > ctx->nodecnt)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	return probe_add(ctx, name, PROBE_VOLTAGE, n1, n2, SIZE_MAX);
+}
+
+// Voltage between two nodes given by name or number
+int libsimul_add_probe_node_voltage(struct libsimul_ctx *ctx, const char *name, const char *n1, const char *n2)
+{
+	int i1 = libsimul_node(ctx, n1);
+	int i2 = libsimul_node(ctx, n2);
+	if (i1 < 0 || i2 < 0)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	return libsimul_add_probe_voltage(ctx, name, i1, i2);
+}
+
+int libsimul_add_probe_inductor_current(struct libsimul_ctx *ctx, const char *name, const char *indname)
+{
+	size_t i = probe_find_element(ctx, indname, TYPE_INDUCTOR);
+	if (i == SIZE_MAX)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	return probe_add(ctx, name, PROBE_INDUCTOR_CURRENT, 0, 0, i);
+}
+
+int libsimul_add_probe_source_current(struct libsimul_ctx *ctx, const char *name, const char *vsname)
+{
+	size_t i = probe_find_element(ctx, vsname, TYPE_VOLTAGE);
+	if (i == SIZE_MAX)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	return probe_add(ctx, name, PROBE_SOURCE_CURRENT, 0, 0, i);
+}
+
+int libsimul_add_probe_transformer_current(struct libsimul_ctx *ctx, const char *name, const char *xfrname)
+{
+	size_t i = probe_find_element(ctx, xfrname, TYPE_TRANSFORMER_DIRECT);
+	if (i == SIZE_MAX)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	return probe_add(ctx, name, PROBE_TRANSFORMER_CURRENT, 0, 0, i);
+}
+
+double libsimul_probe_value(struct libsimul_ctx *ctx, size_t probe)
+{
+	const struct libsimul_probe *p = &ctx->probes[probe];
+	const struct element *el;
+	switch (p->typ)
+	{
+		case PROBE_VOLTAGE:
+			return get_V(ctx, p->n1) - get_V(ctx, p->n2);
+		case PROBE_INDUCTOR_CURRENT:
+			return ctx->state[p->elidx].I_src;
+		case PROBE_SOURCE_CURRENT:
+			el = ctx->circuit->elements_used[p->elidx];
+			return (ctx->state[p->elidx].V - (get_V(ctx, el->n1) - get_V(ctx, el->n2)))/el->R;
+		case PROBE_TRANSFORMER_CURRENT:
+			return -ctx->state[p->elidx].transformer_direct_const;
+	}
+	abort();
+}
+
+void libsimul_free_probes(struct libsimul_ctx *ctx)
+{
+	size_t i;
+	for (i = 0; i < ctx->probecnt; i++)
+	{
+		free(ctx->probes[i].name);
+	}
+	free(ctx->probes);
+	ctx->probes = NULL;
+	ctx->probecnt = 0;
+	ctx->probecap = 0;
+}
+
+static void record_sleep(void)
+{
+	struct timespec ts = {0, 50*1000};
+	nanosleep(&ts, NULL);
+}
+
+static void record_write_header(struct libsimul_recorder *rec, struct libsimul_ctx *ctx)
+{
+	size_t i;
+	if (rec->format == RECORD_TEXT)
+	{
+		fprintf(rec->f, "# t");
+		for (i = 0; i < ctx->probecnt; i++)
+		{
+			fprintf(rec->f, " %s", ctx->probes[i].name);
+		}
+		fprintf(rec->f, "\n");
+		return;
+	}
+	if (rec->format == RECORD_CHUNKED)
+	{
+		// Magic, version, probe count, frames per chunk, names, then
+		// chunks
+		uint32_t hdr[3] = {RECORD_CHUNKED_VERSION, (uint32_t)ctx->probecnt, RECORD_CHUNK_FRAMES};
+		fwrite(RECORD_CHUNKED_MAGIC, 1, 4, rec->f);
+		fwrite(hdr, sizeof(hdr), 1, rec->f);
+	}
+	else
+	{
+		// Binary: magic, version, probe count, names, then native doubles
+		uint32_t hdr[2] = {RECORD_BINARY_VERSION, (uint32_t)ctx->probecnt};
+		fwrite(RECORD_BINARY_MAGIC, 1, 4, rec->f);
+		fwrite(hdr, sizeof(hdr), 1, rec->f);
+	}
+	for (i = 0; i < ctx->probecnt; i++)
+	{
+		uint16_t len = (uint16_t)strlen(ctx->probes[i].name);
+		fwrite(&len, sizeof(len), 1, rec->f);
+		fwrite(ctx->probes[i].name, 1, len, rec->f);
+	}
+}
+
+// Compresses and writes the collected frames: chunk header (magic, frame
+// count, first and last time, payload size and hash) and payload
+static void record_write_chunk(struct libsimul_recorder *rec)
+{
+	struct libsimul_rec_chunk ch;
+	uint32_t frames = (uint32_t)rec->chunk_fill;
+	uint64_t payload, hash;
+	if (rec->chunk_fill == 0)
+	{
+		return;
+	}
+	payload = recfile_encode(rec->chunk, rec->chunk_fill, rec->framesz, rec->zbuf, rec->syms);
+	hash = recfile_hash(rec->zbuf, payload);
+	ch.t_first = rec->chunk[0];
+	ch.t_last = rec->chunk[(rec->chunk_fill-1)*rec->framesz];
+	ch.offset = (uint64_t)ftello(rec->f);
+	ch.frames = rec->chunk_fill;
+	fwrite(RECORD_CHUNK_MAGIC, 1, 4, rec->f);
+	fwrite(&frames, sizeof(frames), 1, rec->f);
+	fwrite(&ch.t_first, sizeof(ch.t_first), 1, rec->f);
+	fwrite(&ch.t_last, sizeof(ch.t_last), 1, rec->f);
+	fwrite(&payload, sizeof(payload), 1, rec->f);
+	fwrite(&hash, sizeof(hash), 1, rec->f);
+	fwrite(rec->zbuf, 1, payload, rec->f);
+	rec->chunk_fill = 0;
+	if (rec->indexcnt >= rec->indexcap || rec->index == NULL)
+	{
+		size_t new_cap = 2*rec->indexcnt+16;
+		struct libsimul_rec_chunk *new_index;
+		new_index = realloc(rec->index, sizeof(*rec->index)*new_cap);
+		if (new_index == NULL)
+		{
+			// The reader can still find the chunks by scanning
+			rec->failed = -ERR_NO_MEMORY;
+			return;
+		}
+		rec->index = new_index;
+		rec->indexcap = new_cap;
+	}
+	rec->index[rec->indexcnt++] = ch;
+}
+
+// Writes the last chunk, the chunk index and the trailer: index offset and
+// end magic
+static void record_write_index(struct libsimul_recorder *rec)
+{
+	uint64_t off, cnt;
+	record_write_chunk(rec);
+	if (rec->failed != 0)
+	{
+		return;
+	}
+	off = (uint64_t)ftello(rec->f);
+	cnt = rec->indexcnt;
+	fwrite(RECORD_INDEX_MAGIC, 1, 4, rec->f);
+	fwrite(&cnt, sizeof(cnt), 1, rec->f);
+	fwrite(rec->index, sizeof(*rec->index), rec->indexcnt, rec->f);
+	fwrite(&off, sizeof(off), 1, rec->f);
+	fwrite(RECORD_END_MAGIC, 1, 4, rec->f);
+}
+
+// Writes frames [first, first+cnt) that are contiguous in the ring
+static void record_write_frames(struct libsimul_recorder *rec, size_t first, size_t cnt)
+{
+	const double *frame = &rec->ring[first*rec->framesz];
+	size_t i, j;
+	if (rec->format == RECORD_BINARY)
+	{
+		fwrite(frame, sizeof(*frame)*rec->framesz, cnt, rec->f);
+		return;
+	}
+	if (rec->format == RECORD_CHUNKED)
+	{
+		while (cnt > 0)
+		{
+			size_t n = RECORD_CHUNK_FRAMES - rec->chunk_fill;
+			if (n > cnt)
+			{
+				n = cnt;
+			}
+			memcpy(&rec->chunk[rec->chunk_fill*rec->framesz], frame,
+			       sizeof(*frame)*rec->framesz*n);
+			rec->chunk_fill += n;
+			frame += rec->framesz*n;
+			cnt -= n;
+			if (rec->chunk_fill == RECORD_CHUNK_FRAMES)
+			{
+				record_write_chunk(rec);
+			}
+		}
+		return;
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		fprintf(rec->f, "%.12g", frame[0]);
+		for (j = 1; j < rec->framesz; j++)
+		{
+			fprintf(rec->f, " %g", frame[j]);
+		}
+		fputc('\n', rec->f);
+		frame += rec->framesz;
+	}
+}
+
+static void *record_writer(void *arg)
+{
+	struct libsimul_recorder *rec = arg;
+	for (;;)
+	{
+		size_t tail = atomic_load_explicit(&rec->tail, memory_order_relaxed);
+		size_t head = atomic_load_explicit(&rec->head, memory_order_acquire);
+		size_t first, cnt;
+		if (head == tail)
+		{
+			if (atomic_load_explicit(&rec->stop, memory_order_acquire))
+			{
+				// Recheck, the last frames may have arrived just before stop
+				if (atomic_load_explicit(&rec->head, memory_order_acquire) == tail)
+				{
+					break;
+				}
+				continue;
+			}
+			record_sleep();
+			continue;
+		}
+		first = tail & (rec->ring_frames-1);
+		cnt = head - tail;
+		if (first + cnt > rec->ring_frames)
+		{
+			cnt = rec->ring_frames - first;
+		}
+		record_write_frames(rec, first, cnt);
+		atomic_store_explicit(&rec->tail, tail+cnt, memory_order_release);
+	}
+	if (rec->format == RECORD_CHUNKED)
+	{
+		record_write_index(rec);
+	}
+	fflush(rec->f);
+	return NULL;
+}
+
+static void record_free(struct libsimul_recorder *rec)
+{
+	free(rec->ring);
+	free(rec->chunk);
+	free(rec->zbuf);
+	free(rec->syms);
+	free(rec->index);
+	free(rec->pre);
+	free(rec->triggers);
+	free(rec);
+}
+
+// Starts recording all probes added so far to fname. ring_frames is rounded
+// up to a power of two. Every decimation'th simulation step is recorded.
+// RECORD_CHUNKED files are read by libsimul_recfile_open().
+int libsimul_record_open(struct libsimul_ctx *ctx, const char *fname, enum record_format format,
+                         size_t ring_frames, size_t decimation)
+{
+	struct libsimul_recorder *rec;
+	size_t cap = 1;
+	if (ctx->recorder != NULL)
+	{
+		return -ERR_BUSY;
+	}
+	while (cap < ring_frames || cap < 2)
+	{
+		cap *= 2;
+	}
+	rec = calloc(1, sizeof(*rec));
+	if (rec == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	rec->format = format;
+	rec->decimation = decimation ? decimation : 1;
+	rec->framesz = 1 + ctx->probecnt;
+	rec->ring_frames = cap;
+	rec->ring = malloc(sizeof(*rec->ring)*rec->framesz*cap);
+	if (rec->ring == NULL)
+	{
+		record_free(rec);
+		return -ERR_NO_MEMORY;
+	}
+	if (format == RECORD_CHUNKED)
+	{
+		rec->chunk = malloc(sizeof(*rec->chunk)*rec->framesz*RECORD_CHUNK_FRAMES);
+		rec->zbuf = malloc(recfile_encode_bound(RECORD_CHUNK_FRAMES, rec->framesz));
+		rec->syms = malloc(RECORD_CHUNK_FRAMES);
+		if (rec->chunk == NULL || rec->zbuf == NULL || rec->syms == NULL)
+		{
+			record_free(rec);
+			return -ERR_NO_MEMORY;
+		}
+	}
+	rec->f = fopen(fname, format == RECORD_TEXT ? "w" : "wb");
+	if (rec->f == NULL)
+	{
+		record_free(rec);
+		return -ERR_IO;
+	}
+	atomic_init(&rec->head, 0);
+	atomic_init(&rec->tail, 0);
+	atomic_init(&rec->stop, 0);
+	record_write_header(rec, ctx);
+	if (pthread_create(&rec->writer, NULL, record_writer, rec) != 0)
+	{
+		fclose(rec->f);
+		record_free(rec);
+		return -ERR_NO_MEMORY;
+	}
+	ctx->recorder = rec;
+	return 0;
+}
+
+// Waits for a free slot in the ring and returns it
+static double *record_slot(struct libsimul_recorder *rec)
+{
+	size_t head = atomic_load_explicit(&rec->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&rec->tail, memory_order_acquire) >= rec->ring_frames)
+	{
+		// Back-pressure: writer can't keep up
+		rec->stall_cnt++;
+		do {
+			sched_yield();
+		} while (head - atomic_load_explicit(&rec->tail, memory_order_acquire) >= rec->ring_frames);
+	}
+	return &rec->ring[(head & (rec->ring_frames-1))*rec->framesz];
+}
+
+// Passes the frame in the slot to the writer
+static void record_publish(struct libsimul_recorder *rec)
+{
+	size_t head = atomic_load_explicit(&rec->head, memory_order_relaxed);
+	atomic_store_explicit(&rec->head, head+1, memory_order_release);
+	rec->frame_cnt++;
+	if (head + 1 - atomic_load_explicit(&rec->tail, memory_order_relaxed) > rec->max_fill)
+	{
+		rec->max_fill = head + 1 - atomic_load_explicit(&rec->tail, memory_order_relaxed);
+	}
+}
+
+static void record_fill(struct libsimul_ctx *ctx, double *frame)
+{
+	size_t i;
+	frame[0] = ctx->t;
+	for (i = 0; i < ctx->probecnt; i++)
+	{
+		frame[i+1] = libsimul_probe_value(ctx, i);
+	}
+}
+
+// Checks all triggers against the frame just taken. Every trigger is
+// evaluated so that each one sees consecutive frames.
+static int record_triggered(struct libsimul_ctx *ctx, struct libsimul_recorder *rec, const double *frame)
+{
+	int fired = rec->forced;
+	size_t i;
+	rec->forced = 0;
+	for (i = 0; i < rec->triggercnt; i++)
+	{
+		struct libsimul_rec_trigger *t = &rec->triggers[i];
+		double x;
+		if (t->typ == TRIGGER_DIODE)
+		{
+			x = !!ctx->state[t->idx].current_switch_state_is_closed;
+		}
+		else
+		{
+			x = frame[t->idx+1];
+		}
+		if (t->has_prev)
+		{
+			switch (t->typ)
+			{
+				case TRIGGER_RISING:
+					fired |= t->prev < t->level && x >= t->level;
+					break;
+				case TRIGGER_FALLING:
+					fired |= t->prev > t->level && x <= t->level;
+					break;
+				case TRIGGER_CROSSING:
+					fired |= (t->prev < t->level && x >= t->level) ||
+					         (t->prev > t->level && x <= t->level);
+					break;
+				case TRIGGER_DIODE:
+					fired |= x != t->prev;
+					break;
+			}
+		}
+		t->prev = x;
+		t->has_prev = 1;
+	}
+	return fired;
+}
+
+// Called at the end of every simulation step
+void libsimul_record_step(struct libsimul_ctx *ctx)
+{
+	struct libsimul_recorder *rec = ctx->recorder;
+	double *frame;
+	size_t i;
+	if (++rec->decimation_cnt < rec->decimation)
+	{
+		return;
+	}
+	rec->decimation_cnt = 0;
+	if (rec->pre == NULL)
+	{
+		record_fill(ctx, record_slot(rec));
+		record_publish(rec);
+		return;
+	}
+	if (rec->post_remain > 0)
+	{
+		// Inside a window, a new trigger extends it
+		frame = record_slot(rec);
+		record_fill(ctx, frame);
+		rec->post_remain--;
+		if (record_triggered(ctx, rec, frame))
+		{
+			rec->post_remain = rec->post_frames;
+		}
+		record_publish(rec);
+		return;
+	}
+	frame = &rec->pre[rec->pre_pos*rec->framesz];
+	record_fill(ctx, frame);
+	if (++rec->pre_pos == rec->pre_cap)
+	{
+		rec->pre_pos = 0;
+	}
+	if (rec->pre_cnt < rec->pre_cap)
+	{
+		rec->pre_cnt++;
+	}
+	if (!record_triggered(ctx, rec, frame))
+	{
+		return;
+	}
+	// History up to and including the trigger frame, oldest first
+	for (i = rec->pre_cnt; i > 0; i--)
+	{
+		size_t k = (rec->pre_pos + rec->pre_cap - i) % rec->pre_cap;
+		memcpy(record_slot(rec), &rec->pre[k*rec->framesz], sizeof(*frame)*rec->framesz);
+		record_publish(rec);
+	}
+	rec->pre_cnt = 0;
+	rec->post_remain = rec->post_frames;
+	rec->window_cnt++;
+}
+
+// From now on records only windows of pre_frames frames before a trigger,
+// the trigger frame and post_frames frames after it instead of every frame.
+// A trigger inside a window extends it. The ring should hold at least
+// pre_frames+1 frames, or the simulation waits for the writer at every
+// trigger.
+int libsimul_record_set_window(struct libsimul_ctx *ctx, size_t pre_frames, size_t post_frames)
+{
+	struct libsimul_recorder *rec = ctx->recorder;
+	double *pre;
+	if (rec == NULL)
+	{
+		return -ERR_NO_DATA;
+	}
+	pre = realloc(rec->pre, sizeof(*pre)*rec->framesz*(pre_frames+1));
+	if (pre == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	rec->pre = pre;
+	rec->pre_cap = pre_frames+1;
+	rec->pre_pos = 0;
+	rec->pre_cnt = 0;
+	rec->post_frames = post_frames;
+	rec->post_remain = 0;
+	return 0;
+}
+
+static int record_trigger_add(struct libsimul_ctx *ctx, enum record_trigger_type typ, size_t idx, double level)
+{
+	struct libsimul_recorder *rec = ctx->recorder;
+	struct libsimul_rec_trigger *triggers;
+	if (rec == NULL)
+	{
+		return -ERR_NO_DATA;
+	}
+	triggers = realloc(rec->triggers, sizeof(*triggers)*(rec->triggercnt+1));
+	if (triggers == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	rec->triggers = triggers;
+	memset(&triggers[rec->triggercnt], 0, sizeof(*triggers));
+	triggers[rec->triggercnt].typ = typ;
+	triggers[rec->triggercnt].idx = idx;
+	triggers[rec->triggercnt].level = level;
+	rec->triggercnt++;
+	return 0;
+}
+
+// Triggers a window when the probe crosses level, checked on the recorded
+// frames only
+int libsimul_record_add_trigger(struct libsimul_ctx *ctx, enum record_trigger_type typ, int probe, double level)
+{
+	if (typ == TRIGGER_DIODE)
+	{
+		return -ERR_INVALID;
+	}
+	if (probe < 0 || (size_t)probe >= ctx->probecnt)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	return record_trigger_add(ctx, typ, (size_t)probe, level);
+}
+
+// Triggers a window when the diode has turned on or off since the previous
+// recorded frame
+int libsimul_record_add_diode_trigger(struct libsimul_ctx *ctx, const char *dname)
+{
+	size_t i = probe_find_element(ctx, dname, TYPE_DIODE);
+	if (i == SIZE_MAX)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	return record_trigger_add(ctx, TRIGGER_DIODE, i, 0);
+}
+
+// Event raised by the driver, e.g. at a load step: the next recorded frame
+// is a trigger frame
+int libsimul_record_trigger(struct libsimul_ctx *ctx)
+{
+	if (ctx->recorder == NULL)
+	{
+		return -ERR_NO_DATA;
+	}
+	ctx->recorder->forced = 1;
+	return 0;
+}
+
+void libsimul_record_get_stats(struct libsimul_ctx *ctx, struct libsimul_record_stats *st)
+{
+	struct libsimul_recorder *rec = ctx->recorder;
+	memset(st, 0, sizeof(*st));
+	if (rec == NULL)
+	{
+		return;
+	}
+	st->frame_cnt = rec->frame_cnt;
+	st->stall_cnt = rec->stall_cnt;
+	st->max_fill = rec->max_fill;
+	st->ring_frames = rec->ring_frames;
+	st->window_cnt = rec->window_cnt;
+}
+
+// Flushes all pending frames and stops the writer thread
+int libsimul_record_close(struct libsimul_ctx *ctx)
+{
+	struct libsimul_recorder *rec = ctx->recorder;
+	int ret = 0;
+	if (rec == NULL)
+	{
+		return 0;
+	}
+	atomic_store_explicit(&rec->stop, 1, memory_order_release);
+	pthread_join(rec->writer, NULL);
+	if (ferror(rec->f))
+	{
+		ret = -ERR_IO;
+	}
+	if (fclose(rec->f) != 0)
+	{
+		ret = -ERR_IO;
+	}
+	if (ret == 0)
+	{
+		ret = rec->failed;
+	}
+	record_free(rec);
+	ctx->recorder = NULL;
+	return ret;
+}
@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+const double dt = 1e-7; // 100 ns
+const size_t nharm = 15;
+
+// Harmonics of the line current of a capacitor input rectifier, computed
+// cycle by cycle while the simulation runs
+int main(int argc, char **argv)
+{
+	size_t i, k;
+	int p_vin, p_iin, h_iin;
+	double thd, dc, ampl[15];
+	struct libsimul_ctx ctx;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "shockleyrectifier.txt");
+	init_simulation(&ctx);
+	p_vin = libsimul_add_probe_voltage(&ctx, "V_in", 1, 0);
+	p_iin = libsimul_add_probe_source_current(&ctx, "I_in", "V1");
+	// Cycles synchronized to the line voltage
+	h_iin = libsimul_add_harmonics(&ctx, p_iin, p_vin, 0, nharm);
+	if (p_vin < 0 || p_iin < 0 || h_iin < 0)
+	{
+		fprintf(stderr, "Can't add harmonic analyzer\n");
+		return 1;
+	}
+	for (i = 0; i < 5*1000*1000; i++)
+	{
+		simulation_step(&ctx);
+		if (i % (1000*1000) == 0 && i > 0 &&
+		    libsimul_harmonics_result(&ctx, h_iin, &thd, &dc, ampl) == 0)
+		{
+			printf("%g: THD %g %%, DC %g A\n", ctx.t, 100*thd, dc);
+		}
+	}
+	for (k = 0; k < nharm; k++)
+	{
+		printf("harmonic %zu: %g A\n", k+1, ampl[k]);
+	}
+	libsimul_free(&ctx);
+	return 0;
+}
@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "libsimul.h"
+
+// Simulation loop driven by the library, with a controller sampled at a
+// fixed period, and handle-based element accessors for controllers.
+//
+// Handles are element indices, so accessors don't search by name. Setters
+// called through handles only mark the context for recalculation; the
+// matrix is recalculated once before the next step, however many elements
+// the controller changed.
+
+int libsimul_element_handle(struct libsimul_ctx *ctx, const char *name)
+{
+	size_t i = libsimul_find_element(ctx->circuit, name);
+	if (i == SIZE_MAX)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	return (int)i;
+}
+
+static const struct element *handle_element(struct libsimul_ctx *ctx, int h)
+{
+	if (h < 0 || (size_t)h >= ctx->circuit->elements_used_sz)
+	{
+		return NULL;
+	}
+	return ctx->circuit->elements_used[h];
+}
+
+int libsimul_handle_set_switch(struct libsimul_ctx *ctx, int h, int state)
+{
+	const struct element *el = handle_element(ctx, h);
+	if (el == NULL || el->typ != TYPE_SWITCH)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	if ((!!ctx->state[h].current_switch_state_is_closed) == (!!state))
+	{
+		return 0;
+	}
+	ctx->state[h].current_switch_state_is_closed = !!state;
+	ctx->needs_recalc = 1;
+	return 0;
+}
+
+int libsimul_handle_set_source(struct libsimul_ctx *ctx, int h, double V)
+{
+	const struct element *el = handle_element(ctx, h);
+	if (el == NULL || el->typ != TYPE_VOLTAGE)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	ctx->state[h].V = V;
+	ctx->state[h].I_src = V/el->R;
+	return 0;
+}
+
+// Voltage from n1 to n2 of any element
+double libsimul_handle_voltage(struct libsimul_ctx *ctx, int h)
+{
+	const struct element *el = handle_element(ctx, h);
+	if (el == NULL)
+	{
+		return NAN;
+	}
+	return get_V(ctx, el->n1) - get_V(ctx, el->n2);
+}
+
+// Current of an inductor, voltage source or X transformer primary (the
+// magnetizing current), or through a resistive element
+double libsimul_handle_current(struct libsimul_ctx *ctx, int h)
+{
+	const struct element *el = handle_element(ctx, h);
+	const struct element_state *st;
+	double V;
+	if (el == NULL)
+	{
+		return NAN;
+	}
+	st = &ctx->state[h];
+	V = get_V(ctx, el->n1) - get_V(ctx, el->n2);
+	switch (el->typ)
+	{
+		case TYPE_INDUCTOR:
+			return st->I_src;
+		case TYPE_VOLTAGE:
+			return (st->V - V)/el->R;
+		case TYPE_TRANSFORMER_DIRECT:
+			if (!el->primary)
+			{
+				return NAN;
+			}
+			return -st->transformer_direct_const;
+		case TYPE_RESISTOR:
+			return V/el->R;
+		case TYPE_SWITCH:
+		case TYPE_DIODE:
+			return st->current_switch_state_is_closed ? V/el->R : 0;
+		default:
+			return NAN;
+	}
+}
+
+// Steps until t_end. ctl is called after the first step and then whenever
+// another period of simulation time has elapsed, or after every step if
+// period is 0. Returns 0 at t_end, -ERR_ABORTED if ctl returned nonzero or
+// the error of a failed step.
+int libsimul_run(struct libsimul_ctx *ctx, double t_end, libsimul_controller_fn ctl,
+                 double period, void *ctl_state, void *userdata)
+{
+	double next_sample = ctx->t;
+	while (ctx->t < t_end - ctx->dt/2)
+	{
+		int ret = simulation_step(ctx);
+		if (ret != 0)
+		{
+			return ret;
+		}
+		if (ctl == NULL || ctx->t < next_sample - ctx->dt/2)
+		{
+			continue;
+		}
+		// A late sample doesn't cause a burst of calls to catch up
+		do {
+			next_sample += period;
+		} while (period > 0 && next_sample <= ctx->t + ctx->dt/2);
+		if (ctl(ctx, ctl_state, userdata) != 0)
+		{
+			return -ERR_ABORTED;
+		}
+	}
+	return 0;
+}
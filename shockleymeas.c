@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+const double dt = 1e-7; // 100 ns
+
+// Input power factor and output ripple of the rectifier, measured while
+// the simulation runs instead of from the recorded waveforms
+int main(int argc, char **argv)
+{
+	size_t i;
+	int p_vin, p_iin, p_vout, m_in, m_out;
+	struct libsimul_ctx ctx;
+	struct libsimul_measurement_result r;
+	libsimul_init(&ctx, dt);
+	read_file(&ctx, "shockleyrectifier.txt");
+	init_simulation(&ctx);
+	p_vin = libsimul_add_probe_voltage(&ctx, "V_in", 1, 0);
+	p_iin = libsimul_add_probe_source_current(&ctx, "I_in", "V1");
+	p_vout = libsimul_add_probe_voltage(&ctx, "V_out", 2, 3);
+	m_in = libsimul_add_measurement_cycles(&ctx, p_vin, p_iin, 1);
+	m_out = libsimul_add_measurement_fixed(&ctx, p_vout, -1, 20e-3);
+	if (p_vin < 0 || p_iin < 0 || p_vout < 0 || m_in < 0 || m_out < 0)
+	{
+		fprintf(stderr, "Can't add measurements\n");
+		return 1;
+	}
+	for (i = 0; i < 5*1000*1000; i++)
+	{
+		simulation_step(&ctx);
+		if (i % (1000*1000) == 0 && i > 0)
+		{
+			if (libsimul_measurement_result(&ctx, m_in, &r) == 0)
+			{
+				printf("%g: input %g Vrms %g Arms %g W PF %g\n", r.t_end, r.rms, r.i_rms, r.power, r.pf);
+			}
+			if (libsimul_measurement_result(&ctx, m_out, &r) == 0)
+			{
+				printf("%g: output avg %g V ripple %g Vpp\n", r.t_end, r.avg, r.pp);
+			}
+		}
+	}
+	libsimul_free(&ctx);
+	return 0;
+}
@@ -14,7 +14,6 @@ int main(int argc, char **argv)
 	init_simulation(&ctx);
 	for (i = 0; i < 5*1000*1000; i++)
 	{
-		set_voltage_source(&ctx, "V1", 24.0*sin(2*3.14159265358979*50.0*t));
 		if (set_resistor(&ctx, "RL", 10.0*(1+0.3*sin(2*3.14159265358979*75.0*t))) != 0)
 		{
 			recalc(&ctx);
@@ -0,0 +1,1530 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <math.h>
+#include "libsimul.h"
+
+// Importer of a subset of SPICE decks.
+//
+// Every card is translated to netlist lines of the read_file() format:
+//
+// R, L, C   resistors, inductors and capacitors; IC= is the initial current
+//           (from n+ to n-, the inductor nodes are swapped for that) or
+//           voltage and Rser= the series resistance
+// K         coupled inductors, a linear transformer (X) with the first
+//           inductor as the primary and magnetizing inductance k*L1; the
+//           leakage inductance of k < 1 is ignored with a warning, since
+//           an inductor in series with a winding doesn't simulate stably
+// V, I      sources with a DC, SIN, PULSE or PWL value; a current source is
+//           a voltage source with SPICE_I_R in series, named V<name>
+// D         Shockley diodes of .model NAME D(IS= N= RS=)
+// S         voltage controlled switches of .model NAME SW(RON= ROFF= VT= VH=):
+//           the switch with RON, ROFF in parallel and a cmp control block
+//           of the same name closing the switch
+// X         instances of .subckt NAME nodes [PARAMS:] name=default
+// .param    netlist parameters, see params.c
+// .tran     the time step and the end time
+//
+// The first line is the title, * starts a comment line, ; a comment and +
+// continues the previous card. Names, nodes and keywords are case
+// insensitive: nodes are lowercased, element names get an uppercase type
+// letter (d for diodes). Numbers may have the SPICE scale suffixes (f p n u
+// m k meg g t mil) followed by a unit. Values are a number, a parameter or
+// an expression in braces; element values stay expressions of the netlist
+// parameters, so they follow libsimul_set_param(), while waveforms, models,
+// coupled inductances and .tran are evaluated when the deck is read. A
+// parameter can only use the parameters before it. Sources, capacitors and
+// windings get SPICE_RSER in series unless Rser= is given, since the netlist
+// format needs a resistance for them. Subcircuits become .subckt
+// definitions with local node numbers; the waveforms and switch control
+// blocks of their instances are added once the instances have been
+// flattened. Other elements are an error and other dot cards are ignored
+// with a warning.
+
+#define SPICE_RSER 1e-6
+#define SPICE_I_R 1e6
+#define SPICE_VT 26e-3 // thermal voltage of N=1
+
+struct spice_card {
+	char **tok;
+	size_t cnt;
+	size_t lineno;
+};
+
+struct spice_scope {
+	char *name; // subcircuit, NULL for the top level
+	struct spice_card *cards;
+	size_t cardcnt;
+	size_t cardcap;
+	char **nodes; // local nodes of a subcircuit, ports first, numbered from 1
+	size_t nodecnt;
+	size_t nodecap;
+	size_t portcnt;
+	char **param_names;
+	char **param_values;
+	size_t paramcnt;
+	size_t paramcap;
+	size_t lineno; // of .subckt
+};
+
+struct spice_deck {
+	const char *fname;
+	struct spice_scope *scopes; // the top level first
+	size_t scopecnt;
+	size_t scopecap;
+	struct spice_card *models;
+	size_t modelcnt;
+	size_t modelcap;
+	char **param_names;
+	char **param_values;
+	size_t paramcnt;
+	size_t paramcap;
+	struct spice_card tran;
+	double tstep;
+	double tstop;
+};
+
+// Inductors coupled by K cards of a scope
+struct spice_coupling {
+	size_t kcard;
+	double k;
+	size_t *lcards;
+	size_t lcnt;
+	size_t lcap;
+};
+
+struct spice_line {
+	char *buf;
+	size_t sz;
+	size_t cap;
+};
+
+static char *spice_strdup(const char *s)
+{
+	char *d = strdup(s);
+	if (d == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return d;
+}
+
+static void *spice_grow(void *arr, size_t elsz, size_t cnt, size_t *cap)
+{
+	void *new_arr;
+	size_t new_cap;
+	if (arr != NULL && cnt < *cap)
+	{
+		return arr;
+	}
+	new_cap = 2*cnt+8;
+	new_arr = realloc(arr, elsz*new_cap);
+	if (new_arr == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	*cap = new_cap;
+	return new_arr;
+}
+
+static void spice_error(const struct spice_deck *d, const struct spice_card *card, const char *fmt, ...)
+{
+	va_list ap;
+	fprintf(stderr, "%s:%zu: ", d->fname, card->lineno);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static void line_printf(struct spice_line *l, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (l->buf == NULL || l->sz + (size_t)len + 1 > l->cap)
+	{
+		size_t new_cap = 2*(l->sz + (size_t)len + 1);
+		char *new_buf = realloc(l->buf, new_cap);
+		if (new_buf == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		l->buf = new_buf;
+		l->cap = new_cap;
+	}
+	va_start(ap, fmt);
+	vsnprintf(l->buf + l->sz, l->cap - l->sz, fmt, ap);
+	va_end(ap);
+	l->sz += (size_t)len;
+}
+
+// Passes the line to the netlist reader and starts a new one
+static void line_emit(struct libsimul_ctx *ctx, struct spice_line *l)
+{
+	read_netlist_line(ctx, l->buf);
+	l->sz = 0;
+	l->buf[0] = '\0';
+}
+
+// Splits a card into tokens. Parentheses and commas separate tokens like
+// spaces, spaces around = are removed and {...} is one token.
+static void spice_tokenize(struct spice_card *card, const char *text)
+{
+	char *s = spice_strdup(text);
+	char *out = s;
+	const char *p;
+	size_t tokcap = 0;
+	int depth = 0;
+	for (p = text; *p; p++)
+	{
+		char ch = *p;
+		if (ch == '{')
+		{
+			depth++;
+		}
+		else if (ch == '}' && depth > 0)
+		{
+			depth--;
+		}
+		else if (depth == 0 && (ch == '(' || ch == ')' || ch == ',' || isspace((unsigned char)ch)))
+		{
+			ch = ' ';
+		}
+		if (ch == ' ' && depth == 0)
+		{
+			const char *q = p;
+			while (q[1] != '\0' && (isspace((unsigned char)q[1]) || q[1] == '(' || q[1] == ')' || q[1] == ','))
+			{
+				q++;
+			}
+			if (q[1] == '=' || (out > s && out[-1] == '='))
+			{
+				p = q;
+				continue;
+			}
+		}
+		*out++ = ch;
+	}
+	*out = '\0';
+	out = s;
+	for (;;)
+	{
+		char *start;
+		while (*out == ' ')
+		{
+			out++;
+		}
+		if (*out == '\0')
+		{
+			break;
+		}
+		start = out;
+		depth = 0;
+		while (*out != '\0' && (*out != ' ' || depth > 0))
+		{
+			if (*out == '{')
+			{
+				depth++;
+			}
+			else if (*out == '}')
+			{
+				depth--;
+			}
+			out++;
+		}
+		card->tok = spice_grow(card->tok, sizeof(*card->tok), card->cnt, &tokcap);
+		card->tok[card->cnt++] = strndup(start, (size_t)(out - start));
+		if (card->tok[card->cnt-1] == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	free(s);
+}
+
+// Number with an optional scale suffix and unit, returns 0 if s isn't one
+static int spice_number(const char *s, double *d)
+{
+	char *endptr;
+	double v = strtod(s, &endptr);
+	if (endptr == s || isalpha((unsigned char)*s))
+	{
+		return 0;
+	}
+	if (strncasecmp(endptr, "meg", 3) == 0)
+	{
+		v *= 1e6;
+		endptr += 3;
+	}
+	else if (strncasecmp(endptr, "mil", 3) == 0)
+	{
+		v *= 25.4e-6;
+		endptr += 3;
+	}
+	else
+	{
+		switch (tolower((unsigned char)*endptr))
+		{
+			case 'f': v *= 1e-15; endptr++; break;
+			case 'p': v *= 1e-12; endptr++; break;
+			case 'n': v *= 1e-9; endptr++; break;
+			case 'u': v *= 1e-6; endptr++; break;
+			case 'm': v *= 1e-3; endptr++; break;
+			case 'k': v *= 1e3; endptr++; break;
+			case 'g': v *= 1e9; endptr++; break;
+			case 't': v *= 1e12; endptr++; break;
+			default: break;
+		}
+	}
+	while (isalpha((unsigned char)*endptr))
+	{
+		endptr++;
+	}
+	if (*endptr != '\0')
+	{
+		return 0;
+	}
+	*d = v;
+	return 1;
+}
+
+static size_t spice_find(char **names, size_t cnt, const char *name)
+{
+	size_t i;
+	for (i = 0; i < cnt; i++)
+	{
+		if (strcasecmp(names[i], name) == 0)
+		{
+			return i;
+		}
+	}
+	return SIZE_MAX;
+}
+
+// Netlist value of a value token in the scope sc, a new string: a number,
+// or an expression in braces with the SPICE numbers converted and the
+// parameters spelled as they're defined. Parameters of the subcircuit sc
+// are an error unless local is set.
+static char *spice_expr(const struct spice_deck *d, const struct spice_scope *sc,
+                        const struct spice_card *card, const char *tok, int local)
+{
+	struct spice_line l = {NULL, 0, 0};
+	char buf[256];
+	const char *p = tok, *end = tok + strlen(tok);
+	double v;
+	if (spice_number(tok, &v))
+	{
+		line_printf(&l, "%.17g", v);
+		return l.buf;
+	}
+	if (end - p >= 2 && *p == '{' && end[-1] == '}')
+	{
+		p++;
+		end--;
+	}
+	line_printf(&l, "{");
+	while (p < end)
+	{
+		const char *q = p;
+		size_t i;
+		if (isspace((unsigned char)*p))
+		{
+			p++;
+			continue;
+		}
+		if (isdigit((unsigned char)*p) || (*p == '.' && isdigit((unsigned char)p[1])))
+		{
+			// The number with its scale suffix and unit
+			char *endptr;
+			strtod(p, &endptr);
+			for (q = endptr; q < end && isalpha((unsigned char)*q); q++)
+			{
+			}
+			if ((size_t)(q - p) >= sizeof(buf))
+			{
+				spice_error(d, card, "Invalid value %s", tok);
+			}
+			memcpy(buf, p, (size_t)(q - p));
+			buf[q - p] = '\0';
+			if (!spice_number(buf, &v))
+			{
+				spice_error(d, card, "Invalid value %s", tok);
+			}
+			line_printf(&l, "%.17g", v);
+		}
+		else if (isalpha((unsigned char)*p) || *p == '_')
+		{
+			const char *r;
+			while (q < end && (isalnum((unsigned char)*q) || *q == '_'))
+			{
+				q++;
+			}
+			if ((size_t)(q - p) >= sizeof(buf))
+			{
+				spice_error(d, card, "Invalid value %s", tok);
+			}
+			for (i = 0; i < (size_t)(q - p); i++)
+			{
+				buf[i] = (char)tolower((unsigned char)p[i]);
+			}
+			buf[i] = '\0';
+			for (r = q; r < end && isspace((unsigned char)*r); r++)
+			{
+			}
+			if ((r < end && *r == '(') || strcmp(buf, "pi") == 0)
+			{
+				// Functions are checked by the netlist reader
+				line_printf(&l, "%s", buf);
+			}
+			else if (sc != NULL && sc->name != NULL &&
+			         (i = spice_find(sc->param_names, sc->paramcnt, buf)) != SIZE_MAX)
+			{
+				if (!local)
+				{
+					spice_error(d, card, "Parameter %s of subcircuit %s can't be used here", buf, sc->name);
+				}
+				line_printf(&l, "%s", sc->param_names[i]);
+			}
+			else if ((i = spice_find(d->param_names, d->paramcnt, buf)) != SIZE_MAX)
+			{
+				line_printf(&l, "%s", d->param_names[i]);
+			}
+			else
+			{
+				spice_error(d, card, "Unknown parameter %s", buf);
+			}
+		}
+		else if (strchr("+-*/^(),", *p) != NULL)
+		{
+			line_printf(&l, "%c", *p);
+			q = p+1;
+		}
+		else
+		{
+			spice_error(d, card, "Invalid value %s", tok);
+		}
+		p = q;
+	}
+	line_printf(&l, "}");
+	return l.buf;
+}
+
+// Value of a token in the scope sc. Parameters of a subcircuit come from
+// the instance inst of ctx, they're an error without an instance.
+static double spice_eval(const struct libsimul_ctx *ctx, const struct spice_deck *d,
+                         const struct spice_scope *sc, size_t inst,
+                         const struct spice_card *card, const char *tok)
+{
+	char *expr = spice_expr(d, sc, card, tok, inst != SIZE_MAX);
+	double v;
+	if (inst != SIZE_MAX)
+	{
+		const struct libsimul_instance *in = &ctx->circuit->insts[inst];
+		const struct libsimul_subckt *nsc = &ctx->circuit->subckts[in->subckt];
+		char *sub = param_subst(expr, nsc->param_names, in->params, nsc->paramcnt);
+		if (sub == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		free(expr);
+		expr = sub;
+	}
+	if (param_eval(ctx->circuit, expr, &v) != 0)
+	{
+		spice_error(d, card, "Invalid value %s", tok);
+	}
+	free(expr);
+	return v;
+}
+
+// Appends a value of an element line, a number or an expression that the
+// netlist reader evaluates, so that the parameters can be overridden
+static void spice_value(struct spice_line *l, const struct spice_deck *d, const struct spice_scope *sc,
+                        const struct spice_card *card, const char *tok)
+{
+	char *expr = spice_expr(d, sc, card, tok, 1);
+	line_printf(l, "%s", expr);
+	free(expr);
+}
+
+// Appends a node: a name or number at the top level, a local node number in
+// a subcircuit
+static void spice_node(struct spice_line *l, struct spice_scope *sc, const char *tok)
+{
+	size_t i;
+	if (strcmp(tok, "0") == 0 || strcasecmp(tok, "gnd") == 0)
+	{
+		line_printf(l, "0 ");
+		return;
+	}
+	if (sc->name != NULL)
+	{
+		i = spice_find(sc->nodes, sc->nodecnt, tok);
+		if (i == SIZE_MAX)
+		{
+			sc->nodes = spice_grow(sc->nodes, sizeof(*sc->nodes), sc->nodecnt, &sc->nodecap);
+			sc->nodes[sc->nodecnt] = spice_strdup(tok);
+			i = sc->nodecnt++;
+		}
+		line_printf(l, "%zu ", i+1);
+		return;
+	}
+	if (!isalnum((unsigned char)*tok) && *tok != '_')
+	{
+		line_printf(l, "_");
+	}
+	else if (isdigit((unsigned char)*tok) && tok[strspn(tok, "0123456789")] != '\0')
+	{
+		line_printf(l, "_");
+	}
+	for (; *tok; tok++)
+	{
+		line_printf(l, "%c", tolower((unsigned char)*tok));
+	}
+	line_printf(l, " ");
+}
+
+// Element name with the type letter typ instead of the first letter
+static void spice_name(struct spice_line *l, char typ, const char *name)
+{
+	line_printf(l, "%c%s", typ, name+1);
+}
+
+static const struct spice_card *spice_model(const struct spice_deck *d, const struct spice_card *card,
+                                            const char *name, const char *typ)
+{
+	size_t i;
+	for (i = 0; i < d->modelcnt; i++)
+	{
+		const struct spice_card *m = &d->models[i];
+		if (strcasecmp(m->tok[1], name) == 0)
+		{
+			if (strcasecmp(m->tok[2], typ) != 0)
+			{
+				spice_error(d, card, "Model %s isn't of type %s", name, typ);
+			}
+			return m;
+		}
+	}
+	spice_error(d, card, "Model %s not found", name);
+	return NULL;
+}
+
+// Parameter of a .model card, def if not given
+static double spice_model_param(const struct libsimul_ctx *ctx, const struct spice_deck *d,
+                                const struct spice_card *m, const char *name, double def)
+{
+	size_t len = strlen(name);
+	size_t i;
+	for (i = 3; i < m->cnt; i++)
+	{
+		if (strncasecmp(m->tok[i], name, len) == 0 && m->tok[i][len] == '=')
+		{
+			return spice_eval(ctx, d, NULL, SIZE_MAX, m, &m->tok[i][len+1]);
+		}
+	}
+	return def;
+}
+
+// Value of key=value tokens of an element card from index first
+static const char *spice_keyval(const struct spice_card *card, size_t first, const char *key)
+{
+	size_t len = strlen(key);
+	size_t i;
+	for (i = first; i < card->cnt; i++)
+	{
+		if (strncasecmp(card->tok[i], key, len) == 0 && card->tok[i][len] == '=')
+		{
+			return &card->tok[i][len+1];
+		}
+	}
+	return NULL;
+}
+
+enum spice_wave {
+	SPICE_WAVE_NONE,
+	SPICE_WAVE_SIN,
+	SPICE_WAVE_PULSE,
+	SPICE_WAVE_PWL,
+};
+
+// Value of a V or I card: token indices of the DC value and the waveform
+// arguments
+struct spice_source {
+	size_t dc;
+	enum spice_wave wave;
+	size_t arg;
+	size_t argcnt;
+};
+
+static void spice_read_source(const struct spice_deck *d, const struct spice_card *card, struct spice_source *src)
+{
+	size_t i = 3;
+	double v;
+	src->dc = SIZE_MAX;
+	src->wave = SPICE_WAVE_NONE;
+	src->arg = 0;
+	src->argcnt = 0;
+	while (i < card->cnt)
+	{
+		const char *tok = card->tok[i];
+		enum spice_wave wave = SPICE_WAVE_NONE;
+		if (strcasecmp(tok, "sin") == 0)
+		{
+			wave = SPICE_WAVE_SIN;
+		}
+		else if (strcasecmp(tok, "pulse") == 0)
+		{
+			wave = SPICE_WAVE_PULSE;
+		}
+		else if (strcasecmp(tok, "pwl") == 0)
+		{
+			wave = SPICE_WAVE_PWL;
+		}
+		if (wave != SPICE_WAVE_NONE)
+		{
+			if (src->wave != SPICE_WAVE_NONE)
+			{
+				spice_error(d, card, "Source %s has two waveforms", card->tok[0]);
+			}
+			src->wave = wave;
+			src->arg = ++i;
+			while (i < card->cnt && strchr(card->tok[i], '=') == NULL &&
+			       strcasecmp(card->tok[i], "dc") != 0 && strcasecmp(card->tok[i], "ac") != 0)
+			{
+				i++;
+			}
+			src->argcnt = i - src->arg;
+		}
+		else if (strcasecmp(tok, "dc") == 0 && i+1 < card->cnt)
+		{
+			src->dc = i+1;
+			i += 2;
+		}
+		else if (strcasecmp(tok, "ac") == 0)
+		{
+			// Magnitude and optional phase of small-signal analysis
+			i += 2;
+			if (i < card->cnt && spice_number(card->tok[i], &v))
+			{
+				i++;
+			}
+		}
+		else if (strncasecmp(tok, "rser=", 5) == 0)
+		{
+			i++;
+		}
+		else if (strchr(tok, '=') == NULL && src->dc == SIZE_MAX)
+		{
+			src->dc = i++;
+		}
+		else
+		{
+			spice_error(d, card, "Unsupported source parameter %s", tok);
+		}
+	}
+}
+
+// .sine, .pulse or .pwl line of a source, values scaled by scale for
+// current sources. prefix is the instance name with a dot for sources of
+// subcircuits.
+static void spice_emit_wave(struct libsimul_ctx *ctx, const struct spice_deck *d, const struct spice_scope *sc,
+                            size_t inst, const struct spice_card *card, const char *prefix)
+{
+	struct spice_source src;
+	struct spice_line l = {NULL, 0, 0};
+	double a[7];
+	const char *name = card->tok[0];
+	int cur = toupper((unsigned char)name[0]) == 'I';
+	double scale = cur ? SPICE_I_R : 1;
+	size_t i;
+	spice_read_source(d, card, &src);
+	if (src.wave == SPICE_WAVE_NONE)
+	{
+		return;
+	}
+	if (src.wave == SPICE_WAVE_PWL)
+	{
+		if (src.argcnt < 2 || src.argcnt % 2 != 0)
+		{
+			spice_error(d, card, "PWL of %s must have time and value pairs", name);
+		}
+		line_printf(&l, ".pwl %s%s%c%s points=", prefix, cur ? "V" : "", toupper((unsigned char)name[0]), name+1);
+		for (i = 0; i < src.argcnt; i++)
+		{
+			double v = spice_eval(ctx, d, sc, inst, card, card->tok[src.arg+i]);
+			line_printf(&l, "%s%.17g", i ? "," : "", i % 2 ? v*scale : v);
+		}
+		line_emit(ctx, &l);
+		free(l.buf);
+		return;
+	}
+	for (i = 0; i < 7; i++)
+	{
+		a[i] = i < src.argcnt ? spice_eval(ctx, d, sc, inst, card, card->tok[src.arg+i]) : NAN;
+	}
+	if (src.wave == SPICE_WAVE_SIN)
+	{
+		// SIN(VO VA FREQ TD THETA PHASE)
+		double f = !isnan(a[2]) ? a[2] : (d->tstop > 0 ? 1/d->tstop : NAN);
+		if (src.argcnt < 2 || isnan(f))
+		{
+			spice_error(d, card, "SIN of %s needs offset, amplitude and frequency", name);
+		}
+		if ((!isnan(a[3]) && a[3] != 0) || (!isnan(a[4]) && a[4] != 0))
+		{
+			fprintf(stderr, "%s:%zu: Warning: delay and damping of %s ignored\n", d->fname, card->lineno, name);
+		}
+		line_printf(&l, ".sine %s%s%c%s ampl=%.17g f=%.17g phase=%.17g offset=%.17g", prefix, cur ? "V" : "",
+			toupper((unsigned char)name[0]), name+1, a[1]*scale, f, isnan(a[5]) ? 0 : a[5], a[0]*scale);
+	}
+	else
+	{
+		// PULSE(V1 V2 TD TR TF PW PER)
+		if (src.argcnt < 2)
+		{
+			spice_error(d, card, "PULSE of %s needs two values", name);
+		}
+		line_printf(&l, ".pulse %s%s%c%s low=%.17g high=%.17g delay=%.17g rise=%.17g fall=%.17g width=%.17g",
+			prefix, cur ? "V" : "", toupper((unsigned char)name[0]), name+1,
+			a[0]*scale, a[1]*scale, isnan(a[2]) ? 0 : a[2],
+			isnan(a[3]) ? d->tstep : a[3], isnan(a[4]) ? d->tstep : a[4],
+			isnan(a[5]) ? d->tstop : a[5]);
+		if (!isnan(a[6]))
+		{
+			line_printf(&l, " period=%.17g", a[6]);
+		}
+	}
+	line_emit(ctx, &l);
+	free(l.buf);
+}
+
+// Control block closing the switch card when the control voltage exceeds
+// VT+VH and opening it below VT-VH. nodes maps the control nodes, which are
+// names at the top level and circuit nodes of the instance otherwise.
+static void spice_emit_switch_ctl(struct libsimul_ctx *ctx, const struct spice_deck *d, struct spice_scope *sc,
+                                  size_t inst, const struct spice_card *card, const char *prefix)
+{
+	const struct spice_card *m = spice_model(d, card, card->tok[5], "sw");
+	struct spice_line l = {NULL, 0, 0};
+	double vt = spice_model_param(ctx, d, m, "vt", 0);
+	double vh = spice_model_param(ctx, d, m, "vh", 0);
+	size_t i;
+	line_printf(&l, ".ctl %sS%s cmp in=V(", prefix, card->tok[0]+1);
+	for (i = 3; i <= 4; i++)
+	{
+		if (inst == SIZE_MAX)
+		{
+			spice_node(&l, sc, card->tok[i]);
+			l.sz--; // space after the node
+		}
+		else if (strcmp(card->tok[i], "0") == 0 || strcasecmp(card->tok[i], "gnd") == 0)
+		{
+			line_printf(&l, "0");
+		}
+		else
+		{
+			size_t k = spice_find(sc->nodes, sc->nodecnt, card->tok[i]);
+			int node = k != SIZE_MAX ? libsimul_instance_node(ctx, (int)inst, (int)k+1) : -ERR_NOT_FOUND;
+			if (node < 0)
+			{
+				spice_error(d, card, "Control node %s of %s isn't connected", card->tok[i], card->tok[0]);
+			}
+			line_printf(&l, "%d", node);
+		}
+		line_printf(&l, i == 3 ? "," : ")");
+	}
+	line_printf(&l, " ref=%.17g hyst=%.17g out=%sS%s", vt, 2*fabs(vh), prefix, card->tok[0]+1);
+	line_emit(ctx, &l);
+	free(l.buf);
+}
+
+// Waveforms and control blocks of an element card, for an instance if
+// inst isn't SIZE_MAX
+static void spice_emit_directives(struct libsimul_ctx *ctx, const struct spice_deck *d, struct spice_scope *sc,
+                                  size_t inst, const struct spice_card *card)
+{
+	char *prefix = spice_strdup("");
+	if (inst != SIZE_MAX)
+	{
+		const char *iname = ctx->circuit->insts[inst].name;
+		free(prefix);
+		prefix = malloc(strlen(iname)+2);
+		if (prefix == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		sprintf(prefix, "%s.", iname);
+	}
+	switch (toupper((unsigned char)card->tok[0][0]))
+	{
+		case 'V':
+		case 'I':
+			spice_emit_wave(ctx, d, sc, inst, card, prefix);
+			break;
+		case 'S':
+			spice_emit_switch_ctl(ctx, d, sc, inst, card, prefix);
+			break;
+		default:
+			break;
+	}
+	free(prefix);
+}
+
+static double spice_rser(const struct libsimul_ctx *ctx, const struct spice_deck *d, const struct spice_card *card)
+{
+	const char *rser = spice_keyval(card, 3, "rser");
+	return rser != NULL ? spice_eval(ctx, d, NULL, SIZE_MAX, card, rser) : SPICE_RSER;
+}
+
+// Groups the inductors of K cards, group[i] is the group of card i
+static struct spice_coupling *spice_couplings(const struct libsimul_ctx *ctx, const struct spice_deck *d,
+                                              const struct spice_scope *sc, size_t *group, size_t *cnt)
+{
+	struct spice_coupling *cp = NULL;
+	size_t cpcap = 0;
+	size_t i, j, n;
+	*cnt = 0;
+	for (i = 0; i < sc->cardcnt; i++)
+	{
+		group[i] = SIZE_MAX;
+	}
+	for (i = 0; i < sc->cardcnt; i++)
+	{
+		const struct spice_card *card = &sc->cards[i];
+		size_t g = SIZE_MAX;
+		double k;
+		if (toupper((unsigned char)card->tok[0][0]) != 'K')
+		{
+			continue;
+		}
+		if (card->cnt < 4)
+		{
+			spice_error(d, card, "Coupling %s needs two inductors and k", card->tok[0]);
+		}
+		k = spice_eval(ctx, d, sc, SIZE_MAX, card, card->tok[card->cnt-1]);
+		if (!(k > 0 && k <= 1))
+		{
+			spice_error(d, card, "Invalid coupling factor of %s", card->tok[0]);
+		}
+		for (j = 1; j < card->cnt-1; j++)
+		{
+			for (n = 0; n < sc->cardcnt; n++)
+			{
+				if (strcasecmp(sc->cards[n].tok[0], card->tok[j]) == 0)
+				{
+					break;
+				}
+			}
+			if (n == sc->cardcnt || toupper((unsigned char)card->tok[j][0]) != 'L')
+			{
+				spice_error(d, card, "Inductor %s of %s not found", card->tok[j], card->tok[0]);
+			}
+			if (group[n] != SIZE_MAX)
+			{
+				if (g != SIZE_MAX && g != group[n])
+				{
+					spice_error(d, card, "%s couples inductors of two transformers", card->tok[0]);
+				}
+				g = group[n];
+			}
+		}
+		if (g == SIZE_MAX)
+		{
+			cp = spice_grow(cp, sizeof(*cp), *cnt, &cpcap);
+			g = (*cnt)++;
+			memset(&cp[g], 0, sizeof(cp[g]));
+			cp[g].kcard = i;
+			cp[g].k = k;
+		}
+		else if (k != cp[g].k)
+		{
+			fprintf(stderr, "%s:%zu: Warning: %s uses the coupling factor of %s\n",
+				d->fname, card->lineno, card->tok[0], sc->cards[cp[g].kcard].tok[0]);
+		}
+		group[i] = g;
+		for (j = 1; j < card->cnt-1; j++)
+		{
+			for (n = 0; n < sc->cardcnt; n++)
+			{
+				if (strcasecmp(sc->cards[n].tok[0], card->tok[j]) == 0)
+				{
+					break;
+				}
+			}
+			if (group[n] == SIZE_MAX)
+			{
+				group[n] = g;
+				cp[g].lcards = spice_grow(cp[g].lcards, sizeof(*cp[g].lcards), cp[g].lcnt, &cp[g].lcap);
+				cp[g].lcards[cp[g].lcnt++] = n;
+			}
+		}
+	}
+	return cp;
+}
+
+// Transformer of coupled inductors: the first is the primary with N=1, the
+// others have N=sqrt(L/L1)
+static void spice_emit_coupling(struct libsimul_ctx *ctx, const struct spice_deck *d, struct spice_scope *sc,
+                                const struct spice_coupling *cp)
+{
+	const struct spice_card *kcard = &sc->cards[cp->kcard];
+	struct spice_line l = {NULL, 0, 0};
+	double L1 = 0;
+	size_t i;
+	if (cp->k < 1)
+	{
+		fprintf(stderr, "%s:%zu: Warning: leakage inductance of %s ignored\n",
+			d->fname, kcard->lineno, kcard->tok[0]);
+	}
+	for (i = 0; i < cp->lcnt; i++)
+	{
+		const struct spice_card *card = &sc->cards[cp->lcards[i]];
+		double L;
+		if (card->cnt < 4)
+		{
+			spice_error(d, card, "Inductor %s needs nodes and inductance", card->tok[0]);
+		}
+		L = spice_eval(ctx, d, sc, SIZE_MAX, card, card->tok[3]);
+		if (!(L > 0))
+		{
+			spice_error(d, card, "Invalid inductance of %s", card->tok[0]);
+		}
+		if (i == 0)
+		{
+			L1 = L;
+		}
+		if (spice_keyval(card, 4, "ic") != NULL)
+		{
+			fprintf(stderr, "%s:%zu: Warning: initial current of coupled %s ignored\n",
+				d->fname, card->lineno, card->tok[0]);
+		}
+		spice_node(&l, sc, card->tok[1]);
+		spice_node(&l, sc, card->tok[2]);
+		line_printf(&l, "X%s", kcard->tok[0]);
+		line_printf(&l, " N=%.17g primary=%d R=%.17g", sqrt(L/L1), i == 0, spice_rser(ctx, d, card));
+		if (i == 0)
+		{
+			line_printf(&l, " Lbase=%.17g", cp->k*L1);
+		}
+		line_emit(ctx, &l);
+	}
+	free(l.buf);
+}
+
+// Netlist lines of an element card
+static void spice_emit_element(struct libsimul_ctx *ctx, const struct spice_deck *d, struct spice_scope *sc,
+                               const struct spice_card *card)
+{
+	struct spice_line l = {NULL, 0, 0};
+	const char *name = card->tok[0];
+	const char *val;
+	char typ = (char)toupper((unsigned char)name[0]);
+	size_t i;
+	if (typ != 'X' && card->cnt < (typ == 'S' ? 6 : typ == 'D' ? 4 : 3))
+	{
+		spice_error(d, card, "Element %s needs more nodes", name);
+	}
+	switch (typ)
+	{
+		case 'R':
+		case 'L':
+		case 'C':
+			if (card->cnt < 4)
+			{
+				spice_error(d, card, "%s needs a value", name);
+			}
+			// A SPICE inductor current flows from n+ to n-, a
+			// native one from n2 to n1
+			spice_node(&l, sc, card->tok[typ == 'L' ? 2 : 1]);
+			spice_node(&l, sc, card->tok[typ == 'L' ? 1 : 2]);
+			spice_name(&l, typ, name);
+			line_printf(&l, " %c=", typ);
+			spice_value(&l, d, sc, card, card->tok[3]);
+			for (i = 4; i < card->cnt; i++)
+			{
+				if (typ == 'R' || (strncasecmp(card->tok[i], "ic=", 3) != 0 &&
+				                   strncasecmp(card->tok[i], "rser=", 5) != 0))
+				{
+					spice_error(d, card, "Unsupported parameter %s of %s", card->tok[i], name);
+				}
+			}
+			if (typ == 'C')
+			{
+				val = spice_keyval(card, 4, "rser");
+				line_printf(&l, " R=");
+				if (val != NULL)
+				{
+					spice_value(&l, d, sc, card, val);
+				}
+				else
+				{
+					line_printf(&l, "%.17g", SPICE_RSER);
+				}
+			}
+			else if (typ == 'L' && (val = spice_keyval(card, 4, "rser")) != NULL)
+			{
+				line_printf(&l, " R=");
+				spice_value(&l, d, sc, card, val);
+			}
+			if (typ != 'R' && (val = spice_keyval(card, 4, "ic")) != NULL)
+			{
+				line_printf(&l, " %s=", typ == 'C' ? "Vinit" : "Iinit");
+				spice_value(&l, d, sc, card, val);
+			}
+			break;
+		case 'V':
+		case 'I':
+		{
+			struct spice_source src;
+			spice_read_source(d, card, &src);
+			// A current source into n- is a voltage source of
+			// I*SPICE_I_R from n+ to n-
+			spice_node(&l, sc, card->tok[typ == 'I' ? 2 : 1]);
+			spice_node(&l, sc, card->tok[typ == 'I' ? 1 : 2]);
+			if (typ == 'I')
+			{
+				line_printf(&l, "V");
+			}
+			spice_name(&l, typ, name);
+			line_printf(&l, " V=");
+			if (src.dc == SIZE_MAX)
+			{
+				line_printf(&l, "0");
+			}
+			else if (typ == 'V')
+			{
+				spice_value(&l, d, sc, card, card->tok[src.dc]);
+			}
+			else
+			{
+				char *expr = spice_expr(d, sc, card, card->tok[src.dc], 1);
+				if (expr[0] == '{')
+				{
+					expr[strlen(expr)-1] = '\0';
+					line_printf(&l, "{(%s)*%.17g}", expr+1, SPICE_I_R);
+				}
+				else
+				{
+					line_printf(&l, "%.17g", SPICE_I_R*strtod(expr, NULL));
+				}
+				free(expr);
+			}
+			line_printf(&l, " R=%.17g", typ == 'I' ? SPICE_I_R : spice_rser(ctx, d, card));
+			break;
+		}
+		case 'D':
+		{
+			const struct spice_card *m = spice_model(d, card, card->tok[3], "d");
+			double rs = spice_model_param(ctx, d, m, "rs", 0);
+			spice_node(&l, sc, card->tok[1]);
+			spice_node(&l, sc, card->tok[2]);
+			spice_name(&l, 'd', name);
+			line_printf(&l, " Is=%.17g VT=%.17g", spice_model_param(ctx, d, m, "is", 1e-14),
+				spice_model_param(ctx, d, m, "n", 1)*SPICE_VT);
+			if (rs > 0)
+			{
+				line_printf(&l, " R=%.17g", rs);
+			}
+			break;
+		}
+		case 'S':
+		{
+			const struct spice_card *m = spice_model(d, card, card->tok[5], "sw");
+			double roff = spice_model_param(ctx, d, m, "roff", 1e12);
+			spice_node(&l, sc, card->tok[1]);
+			spice_node(&l, sc, card->tok[2]);
+			spice_name(&l, 'S', name);
+			line_printf(&l, " R=%.17g", spice_model_param(ctx, d, m, "ron", 1));
+			line_emit(ctx, &l);
+			spice_node(&l, sc, card->tok[1]);
+			spice_node(&l, sc, card->tok[2]);
+			line_printf(&l, "RS%s_off R=%.17g", name+1, roff);
+			break;
+		}
+		case 'X':
+		{
+			// Xname nodes... subckt [PARAMS:] name=value...
+			size_t sub;
+			for (sub = 1; sub < card->cnt; sub++)
+			{
+				if (strchr(card->tok[sub], '=') != NULL || strcasecmp(card->tok[sub], "params:") == 0)
+				{
+					break;
+				}
+			}
+			sub--;
+			if (sub < 1)
+			{
+				spice_error(d, card, "Instance %s needs a subcircuit", name);
+			}
+			line_printf(&l, ".inst ");
+			spice_name(&l, 'X', name);
+			line_printf(&l, " ");
+			for (val = card->tok[sub]; *val; val++)
+			{
+				line_printf(&l, "%c", toupper((unsigned char)*val));
+			}
+			line_printf(&l, " ");
+			for (i = 1; i < sub; i++)
+			{
+				spice_node(&l, sc, card->tok[i]);
+			}
+			for (i = sub+1; i < card->cnt; i++)
+			{
+				char *equals = strchr(card->tok[i], '=');
+				const char *p;
+				if (equals == NULL)
+				{
+					continue;
+				}
+				for (p = card->tok[i]; p < equals; p++)
+				{
+					line_printf(&l, "%c", tolower((unsigned char)*p));
+				}
+				line_printf(&l, "=");
+				spice_value(&l, d, sc, card, equals+1);
+				line_printf(&l, " ");
+			}
+			break;
+		}
+		default:
+			spice_error(d, card, "Unsupported element %s", name);
+	}
+	line_emit(ctx, &l);
+	free(l.buf);
+}
+
+static void spice_emit_scope(struct libsimul_ctx *ctx, const struct spice_deck *d, struct spice_scope *sc)
+{
+	struct spice_coupling *cp;
+	size_t cpcnt;
+	size_t *group = malloc(sizeof(*group)*(sc->cardcnt+1));
+	size_t i;
+	if (group == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	cp = spice_couplings(ctx, d, sc, group, &cpcnt);
+	for (i = 0; i < sc->cardcnt; i++)
+	{
+		const struct spice_card *card = &sc->cards[i];
+		char typ = (char)toupper((unsigned char)card->tok[0][0]);
+		if (typ == 'K')
+		{
+			if (cp[group[i]].kcard == i)
+			{
+				spice_emit_coupling(ctx, d, sc, &cp[group[i]]);
+			}
+			continue;
+		}
+		if (group[i] != SIZE_MAX)
+		{
+			continue;
+		}
+		spice_emit_element(ctx, d, sc, card);
+		if (sc->name == NULL)
+		{
+			spice_emit_directives(ctx, d, sc, SIZE_MAX, card);
+		}
+	}
+	for (i = 0; i < cpcnt; i++)
+	{
+		free(cp[i].lcards);
+	}
+	free(cp);
+	free(group);
+}
+
+static void spice_free_card(struct spice_card *card)
+{
+	size_t i;
+	for (i = 0; i < card->cnt; i++)
+	{
+		free(card->tok[i]);
+	}
+	free(card->tok);
+}
+
+static void spice_free_deck(struct spice_deck *d)
+{
+	size_t i, j;
+	for (i = 0; i < d->scopecnt; i++)
+	{
+		struct spice_scope *sc = &d->scopes[i];
+		for (j = 0; j < sc->cardcnt; j++)
+		{
+			spice_free_card(&sc->cards[j]);
+		}
+		for (j = 0; j < sc->nodecnt; j++)
+		{
+			free(sc->nodes[j]);
+		}
+		for (j = 0; j < sc->paramcnt; j++)
+		{
+			free(sc->param_names[j]);
+			free(sc->param_values[j]);
+		}
+		free(sc->name);
+		free(sc->cards);
+		free(sc->nodes);
+		free(sc->param_names);
+		free(sc->param_values);
+	}
+	for (i = 0; i < d->modelcnt; i++)
+	{
+		spice_free_card(&d->models[i]);
+	}
+	spice_free_card(&d->tran);
+	for (i = 0; i < d->paramcnt; i++)
+	{
+		free(d->param_names[i]);
+		free(d->param_values[i]);
+	}
+	free(d->scopes);
+	free(d->models);
+	free(d->param_names);
+	free(d->param_values);
+}
+
+static struct spice_scope *spice_new_scope(struct spice_deck *d, const char *name)
+{
+	struct spice_scope *sc;
+	d->scopes = spice_grow(d->scopes, sizeof(*d->scopes), d->scopecnt, &d->scopecap);
+	sc = &d->scopes[d->scopecnt++];
+	memset(sc, 0, sizeof(*sc));
+	if (name != NULL)
+	{
+		char *p;
+		sc->name = spice_strdup(name);
+		for (p = sc->name; *p; p++)
+		{
+			*p = (char)toupper((unsigned char)*p);
+		}
+	}
+	return sc;
+}
+
+static void spice_add_param(char ***names, char ***values, size_t *cnt, size_t *cap, const char *tok)
+{
+	const char *equals = strchr(tok, '=');
+	char *name;
+	char *p;
+	*names = spice_grow(*names, sizeof(**names), *cnt, cap);
+	*values = realloc(*values, sizeof(**values)*(*cap));
+	if (*values == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	name = strndup(tok, (size_t)(equals - tok));
+	if (name == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (p = name; *p; p++)
+	{
+		*p = (char)tolower((unsigned char)*p);
+	}
+	(*names)[*cnt] = name;
+	(*values)[*cnt] = spice_strdup(equals+1);
+	(*cnt)++;
+}
+
+// Sorts a card into the deck, returns 1 at .end
+static int spice_add_card(struct spice_deck *d, size_t *cur, struct spice_card *card)
+{
+	const char *first = card->tok[0];
+	char *expr;
+	size_t i;
+	if (*first != '.')
+	{
+		struct spice_scope *sc = &d->scopes[*cur];
+		sc->cards = spice_grow(sc->cards, sizeof(*sc->cards), sc->cardcnt, &sc->cardcap);
+		sc->cards[sc->cardcnt++] = *card;
+		return 0;
+	}
+	if (strcasecmp(first, ".subckt") == 0)
+	{
+		struct spice_scope *sc;
+		if (*cur != 0)
+		{
+			spice_error(d, card, "Nested subcircuit definitions aren't supported");
+		}
+		if (card->cnt < 2)
+		{
+			spice_error(d, card, "Subcircuit without name");
+		}
+		sc = spice_new_scope(d, card->tok[1]);
+		sc->lineno = card->lineno;
+		*cur = d->scopecnt-1;
+		for (i = 2; i < card->cnt; i++)
+		{
+			const char *tok = card->tok[i];
+			if (strcasecmp(tok, "params:") == 0)
+			{
+				continue;
+			}
+			if (strchr(tok, '=') != NULL)
+			{
+				spice_add_param(&sc->param_names, &sc->param_values, &sc->paramcnt, &sc->paramcap, tok);
+				continue;
+			}
+			if (sc->paramcnt)
+			{
+				spice_error(d, card, "Ports of subcircuit %s must precede parameters", sc->name);
+			}
+			if (spice_find(sc->nodes, sc->nodecnt, tok) != SIZE_MAX || strcmp(tok, "0") == 0)
+			{
+				spice_error(d, card, "Invalid port %s of subcircuit %s", tok, sc->name);
+			}
+			sc->nodes = spice_grow(sc->nodes, sizeof(*sc->nodes), sc->nodecnt, &sc->nodecap);
+			sc->nodes[sc->nodecnt++] = spice_strdup(tok);
+			sc->portcnt++;
+		}
+	}
+	else if (strcasecmp(first, ".ends") == 0)
+	{
+		if (*cur == 0)
+		{
+			spice_error(d, card, ".ends without .subckt");
+		}
+		*cur = 0;
+	}
+	else if (strcasecmp(first, ".model") == 0)
+	{
+		if (card->cnt < 3)
+		{
+			spice_error(d, card, "Model needs a name and a type");
+		}
+		d->models = spice_grow(d->models, sizeof(*d->models), d->modelcnt, &d->modelcap);
+		d->models[d->modelcnt++] = *card;
+		return 0;
+	}
+	else if (strcasecmp(first, ".param") == 0)
+	{
+		for (i = 1; i < card->cnt; i++)
+		{
+			if (strchr(card->tok[i], '=') == NULL || card->tok[i][0] == '=')
+			{
+				spice_error(d, card, "Invalid parameter %s", card->tok[i]);
+			}
+			// Translated before it's added, so that it can only use
+			// the parameters before it like the netlist reader
+			expr = spice_expr(d, NULL, card, strchr(card->tok[i], '=')+1, 0);
+			spice_add_param(&d->param_names, &d->param_values, &d->paramcnt, &d->paramcap, card->tok[i]);
+			free(d->param_values[d->paramcnt-1]);
+			d->param_values[d->paramcnt-1] = expr;
+		}
+	}
+	else if (strcasecmp(first, ".tran") == 0)
+	{
+		// Evaluated once the parameters are in the circuit
+		spice_free_card(&d->tran);
+		d->tran = *card;
+		return 0;
+	}
+	else if (strcasecmp(first, ".end") == 0)
+	{
+		spice_free_card(card);
+		return 1;
+	}
+	else
+	{
+		fprintf(stderr, "%s:%zu: Warning: ignoring %s\n", d->fname, card->lineno, first);
+	}
+	spice_free_card(card);
+	return 0;
+}
+
+static void spice_card_text(struct spice_deck *d, size_t *cur, char **text, size_t lineno, int *end)
+{
+	struct spice_card card = {NULL, 0, lineno};
+	if (*text == NULL)
+	{
+		return;
+	}
+	spice_tokenize(&card, *text);
+	free(*text);
+	*text = NULL;
+	if (card.cnt == 0)
+	{
+		free(card.tok);
+		return;
+	}
+	*end = spice_add_card(d, cur, &card);
+}
+
+// Reads a SPICE deck. tstep and tstop, if not NULL, get the time step and
+// the end time of .tran, 0 without .tran.
+void read_spice_file(struct libsimul_ctx *ctx, const char *fname, double *tstep, double *tstop)
+{
+	struct spice_deck d;
+	FILE *f = fopen(fname, "r");
+	char *line = NULL;
+	size_t linesz = 0;
+	char *text = NULL;
+	size_t lineno = 0, cardline = 0;
+	size_t cur = 0;
+	size_t i, j, first;
+	int end = 0;
+	if (f == NULL)
+	{
+		fprintf(stderr, "Can't open file %s\n", fname);
+		exit(1);
+	}
+	memset(&d, 0, sizeof(d));
+	d.fname = fname;
+	spice_new_scope(&d, NULL);
+	while (!end && getline(&line, &linesz, f) > 0)
+	{
+		char *p;
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		// The first line is the title
+		if (lineno == 1 || line[0] == '*')
+		{
+			continue;
+		}
+		p = strchr(line, ';');
+		if (p != NULL)
+		{
+			*p = '\0';
+		}
+		p = line + strspn(line, " \t");
+		if (*p == '+')
+		{
+			size_t len = text ? strlen(text) : 0;
+			char *new_text = realloc(text, len + strlen(p) + 1);
+			if (new_text == NULL)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+			new_text[len] = '\0';
+			strcat(new_text, " ");
+			strcat(new_text, p+1);
+			text = new_text;
+			continue;
+		}
+		spice_card_text(&d, &cur, &text, cardline, &end);
+		if (*p != '\0')
+		{
+			text = spice_strdup(p);
+			cardline = lineno;
+		}
+	}
+	if (!end)
+	{
+		spice_card_text(&d, &cur, &text, cardline, &end);
+	}
+	free(text);
+	free(line);
+	fclose(f);
+	if (cur != 0)
+	{
+		fprintf(stderr, "%s: Subcircuit %s without .ends\n", fname, d.scopes[cur].name);
+		exit(1);
+	}
+
+	// Parameters, the time of .tran, subcircuit definitions and the top
+	// level
+	for (i = 0; i < d.paramcnt; i++)
+	{
+		struct spice_line l = {NULL, 0, 0};
+		line_printf(&l, ".param %s=%s", d.param_names[i], d.param_values[i]);
+		line_emit(ctx, &l);
+		free(l.buf);
+	}
+	if (d.tran.cnt)
+	{
+		size_t n = 0;
+		double v[2];
+		for (i = 1; i < d.tran.cnt && n < 2; i++)
+		{
+			if (strcasecmp(d.tran.tok[i], "uic") != 0)
+			{
+				v[n++] = spice_eval(ctx, &d, NULL, SIZE_MAX, &d.tran, d.tran.tok[i]);
+			}
+		}
+		if (n == 0)
+		{
+			spice_error(&d, &d.tran, ".tran needs the end time");
+		}
+		d.tstep = n == 2 ? v[0] : 0;
+		d.tstop = v[n-1];
+	}
+	for (i = 1; i < d.scopecnt; i++)
+	{
+		struct spice_scope *sc = &d.scopes[i];
+		struct spice_line l = {NULL, 0, 0};
+		struct spice_card card = {NULL, 0, sc->lineno};
+		line_printf(&l, ".subckt %s ", sc->name);
+		for (j = 0; j < sc->portcnt; j++)
+		{
+			line_printf(&l, "%zu ", j+1);
+		}
+		for (j = 0; j < sc->paramcnt; j++)
+		{
+			line_printf(&l, "%s=", sc->param_names[j]);
+			spice_value(&l, &d, NULL, &card, sc->param_values[j]);
+			line_printf(&l, " ");
+		}
+		line_emit(ctx, &l);
+		spice_emit_scope(ctx, &d, sc);
+		line_printf(&l, ".ends");
+		line_emit(ctx, &l);
+		free(l.buf);
+	}
+	spice_emit_scope(ctx, &d, &d.scopes[0]);
+	first = nodes_number(ctx);
+	subckt_flatten(ctx);
+	nodes_check(ctx, first);
+
+	// Waveforms and switches of the instances
+	for (i = 0; i < ctx->circuit->instcnt; i++)
+	{
+		const char *sub = ctx->circuit->subckts[ctx->circuit->insts[i].subckt].name;
+		for (j = 1; j < d.scopecnt; j++)
+		{
+			if (strcmp(d.scopes[j].name, sub) == 0)
+			{
+				size_t k;
+				for (k = 0; k < d.scopes[j].cardcnt; k++)
+				{
+					spice_emit_directives(ctx, &d, &d.scopes[j], i, &d.scopes[j].cards[k]);
+				}
+			}
+		}
+	}
+	if (check_at_most_one_transformer(ctx) != 0 || partition_find_floating(ctx) != 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	if (tstep != NULL)
+	{
+		*tstep = d.tstep;
+	}
+	if (tstop != NULL)
+	{
+		*tstop = d.tstop;
+	}
+	spice_free_deck(&d);
+}
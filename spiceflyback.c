@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+// The flyback converter of a SPICE deck, spiceflyback.cir, imported with
+// its time step and end time from .tran. The switch S1 is closed by a
+// control block of the same name and the output stage is a subcircuit
+// instance, so its nodes and elements have the instance prefix.
+int main(int argc, char **argv)
+{
+	double tstep, tstop;
+	size_t i, steps;
+	int out, drain;
+	struct libsimul_ctx ctx;
+	libsimul_init(&ctx, 1e-6);
+	read_spice_file(&ctx, "spiceflyback.cir", &tstep, &tstop);
+	if (tstep <= 0 || tstop <= 0)
+	{
+		fprintf(stderr, "No .tran in the deck\n");
+		return 1;
+	}
+	ctx.dt = tstep;
+	init_simulation(&ctx);
+	out = libsimul_node(&ctx, "out");
+	drain = libsimul_node(&ctx, "drain");
+	if (out < 0 || drain < 0)
+	{
+		fprintf(stderr, "Nodes not found\n");
+		return 1;
+	}
+	steps = (size_t)(tstop/tstep + 0.5);
+	for (i = 0; i < steps; i++)
+	{
+		simulation_step(&ctx);
+		if (i % 25000 == 0)
+		{
+			printf("%g V_out %g V_drain %g I_mag %g S1 %g\n", ctx.t, get_V(&ctx, out), get_V(&ctx, drain),
+				get_transformer_mag_current(&ctx, "XK1"), get_control_output(&ctx, "S1"));
+		}
+	}
+	libsimul_free(&ctx);
+	return 0;
+}
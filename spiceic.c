@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include "libsimul.h"
+
+// Signs of the SPICE initial conditions of spiceic.cir: V(a) starts at
+// -1 V and V(b) at 2 V.
+int main(int argc, char **argv)
+{
+	double tstep, tstop;
+	struct libsimul_ctx ctx;
+	libsimul_init(&ctx, 1e-9);
+	read_spice_file(&ctx, "spiceic.cir", &tstep, &tstop);
+	ctx.dt = tstep;
+	init_simulation(&ctx);
+	simulation_step(&ctx);
+	printf("V_a %g (-1) V_b %g (2)\n", get_V(&ctx, libsimul_node(&ctx, "a")),
+	       get_V(&ctx, libsimul_node(&ctx, "b")));
+	libsimul_free(&ctx);
+	return 0;
+}
@@ -0,0 +1,755 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include "libsimul.h"
+
+// Subcircuits, flattened when the netlist has been read.
+//
+// .subckt NAME port1 port2 ... param=default ...
+// <elements and .inst lines>
+// .ends
+// .inst NAME SUBCKT node1 node2 ... param=value ...
+//
+// The ports are local node numbers of the body, node 0 is the global
+// ground and every other local node is an internal node of the instance.
+// Nodes of top-level instances may also be node names.
+// Element and instance names get the name of the instance as a prefix, e.g.
+// U1.L1, and the parameters of the subcircuit in values are replaced by
+// the parameters of the instance, see params.c. Instances are flattened at
+// the end of read_file(), so that internal nodes are numbered after all
+// nodes of the netlist, but every instance keeps its elements and internal
+// nodes as contiguous ranges, recorded in struct libsimul_instance.
+
+#define SUBCKT_MAX_DEPTH 32
+// Local node that is used but not numbered yet
+#define SUBCKT_NODE_UNNUMBERED INT_MAX
+
+static size_t subckt_find(const struct libsimul_circuit *c, const char *name)
+{
+	size_t i;
+	for (i = 0; i < c->subcktcnt; i++)
+	{
+		if (strcmp(c->subckts[i].name, name) == 0)
+		{
+			return i;
+		}
+	}
+	return SIZE_MAX;
+}
+
+static int parse_node(const char *tok, const char *what)
+{
+	char *endptr;
+	long l = strtol(tok, &endptr, 10);
+	if (l < 0 || *tok == '\0' || *endptr != '\0' || (long)(int)l != l)
+	{
+		fprintf(stderr, "Not an int node in %s: %s\n", what, tok);
+		exit(1);
+	}
+	return (int)l;
+}
+
+static void *grow(void *arr, size_t elsz, size_t cnt, size_t *cap)
+{
+	void *new_arr;
+	size_t new_cap;
+	if (arr != NULL && cnt < *cap)
+	{
+		return arr;
+	}
+	new_cap = 2*cnt+8;
+	new_arr = realloc(arr, elsz*new_cap);
+	if (new_arr == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	*cap = new_cap;
+	return new_arr;
+}
+
+static char *xstrdup(const char *s)
+{
+	char *d = strdup(s);
+	if (d == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return d;
+}
+
+static void subckt_use_node(struct libsimul_subckt *sc, int node)
+{
+	if (node > sc->maxnode)
+	{
+		int *new_map = realloc(sc->localmap, sizeof(*new_map)*((size_t)node+1));
+		int i;
+		if (new_map == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		for (i = sc->maxnode+1; i <= node; i++)
+		{
+			new_map[i] = -1;
+		}
+		sc->localmap = new_map;
+		sc->maxnode = node;
+	}
+	if (node > 0 && sc->localmap[node] < 0)
+	{
+		// Numbered when the definition ends
+		sc->localmap[node] = SUBCKT_NODE_UNNUMBERED;
+	}
+}
+
+// .subckt NAME port1 port2 ... param=default ...
+int subckt_read_directive(struct libsimul_ctx *ctx, char *lineptr)
+{
+	struct libsimul_circuit *c;
+	struct libsimul_subckt *sc;
+	char *name = next_token(&lineptr);
+	char *tok;
+	if (name == NULL)
+	{
+		fprintf(stderr, "Subcircuit without name\n");
+		exit(1);
+	}
+	if (subckt_find(ctx->circuit, name) != SIZE_MAX)
+	{
+		fprintf(stderr, "Subcircuit %s already defined\n", name);
+		exit(1);
+	}
+	netlist_unshare(ctx);
+	c = ctx->circuit;
+	c->subckts = grow(c->subckts, sizeof(*c->subckts), c->subcktcnt, &c->subcktcap);
+	sc = &c->subckts[c->subcktcnt];
+	memset(sc, 0, sizeof(*sc));
+	sc->name = xstrdup(name);
+	sc->maxnode = -1;
+	subckt_use_node(sc, 0);
+	while ((tok = next_token(&lineptr)) != NULL)
+	{
+		char *equals = strchr(tok, '=');
+		int node;
+		if (equals == NULL)
+		{
+			if (sc->paramcnt)
+			{
+				fprintf(stderr, "Ports of subcircuit %s must precede parameters\n", name);
+				exit(1);
+			}
+			node = parse_node(tok, name);
+			subckt_use_node(sc, node);
+			if (node == 0 || sc->localmap[node] != SUBCKT_NODE_UNNUMBERED)
+			{
+				fprintf(stderr, "Invalid port %d of subcircuit %s\n", node, name);
+				exit(1);
+			}
+			sc->localmap[node] = (int)sc->portcnt++;
+			continue;
+		}
+		*equals = '\0';
+		sc->param_names = grow(sc->param_names, sizeof(*sc->param_names), sc->paramcnt, &sc->paramcap);
+		sc->param_values = realloc(sc->param_values, sizeof(*sc->param_values)*sc->paramcap);
+		if (sc->param_values == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		sc->param_names[sc->paramcnt] = xstrdup(tok);
+		sc->param_values[sc->paramcnt] = xstrdup(equals+1);
+		sc->paramcnt++;
+	}
+	c->subckt_open = c->subcktcnt++;
+	return 0;
+}
+
+static void subckt_end(struct libsimul_subckt *sc)
+{
+	int i;
+	for (i = 1; i <= sc->maxnode; i++)
+	{
+		if (sc->localmap[i] == SUBCKT_NODE_UNNUMBERED)
+		{
+			sc->localmap[i] = (int)(sc->portcnt + sc->internalcnt++);
+		}
+	}
+}
+
+// Line of the body of the subcircuit being defined, called by
+// read_netlist_line() until .ends
+int subckt_add_line(struct libsimul_ctx *ctx, const char *line)
+{
+	struct libsimul_circuit *c = ctx->circuit;
+	struct libsimul_subckt *sc = &c->subckts[c->subckt_open];
+	char *copy = xstrdup(line);
+	char *lineptr = copy;
+	char *first = next_token(&lineptr);
+	char *tok;
+	int nodes = 2;
+	if (strcmp(first, ".ends") == 0)
+	{
+		free(copy);
+		subckt_end(sc);
+		c->subckt_open = SIZE_MAX;
+		return 0;
+	}
+	if (*first == '.')
+	{
+		if (strcmp(first, ".inst") != 0)
+		{
+			fprintf(stderr, "Directive %s not allowed in subcircuit %s\n", first, sc->name);
+			exit(1);
+		}
+		// Name and subcircuit precede the nodes
+		if (next_token(&lineptr) == NULL || next_token(&lineptr) == NULL)
+		{
+			fprintf(stderr, "Invalid line: %s\n", line);
+			exit(1);
+		}
+		nodes = -1;
+	}
+	else
+	{
+		subckt_use_node(sc, parse_node(first, sc->name));
+		nodes--;
+	}
+	while (nodes != 0 && (tok = next_token(&lineptr)) != NULL && strchr(tok, '=') == NULL)
+	{
+		subckt_use_node(sc, parse_node(tok, sc->name));
+		nodes--;
+	}
+	free(copy);
+	sc->lines = grow(sc->lines, sizeof(*sc->lines), sc->linecnt, &sc->linecap);
+	sc->lines[sc->linecnt++] = xstrdup(line);
+	return 0;
+}
+
+// .inst at the top level, instantiated by subckt_flatten()
+int subckt_read_instance(struct libsimul_ctx *ctx, char *lineptr)
+{
+	struct libsimul_circuit *c;
+	char *line, *ptr, *tok;
+	netlist_unshare(ctx);
+	c = ctx->circuit;
+	c->inst_pending = grow(c->inst_pending, sizeof(*c->inst_pending), c->inst_pendingcnt, &c->inst_pendingcap);
+	c->inst_pending[c->inst_pendingcnt++] = xstrdup(lineptr);
+	// Named nodes are numbered before the instances are flattened, after
+	// the numbered ports which may appear nowhere else at the top level
+	line = xstrdup(lineptr);
+	ptr = line;
+	next_token(&ptr);
+	next_token(&ptr);
+	while ((tok = next_token(&ptr)) != NULL && strchr(tok, '=') == NULL)
+	{
+		int n = node_parse(ctx, tok);
+		if (n > 0)
+		{
+			mark_node_seen(ctx, n);
+		}
+	}
+	free(line);
+	return 0;
+}
+
+static int instance_node(const struct libsimul_circuit *c, size_t inst, int node)
+{
+	const struct libsimul_instance *in;
+	const struct libsimul_subckt *sc;
+	int m;
+	if (inst == SIZE_MAX || node == 0)
+	{
+		return node;
+	}
+	in = &c->insts[inst];
+	sc = &c->subckts[in->subckt];
+	if (node < 0 || node > sc->maxnode || (m = sc->localmap[node]) < 0)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	if ((size_t)m < sc->portcnt)
+	{
+		return in->ports[m];
+	}
+	return in->node_first + (m - (int)sc->portcnt);
+}
+
+// Value of a netlist value in an instance, a new string: the parameters of
+// the subcircuit in an expression are replaced by their values, so that the
+// value only refers to the parameters of the netlist
+static char *instance_value(const struct libsimul_circuit *c, size_t inst, const char *val)
+{
+	const struct libsimul_instance *in;
+	const struct libsimul_subckt *sc;
+	char *v;
+	if (inst == SIZE_MAX)
+	{
+		return xstrdup(val);
+	}
+	in = &c->insts[inst];
+	sc = &c->subckts[in->subckt];
+	v = param_subst(val, sc->param_names, in->params, sc->paramcnt);
+	if (v == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return v;
+}
+
+struct flatten_line {
+	char *buf;
+	size_t sz;
+	size_t cap;
+};
+
+static void flatten_append(struct flatten_line *fl, const char *s)
+{
+	size_t len = strlen(s);
+	if (fl->buf == NULL || fl->sz + len + 1 > fl->cap)
+	{
+		size_t new_cap = 2*(fl->sz + len + 1);
+		char *new_buf = realloc(fl->buf, new_cap);
+		if (new_buf == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		fl->buf = new_buf;
+		fl->cap = new_cap;
+	}
+	memcpy(fl->buf + fl->sz, s, len+1);
+	fl->sz += len;
+}
+
+static void instantiate(struct libsimul_ctx *ctx, int *next_node, size_t parent, char *lineptr, int depth);
+
+// Element line of the body of instance inst
+static void instantiate_element(struct libsimul_ctx *ctx, size_t inst, char *lineptr)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	struct flatten_line fl = {NULL, 0, 0};
+	char num[32];
+	char *tok, *val;
+	int i;
+	for (i = 0; i < 2; i++)
+	{
+		tok = next_token(&lineptr);
+		snprintf(num, sizeof(num), "%d ", instance_node(c, inst, parse_node(tok, c->insts[inst].name)));
+		flatten_append(&fl, num);
+	}
+	tok = next_token(&lineptr);
+	if (tok == NULL)
+	{
+		fprintf(stderr, "Element without name in %s\n", c->insts[inst].name);
+		exit(1);
+	}
+	flatten_append(&fl, c->insts[inst].name);
+	flatten_append(&fl, ".");
+	flatten_append(&fl, tok);
+	while ((tok = next_token(&lineptr)) != NULL)
+	{
+		char *equals = strchr(tok, '=');
+		flatten_append(&fl, " ");
+		if (equals == NULL)
+		{
+			flatten_append(&fl, tok);
+			continue;
+		}
+		*equals = '\0';
+		val = instance_value(c, inst, equals+1);
+		flatten_append(&fl, tok);
+		flatten_append(&fl, "=");
+		flatten_append(&fl, val);
+		free(val);
+	}
+	read_netlist_line(ctx, fl.buf);
+	free(fl.buf);
+}
+
+// NAME SUBCKT node1 node2 ... param=value ... in instance parent
+static void instantiate(struct libsimul_ctx *ctx, int *next_node, size_t parent, char *lineptr, int depth)
+{
+	struct libsimul_circuit *c = ctx->circuit;
+	struct libsimul_instance *in;
+	const struct libsimul_subckt *sc;
+	char *name = next_token(&lineptr);
+	char *subname = next_token(&lineptr);
+	char *tok;
+	size_t k, i, idx;
+	if (name == NULL || subname == NULL)
+	{
+		fprintf(stderr, "Invalid instance\n");
+		exit(1);
+	}
+	k = subckt_find(c, subname);
+	if (k == SIZE_MAX)
+	{
+		fprintf(stderr, "Subcircuit %s of instance %s not found\n", subname, name);
+		exit(1);
+	}
+	if (depth >= SUBCKT_MAX_DEPTH)
+	{
+		fprintf(stderr, "Subcircuit %s nested too deep\n", subname);
+		exit(1);
+	}
+	sc = &c->subckts[k];
+	c->insts = grow(c->insts, sizeof(*c->insts), c->instcnt, &c->instcap);
+	idx = c->instcnt;
+	in = &c->insts[idx];
+	memset(in, 0, sizeof(*in));
+	in->subckt = k;
+	in->parent = parent;
+	if (parent == SIZE_MAX)
+	{
+		in->name = xstrdup(name);
+	}
+	else
+	{
+		const char *pname = c->insts[parent].name;
+		in->name = malloc(strlen(pname) + strlen(name) + 2);
+		if (in->name == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		sprintf(in->name, "%s.%s", pname, name);
+	}
+	in->portcnt = sc->portcnt;
+	in->ports = malloc(sizeof(*in->ports)*(sc->portcnt+1));
+	in->params = malloc(sizeof(*in->params)*(sc->paramcnt+1));
+	if (in->ports == NULL || in->params == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < sc->paramcnt; i++)
+	{
+		in->params[i] = NULL;
+	}
+	for (i = 0; i < sc->portcnt; i++)
+	{
+		tok = next_token(&lineptr);
+		if (tok == NULL || strchr(tok, '=') != NULL)
+		{
+			fprintf(stderr, "Instance %s must have %zu nodes\n", in->name, sc->portcnt);
+			exit(1);
+		}
+		if (parent == SIZE_MAX)
+		{
+			in->ports[i] = node_lookup(c, tok);
+		}
+		else
+		{
+			in->ports[i] = instance_node(c, parent, parse_node(tok, in->name));
+		}
+		if (in->ports[i] < 0)
+		{
+			fprintf(stderr, "Node %s of instance %s not found\n", tok, in->name);
+			exit(1);
+		}
+	}
+	while ((tok = next_token(&lineptr)) != NULL)
+	{
+		char *equals = strchr(tok, '=');
+		if (equals == NULL)
+		{
+			fprintf(stderr, "Instance %s must have %zu nodes\n", in->name, sc->portcnt);
+			exit(1);
+		}
+		*equals = '\0';
+		for (i = 0; i < sc->paramcnt; i++)
+		{
+			if (strcmp(sc->param_names[i], tok) == 0)
+			{
+				break;
+			}
+		}
+		if (i == sc->paramcnt)
+		{
+			fprintf(stderr, "Subcircuit %s has no parameter %s\n", sc->name, tok);
+			exit(1);
+		}
+		free(in->params[i]);
+		in->params[i] = instance_value(c, parent, equals+1);
+	}
+	// Defaults may use the parameters before them
+	for (i = 0; i < sc->paramcnt; i++)
+	{
+		if (in->params[i] == NULL)
+		{
+			in->params[i] = param_subst(sc->param_values[i], sc->param_names, in->params, i);
+			if (in->params[i] == NULL)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+	}
+	c->instcnt++;
+	in->node_first = *next_node;
+	in->node_cnt = sc->internalcnt;
+	*next_node += (int)sc->internalcnt;
+	in->el_first = c->elements_used_sz;
+	for (i = 0; i < sc->linecnt; i++)
+	{
+		char *line = xstrdup(c->subckts[k].lines[i]);
+		char *ptr = line;
+		char *first = line + nonspaceoff(line);
+		if (strncmp(first, ".inst", 5) == 0)
+		{
+			ptr = first + 5;
+			instantiate(ctx, next_node, idx, ptr, depth+1);
+		}
+		else
+		{
+			instantiate_element(ctx, idx, ptr);
+		}
+		free(line);
+		// Elements may have unshared the circuit
+		c = ctx->circuit;
+		sc = &c->subckts[k];
+	}
+	c->insts[idx].el_cnt = c->elements_used_sz - c->insts[idx].el_first;
+}
+
+// Instantiates the top-level instances, called at the end of read_file()
+void subckt_flatten(struct libsimul_ctx *ctx)
+{
+	struct libsimul_circuit *c = ctx->circuit;
+	int next_node;
+	size_t i;
+	if (c->subckt_open != SIZE_MAX)
+	{
+		fprintf(stderr, "Subcircuit %s without .ends\n", c->subckts[c->subckt_open].name);
+		exit(1);
+	}
+	if (c->inst_pendingcnt == 0)
+	{
+		return;
+	}
+	netlist_unshare(ctx);
+	c = ctx->circuit;
+	// Internal nodes are numbered after all nodes of the netlist, including
+	// ports used by nothing else
+	next_node = (int)(c->node_seen_sz ? c->node_seen_sz : 1);
+	for (i = 0; i < c->inst_pendingcnt; i++)
+	{
+		char *line = xstrdup(c->inst_pending[i]);
+		char *lineptr = line;
+		char *tok;
+		next_token(&lineptr);
+		next_token(&lineptr);
+		while ((tok = next_token(&lineptr)) != NULL && strchr(tok, '=') == NULL)
+		{
+			int node = node_lookup(c, tok);
+			if (node >= next_node)
+			{
+				next_node = node+1;
+			}
+		}
+		free(line);
+	}
+	for (i = 0; i < c->inst_pendingcnt; i++)
+	{
+		instantiate(ctx, &next_node, SIZE_MAX, c->inst_pending[i], 0);
+		c = ctx->circuit;
+	}
+	for (i = 0; i < c->inst_pendingcnt; i++)
+	{
+		free(c->inst_pending[i]);
+	}
+	c->inst_pendingcnt = 0;
+}
+
+// Index of the instance with the full name, e.g. U1.X2
+int libsimul_find_instance(struct libsimul_ctx *ctx, const char *name)
+{
+	size_t i;
+	for (i = 0; i < ctx->circuit->instcnt; i++)
+	{
+		if (strcmp(ctx->circuit->insts[i].name, name) == 0)
+		{
+			return (int)i;
+		}
+	}
+	return -ERR_NOT_FOUND;
+}
+
+// Node of the circuit of the local node of the instance, e.g. for probes
+int libsimul_instance_node(struct libsimul_ctx *ctx, int inst, int node)
+{
+	if (inst < 0 || (size_t)inst >= ctx->circuit->instcnt)
+	{
+		return -ERR_NOT_FOUND;
+	}
+	return instance_node(ctx->circuit, (size_t)inst, node);
+}
+
+// Declares the ports of the top-level instances as border nodes, so that
+// the block solver solves every instance as a block
+int libsimul_set_instance_blocks(struct libsimul_ctx *ctx)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	unsigned char *seen;
+	int *nodes;
+	size_t cnt = 0;
+	size_t i, j;
+	int ret;
+	seen = calloc(c->node_seen_sz+1, sizeof(*seen));
+	nodes = malloc(sizeof(*nodes)*(c->node_seen_sz+1));
+	if (seen == NULL || nodes == NULL)
+	{
+		free(seen);
+		free(nodes);
+		return -ERR_NO_MEMORY;
+	}
+	for (i = 0; i < c->instcnt; i++)
+	{
+		if (c->insts[i].parent != SIZE_MAX)
+		{
+			continue;
+		}
+		for (j = 0; j < c->insts[i].portcnt; j++)
+		{
+			int n = c->insts[i].ports[j];
+			if (n > 0 && (size_t)n < c->node_seen_sz && !seen[n])
+			{
+				seen[n] = 1;
+				nodes[cnt++] = n;
+			}
+		}
+	}
+	ret = libsimul_set_block_border(ctx, nodes, cnt);
+	free(seen);
+	free(nodes);
+	return ret;
+}
+
+static char **strarr_copy(char *const *src, size_t cnt)
+{
+	char **dst = malloc(sizeof(*dst)*(cnt+1));
+	size_t i;
+	if (dst == NULL)
+	{
+		return NULL;
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		dst[i] = strdup(src[i]);
+		if (dst[i] == NULL)
+		{
+			while (i > 0)
+			{
+				free(dst[--i]);
+			}
+			free(dst);
+			return NULL;
+		}
+	}
+	return dst;
+}
+
+static void strarr_free(char **arr, size_t cnt)
+{
+	size_t i;
+	if (arr == NULL)
+	{
+		return;
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		free(arr[i]);
+	}
+	free(arr);
+}
+
+int subckt_copy_defs(struct libsimul_circuit *dst, const struct libsimul_circuit *src)
+{
+	size_t i;
+	dst->subckt_open = src->subckt_open;
+	dst->subckts = calloc(src->subcktcnt+1, sizeof(*dst->subckts));
+	dst->subcktcap = src->subcktcnt+1;
+	dst->insts = calloc(src->instcnt+1, sizeof(*dst->insts));
+	dst->instcap = src->instcnt+1;
+	dst->inst_pending = strarr_copy(src->inst_pending, src->inst_pendingcnt);
+	dst->inst_pendingcap = src->inst_pendingcnt+1;
+	dst->inst_pendingcnt = dst->inst_pending != NULL ? src->inst_pendingcnt : 0;
+	if (dst->subckts == NULL || dst->insts == NULL || dst->inst_pending == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	for (i = 0; i < src->subcktcnt; i++)
+	{
+		const struct libsimul_subckt *s = &src->subckts[i];
+		struct libsimul_subckt *d = &dst->subckts[i];
+		*d = *s;
+		d->name = strdup(s->name);
+		d->param_names = strarr_copy(s->param_names, s->paramcnt);
+		d->param_values = strarr_copy(s->param_values, s->paramcnt);
+		d->paramcap = s->paramcnt+1;
+		d->lines = strarr_copy(s->lines, s->linecnt);
+		d->linecap = s->linecnt+1;
+		d->localmap = malloc(sizeof(*d->localmap)*((size_t)s->maxnode+1));
+		dst->subcktcnt++;
+		if (d->name == NULL || d->param_names == NULL || d->param_values == NULL ||
+		    d->lines == NULL || d->localmap == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		memcpy(d->localmap, s->localmap, sizeof(*d->localmap)*((size_t)s->maxnode+1));
+	}
+	for (i = 0; i < src->instcnt; i++)
+	{
+		const struct libsimul_instance *s = &src->insts[i];
+		struct libsimul_instance *d = &dst->insts[i];
+		*d = *s;
+		d->name = strdup(s->name);
+		d->params = strarr_copy(s->params, src->subckts[s->subckt].paramcnt);
+		d->ports = malloc(sizeof(*d->ports)*(s->portcnt+1));
+		dst->instcnt++;
+		if (d->name == NULL || d->params == NULL || d->ports == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		memcpy(d->ports, s->ports, sizeof(*d->ports)*s->portcnt);
+	}
+	return 0;
+}
+
+void subckt_free_defs(struct libsimul_circuit *c)
+{
+	size_t i;
+	for (i = 0; i < c->subcktcnt; i++)
+	{
+		struct libsimul_subckt *sc = &c->subckts[i];
+		free(sc->name);
+		strarr_free(sc->param_names, sc->paramcnt);
+		strarr_free(sc->param_values, sc->paramcnt);
+		strarr_free(sc->lines, sc->linecnt);
+		free(sc->localmap);
+	}
+	for (i = 0; i < c->instcnt; i++)
+	{
+		struct libsimul_instance *in = &c->insts[i];
+		free(in->name);
+		strarr_free(in->params, c->subckts[in->subckt].paramcnt);
+		free(in->ports);
+	}
+	strarr_free(c->inst_pending, c->inst_pendingcnt);
+	free(c->subckts);
+	free(c->insts);
+	c->subckts = NULL;
+	c->subcktcnt = 0;
+	c->subcktcap = 0;
+	c->insts = NULL;
+	c->instcnt = 0;
+	c->instcap = 0;
+	c->inst_pending = NULL;
+	c->inst_pendingcnt = 0;
+	c->inst_pendingcap = 0;
+}
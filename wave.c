@@ -0,0 +1,586 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include "libsimul.h"
+
+// Time-dependent voltage sources declared in the netlist:
+//
+// .sine V1 ampl=325 f=50 phase=0 offset=0
+// .sine V1,V2,V3 ampl=325 f=50
+// .pulse V1 low=0 high=5 delay=0 rise=1e-6 fall=1e-6 width=4e-6 period=10e-6
+// .pwl V1 points=0,0,1e-3,10,2e-3,10,3e-3,0 period=4e-3
+//
+// A sine with several sources is a multiphase supply, every source lagging
+// the previous one by 360/n degrees. Pulse and PWL repeat if period is
+// given. Every value can be a parameter expression, PWL points too; a comma
+// inside braces or parentheses belongs to the expression of the point. The sources get their values at the start of every (sub)step,
+// before the matrix is solved, so the main loop doesn't need to call
+// set_voltage_source() for them.
+//
+// Sines don't call sin() every step: the phase is kept as a unit vector
+// rotated by the angle of one time step, and recomputed exactly every
+// WAVE_RESYNC_ROTATIONS steps so that rounding errors don't accumulate.
+
+#define WAVE_RESYNC_ROTATIONS 4096
+
+static const double wave_pi = 3.14159265358979323846;
+
+// Value of the waveform being read
+static double wave_value(struct libsimul_ctx *ctx, const char *val, size_t off, enum libsimul_param_check check)
+{
+	return netlist_value(ctx, val, PARAM_WAVE, ctx->circuit->wavecnt-1, off, check);
+}
+
+// Length of the PWL point at p, up to the next comma that isn't inside
+// braces or parentheses
+static size_t wave_point_len(const char *p)
+{
+	const char *orig_p = p;
+	int depth = 0;
+	for (; *p && (*p != ',' || depth > 0); p++)
+	{
+		if (*p == '{' || *p == '(')
+		{
+			depth++;
+		}
+		else if ((*p == '}' || *p == ')') && depth > 0)
+		{
+			depth--;
+		}
+	}
+	return p - orig_p;
+}
+
+static int wave_pwl_increasing(const struct libsimul_wave *w)
+{
+	size_t i;
+	for (i = 0; i < w->pwlcnt; i++)
+	{
+		if (!(w->pwl[2*i] >= 0) || (i > 0 && w->pwl[2*i] <= w->pwl[2*i-2]))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void wave_read_points(struct libsimul_ctx *ctx, struct libsimul_wave *w, char *val)
+{
+	size_t cnt = 1;
+	size_t i, len;
+	char *p;
+	if (w->pwl != NULL)
+	{
+		fprintf(stderr, "PWL points given twice\n");
+		exit(1);
+	}
+	p = val;
+	len = wave_point_len(p);
+	while (p[len] != '\0')
+	{
+		p += len+1;
+		len = wave_point_len(p);
+		cnt++;
+	}
+	if (cnt < 2 || cnt % 2 != 0)
+	{
+		fprintf(stderr, "PWL points must be time and voltage pairs\n");
+		exit(1);
+	}
+	w->pwl = malloc(sizeof(*w->pwl)*cnt);
+	if (w->pwl == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	w->pwlcnt = cnt/2;
+	for (i = 0; i < cnt; i++)
+	{
+		char *next;
+		len = wave_point_len(val);
+		next = val[len] ? &val[len+1] : &val[len];
+		val[len] = '\0';
+		// Times are nonnegative, the check of the time order follows
+		w->pwl[i] = netlist_value(ctx, val, PARAM_PWL, ctx->circuit->wavecnt-1, sizeof(*w->pwl)*i,
+			i % 2 == 0 ? PARAM_NONNEGATIVE : PARAM_ANY);
+		if (!isfinite(w->pwl[i]))
+		{
+			fprintf(stderr, "Invalid PWL point: %s\n", val);
+			exit(1);
+		}
+		val = next;
+	}
+	if (!wave_pwl_increasing(w))
+	{
+		fprintf(stderr, "PWL times must be increasing\n");
+		exit(1);
+	}
+}
+
+static void wave_read_sources(struct libsimul_wave *w, char *names)
+{
+	size_t cnt = 1;
+	size_t i;
+	char *p;
+	for (p = names; *p; p++)
+	{
+		if (*p == ',')
+		{
+			cnt++;
+		}
+	}
+	w->srcs = malloc(sizeof(*w->srcs)*cnt);
+	if (w->srcs == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		char *comma = strchr(names, ',');
+		struct libsimul_wave_src *src = &w->srcs[i];
+		if (comma != NULL)
+		{
+			*comma = '\0';
+		}
+		if (*names == '\0')
+		{
+			fprintf(stderr, "Empty voltage source name\n");
+			exit(1);
+		}
+		src->name = strdup(names);
+		src->ph_c = cos(2*wave_pi*i/cnt);
+		src->ph_s = sin(2*wave_pi*i/cnt);
+		w->srccnt++;
+		if (src->name == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		names = comma ? &comma[1] : NULL;
+	}
+}
+
+// Range checks of the values of a waveform, applied again when a parameter
+// is overridden
+int wave_valid(const struct libsimul_wave *w)
+{
+	if (w->typ == WAVE_SINE)
+	{
+		return w->f >= 0;
+	}
+	if (w->typ == WAVE_PULSE)
+	{
+		return w->delay >= 0 && w->rise >= 0 && w->fall >= 0 && w->width >= 0 && w->period >= 0 &&
+		       (w->period == 0 || w->period >= w->rise + w->width + w->fall);
+	}
+	return w->period >= 0 && wave_pwl_increasing(w) &&
+	       (w->period == 0 || w->pwlcnt == 0 || w->period >= w->pwl[2*(w->pwlcnt-1)]);
+}
+
+int wave_read_directive(struct libsimul_ctx *ctx, enum libsimul_wave_type typ, char *lineptr)
+{
+	struct libsimul_circuit *c;
+	struct libsimul_wave *w;
+	char *names = next_token(&lineptr);
+	char *tok;
+	int has_f = 0;
+	if (names == NULL)
+	{
+		fprintf(stderr, "Waveform must have voltage source\n");
+		exit(1);
+	}
+	netlist_unshare(ctx);
+	c = ctx->circuit;
+	if (c->wavecnt >= c->wavecap || c->waves == NULL)
+	{
+		size_t new_cap = 2*c->wavecnt+4;
+		struct libsimul_wave *new_waves;
+		new_waves = realloc(c->waves, sizeof(*c->waves)*new_cap);
+		if (new_waves == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		c->waves = new_waves;
+		c->wavecap = new_cap;
+	}
+	w = &c->waves[c->wavecnt];
+	memset(w, 0, sizeof(*w));
+	w->typ = typ;
+	c->wavecnt++;
+	wave_read_sources(w, names);
+	if (typ != WAVE_SINE && w->srccnt != 1)
+	{
+		fprintf(stderr, "Only sines can drive several voltage sources\n");
+		exit(1);
+	}
+	while ((tok = next_token(&lineptr)) != NULL)
+	{
+		char *equals = strchr(tok, '=');
+		char *val;
+		if (equals == NULL)
+		{
+			fprintf(stderr, "Extra token no equals sign\n");
+			exit(1);
+		}
+		*equals = '\0';
+		val = &equals[1];
+		if (typ == WAVE_SINE && strcmp(tok, "ampl") == 0)
+		{
+			w->ampl = wave_value(ctx, val, offsetof(struct libsimul_wave, ampl), PARAM_ANY);
+		}
+		else if (typ == WAVE_SINE && strcmp(tok, "f") == 0)
+		{
+			w->f = wave_value(ctx, val, offsetof(struct libsimul_wave, f), PARAM_NONNEGATIVE);
+			has_f = 1;
+			if (w->f < 0)
+			{
+				fprintf(stderr, "Invalid frequency: %lf\n", w->f);
+				exit(1);
+			}
+		}
+		else if (typ == WAVE_SINE && strcmp(tok, "phase") == 0)
+		{
+			w->phase = wave_value(ctx, val, offsetof(struct libsimul_wave, phase), PARAM_ANY);
+		}
+		else if (typ == WAVE_SINE && strcmp(tok, "offset") == 0)
+		{
+			w->offset = wave_value(ctx, val, offsetof(struct libsimul_wave, offset), PARAM_ANY);
+		}
+		else if (typ == WAVE_PULSE && strcmp(tok, "low") == 0)
+		{
+			w->low = wave_value(ctx, val, offsetof(struct libsimul_wave, low), PARAM_ANY);
+		}
+		else if (typ == WAVE_PULSE && strcmp(tok, "high") == 0)
+		{
+			w->high = wave_value(ctx, val, offsetof(struct libsimul_wave, high), PARAM_ANY);
+		}
+		else if (typ == WAVE_PULSE && strcmp(tok, "delay") == 0)
+		{
+			w->delay = wave_value(ctx, val, offsetof(struct libsimul_wave, delay), PARAM_NONNEGATIVE);
+		}
+		else if (typ == WAVE_PULSE && strcmp(tok, "rise") == 0)
+		{
+			w->rise = wave_value(ctx, val, offsetof(struct libsimul_wave, rise), PARAM_NONNEGATIVE);
+		}
+		else if (typ == WAVE_PULSE && strcmp(tok, "fall") == 0)
+		{
+			w->fall = wave_value(ctx, val, offsetof(struct libsimul_wave, fall), PARAM_NONNEGATIVE);
+		}
+		else if (typ == WAVE_PULSE && strcmp(tok, "width") == 0)
+		{
+			w->width = wave_value(ctx, val, offsetof(struct libsimul_wave, width), PARAM_NONNEGATIVE);
+		}
+		else if (typ == WAVE_PWL && strcmp(tok, "points") == 0)
+		{
+			wave_read_points(ctx, w, val);
+		}
+		else if (typ != WAVE_SINE && strcmp(tok, "period") == 0)
+		{
+			w->period = wave_value(ctx, val, offsetof(struct libsimul_wave, period), PARAM_NONNEGATIVE);
+		}
+		else
+		{
+			fprintf(stderr, "Invalid parameter: %s\n", tok);
+			exit(1);
+		}
+	}
+	if (typ == WAVE_SINE && !has_f)
+	{
+		fprintf(stderr, "Sine %s must have frequency\n", w->srcs[0].name);
+		exit(1);
+	}
+	if (typ == WAVE_PULSE && !wave_valid(w))
+	{
+		fprintf(stderr, "Invalid pulse timing for %s\n", w->srcs[0].name);
+		exit(1);
+	}
+	if (typ == WAVE_PWL && w->pwlcnt == 0)
+	{
+		fprintf(stderr, "PWL %s must have points\n", w->srcs[0].name);
+		exit(1);
+	}
+	if (typ == WAVE_PWL && !wave_valid(w))
+	{
+		fprintf(stderr, "PWL %s period shorter than its points\n", w->srcs[0].name);
+		exit(1);
+	}
+	return 0;
+}
+
+int wave_copy_defs(struct libsimul_circuit *dst, const struct libsimul_circuit *src)
+{
+	size_t i, j;
+	dst->waves = NULL;
+	dst->wavecnt = 0;
+	dst->wavecap = 0;
+	if (src->wavecnt == 0)
+	{
+		return 0;
+	}
+	dst->waves = malloc(sizeof(*dst->waves)*src->wavecnt);
+	if (dst->waves == NULL)
+	{
+		return -ERR_NO_MEMORY;
+	}
+	dst->wavecap = src->wavecnt;
+	for (i = 0; i < src->wavecnt; i++)
+	{
+		const struct libsimul_wave *sw = &src->waves[i];
+		struct libsimul_wave *w = &dst->waves[i];
+		*w = *sw;
+		w->srccnt = 0;
+		w->pwl = NULL;
+		w->srcs = malloc(sizeof(*w->srcs)*sw->srccnt);
+		dst->wavecnt++;
+		if (w->srcs == NULL)
+		{
+			return -ERR_NO_MEMORY;
+		}
+		for (j = 0; j < sw->srccnt; j++)
+		{
+			w->srcs[j] = sw->srcs[j];
+			w->srcs[j].name = strdup(sw->srcs[j].name);
+			w->srccnt++;
+			if (w->srcs[j].name == NULL)
+			{
+				return -ERR_NO_MEMORY;
+			}
+		}
+		if (sw->pwlcnt)
+		{
+			w->pwl = malloc(sizeof(*w->pwl)*2*sw->pwlcnt);
+			if (w->pwl == NULL)
+			{
+				return -ERR_NO_MEMORY;
+			}
+			memcpy(w->pwl, sw->pwl, sizeof(*w->pwl)*2*sw->pwlcnt);
+		}
+	}
+	return 0;
+}
+
+void wave_free_defs(struct libsimul_circuit *c)
+{
+	size_t i, j;
+	for (i = 0; i < c->wavecnt; i++)
+	{
+		for (j = 0; j < c->waves[i].srccnt; j++)
+		{
+			free(c->waves[i].srcs[j].name);
+		}
+		free(c->waves[i].srcs);
+		free(c->waves[i].pwl);
+	}
+	free(c->waves);
+	c->waves = NULL;
+	c->wavecnt = 0;
+	c->wavecap = 0;
+}
+
+static void wave_sine_exact(const struct libsimul_wave *w, struct libsimul_wave_state *st, double t)
+{
+	double theta = 2*wave_pi*w->f*t + w->phase*wave_pi/180.0;
+	st->c = cos(theta);
+	st->s = sin(theta);
+	st->t = t;
+	st->rotations = 0;
+}
+
+static void wave_sine_advance(const struct libsimul_wave *w, struct libsimul_wave_state *st, double t)
+{
+	double dt = t - st->t;
+	double c, s;
+	if (dt == 0)
+	{
+		return;
+	}
+	if (st->rotations >= WAVE_RESYNC_ROTATIONS)
+	{
+		wave_sine_exact(w, st, t);
+		return;
+	}
+	// t accumulates dt, so consecutive differences vary in the last bits
+	if (fabs(dt - st->rot_dt) > 1e-9*fabs(dt))
+	{
+		st->rot_dt = dt;
+		st->rot_c = cos(2*wave_pi*w->f*dt);
+		st->rot_s = sin(2*wave_pi*w->f*dt);
+	}
+	c = st->c*st->rot_c - st->s*st->rot_s;
+	s = st->s*st->rot_c + st->c*st->rot_s;
+	st->c = c;
+	st->s = s;
+	st->t = t;
+	st->rotations++;
+}
+
+static double wave_pulse_value(const struct libsimul_wave *w, double t)
+{
+	double x = t - w->delay;
+	if (x < 0)
+	{
+		return w->low;
+	}
+	if (w->period > 0)
+	{
+		x = fmod(x, w->period);
+	}
+	if (x < w->rise)
+	{
+		return w->low + (w->high - w->low)*x/w->rise;
+	}
+	x -= w->rise;
+	if (x < w->width)
+	{
+		return w->high;
+	}
+	x -= w->width;
+	if (x < w->fall)
+	{
+		return w->high + (w->low - w->high)*x/w->fall;
+	}
+	return w->low;
+}
+
+// Segments are searched from the previous one, as time only moves forward
+static double wave_pwl_value(const struct libsimul_wave *w, struct libsimul_wave_state *st, double t)
+{
+	const double *p = w->pwl;
+	size_t seg = st->pwl_seg;
+	double x = t;
+	if (w->period > 0 && x >= 0)
+	{
+		x = fmod(x, w->period);
+	}
+	if (x <= p[0])
+	{
+		st->pwl_seg = 0;
+		return p[1];
+	}
+	if (x < p[2*seg])
+	{
+		seg = 0;
+	}
+	while (seg+1 < w->pwlcnt && p[2*(seg+1)] <= x)
+	{
+		seg++;
+	}
+	st->pwl_seg = seg;
+	if (seg+1 == w->pwlcnt)
+	{
+		return p[2*seg+1];
+	}
+	return p[2*seg+1] + (p[2*seg+3] - p[2*seg+1])*(x - p[2*seg])/(p[2*seg+2] - p[2*seg]);
+}
+
+static void wave_set_source(struct libsimul_ctx *ctx, size_t idx, double V)
+{
+	ctx->state[idx].V = V;
+	ctx->state[idx].I_src = V/ctx->circuit->elements_used[idx]->R;
+}
+
+// Sets the voltage sources to their values at ctx->t
+void wave_apply(struct libsimul_ctx *ctx)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	size_t i, j;
+	for (i = 0; i < c->wavecnt; i++)
+	{
+		const struct libsimul_wave *w = &c->waves[i];
+		struct libsimul_wave_state *st = &ctx->wave_state[i];
+		const size_t *idx = &ctx->wave_src[st->src_first];
+		switch (w->typ)
+		{
+			case WAVE_SINE:
+				wave_sine_advance(w, st, ctx->t);
+				for (j = 0; j < w->srccnt; j++)
+				{
+					const struct libsimul_wave_src *src = &w->srcs[j];
+					// sin(theta - phase lag)
+					wave_set_source(ctx, idx[j],
+						w->offset + w->ampl*(st->s*src->ph_c - st->c*src->ph_s));
+				}
+				break;
+			case WAVE_PULSE:
+				wave_set_source(ctx, idx[0], wave_pulse_value(w, ctx->t));
+				break;
+			case WAVE_PWL:
+				wave_set_source(ctx, idx[0], wave_pwl_value(w, st, ctx->t));
+				break;
+		}
+	}
+}
+
+static int wave_init_fail(struct libsimul_ctx *ctx, int ret)
+{
+	free(ctx->wave_state);
+	ctx->wave_state = NULL;
+	free(ctx->wave_src);
+	ctx->wave_src = NULL;
+	ctx->wave_srccnt = 0;
+	return ret;
+}
+
+// Resolves source names, they may be defined after the waveform. The handles
+// are kept in the context, the circuit may be shared with clones.
+int wave_init_simulation(struct libsimul_ctx *ctx)
+{
+	const struct libsimul_circuit *c = ctx->circuit;
+	size_t i, j, k, prev, n = 0;
+	if (c->wavecnt == 0)
+	{
+		return 0;
+	}
+	for (i = 0; i < c->wavecnt; i++)
+	{
+		n += c->waves[i].srccnt;
+	}
+	free(ctx->wave_state);
+	free(ctx->wave_src);
+	ctx->wave_state = malloc(sizeof(*ctx->wave_state)*c->wavecnt);
+	ctx->wave_src = malloc(sizeof(*ctx->wave_src)*n);
+	ctx->wave_srccnt = n;
+	if (ctx->wave_state == NULL || ctx->wave_src == NULL)
+	{
+		return wave_init_fail(ctx, libsimul_fail(ctx, ERR_NO_MEMORY, "Out of memory"));
+	}
+	n = 0;
+	for (i = 0; i < c->wavecnt; i++)
+	{
+		const struct libsimul_wave *w = &c->waves[i];
+		memset(&ctx->wave_state[i], 0, sizeof(ctx->wave_state[i]));
+		ctx->wave_state[i].src_first = n;
+		for (j = 0; j < w->srccnt; j++)
+		{
+			const struct libsimul_wave_src *src = &w->srcs[j];
+			k = libsimul_find_element(c, src->name);
+			if (k == SIZE_MAX)
+			{
+				return wave_init_fail(ctx,
+					libsimul_fail(ctx, ERR_NOT_FOUND, "Voltage source %s not found", src->name));
+			}
+			if (c->elements_used[k]->typ != TYPE_VOLTAGE)
+			{
+				return wave_init_fail(ctx,
+					libsimul_fail(ctx, ERR_NOT_FOUND, "Element %s not a voltage source", src->name));
+			}
+			for (prev = 0; prev < n; prev++)
+			{
+				if (ctx->wave_src[prev] == k)
+				{
+					return wave_init_fail(ctx,
+						libsimul_fail(ctx, ERR_INVALID, "Voltage source %s has two waveforms", src->name));
+				}
+			}
+			ctx->wave_src[n++] = k;
+		}
+		wave_sine_exact(w, &ctx->wave_state[i], ctx->t);
+	}
+	wave_apply(ctx);
+	return 0;
+}